@@ -0,0 +1,922 @@
+// This is a data store backend for the Citadel server which uses Berkeley DB.  database.c calls
+// it through bdb_backend, at the bottom of this file.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+// Citadel will checkpoint the db at the end of every session, but only if
+// the specified number of kilobytes has been written, or if the specified
+// number of minutes has passed, since the last checkpoint.
+#define MAX_CHECKPOINT_KBYTES	256
+#define MAX_CHECKPOINT_MINUTES	15
+
+#include "sysdep.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <db.h>
+
+#if DB_VERSION_MAJOR < 5
+#error Citadel requires Berkeley DB v5.0 or newer.  Please upgrade.
+#endif
+
+#include <libcitadel.h>
+#include "ctdl_module.h"
+#include "control.h"
+#include "citserver.h"
+#include "config.h"
+
+static DB *dbp[MAXCDB];		// One DB handle for each Citadel database
+static DB_ENV *dbenv;		// The DB environment (global)
+
+// The buffer pool starts out at this size.  Once the site configuration has been loaded,
+// cdb_apply_storage_profile() resizes it to whatever c_db_cache_mb or c_db_cache_pct asks for.
+#define STARTUP_CACHE_BYTES	(16 * 1024 * 1024)
+#define GIGABYTE		(1024 * 1024 * 1024)
+
+// Page size to create each table with (0 lets Berkeley DB choose).  Berkeley DB can't change the page
+// size of a table which already exists, so this only matters when a table is first created.  Tables of
+// big records get big pages so fewer of them spill onto overflow pages; the rest get the default.
+static const u_int32_t cdb_pagesize[MAXCDB] = {
+	[CDB_MSGMAIN] =		8192,
+	[CDB_MSGLISTS] =	16384,
+	[CDB_BIGMSGS] =		65536,
+	[CDB_FULLTEXT] =	16384,
+};
+
+// Names for the values of c_db_durability
+static const char *cdb_durability_names[] = {
+	"synchronous (every commit is flushed to disk)",
+	"write-nosync (commits are written to the OS, which flushes them at its leisure)",
+	"group commit (commits are buffered and flushed to disk once a minute)"
+};
+
+
+// Verbose logging callback
+static void cdb_verbose_log(const DB_ENV *dbenv, const char *msg) {
+	if (!IsEmptyStr(msg)) {
+		syslog(LOG_DEBUG, "db: %s", msg);
+	}
+}
+
+
+// Verbose logging callback
+static void cdb_verbose_err(const DB_ENV *dbenv, const char *errpfx, const char *msg) {
+	syslog(LOG_ERR, "db: %s", msg);
+}
+
+
+// wrapper for txn_abort() that logs/aborts on error
+static void txabort(DB_TXN *tid) {
+	int ret;
+
+	ret = tid->abort(tid);
+
+	if (ret) {
+		syslog(LOG_ERR, "db: txn_abort: %s", db_strerror(ret));
+		cdb_abort();
+	}
+}
+
+
+// wrapper for txn_commit() that logs/aborts on error
+static void txcommit(DB_TXN *tid) {
+	int ret;
+
+	ret = tid->commit(tid, 0);
+
+	if (ret) {
+		syslog(LOG_ERR, "db: txn_commit: %s", db_strerror(ret));
+		cdb_abort();
+	}
+}
+
+
+// wrapper for txn_begin() that logs/aborts on error
+static void txbegin(DB_TXN **tid) {
+	int ret;
+
+	ret = dbenv->txn_begin(dbenv, NULL, tid, 0);
+
+	if (ret) {
+		syslog(LOG_ERR, "db: txn_begin: %s", db_strerror(ret));
+		cdb_abort();
+	}
+}
+
+
+// panic callback
+static void dbpanic(DB_ENV *env, int errval) {
+	syslog(LOG_ERR, "db: PANIC: %s", db_strerror(errval));
+	cdb_abort();
+}
+
+
+static void cclose(DBC *cursor) {
+	int ret;
+
+	if ((ret = cursor->c_close(cursor))) {
+		syslog(LOG_ERR, "db: c_close: %s", db_strerror(ret));
+		cdb_abort();
+	}
+}
+
+
+static void bailIfCursor(void **cursors, const char *msg) {
+	int i;
+
+	for (i = 0; i < MAXCDB; i++)
+		if (cursors[i] != NULL) {
+			syslog(LOG_ERR, "db: cursor still in progress on cdb %02x: %s", i, msg);
+			cdb_abort();
+		}
+}
+
+
+static void bdb_check_handles(void) {
+	bailIfCursor(TSD->cursors, "in check_handles");
+
+	if (TSD->tid != NULL) {
+		syslog(LOG_ERR, "db: transaction still in progress!");
+		cdb_abort();
+	}
+}
+
+
+// Log the buffer pool hit ratio
+static void bdb_log_cache_stats(void) {
+	DB_MPOOL_STAT *gsp = NULL;
+	unsigned long long hits, misses;
+
+	if ((dbenv->memp_stat(dbenv, &gsp, NULL, 0) != 0) || (gsp == NULL)) {
+		return;
+	}
+	hits = gsp->st_cache_hit;
+	misses = gsp->st_cache_miss;
+	syslog(LOG_INFO, "db: cache: %llu hits, %llu misses (%llu%% hit ratio), %llu pages evicted",
+		hits, misses,
+		(((hits + misses) > 0) ? ((hits * 100) / (hits + misses)) : 100),
+		(unsigned long long)(gsp->st_ro_evict + gsp->st_rw_evict)
+	);
+	free(gsp);
+}
+
+
+// Request a checkpoint of the database.  Called once per minute by the thread manager.
+static void bdb_checkpoint(void) {
+	int ret;
+	static int checkpoints = 0;
+
+	syslog(LOG_DEBUG, "db: -- checkpoint --");
+	ret = dbenv->txn_checkpoint(dbenv, MAX_CHECKPOINT_KBYTES, MAX_CHECKPOINT_MINUTES, 0);
+
+	if (ret != 0) {
+		syslog(LOG_ERR, "db: cdb_checkpoint() txn_checkpoint: %s", db_strerror(ret));
+		cdb_abort();
+	}
+
+	// In "group commit" mode, this is where the commits buffered over the last minute go to disk
+	if (CtdlGetConfigInt("c_db_durability") == 2) {
+		ret = dbenv->log_flush(dbenv, NULL);
+		if (ret != 0) {
+			syslog(LOG_ERR, "db: cdb_checkpoint() log_flush: %s", db_strerror(ret));
+		}
+	}
+
+	// Once an hour, say how well the cache is doing
+	if ((++checkpoints % 60) == 0) {
+		bdb_log_cache_stats();
+	}
+
+	// After a successful checkpoint, we can cull the unused logs
+	if (CtdlGetConfigInt("c_auto_cull")) {
+		ret = dbenv->log_set_config(dbenv, DB_LOG_AUTO_REMOVE, 1);
+	}
+	else {
+		ret = dbenv->log_set_config(dbenv, DB_LOG_AUTO_REMOVE, 0);
+	}
+}
+
+
+// Is there a Berkeley DB store in the data directory?
+static int bdb_exists(void) {
+	struct stat st;
+
+	return(stat(ctdl_db_dir "/cdb.00", &st) == 0);
+}
+
+
+// Open the various databases we'll be using.  Any database which
+// does not exist should be created.  Note that we don't need a
+// critical section here, because there aren't any active threads
+// manipulating the database yet.
+static void bdb_open_databases(void) {
+	int ret;
+	int i;
+	char dbfilename[32];
+	u_int32_t flags = 0;
+	int dbversion_major, dbversion_minor, dbversion_patch;
+	unsigned long long cache_max;
+
+	syslog(LOG_DEBUG, "db: Compiled libdb: %s", DB_VERSION_STRING);
+	syslog(LOG_DEBUG, "db:   Linked libdb: %s", db_version(&dbversion_major, &dbversion_minor, &dbversion_patch));
+
+	// Create synthetic integer version numbers and compare them.
+	// Never allow citserver to run with a libdb older then the one with which it was compiled.
+	int compiled_db_version = ( (DB_VERSION_MAJOR * 1000000) + (DB_VERSION_MINOR * 1000) + (DB_VERSION_PATCH) );
+	int linked_db_version = ( (dbversion_major * 1000000) + (dbversion_minor * 1000) + (dbversion_patch) );
+	if (compiled_db_version > linked_db_version) {
+		syslog(LOG_ERR, "db: citserver is running with a version of libdb older than the one with which it was compiled.");
+		syslog(LOG_ERR, "db: This is an invalid configuration.  citserver will now exit to prevent data loss.");
+		exit(CTDLEXIT_DB);
+	}
+
+	syslog(LOG_DEBUG, "db: Setting up DB environment");
+	ret = db_env_create(&dbenv, 0);
+	if (ret) {
+		syslog(LOG_ERR, "db: db_env_create: %s", db_strerror(ret));
+		syslog(LOG_ERR, "db: exit code %d", ret);
+		exit(CTDLEXIT_DB);
+	}
+	dbenv->set_errpfx(dbenv, "citserver");
+	dbenv->set_paniccall(dbenv, dbpanic);
+	dbenv->set_errcall(dbenv, cdb_verbose_err);
+	dbenv->set_errpfx(dbenv, "ctdl");
+	dbenv->set_msgcall(dbenv, cdb_verbose_log);
+	dbenv->set_verbose(dbenv, DB_VERB_DEADLOCK, 1);
+	dbenv->set_verbose(dbenv, DB_VERB_RECOVERY, 1);
+
+	// We want to specify the shared memory buffer pool cachesize, but everything else is the default.
+	// The cache can be resized later, but only up to the maximum we set now, so allow it up to 75% of RAM
+	// (which is also as far as c_db_cache_pct can go).
+	ret = dbenv->set_cachesize(dbenv, 0, STARTUP_CACHE_BYTES, 0);
+	if (ret) {
+		syslog(LOG_ERR, "db: set_cachesize: %s", db_strerror(ret));
+		dbenv->close(dbenv, 0);
+		syslog(LOG_ERR, "db: exit code %d", ret);
+		exit(CTDLEXIT_DB);
+	}
+	cache_max = (cdb_physical_memory() / 4) * 3;
+	if (cache_max > STARTUP_CACHE_BYTES) {
+		ret = dbenv->set_cache_max(dbenv, (u_int32_t)(cache_max / GIGABYTE), (u_int32_t)(cache_max % GIGABYTE));
+		if (ret) {
+			syslog(LOG_ERR, "db: set_cache_max: %s", db_strerror(ret));
+		}
+	}
+
+	if ((ret = dbenv->set_lk_detect(dbenv, DB_LOCK_DEFAULT))) {
+		syslog(LOG_ERR, "db: set_lk_detect: %s", db_strerror(ret));
+		dbenv->close(dbenv, 0);
+		syslog(LOG_ERR, "db: exit code %d", ret);
+		exit(CTDLEXIT_DB);
+	}
+
+	flags = DB_CREATE | DB_INIT_MPOOL | DB_PRIVATE | DB_INIT_TXN | DB_INIT_LOCK | DB_THREAD | DB_INIT_LOG;
+	syslog(LOG_DEBUG, "db: dbenv->open(dbenv, %s, %d, 0)", ctdl_db_dir, flags);
+	ret = dbenv->open(dbenv, ctdl_db_dir, flags, 0);				// try opening the database cleanly
+	if (ret == DB_RUNRECOVERY) {
+		syslog(LOG_ERR, "db: dbenv->open: %s", db_strerror(ret));
+		syslog(LOG_ERR, "db: attempting recovery...");
+		flags |= DB_RECOVER;
+		ret = dbenv->open(dbenv, ctdl_db_dir, flags, 0);			// try recovery
+	}
+	if (ret == DB_RUNRECOVERY) {
+		syslog(LOG_ERR, "db: dbenv->open: %s", db_strerror(ret));
+		syslog(LOG_ERR, "db: attempting catastrophic recovery...");
+		flags &= ~DB_RECOVER;
+		flags |= DB_RECOVER_FATAL;
+		ret = dbenv->open(dbenv, ctdl_db_dir, flags, 0);			// try catastrophic recovery
+	}
+	if (ret) {
+		syslog(LOG_ERR, "db: dbenv->open: %s", db_strerror(ret));
+		dbenv->close(dbenv, 0);
+		syslog(LOG_ERR, "db: exit code %d", ret);
+		exit(CTDLEXIT_DB);
+	}
+
+	syslog(LOG_INFO, "db: mounting databases");
+	for (i = 0; i < MAXCDB; ++i) {
+		ret = db_create(&dbp[i], dbenv, 0);					// Create a database handle
+		if (ret) {
+			syslog(LOG_ERR, "db: db_create: %s", db_strerror(ret));
+			syslog(LOG_ERR, "db: exit code %d", ret);
+			exit(CTDLEXIT_DB);
+		}
+
+		if (cdb_pagesize[i] > 0) {
+			ret = dbp[i]->set_pagesize(dbp[i], cdb_pagesize[i]);		// ignored if the table exists
+			if (ret) {
+				syslog(LOG_ERR, "db: set_pagesize[%02x]: %s", i, db_strerror(ret));
+			}
+		}
+
+		snprintf(dbfilename, sizeof dbfilename, "cdb.%02x", i);			// table names by number
+		ret = dbp[i]->open(dbp[i], NULL, dbfilename, NULL, DB_BTREE, DB_CREATE | DB_AUTO_COMMIT | DB_THREAD, 0600);
+		if (ret) {
+			syslog(LOG_ERR, "db: db_open[%02x]: %s", i, db_strerror(ret));
+			if (ret == ENOMEM) {
+				syslog(LOG_ERR, "db: You may need to tune your database; please check http://www.citadel.org for more information.");
+			}
+			syslog(LOG_ERR, "db: exit code %d", ret);
+			exit(CTDLEXIT_DB);
+		}
+	}
+}
+
+
+// Apply the storage settings from the site configuration, which isn't available until the databases are
+// open, and report what we ended up with.
+//	c_db_cache_mb		buffer pool size in megabytes, or if that's not set...
+//	c_db_cache_pct		...buffer pool size as a percentage of physical memory
+//	c_db_mmap_mb		read-only tables up to this size are mapped into memory instead of cached
+//	c_db_durability		0 = synchronous, 1 = write-nosync, 2 = group commit
+static void bdb_apply_storage_profile(void) {
+	unsigned long long ram, cache_bytes, cache_max;
+	u_int32_t gbytes, bytes, pagesize;
+	int ncache;
+	int durability;
+	size_t mmapsize;
+	StrBuf *pagesizes;
+	int ret;
+	int i;
+
+	// Cache size: an absolute size wins over a percentage of RAM
+	ram = cdb_physical_memory();
+	if (CtdlGetConfigLong("c_db_cache_mb") > 0) {
+		cache_bytes = (unsigned long long)CtdlGetConfigLong("c_db_cache_mb") * 1024 * 1024;
+	}
+	else if ((ram > 0) && (CtdlGetConfigInt("c_db_cache_pct") > 0)) {
+		cache_bytes = (ram / 100) * CtdlGetConfigInt("c_db_cache_pct");
+	}
+	else {
+		cache_bytes = STARTUP_CACHE_BYTES;
+	}
+	if (dbenv->get_cache_max(dbenv, &gbytes, &bytes) == 0) {
+		cache_max = ((unsigned long long)gbytes * GIGABYTE) + bytes;
+		if ((cache_max > 0) && (cache_bytes > cache_max)) {
+			syslog(LOG_WARNING, "db: the cache can't be larger than %llu MB", cache_max / 1024 / 1024);
+			cache_bytes = cache_max;
+		}
+	}
+	ret = dbenv->set_cachesize(dbenv, (u_int32_t)(cache_bytes / GIGABYTE), (u_int32_t)(cache_bytes % GIGABYTE), 0);
+	if (ret) {
+		syslog(LOG_ERR, "db: unable to resize the cache: %s", db_strerror(ret));
+	}
+
+	if (CtdlGetConfigLong("c_db_mmap_mb") > 0) {
+		ret = dbenv->set_mp_mmapsize(dbenv, (size_t)CtdlGetConfigLong("c_db_mmap_mb") * 1024 * 1024);
+		if (ret) {
+			syslog(LOG_ERR, "db: set_mp_mmapsize: %s", db_strerror(ret));
+		}
+	}
+
+	durability = CtdlGetConfigInt("c_db_durability");
+	if ((durability < 0) || (durability > 2)) {
+		durability = 0;
+	}
+	dbenv->set_flags(dbenv, DB_TXN_WRITE_NOSYNC, (durability == 1));
+	dbenv->set_flags(dbenv, DB_TXN_NOSYNC, (durability == 2));
+
+	// Now say what we got
+	if (dbenv->get_cachesize(dbenv, &gbytes, &bytes, &ncache) == 0) {
+		cache_bytes = ((unsigned long long)gbytes * GIGABYTE) + bytes;
+		syslog(LOG_INFO, "db: cache size is %llu MB in %d region%s (physical memory is %llu MB)",
+			cache_bytes / 1024 / 1024, ncache, ((ncache == 1) ? "" : "s"), ram / 1024 / 1024
+		);
+	}
+	if (dbenv->get_mp_mmapsize(dbenv, &mmapsize) == 0) {
+		syslog(LOG_INFO, "db: tables up to %ld MB are memory mapped", (long)(mmapsize / 1024 / 1024));
+	}
+	syslog(LOG_INFO, "db: durability is %s", cdb_durability_names[durability]);
+
+	pagesizes = NewStrBuf();
+	for (i = 0; i < MAXCDB; ++i) {
+		if (dbp[i]->get_pagesize(dbp[i], &pagesize) == 0) {
+			StrBufAppendPrintf(pagesizes, " %02x=%u", i, pagesize);
+		}
+	}
+	syslog(LOG_INFO, "db: page sizes:%s", ChrPtr(pagesizes));
+	FreeStrBuf(&pagesizes);
+
+	bdb_log_cache_stats();
+}
+
+
+// Close all of the db database files we've opened.  This can be done in a loop, since it's just a bunch of closes.
+static void bdb_close_databases(void) {
+	int i;
+	int ret;
+
+	syslog(LOG_INFO, "db: performing final checkpoint");
+	if ((ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0))) {
+		syslog(LOG_ERR, "db: txn_checkpoint: %s", db_strerror(ret));
+	}
+
+	syslog(LOG_INFO, "db: flushing the database logs");
+	if ((ret = dbenv->log_flush(dbenv, NULL))) {
+		syslog(LOG_ERR, "db: log_flush: %s", db_strerror(ret));
+	}
+
+	// close the tables
+	syslog(LOG_INFO, "db: closing databases");
+	for (i = 0; i < MAXCDB; ++i) {
+		syslog(LOG_INFO, "db: closing database %02x", i);
+		ret = dbp[i]->close(dbp[i], 0);
+		if (ret) {
+			syslog(LOG_ERR, "db: db_close: %s", db_strerror(ret));
+		}
+
+	}
+
+	// This seemed nifty at the time but did anyone really look at it?
+	// #ifdef DB_STAT_ALL
+	// dbenv->lock_stat_print(dbenv, DB_STAT_ALL);
+	// #endif
+
+	// Close the handle.
+	ret = dbenv->close(dbenv, 0);
+	if (ret) {
+		syslog(LOG_ERR, "db: DBENV->close: %s", db_strerror(ret));
+	}
+}
+
+
+
+// Store a piece of data.  Returns 0 if the operation was successful.  If a
+// key already exists it should be overwritten.
+static int bdb_store(int cdb, const void *ckey, int ckeylen, void *cdata, int cdatalen) {
+
+	DBT dkey, ddata;
+	DB_TXN *tid = NULL;
+	int ret = 0;
+
+	memset(&dkey, 0, sizeof(DBT));
+	memset(&ddata, 0, sizeof(DBT));
+	dkey.size = ckeylen;
+	dkey.data = (void *) ckey;
+	ddata.size = cdatalen;
+	ddata.data = cdata;
+
+	if (TSD->tid != NULL) {
+		ret = dbp[cdb]->put(dbp[cdb],	// db
+				    TSD->tid,	// transaction ID
+				    &dkey,	// key
+				    &ddata,	// data
+				    0		// flags
+		);
+		if (ret) {
+			syslog(LOG_ERR, "db: cdb_store(%d): %s", cdb, db_strerror(ret));
+			cdb_abort();
+		}
+		return ret;
+	}
+	else {
+		bailIfCursor(TSD->cursors, "attempt to write during r/o cursor");
+
+	      retry:
+		txbegin(&tid);
+
+		if ((ret = dbp[cdb]->put(dbp[cdb],	// db
+					 tid,		// transaction ID
+					 &dkey,		// key
+					 &ddata,	// data
+					 0))) {		// flags
+			if (ret == DB_LOCK_DEADLOCK) {
+				txabort(tid);
+				goto retry;
+			}
+			else {
+				syslog(LOG_ERR, "db: cdb_store(%d): %s", cdb, db_strerror(ret));
+				cdb_abort();
+			}
+		}
+		else {
+			txcommit(tid);
+			return ret;
+		}
+	}
+	return ret;
+}
+
+
+// Delete a piece of data.  Returns 0 if the operation was successful.
+static int bdb_delete(int cdb, const void *key, int keylen) {
+	DBT dkey;
+	DB_TXN *tid;
+	int ret;
+
+	memset(&dkey, 0, sizeof dkey);
+	dkey.size = keylen;
+	dkey.data = (void *) key;
+
+	if (TSD->tid != NULL) {
+		ret = dbp[cdb]->del(dbp[cdb], TSD->tid, &dkey, 0);
+		if (ret) {
+			syslog(LOG_ERR, "db: cdb_delete(%d): %s", cdb, db_strerror(ret));
+			if (ret != DB_NOTFOUND) {
+				cdb_abort();
+			}
+		}
+	}
+	else {
+		bailIfCursor(TSD->cursors, "attempt to delete during r/o cursor");
+
+	      retry:
+		txbegin(&tid);
+
+		if ((ret = dbp[cdb]->del(dbp[cdb], tid, &dkey, 0)) && ret != DB_NOTFOUND) {
+			if (ret == DB_LOCK_DEADLOCK) {
+				txabort(tid);
+				goto retry;
+			}
+			else {
+				syslog(LOG_ERR, "db: cdb_delete(%d): %s", cdb, db_strerror(ret));
+				cdb_abort();
+			}
+		}
+		else {
+			txcommit(tid);
+		}
+	}
+	return ret;
+}
+
+
+static DBC *localcursor(int cdb) {
+	int ret;
+	DBC *curs;
+
+	if (TSD->cursors[cdb] == NULL) {
+		ret = dbp[cdb]->cursor(dbp[cdb], TSD->tid, &curs, 0);
+	}
+	else {
+		DBC *traversal = TSD->cursors[cdb];
+		ret = traversal->c_dup(traversal, &curs, DB_POSITION);
+	}
+
+	if (ret) {
+		syslog(LOG_ERR, "db: localcursor: %s", db_strerror(ret));
+		cdb_abort();
+	}
+
+	return curs;
+}
+
+
+// Read a record in the thread's snapshot (see bdb_begin_read()).  Once the snapshot has lost a deadlock,
+// nothing more can be read in it, so everything is "not found" until the caller starts over.
+static int bdb_snapshot_get(int cdb, DBT *dkey, DBT *dret) {
+	int ret;
+
+	if (TSD->snapshot_lost) {
+		return(DB_NOTFOUND);
+	}
+	ret = dbp[cdb]->get(dbp[cdb], TSD->snapshot, dkey, dret, 0);
+	if (ret == DB_LOCK_DEADLOCK) {
+		TSD->snapshot_lost = 1;
+		ret = DB_NOTFOUND;
+	}
+	return(ret);
+}
+
+
+// Fetch a piece of data.  Returns 0 and fills in "out" (with a buffer the caller must free) if it was found.
+static int bdb_fetch(int cdb, const void *key, int keylen, struct cdbdata *out) {
+	DBT dkey, dret;
+	int ret;
+
+	memset(&dkey, 0, sizeof(DBT));
+	dkey.size = keylen;
+	dkey.data = (void *) key;
+
+	if (TSD->tid != NULL) {
+		memset(&dret, 0, sizeof(DBT));
+		dret.flags = DB_DBT_MALLOC;
+		ret = dbp[cdb]->get(dbp[cdb], TSD->tid, &dkey, &dret, 0);
+	}
+	else if (TSD->snapshot != NULL) {
+		memset(&dret, 0, sizeof(DBT));
+		dret.flags = DB_DBT_MALLOC;
+		ret = bdb_snapshot_get(cdb, &dkey, &dret);
+	}
+	else {
+		DBC *curs;
+
+		do {
+			memset(&dret, 0, sizeof(DBT));
+			dret.flags = DB_DBT_MALLOC;
+			curs = localcursor(cdb);
+			ret = curs->c_get(curs, &dkey, &dret, DB_SET);
+			cclose(curs);
+		} while (ret == DB_LOCK_DEADLOCK);
+	}
+
+	if ((ret != 0) && (ret != DB_NOTFOUND)) {
+		syslog(LOG_ERR, "db: cdb_fetch(%d): %s", cdb, db_strerror(ret));
+		cdb_abort();
+	}
+
+	if (ret != 0) {
+		return ret;
+	}
+	out->len = dret.size;
+	out->ptr = dret.data;
+	return 0;
+}
+
+
+// Fetch a piece of data into a borrowed buffer.  Berkeley DB reads straight into it, and tells us how
+// big it has to be if it's too small.
+static int bdb_fetch_borrowed(int cdb, const void *key, int keylen, struct cdb_borrowed *b) {
+	DBT dkey, dret;
+	DBC *curs;
+	int ret;
+
+	memset(&dkey, 0, sizeof(DBT));
+	dkey.size = keylen;
+	dkey.data = (void *) key;
+
+	do {
+		memset(&dret, 0, sizeof(DBT));
+		dret.flags = DB_DBT_USERMEM;
+		dret.data = b->buf;
+		dret.ulen = b->alloc;
+		if (TSD->tid != NULL) {
+			ret = dbp[cdb]->get(dbp[cdb], TSD->tid, &dkey, &dret, 0);
+		}
+		else if (TSD->snapshot != NULL) {
+			ret = bdb_snapshot_get(cdb, &dkey, &dret);
+		}
+		else {
+			curs = localcursor(cdb);
+			ret = curs->c_get(curs, &dkey, &dret, DB_SET);
+			cclose(curs);
+		}
+		if (ret == DB_BUFFER_SMALL) {
+			cdb_borrowed_grow(b, dret.size);		// dret.size is how much we need
+		}
+	} while ((ret == DB_BUFFER_SMALL) || ((ret == DB_LOCK_DEADLOCK) && (TSD->tid == NULL)));
+
+	if ((ret != 0) && (ret != DB_NOTFOUND)) {
+		syslog(LOG_ERR, "db: cdb_fetch_borrowed(%d): %s", cdb, db_strerror(ret));
+		cdb_abort();
+	}
+	if (ret != 0) {
+		return ret;
+	}
+	b->data.ptr = b->buf;
+	b->data.len = dret.size;
+	return 0;
+}
+
+
+// Berkeley DB keeps nothing per thread beyond what's in the TSD already
+static void bdb_free_tsd(void) {
+}
+
+
+static void bdb_close_cursor(int cdb) {
+	if (TSD->cursors[cdb] != NULL) {
+		cclose(TSD->cursors[cdb]);
+	}
+
+	TSD->cursors[cdb] = NULL;
+}
+
+
+// Prepare for a sequential search of an entire database.
+// (There is guaranteed to be no more than one traversal in
+// progress per thread at any given time.)
+static void bdb_rewind(int cdb) {
+	DBC *curs;
+	int ret = 0;
+
+	if (TSD->cursors[cdb] != NULL) {
+		syslog(LOG_ERR, "db: cdb_rewind: must close cursor on database %d before reopening", cdb);
+		cdb_abort();
+		// cclose(TSD->cursors[cdb]);
+	}
+
+	// Now initialize the cursor
+	ret = dbp[cdb]->cursor(dbp[cdb], TSD->tid, &curs, 0);
+	if (ret) {
+		syslog(LOG_ERR, "db: cdb_rewind: db_cursor: %s", db_strerror(ret));
+		cdb_abort();
+	}
+	TSD->cursors[cdb] = curs;
+}
+
+
+// Fetch the next item in a sequential search.  Returns 0 and fills in "out" if there was one, or
+// closes the cursor and returns nonzero if we've hit the end.
+static int bdb_next_item(int cdb, struct cdbdata *out) {
+	DBC *curs = TSD->cursors[cdb];
+	DBT key, data;
+	int ret = 0;
+
+	// Initialize the key/data pair so the flags aren't set.
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	data.flags = DB_DBT_MALLOC;
+
+	ret = curs->c_get(curs, &key, &data, DB_NEXT);
+
+	if (ret) {
+		if (ret != DB_NOTFOUND) {
+			syslog(LOG_ERR, "db: cdb_next_item(%d): %s", cdb, db_strerror(ret));
+			cdb_abort();
+		}
+		bdb_close_cursor(cdb);
+		return ret;	// presumably, end of file
+	}
+
+	out->len = data.size;
+	out->ptr = data.data;
+	return 0;
+}
+
+
+// Fetch the next item in a sequential search into a borrowed buffer.
+static int bdb_next_item_borrowed(int cdb, struct cdb_borrowed *b) {
+	DBC *curs = TSD->cursors[cdb];
+	DBT key, data;
+	int ret = 0;
+
+	do {
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		data.flags = DB_DBT_USERMEM;
+		data.data = b->buf;
+		data.ulen = b->alloc;
+		ret = curs->c_get(curs, &key, &data, DB_NEXT);
+		if (ret == DB_BUFFER_SMALL) {
+			cdb_borrowed_grow(b, data.size);		// the cursor stays where it was, so try again
+		}
+	} while (ret == DB_BUFFER_SMALL);
+
+	if (ret) {
+		if (ret != DB_NOTFOUND) {
+			syslog(LOG_ERR, "db: cdb_next_item_borrowed(%d): %s", cdb, db_strerror(ret));
+			cdb_abort();
+		}
+		bdb_close_cursor(cdb);
+		return ret;	// presumably, end of file
+	}
+	b->data.ptr = b->buf;
+	b->data.len = data.size;
+	return 0;
+}
+
+
+// Transaction-based stuff.  I'm writing this as I bake cookies...
+static void bdb_begin_transaction(void) {
+	DB_TXN *tid;
+
+	bailIfCursor(TSD->cursors, "can't begin transaction during r/o cursor");
+
+	if (TSD->tid != NULL) {
+		syslog(LOG_ERR, "db: cdb_begin_transaction: ERROR: nested transaction");
+		cdb_abort();
+	}
+
+	txbegin(&tid);
+
+	// A long transaction holds a lot of locks.  If it deadlocks with one of the short ones, which retry,
+	// let the short one lose; this one can't be retried, and losing it would stop the server.
+	tid->set_priority(tid, 0xFFFFFFFF);
+	TSD->tid = tid;
+}
+
+
+static void bdb_end_transaction(void) {
+	int i;
+
+	for (i = 0; i < MAXCDB; i++) {
+		if (TSD->cursors[i] != NULL) {
+			syslog(LOG_WARNING, "db: cdb_end_transaction: WARNING: cursor %d still open at transaction end", i);
+			cclose(TSD->cursors[i]);
+			TSD->cursors[i] = NULL;
+		}
+	}
+
+	if (TSD->tid == NULL) {
+		syslog(LOG_ERR, "db: cdb_end_transaction: ERROR: txcommit(NULL) !!");
+		cdb_abort();
+	}
+	else {
+		txcommit(TSD->tid);
+	}
+
+	TSD->tid = NULL;
+}
+
+
+// Begin reading from one snapshot.  Berkeley DB only keeps snapshots of databases opened for multiversion
+// concurrency, which ours aren't, so this is a transaction which holds on to its read locks until
+// bdb_end_read().  If it loses a deadlock, there's no getting them back: bdb_snapshot_get() stops reading,
+// and cdb_end_read() tells the caller to start over.
+static void bdb_begin_read(void) {
+	DB_TXN *tid;
+
+	if (TSD->snapshot != NULL) {
+		syslog(LOG_ERR, "db: cdb_begin_read: ERROR: nested snapshot");
+		cdb_abort();
+	}
+	txbegin(&tid);
+	TSD->snapshot = tid;
+	TSD->snapshot_lost = 0;
+}
+
+
+static int bdb_end_read(void) {
+	int lost = TSD->snapshot_lost;
+
+	if (TSD->snapshot == NULL) {
+		syslog(LOG_ERR, "db: cdb_end_read: ERROR: no snapshot");
+		cdb_abort();
+	}
+	txabort(TSD->snapshot);			// nothing was written, and it may have lost a deadlock
+	TSD->snapshot = NULL;
+	TSD->snapshot_lost = 0;
+	return(lost);
+}
+
+
+// Truncate (delete every record)
+static void bdb_trunc(int cdb) {
+	int ret;
+	u_int32_t count;
+
+	if (TSD->tid != NULL) {
+		syslog(LOG_ERR, "db: cdb_trunc must not be called in a transaction.");
+		cdb_abort();
+	}
+	else {
+		bailIfCursor(TSD->cursors, "attempt to write during r/o cursor");
+
+	      retry:
+
+		if ((ret = dbp[cdb]->truncate(dbp[cdb],	// db
+					      NULL,	// transaction ID
+					      &count,	// #rows deleted
+					      0))) {	// flags
+			if (ret == DB_LOCK_DEADLOCK) {
+				goto retry;
+			}
+			else {
+				syslog(LOG_ERR, "db: cdb_truncate(%d): %s", cdb, db_strerror(ret));
+				if (ret == ENOMEM) {
+					syslog(LOG_ERR, "db: You may need to tune your database; please read http://www.citadel.org for more information.");
+				}
+				exit(CTDLEXIT_DB);
+			}
+		}
+	}
+}
+
+
+// compact (defragment) the database, possibly returning space back to the underlying filesystem
+static void bdb_compact(void) {
+	int ret;
+	int i;
+
+	syslog(LOG_DEBUG, "db: cdb_compact() started");
+	for (i = 0; i < MAXCDB; i++) {
+		syslog(LOG_DEBUG, "db: compacting database %d", i);
+		ret = dbp[i]->compact(dbp[i], NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
+		if (ret) {
+			syslog(LOG_ERR, "db: compact: %s", db_strerror(ret));
+		}
+	}
+	syslog(LOG_DEBUG, "db: cdb_compact() finished");
+}
+
+
+const struct cdb_backend bdb_backend = {
+	.name =			"berkeley",
+	.exists =		bdb_exists,
+	.open_databases =	bdb_open_databases,
+	.close_databases =	bdb_close_databases,
+	.apply_storage_profile = bdb_apply_storage_profile,
+	.log_cache_stats =	bdb_log_cache_stats,
+	.checkpoint =		bdb_checkpoint,
+	.compact =		bdb_compact,
+	.check_handles =	bdb_check_handles,
+	.store =		bdb_store,
+	.del =			bdb_delete,
+	.fetch =		bdb_fetch,
+	.fetch_borrowed =	bdb_fetch_borrowed,
+	.rewind =		bdb_rewind,
+	.next_item =		bdb_next_item,
+	.next_item_borrowed =	bdb_next_item_borrowed,
+	.close_cursor =		bdb_close_cursor,
+	.begin_transaction =	bdb_begin_transaction,
+	.end_transaction =	bdb_end_transaction,
+	.begin_read =		bdb_begin_read,
+	.end_read =		bdb_end_read,
+	.trunc =		bdb_trunc,
+	.free_tsd =		bdb_free_tsd,
+};
@@ -170,6 +170,7 @@ enum {
 	S_IM_LOGS,
 	S_OPENSSL,
 	S_SMTPQUEUE,
+	S_MODSEQ,
 	MAX_SEMAPHORES
 };
 
@@ -206,6 +207,8 @@ enum {
 	CDB_USERSBYNUMBER,	// index of users by number
 	CDB_UNUSED1,		// this used to be the EXTAUTH table but is no longer used
 	CDB_CONFIG,		// system configuration database
+	CDB_OVERVIEW,		// per-message overview records (XOVER, ENVELOPE, expiry)
+	CDB_MODSEQ,		// modification sequences (IMAP CONDSTORE/QRESYNC)
 	MAXCDB			// total number of CDB's defined
 };
 
@@ -86,6 +86,7 @@ void master_startup(void) {
 	initialize_config_system();
 	validate_config();
 	migrate_legacy_control_record();
+	cdb_apply_storage_profile();
 
 	// If we have an existing database that is older than version 928, reindex the user records.
 	// Unfortunately we cannot do this in serv_upgrade.c because it needs to happen VERY early during startup.
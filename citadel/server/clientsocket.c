@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #ifdef __FreeBSD__
 #include <sys/socket.h>
@@ -153,10 +154,9 @@ int sock_write_timeout(int *sock, const char *buf, int nbytes, int timeout) {
 	int nSuccessLess = 0;
 	int bytes_written = 0;
 	int retval;
-	fd_set rfds;
+	struct pollfd pfd;
         int fdflags;
 	int IsNonBlock;
-	struct timeval tv;
 	int selectresolution = 100;
 
 	fdflags = fcntl(*sock, F_GETFL);
@@ -164,18 +164,16 @@ int sock_write_timeout(int *sock, const char *buf, int nbytes, int timeout) {
 
 	while ((nSuccessLess < timeout) && (*sock != -1) && (bytes_written < nbytes)) {
 		if (IsNonBlock) {
-			tv.tv_sec = selectresolution;
-			tv.tv_usec = 0;
-			
-			FD_ZERO(&rfds);
-			FD_SET(*sock, &rfds);
-			if (select(*sock + 1, NULL, &rfds, NULL, &tv) == -1) {
+			pfd.fd = *sock;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, selectresolution * 1000) == -1) {
 				close (*sock);
 				*sock = -1;
 				return -1;
 			}
 		}
-		if (IsNonBlock && !  FD_ISSET(*sock, &rfds)) {
+		if (IsNonBlock && !(pfd.revents & (POLLOUT | POLLERR | POLLHUP))) {
 			nSuccessLess ++;
 			continue;
 		}
@@ -188,12 +186,10 @@ int sock_write_timeout(int *sock, const char *buf, int nbytes, int timeout) {
 		}
 		bytes_written = bytes_written + retval;
 		if (IsNonBlock && (bytes_written == nbytes)){
-			tv.tv_sec = selectresolution;
-			tv.tv_usec = 0;
-			
-			FD_ZERO(&rfds);
-			FD_SET(*sock, &rfds);
-			if (select(*sock + 1, NULL, &rfds, NULL, &tv) == -1) {
+			pfd.fd = *sock;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, selectresolution * 1000) == -1) {
 				close (*sock);
 				*sock = -1;
 				return -1;
@@ -272,6 +272,21 @@ void initialize_config_system(void) {
 		CtdlSetConfigInt("c_max_workers", CtdlGetConfigInt("c_min_workers"));		// max >= min
 	}
 
+	// Memory budget for the shared message list cache (a negative value disables the cache)
+	if (CtdlGetConfigLong("c_msglist_cache_mb") == 0)	CtdlSetConfigLong("c_msglist_cache_mb", 64);
+
+	// Memory the full text indexer may use for changes it hasn't written to the index yet
+	if (CtdlGetConfigLong("c_ft_segment_mb") <= 0)		CtdlSetConfigLong("c_ft_segment_mb", 32);
+
+	// Threads to use when building the full text index for a lot of messages at once
+	if (CtdlGetConfigInt("c_ft_threads") <= 0)		CtdlSetConfigInt("c_ft_threads", 4);
+
+	// Database buffer pool: 10% of RAM unless told otherwise, and never most of it
+	if ((CtdlGetConfigLong("c_db_cache_mb") <= 0) && (CtdlGetConfigInt("c_db_cache_pct") <= 0)) {
+		CtdlSetConfigInt("c_db_cache_pct", 10);
+	}
+	if (CtdlGetConfigInt("c_db_cache_pct") > 75)	CtdlSetConfigInt("c_db_cache_pct", 75);
+
 	// Networking more than once every five minutes just isn't sane
 	if (CtdlGetConfigLong("c_net_freq") == 0)	CtdlSetConfigLong("c_net_freq", 3600);	// once per hour default
 	if (CtdlGetConfigLong("c_net_freq") < 300)	CtdlSetConfigLong("c_net_freq", 300);	// minimum 5 minutes
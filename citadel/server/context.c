@@ -277,9 +277,8 @@ void RemoveContext(CitContext *con) {
 	FreeStrBuf(&con->StatusMessage);
 	FreeStrBuf(&con->MigrateBuf);
 	FreeStrBuf(&con->RecvBuf.Buf);
-	if (con->cached_msglist) {
-		free(con->cached_msglist);
-	}
+	FreeStrBuf(&con->SendBuf.Buf);
+	CtdlForgetCachedMsgList(con);
 
 	syslog(LOG_DEBUG, "context: done with RemoveContext()");
 }
@@ -309,6 +308,7 @@ CitContext *CreateNewContext(void) {
 	 * being set up.
 	 */
 	me->state = CON_EXECUTING;
+	me->watched_socket = (-1);
 	/*
 	 * Generate a unique session number and insert this context into
 	 * the list.
@@ -370,9 +370,13 @@ CitContext *CloneContext(CitContext *CloneMe) {
 	me->CIT_ICAL = NULL;
 
 	me->cached_msglist = NULL;
+	me->cached_msglist_ref = NULL;
 	me->download_fp = NULL;
 	me->upload_fp = NULL;
 	me->client_socket = 0;
+	me->watched_socket = (-1);
+	me->next_ready = NULL;
+	me->ready_since = 0;
 
 	me->MigrateBuf = NewStrBuf();
 	me->RecvBuf.Buf = NewStrBuf();
@@ -432,6 +436,7 @@ void begin_session(CitContext *con) {
 	con->download_fp = NULL;
 	con->upload_fp = NULL;
 	con->cached_msglist = NULL;
+	con->cached_msglist_ref = NULL;
 	con->cached_num_msgs = 0;
 	con->FirstExpressMessage = NULL;
 	time(&con->lastcmd);
@@ -564,6 +569,7 @@ void context_cleanup(void) {
 		--num_sessions;
 
 		syslog(LOG_DEBUG, "context: context_cleanup() purging session %d", ptr->cs_pid);
+		unwatch_session(ptr);
 		RemoveContext(ptr);
 		free (ptr);
 		ptr = rem;
@@ -581,6 +587,7 @@ void context_cleanup(void) {
 void dead_session_purge(int force) {
 	CitContext *ptr, *ptr2;		/* general-purpose utility pointer */
 	CitContext *rem = NULL;		/* list of sessions to be destroyed */
+	CCState expected;
 	
 	if (force == 0) {
 		if ( (time(NULL) - last_purge) < 5 ) {
@@ -597,8 +604,11 @@ void dead_session_purge(int force) {
 		ptr2 = ptr;
 		ptr = ptr->next;
 		
-		if ( (ptr2->state == CON_IDLE) && (ptr2->kill_me) ) {
-			/* Remove the session from the active list */
+		expected = CON_IDLE;
+		if (	(ptr2->kill_me)
+			&& (__atomic_compare_exchange_n(&ptr2->state, &expected, CON_EXECUTING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		) {
+			/* We now own the session, so no worker can bind to it.  Remove it from the active list */
 			if (ptr2->prev) {
 				ptr2->prev->next = ptr2->next;
 			}
@@ -610,6 +620,7 @@ void dead_session_purge(int force) {
 			}
 
 			--num_sessions;
+			unwatch_session(ptr2);
 			/* And put it on our to-be-destroyed list */
 			ptr2->next = rem;
 			rem = ptr2;
@@ -648,10 +659,8 @@ void InitializeMasterCC(void) {
 void set_async_waiting(struct CitContext *ccptr) {
 	syslog(LOG_DEBUG, "context: setting async_waiting flag for session %d", ccptr->cs_pid);
 	if (ccptr->is_async) {
-		ccptr->async_waiting++;
-		if (ccptr->state == CON_IDLE) {
-			ccptr->state = CON_READY;
-		}
+		__atomic_add_fetch(&ccptr->async_waiting, 1, __ATOMIC_SEQ_CST);
+		mark_session_ready(ccptr);
 	}
 }
 
@@ -36,6 +36,8 @@ typedef struct CitContext CitContext;
 struct CitContext {
 	CitContext *prev;	/* Link to previous session in list */
 	CitContext *next;	/* Link to next session in the list */
+	CitContext *next_ready;	/* Link to next session on the ready queue */
+	long long ready_since;	/* when it was put on the ready queue (microseconds) */
 
 	int cs_pid;		/* session ID */
 	int dont_term;		/* for special activities like artv so we don't get killed */
@@ -53,6 +55,7 @@ struct CitContext {
 	StrBuf *sMigrateBuf;	/* Our block buffered read buffer */
 
 	int client_socket;
+	int watched_socket;	/* socket number registered with the event dispatcher */
 	int is_local_client;	/* set to 1 if client is running on the same host */
 	/* Redirect this session's output to a memory buffer? */
 	StrBuf *redirect_buffer;		/* the buffer */
@@ -128,6 +131,7 @@ struct CitContext {
 
 	long *cached_msglist;			/* results of the previous CtdlForEachMessage() */
 	int cached_num_msgs;
+	struct msglist *cached_msglist_ref;	/* set if cached_msglist belongs to the shared msglist cache */
 
 	char vcard_updated_by_ldap;		/* !0 iff ldap changed the vcard, treat as aide update */
 };
@@ -148,6 +152,11 @@ void InitializeMasterCC(void);
 void dead_session_purge(int force);
 void set_async_waiting(struct CitContext *ccptr);
 
+/* The session dispatcher (in sysdep.c) */
+void unwatch_session(CitContext *con);
+void mark_session_ready(CitContext *con);
+int ready_session_count(void);
+
 CitContext *CloneContext(CitContext *CloneMe);
 
 /* forcibly close and flush fd's on shutdown */
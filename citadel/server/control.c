@@ -14,6 +14,7 @@
 #include "config.h"
 #include "citserver.h"
 #include "user_ops.h"
+#include "msglist_store.h"
 
 long control_highest_user = 0;
 
@@ -47,7 +48,6 @@ struct cfh {
 // 2 = show inconsistencies but don't repair them, continue execution
 void control_find_highest(struct ctdlroom *qrbuf, void *data) {
 	struct cfh *cfh = (struct cfh *)data;
-	struct cdbdata *cdbfr;
 	long *msglist;
 	int num_msgs=0;
 	int c;
@@ -57,12 +57,8 @@ void control_find_highest(struct ctdlroom *qrbuf, void *data) {
 	}
 
 	// Load the message list
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &qrbuf->QRnumber, sizeof(long));
-	if (cdbfr != NULL) {
-		msglist = (long *) cdbfr->ptr;
-		num_msgs = cdbfr->len / sizeof(long);
-	}
-	else {
+	msglist = msglist_read(qrbuf->QRnumber, &num_msgs);
+	if (msglist == NULL) {
 		return;	// No messages at all?  No further action.
 	}
 
@@ -74,7 +70,7 @@ void control_find_highest(struct ctdlroom *qrbuf, void *data) {
 		}
 	}
 
-	cdb_free(cdbfr);
+	free(msglist);
 }
 
 
@@ -42,6 +42,7 @@
 #include "threads.h"
 #include "citadel_dirs.h"
 #include "context.h"
+#include "seenset.h"
 
 extern int threading;
 
@@ -283,6 +284,10 @@ void CtdlPutCurrentUserLock(void);
 int CtdlGetUserByNumber(struct ctdluser *usbuf, long number);
 void CtdlGetRelationship(struct visit *vbuf, struct ctdluser *rel_user, struct ctdlroom *rel_room);
 void CtdlSetRelationship(struct visit *newvisit, struct ctdluser *rel_user, struct ctdlroom *rel_room);
+void CtdlGetRelationshipSets(struct visit *vbuf, struct seen_set **seen, struct seen_set **answered,
+				struct ctdluser *rel_user, struct ctdlroom *rel_room);
+void CtdlSetRelationshipSets(struct visit *newvisit, struct seen_set *seen, struct seen_set *answered,
+				struct ctdluser *rel_user, struct ctdlroom *rel_room);
 void CtdlMailboxName(char *buf, size_t n, const struct ctdluser *who, const char *prefix);
 int CtdlLoginExistingUser(const char *username);
 
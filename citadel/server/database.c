@@ -1,16 +1,12 @@
-// This is a data store backend for the Citadel server which uses Berkeley DB.
+// This is the data store layer for the Citadel server.  Everything here is the same no matter which
+// storage engine is underneath; the engine itself is one of the backends in berkeley_db.c or lmdb_db.c,
+// which is chosen when the databases are opened.
 //
 // Copyright (c) 1987-2023 by the citadel.org team
 //
 // This program is open source software.  Use, duplication, or disclosure
 // is subject to the terms of the GNU General Public License, version 3.
 
-// Citadel will checkpoint the db at the end of every session, but only if
-// the specified number of kilobytes has been written, or if the specified
-// number of minutes has passed, since the last checkpoint.
-#define MAX_CHECKPOINT_KBYTES	256
-#define MAX_CHECKPOINT_MINUTES	15
-
 #include "sysdep.h"
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,20 +14,25 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <zlib.h>
-#include <db.h>
-
-#if DB_VERSION_MAJOR < 5
-#error Citadel requires Berkeley DB v5.0 or newer.  Please upgrade.
-#endif
-
 #include <libcitadel.h>
 #include "ctdl_module.h"
 #include "control.h"
 #include "citserver.h"
 #include "config.h"
+#include "msglist_cache.h"
+
+// Every backend compiled into this server.  If there is no store in the data directory yet, and nobody
+// asked for a particular one, the first one on the list is used.
+static const struct cdb_backend *cdb_backends[] = {
+	&bdb_backend,
+#ifdef HAVE_LMDB
+	&lmdb_backend,
+#endif
+	NULL
+};
 
-static DB *dbp[MAXCDB];		// One DB handle for each Citadel database
-static DB_ENV *dbenv;		// The DB environment (global)
+static const struct cdb_backend *backend = NULL;	// The one we're using
+char *cdb_backend_name = NULL;				// The one the command line asked for, if any
 
 
 void cdb_abort(void) {
@@ -43,116 +44,45 @@ void cdb_abort(void) {
 }
 
 
-// Verbose logging callback
-void cdb_verbose_log(const DB_ENV *dbenv, const char *msg) {
-	if (!IsEmptyStr(msg)) {
-		syslog(LOG_DEBUG, "db: %s", msg);
-	}
-}
-
-
-// Verbose logging callback
-void cdb_verbose_err(const DB_ENV *dbenv, const char *errpfx, const char *msg) {
-	syslog(LOG_ERR, "db: %s", msg);
-}
-
-
-// wrapper for txn_abort() that logs/aborts on error
-static void txabort(DB_TXN *tid) {
-	int ret;
-
-	ret = tid->abort(tid);
-
-	if (ret) {
-		syslog(LOG_ERR, "db: txn_abort: %s", db_strerror(ret));
-		cdb_abort();
-	}
-}
-
-
-// wrapper for txn_commit() that logs/aborts on error
-static void txcommit(DB_TXN *tid) {
-	int ret;
-
-	ret = tid->commit(tid, 0);
-
-	if (ret) {
-		syslog(LOG_ERR, "db: txn_commit: %s", db_strerror(ret));
-		cdb_abort();
-	}
-}
-
-
-// wrapper for txn_begin() that logs/aborts on error
-static void txbegin(DB_TXN **tid) {
-	int ret;
-
-	ret = dbenv->txn_begin(dbenv, NULL, tid, 0);
-
-	if (ret) {
-		syslog(LOG_ERR, "db: txn_begin: %s", db_strerror(ret));
-		cdb_abort();
-	}
-}
-
-
-// panic callback
-static void dbpanic(DB_ENV *env, int errval) {
-	syslog(LOG_ERR, "db: PANIC: %s", db_strerror(errval));
-	cdb_abort();
-}
+// How much RAM this machine has (0 if we can't tell)
+unsigned long long cdb_physical_memory(void) {
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesize = sysconf(_SC_PAGESIZE);
 
-
-static void cclose(DBC *cursor) {
-	int ret;
-
-	if ((ret = cursor->c_close(cursor))) {
-		syslog(LOG_ERR, "db: c_close: %s", db_strerror(ret));
-		cdb_abort();
+	if ((pages <= 0) || (pagesize <= 0)) {
+		return(0);
 	}
+	return((unsigned long long)pages * pagesize);
 }
 
 
-static void bailIfCursor(DBC **cursors, const char *msg) {
+// Decide which backend to use.  A store which is already in the data directory always wins, because
+// starting up on an empty store of some other kind would look to the users as if everything was lost.
+static void cdb_select_backend(void) {
+	const struct cdb_backend *found = NULL;
+	const struct cdb_backend *wanted = NULL;
 	int i;
 
-	for (i = 0; i < MAXCDB; i++)
-		if (cursors[i] != NULL) {
-			syslog(LOG_ERR, "db: cursor still in progress on cdb %02x: %s", i, msg);
-			cdb_abort();
+	for (i = 0; cdb_backends[i] != NULL; ++i) {
+		if ((found == NULL) && (cdb_backends[i]->exists())) {
+			found = cdb_backends[i];
+		}
+		if ((cdb_backend_name != NULL) && (!strcasecmp(cdb_backend_name, cdb_backends[i]->name))) {
+			wanted = cdb_backends[i];
 		}
-}
-
-
-void cdb_check_handles(void) {
-	bailIfCursor(TSD->cursors, "in check_handles");
-
-	if (TSD->tid != NULL) {
-		syslog(LOG_ERR, "db: transaction still in progress!");
-		cdb_abort();
-	}
-}
-
-
-// Request a checkpoint of the database.  Called once per minute by the thread manager.
-void cdb_checkpoint(void) {
-	int ret;
-
-	syslog(LOG_DEBUG, "db: -- checkpoint --");
-	ret = dbenv->txn_checkpoint(dbenv, MAX_CHECKPOINT_KBYTES, MAX_CHECKPOINT_MINUTES, 0);
-
-	if (ret != 0) {
-		syslog(LOG_ERR, "db: cdb_checkpoint() txn_checkpoint: %s", db_strerror(ret));
-		cdb_abort();
 	}
 
-	// After a successful checkpoint, we can cull the unused logs
-	if (CtdlGetConfigInt("c_auto_cull")) {
-		ret = dbenv->log_set_config(dbenv, DB_LOG_AUTO_REMOVE, 1);
+	if ((cdb_backend_name != NULL) && (wanted == NULL)) {
+		syslog(LOG_ERR, "db: this server was not built with the \"%s\" storage backend", cdb_backend_name);
+		exit(CTDLEXIT_DB);
 	}
-	else {
-		ret = dbenv->log_set_config(dbenv, DB_LOG_AUTO_REMOVE, 0);
+	if ((wanted != NULL) && (found != NULL) && (wanted != found) && (!wanted->exists())) {
+		syslog(LOG_ERR, "db: the data directory contains a %s store, not %s.  Convert it before switching.", found->name, wanted->name);
+		exit(CTDLEXIT_DB);
 	}
+
+	backend = (wanted ? wanted : (found ? found : cdb_backends[0]));
+	syslog(LOG_INFO, "db: using the %s storage backend", backend->name);
 }
 
 
@@ -161,26 +91,8 @@ void cdb_checkpoint(void) {
 // critical section here, because there aren't any active threads
 // manipulating the database yet.
 void open_databases(void) {
-	int ret;
-	int i;
-	char dbfilename[32];
-	u_int32_t flags = 0;
-	int dbversion_major, dbversion_minor, dbversion_patch;
-
 	syslog(LOG_DEBUG, "db: open_databases() starting");
 	syslog(LOG_DEBUG, "db:    Linked zlib: %s", zlibVersion());
-	syslog(LOG_DEBUG, "db: Compiled libdb: %s", DB_VERSION_STRING);
-	syslog(LOG_DEBUG, "db:   Linked libdb: %s", db_version(&dbversion_major, &dbversion_minor, &dbversion_patch));
-
-	// Create synthetic integer version numbers and compare them.
-	// Never allow citserver to run with a libdb older then the one with which it was compiled.
-	int compiled_db_version = ( (DB_VERSION_MAJOR * 1000000) + (DB_VERSION_MINOR * 1000) + (DB_VERSION_PATCH) );
-	int linked_db_version = ( (dbversion_major * 1000000) + (dbversion_minor * 1000) + (dbversion_patch) );
-	if (compiled_db_version > linked_db_version) {
-		syslog(LOG_ERR, "db: citserver is running with a version of libdb older than the one with which it was compiled.");
-		syslog(LOG_ERR, "db: This is an invalid configuration.  citserver will now exit to prevent data loss.");
-		exit(CTDLEXIT_DB);
-	}
 
 	// Silently try to create the database subdirectory.  If it's already there, no problem.
 	if ((mkdir(ctdl_db_dir, 0700) != 0) && (errno != EEXIST)) {
@@ -195,80 +107,43 @@ void open_databases(void) {
 		syslog(LOG_ERR, "db: unable to set the owner for [%s]: %m", ctdl_db_dir);
 		exit(CTDLEXIT_DB);
 	}
-	syslog(LOG_DEBUG, "db: Setting up DB environment");
-	ret = db_env_create(&dbenv, 0);
-	if (ret) {
-		syslog(LOG_ERR, "db: db_env_create: %s", db_strerror(ret));
-		syslog(LOG_ERR, "db: exit code %d", ret);
-		exit(CTDLEXIT_DB);
-	}
-	dbenv->set_errpfx(dbenv, "citserver");
-	dbenv->set_paniccall(dbenv, dbpanic);
-	dbenv->set_errcall(dbenv, cdb_verbose_err);
-	dbenv->set_errpfx(dbenv, "ctdl");
-	dbenv->set_msgcall(dbenv, cdb_verbose_log);
-	dbenv->set_verbose(dbenv, DB_VERB_DEADLOCK, 1);
-	dbenv->set_verbose(dbenv, DB_VERB_RECOVERY, 1);
-
-	// We want to specify the shared memory buffer pool cachesize, but everything else is the default.
-	ret = dbenv->set_cachesize(dbenv, 0, 64 * 1024, 0);
-	if (ret) {
-		syslog(LOG_ERR, "db: set_cachesize: %s", db_strerror(ret));
-		dbenv->close(dbenv, 0);
-		syslog(LOG_ERR, "db: exit code %d", ret);
-		exit(CTDLEXIT_DB);
-	}
 
-	if ((ret = dbenv->set_lk_detect(dbenv, DB_LOCK_DEFAULT))) {
-		syslog(LOG_ERR, "db: set_lk_detect: %s", db_strerror(ret));
-		dbenv->close(dbenv, 0);
-		syslog(LOG_ERR, "db: exit code %d", ret);
-		exit(CTDLEXIT_DB);
-	}
+	cdb_select_backend();
+	backend->open_databases();
+}
 
-	flags = DB_CREATE | DB_INIT_MPOOL | DB_PRIVATE | DB_INIT_TXN | DB_INIT_LOCK | DB_THREAD | DB_INIT_LOG;
-	syslog(LOG_DEBUG, "db: dbenv->open(dbenv, %s, %d, 0)", ctdl_db_dir, flags);
-	ret = dbenv->open(dbenv, ctdl_db_dir, flags, 0);				// try opening the database cleanly
-	if (ret == DB_RUNRECOVERY) {
-		syslog(LOG_ERR, "db: dbenv->open: %s", db_strerror(ret));
-		syslog(LOG_ERR, "db: attempting recovery...");
-		flags |= DB_RECOVER;
-		ret = dbenv->open(dbenv, ctdl_db_dir, flags, 0);			// try recovery
-	}
-	if (ret == DB_RUNRECOVERY) {
-		syslog(LOG_ERR, "db: dbenv->open: %s", db_strerror(ret));
-		syslog(LOG_ERR, "db: attempting catastrophic recovery...");
-		flags &= ~DB_RECOVER;
-		flags |= DB_RECOVER_FATAL;
-		ret = dbenv->open(dbenv, ctdl_db_dir, flags, 0);			// try catastrophic recovery
-	}
-	if (ret) {
-		syslog(LOG_ERR, "db: dbenv->open: %s", db_strerror(ret));
-		dbenv->close(dbenv, 0);
-		syslog(LOG_ERR, "db: exit code %d", ret);
-		exit(CTDLEXIT_DB);
-	}
 
-	syslog(LOG_INFO, "db: mounting databases");
-	for (i = 0; i < MAXCDB; ++i) {
-		ret = db_create(&dbp[i], dbenv, 0);					// Create a database handle
-		if (ret) {
-			syslog(LOG_ERR, "db: db_create: %s", db_strerror(ret));
-			syslog(LOG_ERR, "db: exit code %d", ret);
-			exit(CTDLEXIT_DB);
-		}
+// Close all of the databases we've opened.
+void close_databases(void) {
+	backend->close_databases();
+}
 
-		snprintf(dbfilename, sizeof dbfilename, "cdb.%02x", i);			// table names by number
-		ret = dbp[i]->open(dbp[i], NULL, dbfilename, NULL, DB_BTREE, DB_CREATE | DB_AUTO_COMMIT | DB_THREAD, 0600);
-		if (ret) {
-			syslog(LOG_ERR, "db: db_open[%02x]: %s", i, db_strerror(ret));
-			if (ret == ENOMEM) {
-				syslog(LOG_ERR, "db: You may need to tune your database; please check http://www.citadel.org for more information.");
-			}
-			syslog(LOG_ERR, "db: exit code %d", ret);
-			exit(CTDLEXIT_DB);
-		}
-	}
+
+// Apply the storage settings from the site configuration, which isn't available until the databases are open.
+void cdb_apply_storage_profile(void) {
+	backend->apply_storage_profile();
+}
+
+
+void cdb_log_cache_stats(void) {
+	backend->log_cache_stats();
+}
+
+
+// Request a checkpoint of the database.  Called once per minute by the thread manager.
+void cdb_checkpoint(void) {
+	backend->checkpoint();
+}
+
+
+// compact (defragment) the database, possibly returning space back to the underlying filesystem
+void cdb_compact(void) {
+	backend->compact();
+}
+
+
+void cdb_check_handles(void) {
+	backend->check_handles();
 }
 
 
@@ -292,47 +167,9 @@ void cdb_chmod_data(void) {
 }
 
 
-// Close all of the db database files we've opened.  This can be done in a loop, since it's just a bunch of closes.
-void close_databases(void) {
-	int i;
-	int ret;
-
-	syslog(LOG_INFO, "db: performing final checkpoint");
-	if ((ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0))) {
-		syslog(LOG_ERR, "db: txn_checkpoint: %s", db_strerror(ret));
-	}
-
-	syslog(LOG_INFO, "db: flushing the database logs");
-	if ((ret = dbenv->log_flush(dbenv, NULL))) {
-		syslog(LOG_ERR, "db: log_flush: %s", db_strerror(ret));
-	}
-
-	// close the tables
-	syslog(LOG_INFO, "db: closing databases");
-	for (i = 0; i < MAXCDB; ++i) {
-		syslog(LOG_INFO, "db: closing database %02x", i);
-		ret = dbp[i]->close(dbp[i], 0);
-		if (ret) {
-			syslog(LOG_ERR, "db: db_close: %s", db_strerror(ret));
-		}
-
-	}
-
-	// This seemed nifty at the time but did anyone really look at it?
-	// #ifdef DB_STAT_ALL
-	// dbenv->lock_stat_print(dbenv, DB_STAT_ALL);
-	// #endif
-
-	// Close the handle.
-	ret = dbenv->close(dbenv, 0);
-	if (ret) {
-		syslog(LOG_ERR, "db: DBENV->close: %s", db_strerror(ret));
-	}
-}
-
-
-// Decompress a database item if it was compressed on disk
-void cdb_decompress_if_necessary(struct cdbdata *cdb) {
+// Decompress a database item if it was compressed on disk.  Normally the item's buffer is replaced with a
+// newly allocated one; if "borrowed" is supplied, its buffer is expanded into that thread's buffer instead.
+static void cdb_decompress(struct cdbdata *cdb, struct cdb_borrowed *borrowed) {
 	static int magic = COMPRESS_MAGIC;
 
 	if ((cdb == NULL) || (cdb->ptr == NULL) || (cdb->len < sizeof(magic)) || (memcmp(cdb->ptr, &magic, sizeof(magic)))) {
@@ -359,7 +196,16 @@ void cdb_decompress_if_necessary(struct cdbdata *cdb) {
 
 	sourceLen = (uLongf) zheader.compressed_len;
 	destLen = (uLongf) zheader.uncompressed_len;
-	uncompressed_data = malloc(zheader.uncompressed_len);
+	if (borrowed != NULL) {
+		if (borrowed->unzipped_alloc < zheader.uncompressed_len) {
+			borrowed->unzipped_alloc = zheader.uncompressed_len;
+			borrowed->unzipped = realloc(borrowed->unzipped, borrowed->unzipped_alloc);
+		}
+		uncompressed_data = borrowed->unzipped;
+	}
+	else {
+		uncompressed_data = malloc(zheader.uncompressed_len);
+	}
 
 	if (uncompress((Bytef *) uncompressed_data,
 		       (uLongf *) &destLen, (const Bytef *) compressed_data, (uLong) sourceLen) != Z_OK) {
@@ -367,36 +213,63 @@ void cdb_decompress_if_necessary(struct cdbdata *cdb) {
 		cdb_abort();
 	}
 
-	free(cdb->ptr);
+	if (borrowed == NULL) {
+		free(cdb->ptr);
+	}
 	cdb->len = (size_t) destLen;
 	cdb->ptr = uncompressed_data;
 }
 
 
+void cdb_decompress_if_necessary(struct cdbdata *cdb) {
+	cdb_decompress(cdb, NULL);
+}
+
+
+// After any piece of a room's message list has been written or deleted, drop any cached copy of it.
+// (Every key in CDB_MSGLISTS begins with the room number.)  Inside a transaction, other threads can go on
+// reading the old list until we commit, and may cache it again in the meantime, so remember the room and drop
+// it once more in cdb_end_transaction().
+static void cdb_written(int cdb, const void *key, int keylen) {
+	struct thread_tsd *tsd;
+	long qrnumber;
+	int i;
+
+	if ((cdb != CDB_MSGLISTS) || (keylen < (int)sizeof(long))) {
+		return;
+	}
+	memcpy(&qrnumber, key, sizeof(long));
+	msglist_cache_invalidate(qrnumber);
+
+	tsd = TSD;
+	if (tsd->tid == NULL) {
+		return;
+	}
+	for (i = 0; i < tsd->num_txn_rooms; ++i) {
+		if (tsd->txn_rooms[i] == qrnumber) {
+			return;
+		}
+	}
+	if (tsd->num_txn_rooms >= tsd->alloc_txn_rooms) {
+		tsd->alloc_txn_rooms = (tsd->alloc_txn_rooms > 0) ? (tsd->alloc_txn_rooms * 2) : 16;
+		tsd->txn_rooms = realloc(tsd->txn_rooms, tsd->alloc_txn_rooms * sizeof(long));
+	}
+	tsd->txn_rooms[tsd->num_txn_rooms++] = qrnumber;
+}
+
+
 // Store a piece of data.  Returns 0 if the operation was successful.  If a
 // key already exists it should be overwritten.
 int cdb_store(int cdb, const void *ckey, int ckeylen, void *cdata, int cdatalen) {
-
-	DBT dkey, ddata;
-	DB_TXN *tid = NULL;
-	int ret = 0;
 	struct CtdlCompressHeader zheader;
 	char *compressed_data = NULL;
-	int compressing = 0;
 	size_t buffer_len = 0;
 	uLongf destLen = 0;
-
-	memset(&dkey, 0, sizeof(DBT));
-	memset(&ddata, 0, sizeof(DBT));
-	dkey.size = ckeylen;
-	dkey.data = (void *) ckey;
-	ddata.size = cdatalen;
-	ddata.data = cdata;
+	int ret;
 
 	// "visit" records are numerous and have big, mostly-empty string buffers in them.
 	// If we compress these we can get them down to 1% of their size most of the time.
 	if (cdb == CDB_VISIT) {
-		compressing = 1;
 		zheader.magic = COMPRESS_MAGIC;
 		zheader.uncompressed_len = cdatalen;
 		buffer_len = ((cdatalen * 101) / 100) + 100 + sizeof(struct CtdlCompressHeader);
@@ -408,175 +281,50 @@ int cdb_store(int cdb, const void *ckey, int ckeylen, void *cdata, int cdatalen)
 		}
 		zheader.compressed_len = (size_t) destLen;
 		memcpy(compressed_data, &zheader, sizeof(struct CtdlCompressHeader));
-		ddata.size = (size_t) (sizeof(struct CtdlCompressHeader) + zheader.compressed_len);
-		ddata.data = compressed_data;
+		cdata = compressed_data;
+		cdatalen = (int) (sizeof(struct CtdlCompressHeader) + zheader.compressed_len);
 	}
 
-	if (TSD->tid != NULL) {
-		ret = dbp[cdb]->put(dbp[cdb],	// db
-				    TSD->tid,	// transaction ID
-				    &dkey,	// key
-				    &ddata,	// data
-				    0		// flags
-		);
-		if (ret) {
-			syslog(LOG_ERR, "db: cdb_store(%d): %s", cdb, db_strerror(ret));
-			cdb_abort();
-		}
-		if (compressing) {
-			free(compressed_data);
-		}
-		return ret;
-	}
-	else {
-		bailIfCursor(TSD->cursors, "attempt to write during r/o cursor");
-
-	      retry:
-		txbegin(&tid);
-
-		if ((ret = dbp[cdb]->put(dbp[cdb],	// db
-					 tid,		// transaction ID
-					 &dkey,		// key
-					 &ddata,	// data
-					 0))) {		// flags
-			if (ret == DB_LOCK_DEADLOCK) {
-				txabort(tid);
-				goto retry;
-			}
-			else {
-				syslog(LOG_ERR, "db: cdb_store(%d): %s", cdb, db_strerror(ret));
-				cdb_abort();
-			}
-		}
-		else {
-			txcommit(tid);
-			if (compressing) {
-				free(compressed_data);
-			}
-			return ret;
-		}
+	ret = backend->store(cdb, ckey, ckeylen, cdata, cdatalen);
+	if (compressed_data != NULL) {
+		free(compressed_data);
 	}
+	cdb_written(cdb, ckey, ckeylen);
 	return ret;
 }
 
 
 // Delete a piece of data.  Returns 0 if the operation was successful.
 int cdb_delete(int cdb, void *key, int keylen) {
-	DBT dkey;
-	DB_TXN *tid;
 	int ret;
 
-	memset(&dkey, 0, sizeof dkey);
-	dkey.size = keylen;
-	dkey.data = key;
-
-	if (TSD->tid != NULL) {
-		ret = dbp[cdb]->del(dbp[cdb], TSD->tid, &dkey, 0);
-		if (ret) {
-			syslog(LOG_ERR, "db: cdb_delete(%d): %s", cdb, db_strerror(ret));
-			if (ret != DB_NOTFOUND) {
-				cdb_abort();
-			}
-		}
-	}
-	else {
-		bailIfCursor(TSD->cursors, "attempt to delete during r/o cursor");
-
-	      retry:
-		txbegin(&tid);
-
-		if ((ret = dbp[cdb]->del(dbp[cdb], tid, &dkey, 0)) && ret != DB_NOTFOUND) {
-			if (ret == DB_LOCK_DEADLOCK) {
-				txabort(tid);
-				goto retry;
-			}
-			else {
-				syslog(LOG_ERR, "db: cdb_delete(%d): %s", cdb, db_strerror(ret));
-				cdb_abort();
-			}
-		}
-		else {
-			txcommit(tid);
-		}
-	}
+	ret = backend->del(cdb, key, keylen);
+	cdb_written(cdb, key, keylen);
 	return ret;
 }
 
 
-static DBC *localcursor(int cdb) {
-	int ret;
-	DBC *curs;
-
-	if (TSD->cursors[cdb] == NULL) {
-		ret = dbp[cdb]->cursor(dbp[cdb], TSD->tid, &curs, 0);
-	}
-	else {
-		ret = TSD->cursors[cdb]->c_dup(TSD->cursors[cdb], &curs, DB_POSITION);
-	}
-
-	if (ret) {
-		syslog(LOG_ERR, "db: localcursor: %s", db_strerror(ret));
-		cdb_abort();
-	}
-
-	return curs;
-}
-
-
 // Fetch a piece of data.  If not found, returns NULL.  Otherwise, it returns
 // a struct cdbdata which it is the caller's responsibility to free later on
 // using the cdb_free() routine.
 struct cdbdata *cdb_fetch(int cdb, const void *key, int keylen) {
+	struct cdbdata *tempcdb;
 
 	if (keylen == 0) {		// key length zero is impossible
 		return(NULL);
 	}
 
-	struct cdbdata *tempcdb;
-	DBT dkey, dret;
-	int ret;
-
-	memset(&dkey, 0, sizeof(DBT));
-	dkey.size = keylen;
-	dkey.data = (void *) key;
-
-	if (TSD->tid != NULL) {
-		memset(&dret, 0, sizeof(DBT));
-		dret.flags = DB_DBT_MALLOC;
-		ret = dbp[cdb]->get(dbp[cdb], TSD->tid, &dkey, &dret, 0);
-	}
-	else {
-		DBC *curs;
-
-		do {
-			memset(&dret, 0, sizeof(DBT));
-			dret.flags = DB_DBT_MALLOC;
-			curs = localcursor(cdb);
-			ret = curs->c_get(curs, &dkey, &dret, DB_SET);
-			cclose(curs);
-		} while (ret == DB_LOCK_DEADLOCK);
-	}
-
-	if ((ret != 0) && (ret != DB_NOTFOUND)) {
-		syslog(LOG_ERR, "db: cdb_fetch(%d): %s", cdb, db_strerror(ret));
-		cdb_abort();
-	}
-
-	if (ret != 0) {
-		return NULL;
-	}
-
 	tempcdb = (struct cdbdata *) malloc(sizeof(struct cdbdata));
 	if (tempcdb == NULL) {
 		syslog(LOG_ERR, "db: cdb_fetch() cannot allocate memory for tempcdb: %m");
 		cdb_abort();
 	}
-	else {
-		tempcdb->len = dret.size;
-		tempcdb->ptr = dret.data;
-		cdb_decompress_if_necessary(tempcdb);
-		return (tempcdb);
+	if (backend->fetch(cdb, key, keylen, tempcdb) != 0) {
+		free(tempcdb);
+		return(NULL);
 	}
+	cdb_decompress_if_necessary(tempcdb);
+	return(tempcdb);
 }
 
 
@@ -594,12 +342,61 @@ void cdb_free(struct cdbdata *cdb) {
 }
 
 
-void cdb_close_cursor(int cdb) {
-	if (TSD->cursors[cdb] != NULL) {
-		cclose(TSD->cursors[cdb]);
+// Borrowed reads.  cdb_fetch() and cdb_next_item() give the caller its own copy of every record, which
+// most callers copy again into a struct and then free.  Callers which only read the record can use
+// cdb_fetch_borrowed() and cdb_next_item_borrowed() instead.  These read into a buffer belonging to the
+// calling thread, which is reused from one call to the next, so once it has grown to fit the records
+// a thread reads there is no heap traffic at all.  The cdbdata they return belongs to the thread: don't
+// free it or keep any pointers into it, because the next call of the same function overwrites it.
+
+// Make sure a borrowed buffer can hold at least "len" bytes (backends call this while reading)
+void cdb_borrowed_grow(struct cdb_borrowed *b, size_t len) {
+	if (b->alloc < len) {
+		b->alloc = (len > b->alloc * 2) ? len : (b->alloc * 2);
+		b->buf = realloc(b->buf, b->alloc);
 	}
+}
+
 
-	TSD->cursors[cdb] = NULL;
+// Fetch a piece of data into this thread's buffer.  If not found, returns NULL.
+struct cdbdata *cdb_fetch_borrowed(int cdb, const void *key, int keylen) {
+	struct cdb_borrowed *b = &TSD->fetch_buf;
+
+	if (keylen == 0) {		// key length zero is impossible
+		return(NULL);
+	}
+	if (backend->fetch_borrowed(cdb, key, keylen, b) != 0) {
+		return(NULL);
+	}
+	cdb_decompress(&b->data, b);
+	return(&b->data);
+}
+
+
+// Free this thread's borrowed buffers and anything the backend was keeping for it (called when a thread exits)
+void cdb_free_tsd(void) {
+	struct cdb_borrowed *b[2] = { &TSD->fetch_buf, &TSD->cursor_buf };
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (b[i]->buf != NULL) free(b[i]->buf);
+		if (b[i]->unzipped != NULL) free(b[i]->unzipped);
+		memset(b[i], 0, sizeof(struct cdb_borrowed));
+	}
+	if (TSD->txn_rooms != NULL) {
+		free(TSD->txn_rooms);
+		TSD->txn_rooms = NULL;
+	}
+	TSD->num_txn_rooms = 0;
+	TSD->alloc_txn_rooms = 0;
+	if (backend != NULL) {
+		backend->free_tsd();
+	}
+}
+
+
+void cdb_close_cursor(int cdb) {
+	backend->close_cursor(cdb);
 }
 
 
@@ -607,138 +404,80 @@ void cdb_close_cursor(int cdb) {
 // (There is guaranteed to be no more than one traversal in
 // progress per thread at any given time.)
 void cdb_rewind(int cdb) {
-	int ret = 0;
-
-	if (TSD->cursors[cdb] != NULL) {
-		syslog(LOG_ERR, "db: cdb_rewind: must close cursor on database %d before reopening", cdb);
-		cdb_abort();
-		// cclose(TSD->cursors[cdb]);
-	}
-
-	// Now initialize the cursor
-	ret = dbp[cdb]->cursor(dbp[cdb], TSD->tid, &TSD->cursors[cdb], 0);
-	if (ret) {
-		syslog(LOG_ERR, "db: cdb_rewind: db_cursor: %s", db_strerror(ret));
-		cdb_abort();
-	}
+	backend->rewind(cdb);
 }
 
 
-// Fetch the next item in a sequential search.  Returns a pointer to a 
+// Fetch the next item in a sequential search.  Returns a pointer to a
 // cdbdata structure, or NULL if we've hit the end.
 struct cdbdata *cdb_next_item(int cdb) {
-	DBT key, data;
 	struct cdbdata *cdbret;
-	int ret = 0;
-
-	// Initialize the key/data pair so the flags aren't set.
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	data.flags = DB_DBT_MALLOC;
-
-	ret = TSD->cursors[cdb]->c_get(TSD->cursors[cdb], &key, &data, DB_NEXT);
 
-	if (ret) {
-		if (ret != DB_NOTFOUND) {
-			syslog(LOG_ERR, "db: cdb_next_item(%d): %s", cdb, db_strerror(ret));
-			cdb_abort();
-		}
-		cdb_close_cursor(cdb);
+	cdbret = (struct cdbdata *) malloc(sizeof(struct cdbdata));
+	if (backend->next_item(cdb, cdbret) != 0) {
+		free(cdbret);
 		return NULL;	// presumably, end of file
 	}
-
-	cdbret = (struct cdbdata *) malloc(sizeof(struct cdbdata));
-	cdbret->len = data.size;
-	cdbret->ptr = data.data;
 	cdb_decompress_if_necessary(cdbret);
-
 	return (cdbret);
 }
 
 
-// Transaction-based stuff.  I'm writing this as I bake cookies...
-void cdb_begin_transaction(void) {
-	bailIfCursor(TSD->cursors, "can't begin transaction during r/o cursor");
+// Fetch the next item in a sequential search into this thread's buffer.  Returns NULL if we've hit the end.
+struct cdbdata *cdb_next_item_borrowed(int cdb) {
+	struct cdb_borrowed *b = &TSD->cursor_buf;
 
-	if (TSD->tid != NULL) {
-		syslog(LOG_ERR, "db: cdb_begin_transaction: ERROR: nested transaction");
-		cdb_abort();
+	if (backend->next_item_borrowed(cdb, b) != 0) {
+		return NULL;	// presumably, end of file
 	}
+	cdb_decompress(&b->data, b);
+	return(&b->data);
+}
 
-	txbegin(&TSD->tid);
+
+void cdb_begin_transaction(void) {
+	backend->begin_transaction();
 }
 
 
 void cdb_end_transaction(void) {
+	struct thread_tsd *tsd = TSD;
 	int i;
 
-	for (i = 0; i < MAXCDB; i++) {
-		if (TSD->cursors[i] != NULL) {
-			syslog(LOG_WARNING, "db: cdb_end_transaction: WARNING: cursor %d still open at transaction end", i);
-			cclose(TSD->cursors[i]);
-			TSD->cursors[i] = NULL;
-		}
-	}
+	backend->end_transaction();
 
-	if (TSD->tid == NULL) {
-		syslog(LOG_ERR, "db: cdb_end_transaction: ERROR: txcommit(NULL) !!");
-		cdb_abort();
+	// Now that everyone can see the new lists, drop whatever was cached from the old ones
+	for (i = 0; i < tsd->num_txn_rooms; ++i) {
+		msglist_cache_invalidate(tsd->txn_rooms[i]);
 	}
-	else {
-		txcommit(TSD->tid);
-	}
-
-	TSD->tid = NULL;
+	tsd->num_txn_rooms = 0;
 }
 
 
-// Truncate (delete every record)
-void cdb_trunc(int cdb) {
-	int ret;
-	u_int32_t count;
-
-	if (TSD->tid != NULL) {
-		syslog(LOG_ERR, "db: cdb_trunc must not be called in a transaction.");
-		cdb_abort();
+// Read everything from one snapshot until cdb_end_read(), so that a record stored in several pieces can't be
+// seen half written.  In a transaction, that's what we get anyway.  cdb_end_read() returns nonzero if the
+// backend had to give up the snapshot part of the way through, in which case the reads must be done again.
+void cdb_begin_read(void) {
+	if (TSD->tid == NULL) {
+		backend->begin_read();
 	}
-	else {
-		bailIfCursor(TSD->cursors, "attempt to write during r/o cursor");
+}
 
-	      retry:
 
-		if ((ret = dbp[cdb]->truncate(dbp[cdb],	// db
-					      NULL,	// transaction ID
-					      &count,	// #rows deleted
-					      0))) {	// flags
-			if (ret == DB_LOCK_DEADLOCK) {
-				goto retry;
-			}
-			else {
-				syslog(LOG_ERR, "db: cdb_truncate(%d): %s", cdb, db_strerror(ret));
-				if (ret == ENOMEM) {
-					syslog(LOG_ERR, "db: You may need to tune your database; please read http://www.citadel.org for more information.");
-				}
-				exit(CTDLEXIT_DB);
-			}
-		}
+int cdb_end_read(void) {
+	if (TSD->tid != NULL) {
+		return(0);
 	}
+	return(backend->end_read());
 }
 
 
-// compact (defragment) the database, possibly returning space back to the underlying filesystem
-void cdb_compact(void) {
-	int ret;
-	int i;
-
-	syslog(LOG_DEBUG, "db: cdb_compact() started");
-	for (i = 0; i < MAXCDB; i++) {
-		syslog(LOG_DEBUG, "db: compacting database %d", i);
-		ret = dbp[i]->compact(dbp[i], NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
-		if (ret) {
-			syslog(LOG_ERR, "db: compact: %s", db_strerror(ret));
-		}
+// Truncate (delete every record)
+void cdb_trunc(int cdb) {
+	backend->trunc(cdb);
+	if (cdb == CDB_MSGLISTS) {
+		msglist_cache_flush();
 	}
-	syslog(LOG_DEBUG, "db: cdb_compact() finished");
 }
 
 
@@ -13,18 +13,26 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+struct cdbdata;
+struct cdb_borrowed;
 
 void open_databases (void);
 void close_databases (void);
+void cdb_apply_storage_profile(void);
+void cdb_log_cache_stats(void);
 int cdb_store (int cdb, const void *key, int keylen, void *data, int datalen);
 int cdb_delete (int cdb, void *key, int keylen);
 struct cdbdata *cdb_fetch (int cdb, const void *key, int keylen);
 void cdb_free (struct cdbdata *cdb);
+struct cdbdata *cdb_fetch_borrowed(int cdb, const void *key, int keylen);
+struct cdbdata *cdb_next_item_borrowed(int cdb);
 void cdb_rewind (int cdb);
 struct cdbdata *cdb_next_item (int cdb);
 void cdb_close_cursor(int cdb);
 void cdb_begin_transaction(void);
 void cdb_end_transaction(void);
+void cdb_begin_read(void);
+int cdb_end_read(void);
 void cdb_allocate_tsd(void);
 void cdb_free_tsd(void);
 void cdb_check_handles(void);
@@ -35,9 +43,51 @@ void cdb_checkpoint(void);
 void check_handles(void *arg);
 void cdb_cull_logs(void);
 void cdb_compact(void);
+void cdb_abort(void);
 
 
 int CheckIfAlreadySeen(StrBuf *guid);
 
+
+/*
+ * A storage engine.  database.c does everything which doesn't depend on the engine (compression,
+ * the message list cache, borrowed buffers) and passes the rest to whichever one of these was
+ * selected when the databases were opened.  Records go in and come out exactly as stored.
+ */
+struct cdb_backend {
+	const char *name;
+	int (*exists)(void);			/* Is there a store of this kind in the data directory? */
+	void (*open_databases)(void);
+	void (*close_databases)(void);
+	void (*apply_storage_profile)(void);
+	void (*log_cache_stats)(void);
+	void (*checkpoint)(void);
+	void (*compact)(void);
+	void (*check_handles)(void);
+	int (*store)(int cdb, const void *key, int keylen, void *data, int datalen);
+	int (*del)(int cdb, const void *key, int keylen);
+	int (*fetch)(int cdb, const void *key, int keylen, struct cdbdata *out);		/* 0 if found */
+	int (*fetch_borrowed)(int cdb, const void *key, int keylen, struct cdb_borrowed *b);	/* 0 if found */
+	void (*rewind)(int cdb);
+	int (*next_item)(int cdb, struct cdbdata *out);				/* 0 if found */
+	int (*next_item_borrowed)(int cdb, struct cdb_borrowed *b);		/* 0 if found */
+	void (*close_cursor)(int cdb);
+	void (*begin_transaction)(void);
+	void (*end_transaction)(void);
+	void (*begin_read)(void);
+	int (*end_read)(void);					/* nonzero if the snapshot was lost */
+	void (*trunc)(int cdb);
+	void (*free_tsd)(void);
+};
+
+extern const struct cdb_backend bdb_backend;
+#ifdef HAVE_LMDB
+extern const struct cdb_backend lmdb_backend;
+#endif
+extern char *cdb_backend_name;
+
+void cdb_borrowed_grow(struct cdb_borrowed *b, size_t len);
+unsigned long long cdb_physical_memory(void);
+
 #endif /* DATABASE_H */
 
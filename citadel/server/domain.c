@@ -7,6 +7,11 @@
 
 #include "sysdep.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 #include <syslog.h>
 #ifdef HAVE_RESOLV_H
 #include <arpa/nameser.h>
@@ -79,14 +84,10 @@ int mx_compare_pref(const void *mx1, const void *mx2) {
 }
 
 
-// getmx()
-//
-// Return one or more MX's for a mail destination.
-//
-// Upon success, it fills 'mxbuf' with one or more MX hosts, separated by
-// vertical bar characters, and returns the number of hosts as its return
-// value.  If no MX's are found, it returns 0.
-int getmx(char *mxbuf, char *dest) {
+// Look up the MX records for a domain, sorted by preference, and fill 'mxbuf' with them the same way getmx() does.
+// The TTL of the answer is returned in 'ttl' (zero if the lookup failed, in which case the domain itself is
+// returned as its only MX).
+static int lookup_mx(char *mxbuf, char *dest, long *ttl) {
 
 #ifdef HAVE_RESOLV_H
 	union {
@@ -99,20 +100,16 @@ int getmx(char *mxbuf, char *dest) {
 	unsigned char *startptr, *endptr, *ptr;
 	char expanded_buf[1024];
 	unsigned short pref, type;
+	unsigned long rrttl;
 	int n = 0;
 	int qdcount;
 	Array *mxrecords = NULL;
 	struct mx mx;
 
-	// If we're configured to send all mail to a smart-host, then our job here is really easy -- just return those.
-	n = get_hosts(mxbuf, "smarthost");
-	if (n > 0) {
-		return(n);
-	}
-
+	*ttl = 0;
 	mxrecords = array_new(sizeof(struct mx));
 
-	// No smart-host?  Look up the best MX for a site.  Make a call to the resolver library.
+	// Make a call to the resolver library.
 	ret = res_query(dest, C_IN, T_MX, (unsigned char *)answer.bytes, sizeof(answer));
 
 	if (ret < 0) {
@@ -132,6 +129,8 @@ int getmx(char *mxbuf, char *dest) {
 		for (qdcount = ntohs(answer.header.qdcount); qdcount--; ptr += ret + QFIXEDSZ) {
 			if ((ret = dn_skipname(ptr, endptr)) < 0) {
 				syslog(LOG_DEBUG, "domain: dn_skipname error");
+				array_free(mxrecords);
+				strcpy(mxbuf, "");
 				return(0);
 			}
 		}
@@ -143,7 +142,8 @@ int getmx(char *mxbuf, char *dest) {
 			ptr += ret;
 	
 			GETSHORT(type, ptr);
-			ptr += INT16SZ + INT32SZ;
+			ptr += INT16SZ;
+			GETLONG(rrttl, ptr);
 			GETSHORT(n, ptr);
 	
 			if (type != T_MX) {
@@ -158,6 +158,9 @@ int getmx(char *mxbuf, char *dest) {
 				mx.pref = pref;
 				strcpy(mx.host, expanded_buf);
 				array_append(mxrecords, &mx);
+				if ((*ttl == 0) || ((long)rrttl < *ttl)) {
+					*ttl = (long)rrttl;
+				}
 			}
 		}
 	}
@@ -174,6 +177,114 @@ int getmx(char *mxbuf, char *dest) {
 		strcat(mxbuf, "|");
 	}
 	array_free(mxrecords);
+	return(num_mxrecs);
+}
+
+
+// Cache of MX lookups.  An answer is kept for as long as its TTL says (within MX_CACHE_MIN_TTL and
+// MX_CACHE_MAX_TTL), and a lookup which found nothing is kept for MX_CACHE_NEGATIVE_TTL, so sending a lot of
+// mail to one domain doesn't ask the resolver the same question over and over.  The cache is a table of
+// MX_CACHE_SIZE slots, one per domain, and a domain which lands in an occupied slot simply replaces what's there.
+struct mx_cache_entry {
+	char domain[256];
+	time_t expires;
+	int negative;
+	int num_mx;
+	char mxes[];
+};
+
+static struct mx_cache_entry *mx_cache[MX_CACHE_SIZE];
+static struct mx_cache_stats mx_stats;
+static pthread_mutex_t mx_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void getmx_cache_stats(struct mx_cache_stats *stats) {
+	time_t now = time(NULL);
+	int i;
+
+	pthread_mutex_lock(&mx_cache_lock);
+	memcpy(stats, &mx_stats, sizeof(struct mx_cache_stats));
+	stats->entries = 0;
+	for (i = 0; i < MX_CACHE_SIZE; ++i) {
+		if ((mx_cache[i] != NULL) && (mx_cache[i]->expires > now)) {
+			++stats->entries;
+		}
+	}
+	pthread_mutex_unlock(&mx_cache_lock);
+}
+
+
+// getmx()
+//
+// Return one or more MX's for a mail destination.
+//
+// Upon success, it fills 'mxbuf' with one or more MX hosts, separated by
+// vertical bar characters, and returns the number of hosts as its return
+// value.  If no MX's are found, it returns 0.
+int getmx(char *mxbuf, char *dest) {
+	struct mx_cache_entry *e;
+	char key[256];
+	long ttl = 0;
+	time_t now;
+	int num_mxrecs = -1;
+	int slot;
+	int n;
+
+	// If we're configured to send all mail to a smart-host, then our job here is really easy -- just return those.
+	n = get_hosts(mxbuf, "smarthost");
+	if (n > 0) {
+		return(n);
+	}
+
+	// No smart-host?  Look up the best MX for a site, if we haven't already done so recently.
+	for (n = 0; (dest[n] != 0) && (n < sizeof key - 1); ++n) {
+		key[n] = tolower(dest[n]);
+	}
+	key[n] = 0;
+	slot = abs(HashLittle(key, n)) % MX_CACHE_SIZE;
+	now = time(NULL);
+
+	pthread_mutex_lock(&mx_cache_lock);
+	e = mx_cache[slot];
+	if ((e != NULL) && (e->expires > now) && (!strcmp(e->domain, key))) {
+		strcpy(mxbuf, e->mxes);
+		num_mxrecs = e->num_mx;
+		++mx_stats.hits;
+		if (e->negative) {
+			++mx_stats.negative_hits;
+		}
+	}
+	else {
+		++mx_stats.misses;
+	}
+	pthread_mutex_unlock(&mx_cache_lock);
+
+	if (num_mxrecs < 0) {
+		num_mxrecs = lookup_mx(mxbuf, dest, &ttl);
+		e = malloc(sizeof(struct mx_cache_entry) + strlen(mxbuf) + 1);
+		if (e != NULL) {
+			safestrncpy(e->domain, key, sizeof e->domain);
+			e->negative = (ttl <= 0);
+			if (e->negative) {
+				ttl = MX_CACHE_NEGATIVE_TTL;
+			}
+			else if (ttl < MX_CACHE_MIN_TTL) {
+				ttl = MX_CACHE_MIN_TTL;
+			}
+			else if (ttl > MX_CACHE_MAX_TTL) {
+				ttl = MX_CACHE_MAX_TTL;
+			}
+			e->expires = now + ttl;
+			e->num_mx = num_mxrecs;
+			strcpy(e->mxes, mxbuf);
+			pthread_mutex_lock(&mx_cache_lock);
+			if (mx_cache[slot] != NULL) {
+				free(mx_cache[slot]);
+			}
+			mx_cache[slot] = e;
+			pthread_mutex_unlock(&mx_cache_lock);
+		}
+	}
 
 	// Append any fallback smart hosts we have configured.
 	num_mxrecs += get_hosts(&mxbuf[strlen(mxbuf)], "fallbackhost");
@@ -15,7 +15,15 @@ struct mx {
 	char host[1024];
 };
 
+struct mx_cache_stats {
+	long hits;
+	long negative_hits;
+	long misses;
+	int entries;
+};
+
 int getmx(char *mxbuf, char *dest);
+void getmx_cache_stats(struct mx_cache_stats *stats);
 int get_hosts(char *mxbuf, char *rectype);
 
 
@@ -10,6 +10,7 @@
 #include <libcitadel.h>
 #include "citserver.h"
 #include "room_ops.h"
+#include "msglist_cache.h"
 
 // The structure of an euidindex record *key* is:
 //
@@ -166,9 +167,7 @@ void rebuild_euid_index(void) {
 void cmd_euid(char *cmdbuf) {
 	char euid[256];
 	long msgnum;
-        struct cdbdata *cdbfr;
-        long *msglist = NULL;
-        int num_msgs = 0;
+	struct msglist *ml;
 	int i;
 
 	if (CtdlAccessCheck(ac_logged_in_or_guest)) return;
@@ -180,18 +179,15 @@ void cmd_euid(char *cmdbuf) {
 		return;
 	}
 
-        cdbfr = cdb_fetch(CDB_MSGLISTS, &CC->room.QRnumber, sizeof(long));
-	if (cdbfr != NULL) {
-                num_msgs = cdbfr->len / sizeof(long);
-                msglist = (long *) cdbfr->ptr;
-                for (i = 0; i < num_msgs; ++i) {
-                        if (msglist[i] == msgnum) {
-				cdb_free(cdbfr);
-				cprintf("%d %ld\n", CIT_OK, msgnum);
-				return;
-			}
+	ml = CtdlGetMsgList(CC->room.QRnumber);
+	if (ml != NULL) {
+		i = msglist_gallop(ml->msgs, ml->num_msgs, 0, msgnum);
+		if ((i < ml->num_msgs) && (ml->msgs[i] == msgnum)) {
+			CtdlPutMsgList(&ml);
+			cprintf("%d %ld\n", CIT_OK, msgnum);
+			return;
 		}
-                cdb_free(cdbfr);
+		CtdlPutMsgList(&ml);
 	}
 
 	cprintf("%d not found\n", ERROR + MESSAGE_NOT_FOUND);
@@ -0,0 +1,635 @@
+// This is a data store backend for the Citadel server which uses LMDB.  database.c calls it through
+// lmdb_backend, at the bottom of this file.
+//
+// LMDB keeps the whole store in one memory mapped file.  Readers never lock anything and never wait for
+// writers; they just see the store as it was when their transaction began.  Writers take turns.  That
+// means none of the deadlock-and-retry loops Berkeley DB needs, and no buffer pool to size: the
+// operating system's page cache is the cache.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifdef HAVE_LMDB
+
+#include "sysdep.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <lmdb.h>
+#include <libcitadel.h>
+#include "ctdl_module.h"
+#include "control.h"
+#include "citserver.h"
+#include "config.h"
+
+static MDB_env *env = NULL;		// The LMDB environment
+static MDB_dbi dbi[MAXCDB];		// One named database for each Citadel database
+
+// The map is as big as the store can get before citserver has to be restarted.  It only takes up address
+// space, not memory, so we're generous: at least this much, or twice the size of the store, whichever is
+// more.  A store which does fill its map stops the server, and the restart doubles the map.
+#define LMDB_MIN_MAP_SIZE	(64ULL * 1024 * 1024 * 1024)
+#define LMDB_MIN_MAP_SIZE_32	(1ULL * 1024 * 1024 * 1024)
+
+// Every thread keeps a reader, and every traversal in progress needs one more
+#define LMDB_MAX_READERS	1024
+
+#define MEGABYTE		(1024 * 1024)
+
+
+// Log an error from LMDB and stop, because there's no telling what state the store is in
+static void lmdb_fail(const char *where, int cdb, int ret) {
+	syslog(LOG_ERR, "db: %s(%02x): %s", where, cdb, mdb_strerror(ret));
+	if (ret == MDB_MAP_FULL) {
+		syslog(LOG_ERR, "db: the store has filled its map; restarting citserver will make the map bigger");
+	}
+	cdb_abort();
+}
+
+
+static void lmdb_check_handles(void) {
+	int i;
+
+	for (i = 0; i < MAXCDB; i++) {
+		if (TSD->cursors[i] != NULL) {
+			syslog(LOG_ERR, "db: cursor still in progress on cdb %02x: in check_handles", i);
+			cdb_abort();
+		}
+	}
+
+	if (TSD->tid != NULL) {
+		syslog(LOG_ERR, "db: transaction still in progress!");
+		cdb_abort();
+	}
+}
+
+
+// Say how full the map is
+static void lmdb_log_cache_stats(void) {
+	MDB_envinfo info;
+	MDB_stat st;
+
+	if ((mdb_env_info(env, &info) != 0) || (mdb_env_stat(env, &st) != 0) || (info.me_mapsize == 0)) {
+		return;
+	}
+	syslog(LOG_INFO, "db: %llu of %llu MB in use (%llu%% of the map), %u readers",
+		(unsigned long long)(info.me_last_pgno + 1) * st.ms_psize / MEGABYTE,
+		(unsigned long long)info.me_mapsize / MEGABYTE,
+		(unsigned long long)(info.me_last_pgno + 1) * st.ms_psize * 100 / info.me_mapsize,
+		info.me_numreaders
+	);
+}
+
+
+// Called once per minute by the thread manager.  LMDB has no log to checkpoint; this is only where the
+// commits of the last minute get flushed in "group commit" mode.
+static void lmdb_checkpoint(void) {
+	int ret;
+	int dead = 0;
+	static int checkpoints = 0;
+
+	syslog(LOG_DEBUG, "db: -- checkpoint --");
+	if (CtdlGetConfigInt("c_db_durability") == 2) {
+		ret = mdb_env_sync(env, 1);
+		if (ret != 0) {
+			syslog(LOG_ERR, "db: cdb_checkpoint() mdb_env_sync: %s", mdb_strerror(ret));
+		}
+	}
+
+	// Once an hour, say how full the map is and clear out readers left behind by dead processes
+	if ((++checkpoints % 60) == 0) {
+		lmdb_log_cache_stats();
+		mdb_reader_check(env, &dead);
+		if (dead > 0) {
+			syslog(LOG_INFO, "db: cleared %d stale readers", dead);
+		}
+	}
+}
+
+
+// Is there an LMDB store in the data directory?
+static int lmdb_exists(void) {
+	struct stat st;
+
+	return(stat(ctdl_db_dir "/data.mdb", &st) == 0);
+}
+
+
+// How big to make the map
+static size_t lmdb_map_size(void) {
+	struct stat st;
+	unsigned long long map_size;
+
+	if (sizeof(size_t) < 8) {
+		return(LMDB_MIN_MAP_SIZE_32);
+	}
+	map_size = LMDB_MIN_MAP_SIZE;
+	if ((stat(ctdl_db_dir "/data.mdb", &st) == 0) && ((unsigned long long)st.st_size * 2 > map_size)) {
+		map_size = (unsigned long long)st.st_size * 2;
+	}
+	return((size_t)map_size);
+}
+
+
+// Open the various databases we'll be using.  Any database which does not exist should be created.
+static void lmdb_open_databases(void) {
+	int ret;
+	int i;
+	int dead = 0;
+	char dbname[32];
+	MDB_txn *txn;
+	int major, minor, patch;
+
+	syslog(LOG_DEBUG, "db: Compiled liblmdb: %s", MDB_VERSION_STRING);
+	syslog(LOG_DEBUG, "db:   Linked liblmdb: %s", mdb_version(&major, &minor, &patch));
+
+	syslog(LOG_DEBUG, "db: Setting up LMDB environment");
+	ret = mdb_env_create(&env);
+	if (ret) {
+		syslog(LOG_ERR, "db: mdb_env_create: %s", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	mdb_env_set_maxdbs(env, MAXCDB);
+	mdb_env_set_maxreaders(env, LMDB_MAX_READERS);
+	ret = mdb_env_set_mapsize(env, lmdb_map_size());
+	if (ret) {
+		syslog(LOG_ERR, "db: mdb_env_set_mapsize: %s", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+
+	// MDB_NOTLS lets a thread hold more than one read transaction (one for lookups, one for each traversal)
+	ret = mdb_env_open(env, ctdl_db_dir, MDB_NOTLS, 0600);
+	if (ret) {
+		syslog(LOG_ERR, "db: mdb_env_open(%s): %s", ctdl_db_dir, mdb_strerror(ret));
+		mdb_env_close(env);
+		exit(CTDLEXIT_DB);
+	}
+	mdb_reader_check(env, &dead);
+
+	syslog(LOG_INFO, "db: mounting databases");
+	ret = mdb_txn_begin(env, NULL, 0, &txn);
+	if (ret) {
+		syslog(LOG_ERR, "db: mdb_txn_begin: %s", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	for (i = 0; i < MAXCDB; ++i) {
+		snprintf(dbname, sizeof dbname, "cdb.%02x", i);				// table names by number
+		ret = mdb_dbi_open(txn, dbname, MDB_CREATE, &dbi[i]);
+		if (ret) {
+			syslog(LOG_ERR, "db: mdb_dbi_open[%02x]: %s", i, mdb_strerror(ret));
+			exit(CTDLEXIT_DB);
+		}
+	}
+	ret = mdb_txn_commit(txn);
+	if (ret) {
+		syslog(LOG_ERR, "db: mdb_txn_commit: %s", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+}
+
+
+// Apply the storage settings from the site configuration and report what we ended up with.  Only
+// c_db_durability means anything here: LMDB has no cache of its own, and the whole store is mapped.
+static void lmdb_apply_storage_profile(void) {
+	static const char *durability_names[] = {
+		"synchronous (every commit is flushed to disk)",
+		"write-nosync (commits are written to the OS, which flushes them at its leisure)",
+		"group commit (commits are buffered and flushed to disk once a minute)"
+	};
+	MDB_envinfo info;
+	MDB_stat st;
+	int durability;
+
+	durability = CtdlGetConfigInt("c_db_durability");
+	if ((durability < 0) || (durability > 2)) {
+		durability = 0;
+	}
+	mdb_env_set_flags(env, MDB_NOSYNC, (durability != 0));
+
+	if ((CtdlGetConfigLong("c_db_cache_mb") > 0) || (CtdlGetConfigLong("c_db_mmap_mb") > 0)) {
+		syslog(LOG_INFO, "db: LMDB uses the operating system's page cache; the cache and mmap settings are ignored");
+	}
+	if ((mdb_env_info(env, &info) == 0) && (mdb_env_stat(env, &st) == 0)) {
+		syslog(LOG_INFO, "db: map size is %llu MB, page size is %u, key size limit is %d",
+			(unsigned long long)info.me_mapsize / MEGABYTE, st.ms_psize, mdb_env_get_maxkeysize(env)
+		);
+	}
+	syslog(LOG_INFO, "db: durability is %s", durability_names[durability]);
+	lmdb_log_cache_stats();
+}
+
+
+// Close the environment.  Everything it holds is in the one file, so this is all there is to do.
+static void lmdb_close_databases(void) {
+	int ret;
+
+	syslog(LOG_INFO, "db: flushing the store");
+	if ((ret = mdb_env_sync(env, 1))) {
+		syslog(LOG_ERR, "db: mdb_env_sync: %s", mdb_strerror(ret));
+	}
+	syslog(LOG_INFO, "db: closing databases");
+	mdb_env_close(env);
+	env = NULL;
+}
+
+
+// The transaction to write in: the thread's own, if it has begun one, or else a new one just for this write
+static MDB_txn *lmdb_write_begin(void) {
+	MDB_txn *txn;
+	int ret;
+
+	if (TSD->tid != NULL) {
+		return(TSD->tid);
+	}
+	ret = mdb_txn_begin(env, NULL, 0, &txn);
+	if (ret) {
+		lmdb_fail("mdb_txn_begin", 0, ret);
+	}
+	return(txn);
+}
+
+
+// Finish a write.  A transaction the thread began itself is left for cdb_end_transaction().
+static void lmdb_write_end(MDB_txn *txn, int cdb, int commit) {
+	int ret;
+
+	if (txn == TSD->tid) {
+		return;
+	}
+	if (!commit) {
+		mdb_txn_abort(txn);
+		return;
+	}
+	ret = mdb_txn_commit(txn);
+	if (ret) {
+		lmdb_fail("mdb_txn_commit", cdb, ret);
+	}
+}
+
+
+// The transaction to read from: the thread's own, if it has begun one, or the snapshot from cdb_begin_read(),
+// or else the thread's reader, which is renewed for every read so it sees everything committed so far.
+// Threads without TSD of their own share the master TSD, so they get a new reader every time instead.
+static MDB_txn *lmdb_read_begin(void) {
+	MDB_txn *txn;
+	int ret;
+
+	if (TSD->tid != NULL) {
+		return(TSD->tid);
+	}
+	if (TSD->snapshot != NULL) {
+		return(TSD->snapshot);
+	}
+	if ((TSD == &masterTSD) || (TSD->reader == NULL)) {
+		ret = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+		if ((ret == 0) && (TSD != &masterTSD)) {
+			TSD->reader = txn;
+		}
+	}
+	else {
+		txn = TSD->reader;
+		ret = mdb_txn_renew(txn);
+	}
+	if (ret) {
+		lmdb_fail("lmdb_read_begin", 0, ret);
+	}
+	return(txn);
+}
+
+
+// Done reading.  The reader lets go of its snapshot but keeps its slot for next time.
+static void lmdb_read_end(MDB_txn *txn) {
+	if ((txn == TSD->tid) || (txn == TSD->snapshot)) {
+		return;
+	}
+	if (txn == TSD->reader) {
+		mdb_txn_reset(txn);
+	}
+	else {
+		mdb_txn_abort(txn);
+	}
+}
+
+
+// Store a piece of data.  Returns 0 if the operation was successful.  If a
+// key already exists it should be overwritten.
+static int lmdb_store(int cdb, const void *ckey, int ckeylen, void *cdata, int cdatalen) {
+	MDB_val dkey, ddata;
+	MDB_txn *txn;
+	int ret;
+
+	if (ckeylen > mdb_env_get_maxkeysize(env)) {
+		syslog(LOG_ERR, "db: cdb_store(%02x): a %d byte key is longer than LMDB allows", cdb, ckeylen);
+		return(-1);
+	}
+
+	dkey.mv_size = ckeylen;
+	dkey.mv_data = (void *) ckey;
+	ddata.mv_size = cdatalen;
+	ddata.mv_data = cdata;
+
+	txn = lmdb_write_begin();
+	ret = mdb_put(txn, dbi[cdb], &dkey, &ddata, 0);
+	if (ret) {
+		lmdb_fail("cdb_store", cdb, ret);
+	}
+	lmdb_write_end(txn, cdb, 1);
+	return(0);
+}
+
+
+// Delete a piece of data.  Returns 0 if the operation was successful.
+static int lmdb_delete(int cdb, const void *key, int keylen) {
+	MDB_val dkey;
+	MDB_txn *txn;
+	int ret;
+
+	dkey.mv_size = keylen;
+	dkey.mv_data = (void *) key;
+
+	txn = lmdb_write_begin();
+	ret = mdb_del(txn, dbi[cdb], &dkey, NULL);
+	if ((ret != 0) && (ret != MDB_NOTFOUND) && (ret != MDB_BAD_VALSIZE)) {
+		lmdb_fail("cdb_delete", cdb, ret);
+	}
+	lmdb_write_end(txn, cdb, (ret == 0));
+	return(ret);
+}
+
+
+// Look up a record.  The value points into the map, and is only good until lmdb_read_end().
+static int lmdb_get(int cdb, const void *key, int keylen, MDB_txn *txn, MDB_val *dret) {
+	MDB_val dkey;
+	int ret;
+
+	dkey.mv_size = keylen;
+	dkey.mv_data = (void *) key;
+
+	ret = mdb_get(txn, dbi[cdb], &dkey, dret);
+	if ((ret != 0) && (ret != MDB_NOTFOUND) && (ret != MDB_BAD_VALSIZE)) {	// a key too long to store can't be found
+		lmdb_fail("cdb_fetch", cdb, ret);
+	}
+	return(ret);
+}
+
+
+// Fetch a piece of data.  Returns 0 and fills in "out" (with a buffer the caller must free) if it was found.
+static int lmdb_fetch(int cdb, const void *key, int keylen, struct cdbdata *out) {
+	MDB_txn *txn;
+	MDB_val dret;
+	int ret;
+
+	txn = lmdb_read_begin();
+	ret = lmdb_get(cdb, key, keylen, txn, &dret);
+	if (ret == 0) {
+		out->len = dret.mv_size;
+		out->ptr = malloc(dret.mv_size + 1);
+		memcpy(out->ptr, dret.mv_data, dret.mv_size);
+	}
+	lmdb_read_end(txn);
+	return(ret);
+}
+
+
+// Fetch a piece of data into a borrowed buffer
+static int lmdb_fetch_borrowed(int cdb, const void *key, int keylen, struct cdb_borrowed *b) {
+	MDB_txn *txn;
+	MDB_val dret;
+	int ret;
+
+	txn = lmdb_read_begin();
+	ret = lmdb_get(cdb, key, keylen, txn, &dret);
+	if (ret == 0) {
+		cdb_borrowed_grow(b, dret.mv_size);
+		memcpy(b->buf, dret.mv_data, dret.mv_size);
+		b->data.ptr = b->buf;
+		b->data.len = dret.mv_size;
+	}
+	lmdb_read_end(txn);
+	return(ret);
+}
+
+
+// Let go of this thread's reader (called when a thread exits)
+static void lmdb_free_tsd(void) {
+	if ((env != NULL) && (TSD->reader != NULL) && (TSD != &masterTSD)) {
+		mdb_txn_abort(TSD->reader);
+	}
+	TSD->reader = NULL;
+}
+
+
+static void lmdb_close_cursor(int cdb) {
+	MDB_cursor *curs = TSD->cursors[cdb];
+	MDB_txn *txn;
+
+	if (curs != NULL) {
+		txn = mdb_cursor_txn(curs);
+		mdb_cursor_close(curs);
+		if (txn != TSD->tid) {
+			mdb_txn_abort(txn);
+		}
+	}
+
+	TSD->cursors[cdb] = NULL;
+}
+
+
+// Prepare for a sequential search of an entire database.  Unless the thread is in a transaction, the
+// traversal gets a read transaction of its own, so it sees the table as it was when it started.
+static void lmdb_rewind(int cdb) {
+	MDB_cursor *curs;
+	MDB_txn *txn;
+	int ret;
+
+	if (TSD->cursors[cdb] != NULL) {
+		syslog(LOG_ERR, "db: cdb_rewind: must close cursor on database %d before reopening", cdb);
+		cdb_abort();
+	}
+
+	if (TSD->tid != NULL) {
+		txn = TSD->tid;
+	}
+	else {
+		ret = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+		if (ret) {
+			lmdb_fail("cdb_rewind", cdb, ret);
+		}
+	}
+	ret = mdb_cursor_open(txn, dbi[cdb], &curs);
+	if (ret) {
+		lmdb_fail("cdb_rewind", cdb, ret);
+	}
+	TSD->cursors[cdb] = curs;
+}
+
+
+// Step the traversal forward.  At the end, closes the cursor and returns nonzero.
+static int lmdb_next(int cdb, MDB_val *data) {
+	MDB_val key;
+	int ret;
+
+	ret = mdb_cursor_get(TSD->cursors[cdb], &key, data, MDB_NEXT);
+	if (ret) {
+		if (ret != MDB_NOTFOUND) {
+			lmdb_fail("cdb_next_item", cdb, ret);
+		}
+		lmdb_close_cursor(cdb);
+	}
+	return(ret);
+}
+
+
+// Fetch the next item in a sequential search.  Returns 0 and fills in "out" if there was one.
+static int lmdb_next_item(int cdb, struct cdbdata *out) {
+	MDB_val data;
+	int ret;
+
+	ret = lmdb_next(cdb, &data);
+	if (ret == 0) {
+		out->len = data.mv_size;
+		out->ptr = malloc(data.mv_size + 1);
+		memcpy(out->ptr, data.mv_data, data.mv_size);
+	}
+	return(ret);
+}
+
+
+// Fetch the next item in a sequential search into a borrowed buffer.
+static int lmdb_next_item_borrowed(int cdb, struct cdb_borrowed *b) {
+	MDB_val data;
+	int ret;
+
+	ret = lmdb_next(cdb, &data);
+	if (ret == 0) {
+		cdb_borrowed_grow(b, data.mv_size);
+		memcpy(b->buf, data.mv_data, data.mv_size);
+		b->data.ptr = b->buf;
+		b->data.len = data.mv_size;
+	}
+	return(ret);
+}
+
+
+// Begin a transaction.  Until it ends, any other thread which wants to write waits its turn.
+static void lmdb_begin_transaction(void) {
+	MDB_txn *txn;
+	int ret;
+
+	if (TSD->tid != NULL) {
+		syslog(LOG_ERR, "db: cdb_begin_transaction: ERROR: nested transaction");
+		cdb_abort();
+	}
+
+	ret = mdb_txn_begin(env, NULL, 0, &txn);
+	if (ret) {
+		lmdb_fail("cdb_begin_transaction", 0, ret);
+	}
+	TSD->tid = txn;
+}
+
+
+static void lmdb_end_transaction(void) {
+	int ret;
+	int i;
+
+	if (TSD->tid == NULL) {
+		syslog(LOG_ERR, "db: cdb_end_transaction: ERROR: txcommit(NULL) !!");
+		cdb_abort();
+	}
+
+	for (i = 0; i < MAXCDB; i++) {
+		if ((TSD->cursors[i] != NULL) && (mdb_cursor_txn(TSD->cursors[i]) == TSD->tid)) {
+			syslog(LOG_WARNING, "db: cdb_end_transaction: WARNING: cursor %d still open at transaction end", i);
+			lmdb_close_cursor(i);
+		}
+	}
+
+	ret = mdb_txn_commit(TSD->tid);
+	TSD->tid = NULL;
+	if (ret) {
+		lmdb_fail("cdb_end_transaction", 0, ret);
+	}
+}
+
+
+// Begin reading from one snapshot: the thread's reader, held until lmdb_end_read() instead of being let go
+// after every read.  An LMDB reader never loses its snapshot.
+static void lmdb_begin_read(void) {
+	if (TSD->snapshot != NULL) {
+		syslog(LOG_ERR, "db: cdb_begin_read: ERROR: nested snapshot");
+		cdb_abort();
+	}
+	TSD->snapshot = lmdb_read_begin();
+}
+
+
+static int lmdb_end_read(void) {
+	MDB_txn *txn = TSD->snapshot;
+
+	if (txn == NULL) {
+		syslog(LOG_ERR, "db: cdb_end_read: ERROR: no snapshot");
+		cdb_abort();
+	}
+	TSD->snapshot = NULL;
+	lmdb_read_end(txn);
+	return(0);
+}
+
+
+// Truncate (delete every record)
+static void lmdb_trunc(int cdb) {
+	MDB_txn *txn;
+	int ret;
+
+	if (TSD->tid != NULL) {
+		syslog(LOG_ERR, "db: cdb_trunc must not be called in a transaction.");
+		cdb_abort();
+	}
+
+	txn = lmdb_write_begin();
+	ret = mdb_drop(txn, dbi[cdb], 0);
+	if (ret) {
+		lmdb_fail("cdb_trunc", cdb, ret);
+	}
+	lmdb_write_end(txn, cdb, 1);
+}
+
+
+// LMDB reuses freed pages as it goes, and can't give them back to the filesystem without copying the
+// whole store while nobody is using it, so there's nothing for us to do here.
+static void lmdb_compact(void) {
+	syslog(LOG_DEBUG, "db: cdb_compact() has nothing to do with LMDB");
+}
+
+
+const struct cdb_backend lmdb_backend = {
+	.name =			"lmdb",
+	.exists =		lmdb_exists,
+	.open_databases =	lmdb_open_databases,
+	.close_databases =	lmdb_close_databases,
+	.apply_storage_profile = lmdb_apply_storage_profile,
+	.log_cache_stats =	lmdb_log_cache_stats,
+	.checkpoint =		lmdb_checkpoint,
+	.compact =		lmdb_compact,
+	.check_handles =	lmdb_check_handles,
+	.store =		lmdb_store,
+	.del =			lmdb_delete,
+	.fetch =		lmdb_fetch,
+	.fetch_borrowed =	lmdb_fetch_borrowed,
+	.rewind =		lmdb_rewind,
+	.next_item =		lmdb_next_item,
+	.next_item_borrowed =	lmdb_next_item_borrowed,
+	.close_cursor =		lmdb_close_cursor,
+	.begin_transaction =	lmdb_begin_transaction,
+	.end_transaction =	lmdb_end_transaction,
+	.begin_read =		lmdb_begin_read,
+	.end_read =		lmdb_end_read,
+	.trunc =		lmdb_trunc,
+	.free_tsd =		lmdb_free_tsd,
+};
+
+#endif // HAVE_LMDB
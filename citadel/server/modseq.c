@@ -0,0 +1,398 @@
+// Modification sequences (CDB_MODSEQ)
+//
+// IMAP CONDSTORE and QRESYNC (RFC 7162) let a client which has seen a folder before ask for only what has
+// changed since then.  For that, every change in a room needs a number higher than any change before it.  We
+// take them from the message number sequence: a new message's own number stands for its arrival, and each
+// later change (seen/answered flags set or cleared, messages deleted) takes a fresh number from the same
+// sequence.  So does the arrival of a message whose number isn't the newest any more by the time it lands in
+// the room (it was copied or moved from another one, or other things happened while it was being saved).
+//
+// For each room we keep a log of the messages deleted from it and a log of those late arrivals, and for each
+// user in each room a log of the messages whose flags they changed, each entry with the number of the change.  The logs are capped at
+// MODSEQ_LOG_SIZE entries; when old ones are dropped, the log's floor is raised past them, and a client asking
+// about anything older than the floor is told that everything changed.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "sysdep.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <libcitadel.h>
+#include "citadel_defs.h"
+#include "server.h"
+#include "database.h"
+#include "threads.h"
+#include "control.h"
+#include "ctdl_module.h"
+#include "room_ops.h"
+#include "msglist_cache.h"
+#include "modseq.h"
+
+static void make_key(struct modseq_key *key, long roomnum, long usernum) {
+	memset(key, 0, sizeof(struct modseq_key));
+	key->mk_roomnum = roomnum;
+	key->mk_usernum = usernum;
+}
+
+
+// Read just the header of a log.  Returns 0 if there is no such log.
+static int get_modseq_hdr(long roomnum, long usernum, struct modseq_hdr *hdr) {
+	struct modseq_key key;
+	struct cdbdata *cdbml;
+
+	memset(hdr, 0, sizeof(struct modseq_hdr));
+	make_key(&key, roomnum, usernum);
+	cdbml = cdb_fetch_borrowed(CDB_MODSEQ, &key, sizeof key);
+	if ((cdbml == NULL) || (cdbml->len < sizeof(struct modseq_hdr))) {
+		return(0);
+	}
+	memcpy(hdr, cdbml->ptr, sizeof(struct modseq_hdr));
+	return(1);
+}
+
+
+// Load a log.  If there isn't one yet, an empty one is returned, so this never returns NULL.
+struct modseq_log *CtdlGetModseqLog(long roomnum, long usernum) {
+	struct modseq_key key;
+	struct modseq_hdr hdr;
+	struct cdbdata *cdbml;
+	struct modseq_log *log;
+	long num_entries;
+
+	log = malloc(sizeof(struct modseq_log));
+	memset(log, 0, sizeof(struct modseq_log));
+
+	make_key(&key, roomnum, usernum);
+	cdbml = cdb_fetch_borrowed(CDB_MODSEQ, &key, sizeof key);
+	if ((cdbml == NULL) || (cdbml->len < sizeof(struct modseq_hdr))) {
+		return(log);
+	}
+
+	memcpy(&hdr, cdbml->ptr, sizeof hdr);
+	num_entries = (cdbml->len - sizeof hdr) / sizeof(struct modseq_entry);
+	if (hdr.mh_num_entries < num_entries) {
+		num_entries = hdr.mh_num_entries;
+	}
+
+	log->floor = hdr.mh_floor;
+	log->highest = hdr.mh_highest;
+	log->num_entries = (int) num_entries;
+	if (num_entries > 0) {
+		log->entries = malloc(num_entries * sizeof(struct modseq_entry));
+		memcpy(log->entries, cdbml->ptr + sizeof hdr, num_entries * sizeof(struct modseq_entry));
+	}
+	return(log);
+}
+
+
+static void put_modseq_log(long roomnum, long usernum, struct modseq_log *log) {
+	struct modseq_key key;
+	struct modseq_hdr hdr;
+	size_t len;
+	char *buf;
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.mh_roomnum = roomnum;
+	hdr.mh_usernum = usernum;
+	hdr.mh_floor = log->floor;
+	hdr.mh_highest = log->highest;
+	hdr.mh_num_entries = log->num_entries;
+
+	len = sizeof hdr + (log->num_entries * sizeof(struct modseq_entry));
+	buf = malloc(len);
+	if (buf == NULL) {
+		return;
+	}
+	memcpy(buf, &hdr, sizeof hdr);
+	if (log->num_entries > 0) {
+		memcpy(buf + sizeof hdr, log->entries, log->num_entries * sizeof(struct modseq_entry));
+	}
+
+	make_key(&key, roomnum, usernum);
+	cdb_store(CDB_MODSEQ, &key, sizeof key, buf, (int)len);
+	free(buf);
+}
+
+
+void CtdlFreeModseqLog(struct modseq_log **log) {
+	if (*log == NULL) {
+		return;
+	}
+	if ((*log)->entries != NULL) {
+		free((*log)->entries);
+	}
+	free(*log);
+	*log = NULL;
+}
+
+
+// Look a message up in a log sorted by message number, and raise its modification sequence to what's there
+static long sorted_log_modseq(struct modseq_log *log, long msgnum, long modseq) {
+	int lo = 0;
+	int hi;
+	int mid;
+
+	if (log == NULL) {
+		return(modseq);
+	}
+	if (log->floor > modseq) {
+		modseq = log->floor;
+	}
+
+	hi = log->num_entries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (log->entries[mid].msgnum < msgnum) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if ((lo < log->num_entries) && (log->entries[lo].msgnum == msgnum) && (log->entries[lo].modseq > modseq)) {
+		modseq = log->entries[lo].modseq;
+	}
+	return(modseq);
+}
+
+
+// The modification sequence of a message, according to its room's log of arrivals and the log of its user's
+// flag changes in that room
+long CtdlMsgModseq(struct modseq_log *flaglog, struct modseq_log *arrivals, long msgnum) {
+	return(sorted_log_modseq(flaglog, msgnum, sorted_log_modseq(arrivals, msgnum, msgnum)));
+}
+
+
+// The highest modification sequence in a room, as seen by one user: the newest message, the most recent
+// arrival or deletion, or the most recent change that user made to the flags, whichever came last.
+long CtdlHighestModseq(long roomnum, long usernum) {
+	struct modseq_hdr hdr;
+	struct msglist *ml;
+	long highest = 0L;
+
+	ml = CtdlGetMsgList(roomnum);
+	if (ml != NULL) {
+		if (ml->num_msgs > 0) {
+			highest = ml->msgs[ml->num_msgs - 1];
+		}
+		CtdlPutMsgList(&ml);
+	}
+	if ((get_modseq_hdr(roomnum, MODSEQ_EXPUNGES, &hdr)) && (hdr.mh_highest > highest)) {
+		highest = hdr.mh_highest;
+	}
+	if ((get_modseq_hdr(roomnum, MODSEQ_ARRIVALS, &hdr)) && (hdr.mh_highest > highest)) {
+		highest = hdr.mh_highest;
+	}
+	if ((get_modseq_hdr(roomnum, usernum, &hdr)) && (hdr.mh_highest > highest)) {
+		highest = hdr.mh_highest;
+	}
+
+	// Never zero, which RFC 7162 reserves
+	return((highest > 0) ? highest : 1L);
+}
+
+
+// Fetch the numbers of the messages which have been deleted from a room since the supplied modification
+// sequence, sorted.  Returns how many there are, or -1 if the log doesn't go back that far.  The caller must
+// free() the array.
+int CtdlModseqVanished(long roomnum, long since, long **uids) {
+	struct modseq_log *log;
+	int lo = 0;
+	int hi;
+	int mid;
+	int num_uids = 0;
+	int i;
+
+	*uids = NULL;
+	log = CtdlGetModseqLog(roomnum, MODSEQ_EXPUNGES);
+	if (since < log->floor) {
+		CtdlFreeModseqLog(&log);
+		return(-1);
+	}
+
+	// The room's log is in the order things happened, so we can skip straight to the first one we want
+	hi = log->num_entries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (log->entries[mid].modseq <= since) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	if (lo < log->num_entries) {
+		*uids = malloc((log->num_entries - lo) * sizeof(long));
+		for (i = lo; i < log->num_entries; ++i) {
+			(*uids)[num_uids++] = log->entries[i].msgnum;
+		}
+		num_uids = sort_msglist(*uids, num_uids);
+	}
+
+	CtdlFreeModseqLog(&log);
+	return(num_uids);
+}
+
+
+static int modseq_cmp(const void *m1, const void *m2) {
+	long a = *(const long *)m1;
+	long b = *(const long *)m2;
+	return((a > b) - (a < b));
+}
+
+
+// Keep a log sorted by message number no bigger than MODSEQ_LOG_SIZE by forgetting the oldest changes
+static void trim_sorted_log(struct modseq_log *log) {
+	long *modseqs;
+	long threshold;
+	int i, j;
+
+	if (log->num_entries <= MODSEQ_LOG_SIZE) {
+		return;
+	}
+
+	modseqs = malloc(log->num_entries * sizeof(long));
+	for (i = 0; i < log->num_entries; ++i) {
+		modseqs[i] = log->entries[i].modseq;
+	}
+	qsort(modseqs, log->num_entries, sizeof(long), modseq_cmp);
+	threshold = modseqs[log->num_entries - MODSEQ_LOG_SIZE - 1];
+	free(modseqs);
+
+	for (i = 0, j = 0; i < log->num_entries; ++i) {
+		if (log->entries[i].modseq > threshold) {
+			log->entries[j++] = log->entries[i];
+		}
+	}
+	log->num_entries = j;
+	if (threshold > log->floor) {
+		log->floor = threshold;
+	}
+}
+
+
+// Take the number for a change.  Logs have to be written in the order their numbers were taken, so this holds
+// S_MODSEQ until CtdlModseqEnd().  Taking a number writes to the database, so it can't be done in a
+// transaction, but whatever is recorded under it can go in one begun afterwards.
+long CtdlModseqBegin(void) {
+	begin_critical_section(S_MODSEQ);
+	return(get_new_message_number());
+}
+
+
+void CtdlModseqEnd(void) {
+	end_critical_section(S_MODSEQ);
+}
+
+
+// Give some messages a new modification sequence in a log sorted by message number.  The message numbers
+// must be sorted.
+static void sorted_log_put(long roomnum, long usernum, long *msgnums, int num_msgnums, long modseq) {
+	struct modseq_log *log;
+	struct modseq_entry *merged;
+	int i, j, k;
+
+	if (num_msgnums < 1) {
+		return;
+	}
+
+	log = CtdlGetModseqLog(roomnum, usernum);
+
+	// Both lists are sorted by message number, so this is a single merge pass
+	merged = malloc((log->num_entries + num_msgnums) * sizeof(struct modseq_entry));
+	for (i = 0, j = 0, k = 0; (i < log->num_entries) || (k < num_msgnums); ) {
+		if ((k >= num_msgnums) || ((i < log->num_entries) && (log->entries[i].msgnum < msgnums[k]))) {
+			merged[j++] = log->entries[i++];
+		}
+		else {
+			if ((i < log->num_entries) && (log->entries[i].msgnum == msgnums[k])) {
+				++i;
+			}
+			merged[j].msgnum = msgnums[k++];
+			merged[j++].modseq = modseq;
+		}
+	}
+	if (log->entries != NULL) {
+		free(log->entries);
+	}
+	log->entries = merged;
+	log->num_entries = j;
+	log->highest = modseq;
+
+	trim_sorted_log(log);
+	put_modseq_log(roomnum, usernum, log);
+	CtdlFreeModseqLog(&log);
+}
+
+
+// A user's seen or answered flag changed on some messages in a room, as the change numbered "modseq" (from
+// CtdlModseqBegin()).  The message numbers must be sorted.
+void CtdlModseqFlagsChanged(long roomnum, long usernum, long *msgnums, int num_msgnums, long modseq) {
+	sorted_log_put(roomnum, usernum, msgnums, num_msgnums, modseq);
+}
+
+
+// Some messages were added to a room (call this once they're in its message list, not before).  The message
+// numbers must be sorted.  A message whose number is still the newest in the system needs nothing more: no
+// client can have been told of a higher modification sequence.  Any other may have arrived after a client was
+// told of a higher one, and would be missed, so it gets a fresh number in the room's log of arrivals.
+void CtdlModseqArrived(long roomnum, long *msgnums, int num_msgnums) {
+	if ((num_msgnums > 0) && (msgnums[num_msgnums - 1] >= CtdlGetCurrentMessageNumber())) {
+		--num_msgnums;
+	}
+	if (num_msgnums > 0) {
+		sorted_log_put(roomnum, MODSEQ_ARRIVALS, msgnums, num_msgnums, CtdlModseqBegin());
+		CtdlModseqEnd();
+	}
+}
+
+
+// Some messages were deleted from a room
+void CtdlModseqExpunged(long roomnum, long *msgnums, int num_msgnums) {
+	struct modseq_log *log;
+	long modseq;
+	int drop;
+	int i;
+
+	if (num_msgnums < 1) {
+		return;
+	}
+
+	modseq = CtdlModseqBegin();
+	log = CtdlGetModseqLog(roomnum, MODSEQ_EXPUNGES);
+
+	// If it's more than the log can hold (a whole room being deleted, say), nobody is going to be told which
+	// messages they were, so don't bother writing them down.
+	if (num_msgnums >= MODSEQ_LOG_SIZE) {
+		log->num_entries = 0;
+		log->floor = modseq;
+	}
+	else {
+		log->entries = realloc(log->entries, (log->num_entries + num_msgnums) * sizeof(struct modseq_entry));
+		for (i = 0; i < num_msgnums; ++i) {
+			log->entries[log->num_entries].msgnum = msgnums[i];
+			log->entries[log->num_entries++].modseq = modseq;
+		}
+	}
+	log->highest = modseq;
+
+	// This log is in the order things happened, so the oldest entries are the ones at the front
+	if (log->num_entries > MODSEQ_LOG_SIZE) {
+		drop = log->num_entries - MODSEQ_LOG_SIZE;
+		if (log->entries[drop - 1].modseq > log->floor) {
+			log->floor = log->entries[drop - 1].modseq;
+		}
+		memmove(&log->entries[0], &log->entries[drop], MODSEQ_LOG_SIZE * sizeof(struct modseq_entry));
+		log->num_entries = MODSEQ_LOG_SIZE;
+	}
+
+	put_modseq_log(roomnum, MODSEQ_EXPUNGES, log);
+	CtdlModseqEnd();
+	CtdlFreeModseqLog(&log);
+}
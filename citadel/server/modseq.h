@@ -0,0 +1,55 @@
+// Modification sequences (CDB_MODSEQ)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef MODSEQ_H
+#define MODSEQ_H
+
+#define MODSEQ_EXPUNGES	(-1L)		// "user number" of a room's log of deleted messages
+#define MODSEQ_ARRIVALS	(-2L)		// "user number" of a room's log of messages which arrived with old numbers
+
+// On disk, a log is indexed by room number and user number, and is this header followed by the entries.
+// It's all longs, so ctdl3264 can convert it like a message list.
+struct modseq_key {
+	long mk_roomnum;
+	long mk_usernum;
+};
+
+struct modseq_hdr {
+	long mh_roomnum;		// the key again, so the nightly purge can tell whose log it is
+	long mh_usernum;
+	long mh_floor;
+	long mh_highest;
+	long mh_num_entries;
+};
+
+struct modseq_entry {
+	long msgnum;
+	long modseq;
+};
+
+// One log, as loaded from disk.  A room's log of deleted messages is in the order they were deleted.  Its log of
+// arrivals, and a user's log of flag changes in it, are sorted by message number and have at most one entry
+// for each message.
+struct modseq_log {
+	long floor;			// changes at or below this may have been forgotten
+	long highest;			// the most recent change which was recorded
+	int num_entries;
+	struct modseq_entry *entries;
+};
+
+struct modseq_log *CtdlGetModseqLog(long roomnum, long usernum);
+void CtdlFreeModseqLog(struct modseq_log **log);
+long CtdlMsgModseq(struct modseq_log *flaglog, struct modseq_log *arrivals, long msgnum);
+long CtdlHighestModseq(long roomnum, long usernum);
+int CtdlModseqVanished(long roomnum, long since, long **uids);
+long CtdlModseqBegin(void);
+void CtdlModseqEnd(void);
+void CtdlModseqFlagsChanged(long roomnum, long usernum, long *msgnums, int num_msgnums, long modseq);
+void CtdlModseqArrived(long roomnum, long *msgnums, int num_msgnums);
+void CtdlModseqExpunged(long roomnum, long *msgnums, int num_msgnums);
+
+#endif // MODSEQ_H
@@ -16,6 +16,7 @@
 #include "../../ctdl_module.h"
 #include "serv_autocompletion.h"
 #include "../../config.h"
+#include "../../msglist_cache.h"
 
 
 /*
@@ -134,7 +135,7 @@ void cmd_auto(char *argbuf) {
 	int num_msgs = 0;
 	long *fts_msgs = NULL;
 	int fts_num_msgs = 0;
-	struct cdbdata *cdbfr;
+	struct msglist *ml;
 	int r = 0;
 	int i = 0;
 	int j = 0;
@@ -157,12 +158,12 @@ void cmd_auto(char *argbuf) {
 	 */
 	for (r=0; r < (sizeof(rooms_to_try) / sizeof(char *)); ++r) {
 		if (CtdlGetRoom(&CC->room, rooms_to_try[r]) == 0) {
-			cdbfr = cdb_fetch(CDB_MSGLISTS, &CC->room.QRnumber, sizeof(long));
-			if (cdbfr != NULL) {
-				msglist = realloc(msglist, (num_msgs * sizeof(long)) + cdbfr->len + 1);
-				memcpy(&msglist[num_msgs], cdbfr->ptr, cdbfr->len);
-				num_msgs += (cdbfr->len / sizeof(long));
-				cdb_free(cdbfr);
+			ml = CtdlGetMsgList(CC->room.QRnumber);
+			if (ml != NULL) {
+				msglist = realloc(msglist, ((num_msgs + ml->num_msgs) * sizeof(long)) + 1);
+				memcpy(&msglist[num_msgs], ml->msgs, ml->num_msgs * sizeof(long));
+				num_msgs += ml->num_msgs;
+				CtdlPutMsgList(&ml);
 			}
 		}
 	}
@@ -1889,6 +1889,8 @@ void ical_CtdlCreateRoom(void)
 {
 	struct ctdlroom qr;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	/* Create the calendar room if it doesn't already exist */
 	CtdlCreateRoom(USERCALENDARROOM, 4, "", 0, 1, 0, VIEW_CALENDAR);
@@ -1903,9 +1905,11 @@ void ical_CtdlCreateRoom(void)
 	CtdlPutRoomLock(&qr);
 
 	/* Set the view to a calendar view */
-	CtdlGetRelationship(&vbuf, &CC->user, &qr);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &qr);
 	vbuf.v_view = VIEW_CALENDAR;
-	CtdlSetRelationship(&vbuf, &CC->user, &qr);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &qr);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 
 	/* Create the tasks list room if it doesn't already exist */
 	CtdlCreateRoom(USERTASKSROOM, 4, "", 0, 1, 0, VIEW_TASKS);
@@ -1920,9 +1924,11 @@ void ical_CtdlCreateRoom(void)
 	CtdlPutRoomLock(&qr);
 
 	/* Set the view to a task list view */
-	CtdlGetRelationship(&vbuf, &CC->user, &qr);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &qr);
 	vbuf.v_view = VIEW_TASKS;
-	CtdlSetRelationship(&vbuf, &CC->user, &qr);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &qr);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 
 	/* Create the notes room if it doesn't already exist */
 	CtdlCreateRoom(USERNOTESROOM, 4, "", 0, 1, 0, VIEW_NOTES);
@@ -1937,9 +1943,11 @@ void ical_CtdlCreateRoom(void)
 	CtdlPutRoomLock(&qr);
 
 	/* Set the view to a notes view */
-	CtdlGetRelationship(&vbuf, &CC->user, &qr);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &qr);
 	vbuf.v_view = VIEW_NOTES;
-	CtdlSetRelationship(&vbuf, &CC->user, &qr);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &qr);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 
 	return;
 }
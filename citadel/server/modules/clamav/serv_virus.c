@@ -4,7 +4,7 @@
  * http://clamav.net (the ClamAV project is not in any way
  * affiliated with the Citadel project).
  *
- * Copyright (c) 1987-2022 by the citadel.org team
+ * Copyright (c) 1987-2023 by the citadel.org team
  *
  * This program is open source software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 3.
@@ -16,6 +16,7 @@
  */
 
 #define CLAMD_PORT       "3310"
+#define CLAMD_CHUNK      65536
 
 #include "../../sysdep.h"
 #include <stdlib.h>
@@ -31,6 +32,8 @@
 #include <string.h>
 #include <limits.h>
 #include <sys/socket.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 #include <libcitadel.h>
 #include "../../citadel_defs.h"
 #include "../../server.h"
@@ -45,133 +48,87 @@
 #include "../../domain.h"
 #include "../../clientsocket.h"
 #include "../../ctdl_module.h"
+#include "../../scanclient.h"
 
 
 /*
- * Connect to the clamd server and scan a message.
+ * A new connection to clamd starts a session, so that it can be used for
+ * more than one message.
  */
-int clamd(struct CtdlMessage *msg, struct recptypes *recp) {
-	int sock = (-1);
-	int streamsock = (-1);
-	char clamhosts[SIZ];
-	int num_clamhosts;
-	char buf[SIZ];
-        char hostbuf[SIZ];
-        char portbuf[SIZ];
-	int is_virus = 0;
-	int clamhost;
-	StrBuf *msgtext;
-	CitContext *CCC;
-
-	/* See if we have any clamd hosts configured */
-	num_clamhosts = get_hosts(clamhosts, "clamav");
-	if (num_clamhosts < 1) {
-		return(0);
-	}
-
-	/* Try them one by one until we get a working one */
-        for (clamhost=0; clamhost<num_clamhosts; ++clamhost) {
-                extract_token(buf, clamhosts, clamhost, '|', sizeof buf);
-                syslog(LOG_INFO, "Connecting to clamd at <%s>\n", buf);
-
-                /* Assuming a host:port entry */ 
-                extract_token(hostbuf, buf, 0, ':', sizeof hostbuf);
-                if (extract_token(portbuf, buf, 1, ':', sizeof portbuf)==-1)
-                  /* Didn't specify a port so we'll try the psuedo-standard 3310 */
-                  sock = sock_connect(hostbuf, CLAMD_PORT);
-                else
-                  /* Port specified lets try connecting to it! */
-                  sock = sock_connect(hostbuf, portbuf);
-
-                if (sock >= 0) syslog(LOG_DEBUG, "Connected!\n");
-        }
-
-	if (sock < 0) {
-		/* If the service isn't running, just pass the mail
-		 * through.  Potentially throwing away mails isn't good.
-		 */
-		return(0);
-	}
-	CCC=CC;
-	CCC->SBuf.Buf = NewStrBuf();
-	CCC->sMigrateBuf = NewStrBuf();
-	CCC->SBuf.ReadWritePointer = NULL;
-
-	/* Command */
-	syslog(LOG_DEBUG, "Transmitting STREAM command\n");
-	sprintf(buf, "STREAM\r\n");
-	sock_write(&sock, buf, strlen(buf));
-
-	syslog(LOG_DEBUG, "Waiting for PORT number\n");
-        if (sock_getln(&sock, buf, sizeof buf) < 0) {
-                goto bail;
-        }
-
-        syslog(LOG_DEBUG, "<%s\n", buf);
-	if (strncasecmp(buf, "PORT", 4)!=0) {
-	        goto bail;
-	}
-
-        /* Should have received a port number to connect to */
-	extract_token(portbuf, buf, 1, ' ', sizeof portbuf);
+void clamd_hello(StrBuf *out) {
+	StrBufAppendBufPlain(out, "zIDSESSION", 11, 0);		/* including the terminating NUL */
+}
 
-	/* Attempt to establish connection to STREAM socket */
-        streamsock = sock_connect(hostbuf, portbuf);
 
-	if (streamsock < 0) {
-		/* If the service isn't running, just pass the mail
-		 * through.  Potentially throwing away mails isn't good.
-		 */
-		FreeStrBuf(&CCC->SBuf.Buf);
-		FreeStrBuf(&CCC->sMigrateBuf);
-		return(0);
-        }
-	else {
-	        syslog(LOG_DEBUG, "STREAM socket connected!\n");
+/*
+ * The message is sent as a series of chunks, each preceded by its length as
+ * a four byte number in network byte order, and a zero length chunk at the end.
+ */
+void clamd_request(StrBuf *out, StrBuf *msgtext) {
+	const char *ptr = ChrPtr(msgtext);
+	long remaining = StrLength(msgtext);
+	long chunk;
+	uint32_t len;
+
+	StrBufAppendBufPlain(out, "zINSTREAM", 10, 0);
+	while (remaining > 0) {
+		chunk = (remaining > CLAMD_CHUNK) ? CLAMD_CHUNK : remaining;
+		len = htonl((uint32_t)chunk);
+		StrBufAppendBufPlain(out, (const char *)&len, sizeof len, 0);
+		StrBufAppendBufPlain(out, ptr, chunk, 0);
+		ptr += chunk;
+		remaining -= chunk;
 	}
+	len = 0;
+	StrBufAppendBufPlain(out, (const char *)&len, sizeof len, 0);
+}
 
 
-	/* Message */
-	CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
-	CtdlOutputPreLoadedMsg(msg, MT_RFC822, HEADERS_ALL, 0, 1, 0);
-	msgtext = CC->redirect_buffer;
-	CC->redirect_buffer = NULL;
+/*
+ * Replies are terminated by a NUL.
+ */
+int clamd_reply_complete(StrBuf *in, int eof) {
+	return(memchr(ChrPtr(in), 0, StrLength(in)) != NULL);
+}
 
-	sock_write(&streamsock, SKEY(msgtext));
-	FreeStrBuf(&msgtext);
 
-	/* Close the streamsocket connection; this tells clamd
-	 * that we're done.
-	 */
-	if (streamsock != -1) {
-		close(streamsock);
-	}
-	
-	/* Response */
-	syslog(LOG_DEBUG, "Awaiting response\n");
-        if (sock_getln(&sock, buf, sizeof buf) < 0) {
-                goto bail;
-        }
-        syslog(LOG_DEBUG, "<%s\n", buf);
-	if (strncasecmp(buf, "stream: OK", 10)!=0) {
-		is_virus = 1;
-	}
+/*
+ * The reply looks like "1: stream: OK" or "1: stream: Eicar-Signature FOUND".
+ * Anything else is an error (such as the message being too big to scan).
+ */
+int clamd_verdict(StrBuf *in, struct CtdlMessage *msg) {
+	const char *reply = ChrPtr(in);
+	size_t len = strlen(reply);
 
-	if (is_virus) {
+	syslog(LOG_DEBUG, "virus: <%s", reply);
+	if ((len >= 2) && (!strcmp(&reply[len - 2], "OK"))) {
+		return(0);
+	}
+	if ((len >= 5) && (!strcmp(&reply[len - 5], "FOUND"))) {
 		CM_SetField(msg, eErrorMsg, HKEY("message rejected by virus filter"));
+		return(1);
 	}
-
-bail:	close(sock);
-	FreeStrBuf(&CCC->SBuf.Buf);
-	FreeStrBuf(&CCC->sMigrateBuf);
-	return(is_virus);
+	return(-1);
 }
 
 
+static struct scanner clamav = {
+	.name = "clamd",
+	.hosttype = "clamav",
+	.port = CLAMD_PORT,
+	.trust_logged_in = 0,
+	.keepalive = 1,
+	.hello = clamd_hello,
+	.request = clamd_request,
+	.reply_complete = clamd_reply_complete,
+	.verdict = clamd_verdict
+};
+
+
 // Initialization function, called from modules_init.c
 char *ctdl_module_init_virus(void) {
 	if (!threading) {
-		CtdlRegisterMessageHook(clamd, EVT_SMTPSCAN);
+		CtdlRegisterScanner(&clamav);
 	}
 	
 	/* return our module name for the log */
@@ -551,6 +551,7 @@ void CtdlStartTLS(char *ok_response, char *nosup_response, char *error_response)
 	if (ok_response != NULL) {
 		cprintf("%s", ok_response);
 	}
+	client_flush();				// everything up to here must go out in the clear
 	retval = SSL_accept(CC->ssl);
 	if (retval < 1) {
 		// Can't notify the client of an error here; they will
@@ -605,6 +606,9 @@ void cmd_gtls(char *params) {
 
 // endtls() shuts down the TLS connection
 void endtls(void) {
+	if (CC->ssl) {
+		client_flush();		// may itself end TLS if the connection has failed
+	}
 	if (!CC->ssl) {
 		CC->redirect_ssl = 0;
 		return;
@@ -15,6 +15,10 @@
 
 #include "../../serv_extensions.h"
 #include "../../ctdl_module.h"
+#include "../../context.h"
+#include "../../threads.h"
+#include "../../msglist_cache.h"
+#include "../../config.h"
 
 
 // Shut down or restart the server
@@ -71,12 +75,73 @@ void cmd_scdn(char *argbuf) {
 }
 
 
+// Report worker thread pool statistics.
+// The status line carries: total workers | active workers | sessions waiting on the ready queue | min | max
+// Then one line per worker: thread id | seconds running | busy now | sessions bound | commands run |
+//	busy milliseconds | sessions taken from the ready queue | total queue wait ms | longest queue wait ms
+void cmd_wsta(char *argbuf) {
+	struct worker_stats *ws = NULL;
+	int num_ws, i;
+	time_t now;
+
+	if (CtdlAccessCheck(ac_aide)) return;
+
+	num_ws = CtdlGetWorkerStats(&ws);
+	now = time(NULL);
+
+	cprintf("%d %d|%d|%d|%d|%d\n",
+		LISTING_FOLLOWS,
+		num_workers,
+		active_workers,
+		ready_session_count(),
+		CtdlGetConfigInt("c_min_workers"),
+		CtdlGetConfigInt("c_max_workers")
+	);
+	for (i=0; i<num_ws; ++i) {
+		cprintf("%lu|%ld|%d|%ld|%ld|%lld|%ld|%lld|%lld\n",
+			(unsigned long) ws[i].tid,
+			(long) (now - ws[i].started),
+			ws[i].busy,
+			ws[i].sessions_bound,
+			ws[i].commands_run,
+			ws[i].busy_usec / 1000,
+			ws[i].queue_waits,
+			ws[i].queue_wait_usec / 1000,
+			ws[i].max_queue_wait_usec / 1000
+		);
+	}
+	cprintf("000\n");
+	free(ws);
+}
+
+
+// Report statistics for the server's in-memory caches, one line per cache:
+// name | entries | bytes used | budget in bytes | hits | misses | evictions | invalidations
+void cmd_csta(char *argbuf) {
+	struct msglist_cache_stats mls;
+
+	if (CtdlAccessCheck(ac_aide)) return;
+
+	cprintf("%d Cache statistics follow\n", LISTING_FOLLOWS);
+
+	msglist_cache_get_stats(&mls);
+	cprintf("msglists|%ld|%ld|%ld|%ld|%ld|%ld|%ld\n",
+		mls.entries, (long) mls.bytes, (long) mls.budget,
+		mls.hits, mls.misses, mls.evictions, mls.invalidations
+	);
+
+	cprintf("000\n");
+}
+
+
 // Initialization function, called from modules_init.c
 char *ctdl_module_init_syscmd(void) {
 	if (!threading) {
 		CtdlRegisterProtoHook(cmd_down, "DOWN", "perform a server shutdown");
 		CtdlRegisterProtoHook(cmd_halt, "HALT", "halt the server without exiting the server process");
 		CtdlRegisterProtoHook(cmd_scdn, "SCDN", "schedule or cancel a server shutdown");
+		CtdlRegisterProtoHook(cmd_wsta, "WSTA", "report worker thread pool statistics");
+		CtdlRegisterProtoHook(cmd_csta, "CSTA", "report cache statistics");
 	}
         // return our id for the log
 	return "syscmd";
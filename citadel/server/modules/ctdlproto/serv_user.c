@@ -249,7 +249,9 @@ void cmd_setu(char *new_parms) {
 void cmd_slrp(char *new_ptr) {
 	long newlr;
 	struct visit vbuf;
-	struct visit original_vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
+	int seen_changed;
 
 	if (CtdlAccessCheck(ac_logged_in)) {
 		return;
@@ -264,17 +266,20 @@ void cmd_slrp(char *new_ptr) {
 
 	CtdlLockGetCurrentUser();
 
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
-	memcpy(&original_vbuf, &vbuf, sizeof(struct visit));
-	vbuf.v_lastseen = newlr;
-	snprintf(vbuf.v_seen, sizeof vbuf.v_seen, "*:%ld", newlr);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &CC->room);
+
+	// Everything up to newlr is now seen, and nothing after it
+	seen_changed = ( (seen->num_ranges != 1) || (seen->ranges[0].lo > 0) || (seen->ranges[0].hi != newlr) );
 
 	// Only rewrite the record if it changed
-	if (	(vbuf.v_lastseen != original_vbuf.v_lastseen)
-		|| (strcmp(vbuf.v_seen, original_vbuf.v_seen))
-	) {
-		CtdlSetRelationship(&vbuf, &CC->user, &CC->room);
+	if ( (vbuf.v_lastseen != newlr) || (seen_changed) ) {
+		vbuf.v_lastseen = newlr;
+		seen_set_clear(seen);
+		seen_set_add(seen, 0, newlr);
+		CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &CC->room);
 	}
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 
 	CtdlPutCurrentUserLock();
 	cprintf("%d %ld\n", CIT_OK, newlr);
@@ -303,18 +308,20 @@ void cmd_seen(char *argbuf) {
 
 
 void cmd_gtsn(char *argbuf) {
-	struct visit vbuf;
+	StrBuf *seen;
 
 	if (CtdlAccessCheck(ac_logged_in)) {
 		return;
 	}
 
 	// Learn about the user and room in question
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
+	seen = NewStrBuf();
+	CtdlGetSeen(seen, ctdlsetseen_seen);
 
 	cprintf("%d ", CIT_OK);
-	client_write(vbuf.v_seen, strlen(vbuf.v_seen));
+	client_write(ChrPtr(seen), StrLength(seen));
 	client_write(HKEY("\n"));
+	FreeStrBuf(&seen);
 }
 
 
@@ -702,6 +709,8 @@ void cmd_asea(char *cmdbuf) {
 void cmd_view(char *cmdbuf) {
 	int requested_view;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	if (CtdlAccessCheck(ac_logged_in)) {
 		return;
@@ -709,9 +718,11 @@ void cmd_view(char *cmdbuf) {
 
 	requested_view = extract_int(cmdbuf, 0);
 
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &CC->room);
 	vbuf.v_view = requested_view;
-	CtdlSetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &CC->room);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 	
 	cprintf("%d ok\n", CIT_OK);
 }
@@ -30,6 +30,9 @@
 #include "policy.h"
 #include "../../database.h"
 #include "../../msgbase.h"
+#include "../../msglist_store.h"
+#include "../../overview.h"
+#include "../../modseq.h"
 #include "../../user_ops.h"
 #include "../../control.h"
 #include "../../threads.h"
@@ -43,40 +46,22 @@ struct PurgeList {
 	char name[ROOMNAMELEN];		// use the larger of username or roomname
 };
 
-struct VPurgeList {
-	struct VPurgeList *next;
-	long vp_roomnum;
-	long vp_roomgen;
-	long vp_usernum;
-};
-
-struct ValidRoom {
-	struct ValidRoom *next;
-	long vr_roomnum;
-	long vr_roomgen;
-};
-
-struct ValidUser {
-	struct ValidUser *next;
-	long vu_usernum;
-};
-
 struct ctdlroomref {
 	struct ctdlroomref *next;
 	long msgnum;
 };
 
-struct EPurgeList {
-	struct EPurgeList *next;
-	int ep_keylen;
-	char *ep_key;
+// A record found by a table traversal which is to be deleted afterwards
+struct PurgeKey {
+	int pk_keylen;
+	char *pk_key;
 };
 
 
 struct PurgeList *UserPurgeList = NULL;
 struct PurgeList *RoomPurgeList = NULL;
-struct ValidRoom *ValidRoomList = NULL;
-struct ValidUser *ValidUserList = NULL;
+HashList *ValidRooms = NULL;			// room number -> generation, for every room that exists
+HashList *ValidUsers = NULL;			// user number, for every user that exists
 int messages_purged;
 int users_not_purged;
 char *users_corrupt_msg = NULL;
@@ -85,23 +70,58 @@ struct ctdlroomref *rr = NULL;
 int force_purge_now = 0;			// set to nonzero to force a run right now
 
 
-// First phase of message purge -- gather the locations of messages which
-// qualify for purging and write them to a temp file.
+// The messages to be expired from one room
+struct MPurgeList {
+	struct MPurgeList *next;
+	char roomname[ROOMNAMELEN];
+	long *msgs;			// sorted; the first num_msgs of them are the ones to go
+	int num_msgs;
+};
+
+
+// When was this message saved here?  0 if we don't know, or if it can't be read.
+static time_t expire_saved_time(long msgnum) {
+	struct msg_overview *ov;
+	time_t saved = 0;
+
+	ov = GetOverview(msgnum);		// all we need is the date
+	if (ov != NULL) {
+		saved = ov->saved;
+		free(ov);
+	}
+	return(saved);
+}
+
+
+// Is this message old enough to expire?  If we don't know when it was saved here (it was saved by an older
+// version) we go by the date on it, as we always used to.  A message we can't read, or which has no date, stays.
+static int expire_is_old(long msgnum, time_t cutoff) {
+	struct msg_overview *ov;
+	time_t when;
+
+	ov = GetOverview(msgnum);
+	if (ov == NULL) {
+		return(0);
+	}
+	when = (ov->saved != 0) ? ov->saved : ov->date;
+	free(ov);
+	return((when > 0) && (when < cutoff));
+}
+
+
+// First phase of message purge -- gather the locations of messages which qualify for purging.
+// Rooms are only read here; we can't write to them during the room traversal, so the deleting is done afterwards.
 void GatherPurgeMessages(struct ctdlroom *qrbuf, void *data) {
+	struct MPurgeList **purgelist = (struct MPurgeList **)data;
+	struct MPurgeList *mp;
 	struct ExpirePolicy epbuf;
-	long delnum;
-	time_t xtime, now;
-	struct CtdlMessage *msg = NULL;
-	int a;
-	struct cdbdata *cdbfr;
+	time_t cutoff;
 	long *msglist = NULL;
 	int num_msgs = 0;
-	FILE *purgelist;
-
-	purgelist = (FILE *)data;
-	fprintf(purgelist, "r=%s\n", qrbuf->QRname);
+	int num_expired = 0;
+	int lo, hi, mid;
+	int i;
 
-	time(&now);
 	GetExpirePolicy(&epbuf, qrbuf);
 
 	// If the room is set to never expire messages ... do nothing
@@ -112,140 +132,160 @@ void GatherPurgeMessages(struct ctdlroom *qrbuf, void *data) {
 	if (!strcasecmp(qrbuf->QRname, SYSCONFIGROOM)) return;
 
 	// Ok, we got this far ... now let's see what's in the room.
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &qrbuf->QRnumber, sizeof(long));
-
-	if (cdbfr != NULL) {
-		msglist = malloc(cdbfr->len);
-		memcpy(msglist, cdbfr->ptr, cdbfr->len);
-		num_msgs = cdbfr->len / sizeof(long);
-		cdb_free(cdbfr);
-	}
-
-	// Nothing to do if there aren't any messages
-	if (num_msgs == 0) {
-		if (msglist != NULL) free(msglist);
-		return;
-	}
+	// (This goes straight to the database, so the sweep doesn't push everything else out of the cache.)
+	msglist = msglist_read(qrbuf->QRnumber, &num_msgs);
 
-	// If the room is set to expire by count, do that.
+	// If the room is set to expire by count, the oldest ones over the limit go.
 	if (epbuf.expire_mode == EXPIRE_NUMMSGS) {
 		if (num_msgs > epbuf.expire_value) {
-			for (a=0; a<(num_msgs - epbuf.expire_value); ++a) {
-				fprintf(purgelist, "m=%ld\n", msglist[a]);
-				++messages_purged;
-			}
+			num_expired = num_msgs - epbuf.expire_value;
 		}
 	}
 
-	// If the room is set to expire by age...
-	if (epbuf.expire_mode == EXPIRE_AGE) {
-		for (a=0; a<num_msgs; ++a) {
-			delnum = msglist[a];
-
-			msg = CtdlFetchMessage(delnum, 0);	// don't need the body
-			if (msg != NULL) {
-				xtime = atol(msg->cm_fields[eTimestamp]);
-				CM_Free(msg);
+	// If the room is set to expire by age, the message list is already our time index: message numbers are
+	// handed out in the order messages are saved, so the times they were saved only go up along the list.
+	// Messages saved before we recorded that come first (they have the lowest numbers), and count as old
+	// here.  So a binary search finds the first message which was saved recently enough to keep, and only
+	// the ones before it need looking at.  Each of those is then judged on its own, because for the older
+	// ones all we have to go by is the date they carry, which could be anything.
+	if ((epbuf.expire_mode == EXPIRE_AGE) && (num_msgs > 0)) {
+		cutoff = time(NULL) - (time_t)(epbuf.expire_value * 86400L);
+		lo = 0;
+		hi = num_msgs;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (expire_saved_time(msglist[mid]) < cutoff) {
+				lo = mid + 1;
 			}
 			else {
-				xtime = 0L;
+				hi = mid;
 			}
-
-			if ((xtime > 0L) && (now - xtime > (time_t)(epbuf.expire_value * 86400L))) {
-				fprintf(purgelist, "m=%ld\n", delnum);
-				++messages_purged;
+		}
+		for (i = 0; i < lo; ++i) {
+			if (expire_is_old(msglist[i], cutoff)) {
+				msglist[num_expired++] = msglist[i];
 			}
 		}
 	}
 
-	if (msglist != NULL) free(msglist);
+	if (num_expired == 0) {
+		if (msglist != NULL) free(msglist);
+		return;
+	}
+
+	mp = (struct MPurgeList *) malloc(sizeof(struct MPurgeList));
+	if (mp == NULL) {
+		free(msglist);
+		return;
+	}
+	safestrncpy(mp->roomname, qrbuf->QRname, sizeof mp->roomname);
+	mp->msgs = msglist;
+	mp->num_msgs = num_expired;
+	mp->next = *purgelist;
+	*purgelist = mp;
 }
 
 
-// Second phase of message purge -- read list of msgs from temp file and delete them.
-void DoPurgeMessages(FILE *purgelist) {
-	char roomname[ROOMNAMELEN];
-	long msgnum;
-	char buf[SIZ];
-
-	rewind(purgelist);
-	strcpy(roomname, "nonexistent room ___ ___");
-	while (fgets(buf, sizeof buf, purgelist) != NULL) {
-		buf[strlen(buf)-1]=0;
-		if (!strncasecmp(buf, "r=", 2)) {
-			strcpy(roomname, &buf[2]);
-		}
-		if (!strncasecmp(buf, "m=", 2)) {
-			msgnum = atol(&buf[2]);
-			if (msgnum > 0L) {
-				CtdlDeleteMessages(roomname, &msgnum, 1, "");
-			}
-		}
+// Second phase of message purge -- delete the messages we gathered, all of them from a room at once, so each
+// room's message list is rewritten just the once.
+void DoPurgeMessages(struct MPurgeList *purgelist) {
+	struct MPurgeList *mp;
+
+	while (purgelist != NULL) {
+		mp = purgelist;
+		purgelist = purgelist->next;
+		messages_purged += CtdlDeleteMessages(mp->roomname, mp->msgs, mp->num_msgs, "");
+		free(mp->msgs);
+		free(mp);
 	}
 }
 
 
 void PurgeMessages(void) {
-	FILE *purgelist;
+	struct MPurgeList *purgelist = NULL;
 
 	syslog(LOG_DEBUG, "PurgeMessages() called");
 	messages_purged = 0;
 
-	purgelist = tmpfile();
-	if (purgelist == NULL) {
-		syslog(LOG_CRIT, "Can't create purgelist temp file: %s", strerror(errno));
-		return;
-	}
-
-	CtdlForEachRoom(GatherPurgeMessages, (void *)purgelist );
+	CtdlForEachRoom(GatherPurgeMessages, (void *)&purgelist);
 	DoPurgeMessages(purgelist);
-	fclose(purgelist);
 }
 
 
 void AddValidUser(char *username, void *data) {
-	struct ValidUser *vuptr;
 	struct ctdluser usbuf;
 
 	if (CtdlGetUser(&usbuf, username) != 0) {
 		return;
 	}
-
-	vuptr = (struct ValidUser *)malloc(sizeof(struct ValidUser));
-	vuptr->next = ValidUserList;
-	vuptr->vu_usernum = usbuf.usernum;
-	ValidUserList = vuptr;
+	Put(ValidUsers, (const char *)&usbuf.usernum, sizeof(long), NULL, reference_free_handler);
 }
 
 
 void AddValidRoom(struct ctdlroom *qrbuf, void *data) {
-	struct ValidRoom *vrptr;
+	long *gen;
+
+	gen = (long *)malloc(sizeof(long));
+	*gen = qrbuf->QRgen;
+	Put(ValidRooms, (const char *)&qrbuf->QRnumber, sizeof(long), gen, NULL);
+}
 
-	vrptr = (struct ValidRoom *)malloc(sizeof(struct ValidRoom));
-	vrptr->next = ValidRoomList;
-	vrptr->vr_roomnum = qrbuf->QRnumber;
-	vrptr->vr_roomgen = qrbuf->QRgen;
-	ValidRoomList = vrptr;
+
+static int IsValidUser(long usernum) {
+	void *v;
+
+	return(GetHash(ValidUsers, (const char *)&usernum, sizeof(long), &v));
+}
+
+
+static int IsValidRoom(long roomnum, long roomgen) {
+	void *v;
+
+	return( (GetHash(ValidRooms, (const char *)&roomnum, sizeof(long), &v)) && (*(long *)v == roomgen) );
+}
+
+
+// Remember a record to be deleted once the traversal which found it is finished
+static void AddPurgeKey(Array *keys, const void *key, int keylen) {
+	struct PurgeKey pk;
+
+	pk.pk_keylen = keylen;
+	pk.pk_key = malloc(keylen);
+	memcpy(pk.pk_key, key, keylen);
+	array_append(keys, &pk);
+}
+
+
+// Delete the records a traversal found, EXPIRE_DELETE_BATCH of them per database transaction.
+// (We can't delete them as we go, because the traversal's cursor is read-only.)
+static void DeletePurgeKeys(int cdb, Array *keys) {
+	struct PurgeKey *pk;
+	int num_keys = array_len(keys);
+	int first, i;
+
+	for (first = 0; first < num_keys; first += EXPIRE_DELETE_BATCH) {
+		cdb_begin_transaction();
+		for (i = first; (i < num_keys) && (i < first + EXPIRE_DELETE_BATCH); ++i) {
+			pk = (struct PurgeKey *)array_get_element_at(keys, i);
+			cdb_delete(cdb, pk->pk_key, pk->pk_keylen);
+			free(pk->pk_key);
+		}
+		cdb_end_transaction();
+	}
+	array_free(keys);
 }
 
 
 void DoPurgeRooms(struct ctdlroom *qrbuf, void *data) {
 	time_t age, purge_secs;
 	struct PurgeList *pptr;
-	struct ValidUser *vuptr;
 	int do_purge = 0;
 
 	// For mailbox rooms, there's only one purging rule: if the user who
 	// owns the room still exists, we keep the room; otherwise, we purge
 	// it.  Bypass any other rules.
 	if (qrbuf->QRflags & QR_MAILBOX) {
-		// if user not found, do_purge will be 1
-		do_purge = 1;
-		for (vuptr=ValidUserList; vuptr!=NULL; vuptr=vuptr->next) {
-			if (vuptr->vu_usernum == atol(qrbuf->QRname)) {
-				do_purge = 0;
-			}
-		}
+		do_purge = !IsValidUser(atol(qrbuf->QRname));
 	}
 	else {
 		// Any of these attributes render a room non-purgable
@@ -283,24 +323,20 @@ int PurgeRooms(void) {
 	struct PurgeList *pptr;
 	int num_rooms_purged = 0;
 	struct ctdlroom qrbuf;
-	struct ValidUser *vuptr;
 	char *transcript = NULL;
 
 	syslog(LOG_DEBUG, "PurgeRooms() called");
 
 	// Load up a table full of valid user numbers so we can delete
 	// user-owned rooms for users who no longer exist
+	ValidUsers = NewHash(1, lFlathash);
 	ForEachUser(AddValidUser, NULL);
 
 	// Then cycle through the room file
 	CtdlForEachRoom(DoPurgeRooms, NULL);
 
-	// Free the valid user list
-	while (ValidUserList != NULL) {
-		vuptr = ValidUserList->next;
-		free(ValidUserList);
-		ValidUserList = vuptr;
-	}
+	// Free the valid user table
+	DeleteHash(&ValidUsers);
 
 	transcript = malloc(SIZ);
 	strcpy(transcript, "The following rooms have been auto-purged:\n");
@@ -477,141 +513,121 @@ int PurgeUsers(void) {
 }
 
 
+// Purge the modification sequence logs of rooms and users which no longer exist.  Called by PurgeVisits(),
+// with its tables of the ones which do.
+static void PurgeModseqs(void) {
+	struct cdbdata *cdbml;
+	struct modseq_hdr hdr;
+	struct modseq_key key;
+	Array *purge_list = array_new(sizeof(struct PurgeKey));
+	int purged = 0;
+	void *v;
+
+	cdb_rewind(CDB_MODSEQ);
+	while (cdbml = cdb_next_item_borrowed(CDB_MODSEQ), cdbml != NULL) {
+		if (cdbml->len < sizeof(struct modseq_hdr)) {
+			continue;
+		}
+		memcpy(&hdr, cdbml->ptr, sizeof(struct modseq_hdr));
+
+		// A room's own logs go with the room; a user's log of flag changes with either
+		if (	(!GetHash(ValidRooms, (const char *)&hdr.mh_roomnum, sizeof(long), &v))
+			|| ((hdr.mh_usernum >= 0) && (!IsValidUser(hdr.mh_usernum)))
+		) {
+			memset(&key, 0, sizeof key);
+			key.mk_roomnum = hdr.mh_roomnum;
+			key.mk_usernum = hdr.mh_usernum;
+			AddPurgeKey(purge_list, &key, sizeof key);
+			++purged;
+		}
+	}
+
+	DeletePurgeKeys(CDB_MODSEQ, purge_list);
+	syslog(LOG_DEBUG, "Purged %d modification sequence logs.", purged);
+}
+
+
 // Purge visits
 //
 // This is a really cumbersome "garbage collection" function.  We have to
 // delete visits which refer to rooms and/or users which no longer exist.  In
 // order to prevent endless traversals of the room and user files, we first
-// build linked lists of rooms and users which _do_ exist on the system, then
-// traverse the visit file, checking each record against those two lists and
-// purging the ones that do not have a match on _both_ lists.  (Remember, if
+// build hash tables of the rooms and users which _do_ exist on the system, then
+// traverse the visit file, looking each record up in those two tables and
+// purging the ones that are not in _both_ of them.  (Remember, if
 // either the room or user being referred to is no longer on the system, the
 // record is useless and should be removed.)
 //
 int PurgeVisits(void) {
 	struct cdbdata *cdbvisit;
 	struct visit vbuf;
-	struct VPurgeList *VisitPurgeList = NULL;
-	struct VPurgeList *vptr;
+	Array *purge_list = array_new(sizeof(struct PurgeKey));
 	int purged = 0;
 	char IndexBuf[32];
 	int IndexLen;
-	struct ValidRoom *vrptr;
-	struct ValidUser *vuptr;
-	int RoomIsValid, UserIsValid;
 
 	// First, load up a table full of valid room/gen combinations
+	ValidRooms = NewHash(1, lFlathash);
 	CtdlForEachRoom(AddValidRoom, NULL);
 
 	// Then load up a table full of valid user numbers
+	ValidUsers = NewHash(1, lFlathash);
 	ForEachUser(AddValidUser, NULL);
 
-	// Now traverse through the visits, purging irrelevant records...
+	// Now traverse through the visits, finding the irrelevant records...
 	cdb_rewind(CDB_VISIT);
-	while(cdbvisit = cdb_next_item(CDB_VISIT), cdbvisit != NULL) {
+	while (cdbvisit = cdb_next_item_borrowed(CDB_VISIT), cdbvisit != NULL) {
 		memset(&vbuf, 0, sizeof(struct visit));
 		memcpy(&vbuf, cdbvisit->ptr,
 			( (cdbvisit->len > sizeof(struct visit)) ?
 			  sizeof(struct visit) : cdbvisit->len) );
-		cdb_free(cdbvisit);
-
-		RoomIsValid = 0;
-		UserIsValid = 0;
-
-		// Check to see if the room exists
-		for (vrptr=ValidRoomList; vrptr!=NULL; vrptr=vrptr->next) {
-			if ( (vrptr->vr_roomnum==vbuf.v_roomnum)
-			     && (vrptr->vr_roomgen==vbuf.v_roomgen))
-				RoomIsValid = 1;
-		}
-
-		// Check to see if the user exists
-		for (vuptr=ValidUserList; vuptr!=NULL; vuptr=vuptr->next) {
-			if (vuptr->vu_usernum == vbuf.v_usernum)
-				UserIsValid = 1;
-		}
 
 		// Put the record on the purge list if it's dead
-		if ((RoomIsValid==0) || (UserIsValid==0)) {
-			vptr = (struct VPurgeList *)
-				malloc(sizeof(struct VPurgeList));
-			vptr->next = VisitPurgeList;
-			vptr->vp_roomnum = vbuf.v_roomnum;
-			vptr->vp_roomgen = vbuf.v_roomgen;
-			vptr->vp_usernum = vbuf.v_usernum;
-			VisitPurgeList = vptr;
+		if ( (!IsValidRoom(vbuf.v_roomnum, vbuf.v_roomgen)) || (!IsValidUser(vbuf.v_usernum)) ) {
+			IndexLen = GenerateRelationshipIndex(IndexBuf, vbuf.v_roomnum, vbuf.v_roomgen, vbuf.v_usernum);
+			AddPurgeKey(purge_list, IndexBuf, IndexLen);
+			++purged;
 		}
-
 	}
 
-	// Free the valid room/gen combination list
-	while (ValidRoomList != NULL) {
-		vrptr = ValidRoomList->next;
-		free(ValidRoomList);
-		ValidRoomList = vrptr;
-	}
+	// The modification sequence logs (for IMAP) belong to the same rooms and users, so while we have the tables...
+	PurgeModseqs();
 
-	// Free the valid user list
-	while (ValidUserList != NULL) {
-		vuptr = ValidUserList->next;
-		free(ValidUserList);
-		ValidUserList = vuptr;
-	}
+	DeleteHash(&ValidRooms);
+	DeleteHash(&ValidUsers);
 
 	// Now delete every visit on the purged list
-	while (VisitPurgeList != NULL) {
-		IndexLen = GenerateRelationshipIndex(IndexBuf,
-				VisitPurgeList->vp_roomnum,
-				VisitPurgeList->vp_roomgen,
-				VisitPurgeList->vp_usernum);
-		cdb_delete(CDB_VISIT, IndexBuf, IndexLen);
-		vptr = VisitPurgeList->next;
-		free(VisitPurgeList);
-		VisitPurgeList = vptr;
-		++purged;
-	}
-
+	DeletePurgeKeys(CDB_VISIT, purge_list);
 	return(purged);
 }
 
 
 // Purge the use table of old entries.
-// Holy crap, this is WAY better.  We need to replace most linked lists with arrays.
 int PurgeUseTable(StrBuf *ErrMsg) {
 	int purged = 0;
 	int total = 0;
 	struct cdbdata *cdbut;
 	struct UseTable ut;
-	Array *purge_list = array_new(sizeof(int));
+	Array *purge_list = array_new(sizeof(struct PurgeKey));
+	time_t now = time(NULL);
 
 	// Phase 1: traverse through the table, discovering old records...
-
 	syslog(LOG_DEBUG, "Purge use table: phase 1");
 	cdb_rewind(CDB_USETABLE);
-	while(cdbut = cdb_next_item(CDB_USETABLE), cdbut != NULL) {
+	while (cdbut = cdb_next_item_borrowed(CDB_USETABLE), cdbut != NULL) {
 		++total;
-		if (cdbut->len > sizeof(struct UseTable))
-			memcpy(&ut, cdbut->ptr, sizeof(struct UseTable));
-		else {
-			memset(&ut, 0, sizeof(struct UseTable));
-			memcpy(&ut, cdbut->ptr, cdbut->len);
-		}
-		cdb_free(cdbut);
+		memset(&ut, 0, sizeof(struct UseTable));
+		memcpy(&ut, cdbut->ptr, ((cdbut->len > sizeof(struct UseTable)) ? sizeof(struct UseTable) : cdbut->len));
 
-		if ( (time(NULL) - ut.timestamp) > USETABLE_RETAIN ) {
-			array_append(purge_list, &ut.hash);
+		if ( (now - ut.timestamp) > USETABLE_RETAIN ) {
+			AddPurgeKey(purge_list, &ut.hash, sizeof(int));
 			++purged;
 		}
 	}
 
 	// Phase 2: delete the records
 	syslog(LOG_DEBUG, "Purge use table: phase 2");
-	int i;
-	for (i=0; i<purged; ++i) {
-		struct UseTable *u = (struct UseTable *)array_get_element_at(purge_list, i);
-		cdb_delete(CDB_USETABLE, &u->hash, sizeof(int));
-	}
-	array_free(purge_list);
+	DeletePurgeKeys(CDB_USETABLE, purge_list);
 
 	syslog(LOG_DEBUG, "Purge use table: finished (purged %d of %d records)", purged, total);
 	return(purged);
@@ -622,47 +638,26 @@ int PurgeUseTable(StrBuf *ErrMsg) {
 int PurgeEuidIndexTable(void) {
 	int purged = 0;
 	struct cdbdata *cdbei;
-	struct EPurgeList *el = NULL;
-	struct EPurgeList *eptr; 
+	Array *purge_list = array_new(sizeof(struct PurgeKey));
 	long msgnum;
-	struct CtdlMessage *msg = NULL;
 
 	// Phase 1: traverse through the table, discovering old records...
 	syslog(LOG_DEBUG, "Purge EUID index: phase 1");
 	cdb_rewind(CDB_EUIDINDEX);
-	while(cdbei = cdb_next_item(CDB_EUIDINDEX), cdbei != NULL) {
-
+	while (cdbei = cdb_next_item_borrowed(CDB_EUIDINDEX), cdbei != NULL) {
 		memcpy(&msgnum, cdbei->ptr, sizeof(long));
 
-		msg = CtdlFetchMessage(msgnum, 0);
-		if (msg != NULL) {
-			CM_Free(msg);	// it still exists, so do nothing
-		}
-		else {
-			eptr = (struct EPurgeList *) malloc(sizeof(struct EPurgeList));
-			if (eptr != NULL) {
-				eptr->next = el;
-				eptr->ep_keylen = cdbei->len - sizeof(long);
-				eptr->ep_key = malloc(cdbei->len);
-				memcpy(eptr->ep_key, &cdbei->ptr[sizeof(long)], eptr->ep_keylen);
-				el = eptr;
-			}
+		// All we need to know is whether the message still exists, so look for its record without
+		// loading it.  (This reads into a different borrowed buffer than the cursor does.)
+		if (cdb_fetch_borrowed(CDB_MSGMAIN, &msgnum, sizeof(long)) == NULL) {
+			AddPurgeKey(purge_list, &cdbei->ptr[sizeof(long)], cdbei->len - sizeof(long));
 			++purged;
 		}
-
-	       cdb_free(cdbei);
-
 	}
 
 	// Phase 2: delete the records
 	syslog(LOG_DEBUG, "Purge euid index: phase 2");
-	while (el != NULL) {
-		cdb_delete(CDB_EUIDINDEX, el->ep_key, el->ep_keylen);
-		free(el->ep_key);
-		eptr = el->next;
-		free(el);
-		el = eptr;
-	}
+	DeletePurgeKeys(CDB_EUIDINDEX, purge_list);
 
 	syslog(LOG_DEBUG, "Purge euid index: finished (purged %d records)", purged);
 	return(purged);
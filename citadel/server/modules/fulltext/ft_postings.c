@@ -0,0 +1,250 @@
+// Compressed posting lists for the full text index
+//
+// Each word in the index has a list of the messages containing it.  Message numbers only go up, so
+// we store the list sorted, as the differences between consecutive message numbers, each one
+// written as a variable length integer (seven bits per byte, high bit set on all but the last).
+// A typical list takes one or two bytes per message instead of eight.  The list is preceded by
+// the number of messages in it and the highest message number, so we can tell how big it is
+// without decoding it, and add newer messages to the end without decoding it either.
+//
+// Copyright (c) 2005-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include <stdlib.h>
+#include <string.h>
+#include "ft_postings.h"
+
+#define VARINT_MAX	10		// bytes needed for a 64 bit value
+
+
+static size_t put_varint(unsigned char *p, unsigned long v) {
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return(n);
+}
+
+
+// Returns the number of bytes consumed, or 0 if the data ends in the middle of a value
+static size_t get_varint(const unsigned char *p, const unsigned char *end, unsigned long *v) {
+	size_t n = 0;
+	int shift = 0;
+
+	*v = 0;
+	while ((p + n < end) && (shift < 64)) {
+		*v |= ((unsigned long)(p[n] & 0x7f)) << shift;
+		if ((p[n++] & 0x80) == 0) {
+			return(n);
+		}
+		shift += 7;
+	}
+	return(0);
+}
+
+
+// Read the header of a posting list.  Returns the length of the header, or -1 if it's damaged.
+int ft_postings_header(const char *data, size_t len, long *num_msgs, long *last_msgnum) {
+	const unsigned char *p = (const unsigned char *)data;
+	const unsigned char *end = p + len;
+	unsigned long v;
+	size_t n1, n2;
+
+	n1 = get_varint(p, end, &v);
+	if (n1 == 0) return(-1);
+	*num_msgs = v;
+	n2 = get_varint(p + n1, end, &v);
+	if (n2 == 0) return(-1);
+	*last_msgnum = v;
+	return(n1 + n2);
+}
+
+
+static size_t put_header(unsigned char *p, long num_msgs, long last_msgnum) {
+	size_t n;
+
+	n = put_varint(p, num_msgs);
+	n += put_varint(p + n, last_msgnum);
+	return(n);
+}
+
+
+// Encode deltas for msgs[] (which must be ascending) starting after "prev".  Anything not greater than
+// the message before it is skipped.  Returns bytes written; *num_written gets the number of messages.
+static size_t put_deltas(unsigned char *p, long prev, const long *msgs, int num_msgs, int *num_written) {
+	size_t n = 0;
+	int i;
+
+	*num_written = 0;
+	for (i=0; i<num_msgs; ++i) {
+		if (msgs[i] > prev) {
+			n += put_varint(p + n, msgs[i] - prev);
+			prev = msgs[i];
+			++(*num_written);
+		}
+	}
+	return(n);
+}
+
+
+// Encode a sorted list of message numbers.  The caller must free() the result.
+char *ft_postings_encode(const long *msgs, int num_msgs, size_t *len) {
+	unsigned char hdr[VARINT_MAX * 2];
+	unsigned char *buf;
+	size_t hlen, dlen;
+	int num_written;
+
+	buf = malloc((VARINT_MAX * 2) + ((size_t)num_msgs * VARINT_MAX));
+	dlen = put_deltas(buf + (VARINT_MAX * 2), 0, msgs, num_msgs, &num_written);
+	hlen = put_header(hdr, num_written, ((num_written > 0) ? msgs[num_msgs - 1] : 0));
+	memcpy(buf, hdr, hlen);
+	memmove(buf + hlen, buf + (VARINT_MAX * 2), dlen);
+
+	*len = hlen + dlen;
+	return(realloc(buf, *len));
+}
+
+
+// Decode a posting list into a newly allocated array of message numbers
+long *ft_postings_decode(const char *data, size_t len, int *num_msgs) {
+	const unsigned char *p;
+	const unsigned char *end = (const unsigned char *)data + len;
+	long count, last, cur = 0;
+	long *msgs;
+	unsigned long v;
+	size_t n;
+	int hlen;
+	int i = 0;
+
+	*num_msgs = 0;
+	hlen = ft_postings_header(data, len, &count, &last);
+	if ((hlen < 0) || (count <= 0) || ((size_t)count > len)) {	// every entry takes at least one byte
+		return(NULL);
+	}
+
+	msgs = malloc(sizeof(long) * count);
+	p = (const unsigned char *)data + hlen;
+	while ((i < count) && (n = get_varint(p, end, &v), n > 0)) {
+		p += n;
+		cur += v;
+		msgs[i++] = cur;
+	}
+	*num_msgs = i;
+	return(msgs);
+}
+
+
+// Merge two ascending lists, dropping duplicates.  Returns a newly allocated list.
+long *ft_msgs_union(const long *a, int num_a, const long *b, int num_b, int *num_out) {
+	long *out;
+	int i = 0, j = 0, n = 0;
+
+	out = malloc(sizeof(long) * (num_a + num_b + 1));
+	while ((i < num_a) || (j < num_b)) {
+		long m;
+		if ((j >= num_b) || ((i < num_a) && (a[i] <= b[j]))) {
+			m = a[i++];
+		}
+		else {
+			m = b[j++];
+		}
+		if ((n == 0) || (m > out[n-1])) {
+			out[n++] = m;
+		}
+	}
+	*num_out = n;
+	return(out);
+}
+
+
+// Take the messages in b[] out of a[] (both ascending), in place.  Returns the number left in a[].
+int ft_msgs_subtract(long *a, int num_a, const long *b, int num_b) {
+	int i, j = 0, n = 0;
+
+	for (i=0; i<num_a; ++i) {
+		while ((j < num_b) && (b[j] < a[i])) {
+			++j;
+		}
+		if ((j >= num_b) || (b[j] != a[i])) {
+			a[n++] = a[i];
+		}
+	}
+	return(n);
+}
+
+
+// Add a sorted list of messages to an existing posting list, returning a new one (which the caller
+// must free).  Messages newer than anything already in the list -- the usual case -- are tacked on
+// the end without decoding what's already there.
+char *ft_postings_append(const char *data, size_t len, const long *msgs, int num_msgs, size_t *newlen) {
+	long count, last;
+	unsigned char *buf;
+	size_t hlen_old, hlen_new, dlen;
+	int num_written;
+	long *old_msgs, *all_msgs;
+	int num_old, num_all;
+	char *ret;
+	int h;
+
+	h = ft_postings_header(data, len, &count, &last);
+	if ((h < 0) || (count <= 0)) {
+		return(ft_postings_encode(msgs, num_msgs, newlen));
+	}
+	hlen_old = h;
+
+	if ((num_msgs > 0) && (msgs[0] > last)) {
+		buf = malloc((VARINT_MAX * 2) + (len - hlen_old) + ((size_t)num_msgs * VARINT_MAX));
+		dlen = put_deltas(buf + (VARINT_MAX * 2) + (len - hlen_old), last, msgs, num_msgs, &num_written);
+		hlen_new = put_header(buf, count + num_written, msgs[num_msgs - 1]);
+		memmove(buf + hlen_new, data + hlen_old, len - hlen_old);
+		memmove(buf + hlen_new + (len - hlen_old), buf + (VARINT_MAX * 2) + (len - hlen_old), dlen);
+		*newlen = hlen_new + (len - hlen_old) + dlen;
+		return(realloc(buf, *newlen));
+	}
+
+	// Out of order; do it the slow way
+	old_msgs = ft_postings_decode(data, len, &num_old);
+	all_msgs = ft_msgs_union(old_msgs, num_old, msgs, num_msgs, &num_all);
+	ret = ft_postings_encode(all_msgs, num_all, newlen);
+	if (old_msgs != NULL) free(old_msgs);
+	free(all_msgs);
+	return(ret);
+}
+
+
+// Remove from cands[] (which must be ascending) any message not in the posting list, decoding only as much
+// of the list as we need to.  Returns the number of candidates left.
+int ft_postings_intersect(const char *data, size_t len, long *cands, int num_cands) {
+	const unsigned char *p;
+	const unsigned char *end = (const unsigned char *)data + len;
+	long count, last, cur = 0;
+	unsigned long v;
+	size_t n;
+	int hlen;
+	int i = 0;
+	int num_out = 0;
+
+	hlen = ft_postings_header(data, len, &count, &last);
+	if (hlen < 0) {
+		return(0);
+	}
+	p = (const unsigned char *)data + hlen;
+
+	while ((i < num_cands) && (cands[i] <= last) && (n = get_varint(p, end, &v), n > 0)) {
+		p += n;
+		cur += v;
+		while ((i < num_cands) && (cands[i] < cur)) {
+			++i;
+		}
+		if ((i < num_cands) && (cands[i] == cur)) {
+			cands[num_out++] = cur;
+			++i;
+		}
+	}
+	return(num_out);
+}
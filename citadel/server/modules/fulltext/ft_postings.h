@@ -0,0 +1,19 @@
+// Compressed posting lists for the full text index
+//
+// Copyright (c) 2005-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef FT_POSTINGS_H
+#define FT_POSTINGS_H
+
+int ft_postings_header(const char *data, size_t len, long *num_msgs, long *last_msgnum);
+char *ft_postings_encode(const long *msgs, int num_msgs, size_t *len);
+long *ft_postings_decode(const char *data, size_t len, int *num_msgs);
+char *ft_postings_append(const char *data, size_t len, const long *msgs, int num_msgs, size_t *newlen);
+int ft_postings_intersect(const char *data, size_t len, long *cands, int num_cands);
+long *ft_msgs_union(const long *a, int num_a, const long *b, int num_b, int *num_out);
+int ft_msgs_subtract(long *a, int num_a, const long *b, int num_b);
+
+#endif // FT_POSTINGS_H
@@ -0,0 +1,508 @@
+// In-memory segment of pending full text index changes
+//
+// The indexer doesn't read or rewrite a word's posting list every time it sees the word.  Instead,
+// the messages added to (or removed from) each word go into an in-memory segment, which costs one
+// hash lookup and usually one append per word.  When the segment reaches its memory limit
+// (c_ft_segment_mb), or the housekeeper decides it has been around long enough, it is merged into
+// CDB_FULLTEXT: each word's new messages are appended to its compressed posting list in one go.  A merge
+// can take a while, so a client command which happens to fill the segment (deleting a message de-indexes
+// it) doesn't do it; it only asks for one, and the indexer does it on the next housekeeping pass.
+//
+// A merge swaps in a fresh segment first, so indexing and searching carry on while it runs.
+// Searches look at the segment being merged and the current one as well as the disk, so newly
+// indexed messages can be found right away.
+//
+// Copyright (c) 2005-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "../../sysdep.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <libcitadel.h>
+#include "../../citserver.h"
+#include "../../config.h"
+#include "../../database.h"
+#include "../../room_ops.h"
+#include "ft_wordbreaker.h"
+#include "ft_postings.h"
+#include "ft_segment.h"
+
+#define FT_SEGMENT_BUCKETS	65536
+
+// Changes to one word's posting list which haven't been written out yet
+struct ft_pending {
+	struct ft_pending *next;
+	long *added;			// both lists are kept sorted
+	int num_added;
+	int alloc_added;
+	long *removed;
+	int num_removed;
+	int alloc_removed;
+	ft_token word;
+};
+
+struct ft_segment {
+	struct ft_pending *buckets[FT_SEGMENT_BUCKETS];
+	size_t bytes;
+	long num_words;
+};
+
+static struct ft_segment *ft_active = NULL;		// where new changes go
+static struct ft_segment *ft_merging = NULL;		// being written to disk, still searchable
+static pthread_mutex_t ft_segment_lock = PTHREAD_MUTEX_INITIALIZER;	// protects both of the above
+static pthread_mutex_t ft_merge_lock = PTHREAD_MUTEX_INITIALIZER;	// one merge at a time
+static int ft_merge_wanted = 0;				// the current segment is full
+
+
+static int tokcmp(const void *rec1, const void *rec2) {
+	return(strcmp((const char *)rec1, (const char *)rec2));
+}
+
+
+// Build the key of the dictionary record a word is filed under
+int ft_dict_key(char *key, const char *word) {
+	key[0] = FT_DICT_PREFIX;
+	memcpy(&key[1], word, WB_MIN);
+	return(WB_MIN + 1);
+}
+
+
+struct ft_segment *ft_segment_new(void) {
+	struct ft_segment *seg;
+
+	seg = (struct ft_segment *) malloc(sizeof(struct ft_segment));
+	memset(seg, 0, sizeof(struct ft_segment));
+	seg->bytes = sizeof(struct ft_segment);
+	return(seg);
+}
+
+
+void ft_segment_free(struct ft_segment *seg) {
+	struct ft_pending *p;
+	int i;
+
+	for (i=0; i<FT_SEGMENT_BUCKETS; ++i) {
+		while (p = seg->buckets[i], p != NULL) {
+			seg->buckets[i] = p->next;
+			if (p->added != NULL) free(p->added);
+			if (p->removed != NULL) free(p->removed);
+			free(p);
+		}
+	}
+	free(seg);
+}
+
+
+static int word_bucket(const char *word) {
+	return( (HashLittle(word, strlen(word)) & 0x7fffffff) % FT_SEGMENT_BUCKETS );
+}
+
+
+static struct ft_pending *find_pending(struct ft_segment *seg, const char *word, int create) {
+	struct ft_pending *p;
+	int b;
+
+	if (seg == NULL) {
+		return(NULL);
+	}
+	b = word_bucket(word);
+	for (p = seg->buckets[b]; p != NULL; p = p->next) {
+		if (!strcmp(p->word, word)) {
+			return(p);
+		}
+	}
+	if (!create) {
+		return(NULL);
+	}
+
+	p = (struct ft_pending *) malloc(sizeof(struct ft_pending));
+	memset(p, 0, sizeof(struct ft_pending));
+	safestrncpy(p->word, word, sizeof p->word);
+	p->next = seg->buckets[b];
+	seg->buckets[b] = p;
+	seg->bytes += sizeof(struct ft_pending);
+	++seg->num_words;
+	return(p);
+}
+
+
+// Add a message number to a sorted list.  Messages nearly always arrive in order, so this is usually an append.
+static void list_insert(struct ft_segment *seg, long **list, int *num, int *alloc, long msgnum) {
+	int j;
+
+	if ((*num > 0) && ((*list)[*num - 1] >= msgnum)) {
+		j = msglist_gallop(*list, *num, 0, msgnum);
+		if ((j < *num) && ((*list)[j] == msgnum)) {
+			return;					// already there
+		}
+	}
+	else {
+		j = *num;
+	}
+
+	if (*num >= *alloc) {
+		seg->bytes += (*alloc > 0) ? (*alloc * sizeof(long)) : (16 * sizeof(long));
+		*alloc = (*alloc > 0) ? (*alloc * 2) : 16;
+		*list = realloc(*list, *alloc * sizeof(long));
+	}
+	if (j < *num) {
+		memmove(&(*list)[j+1], &(*list)[j], ((*num - j) * sizeof(long)));
+	}
+	(*list)[j] = msgnum;
+	++(*num);
+}
+
+
+static void list_remove(long *list, int *num, long msgnum) {
+	int j;
+
+	j = msglist_gallop(list, *num, 0, msgnum);
+	if ((j < *num) && (list[j] == msgnum)) {
+		memmove(&list[j], &list[j+1], ((*num - j - 1) * sizeof(long)));
+		--(*num);
+	}
+}
+
+
+// The memory limit is read from the config every time, so it can be changed on a running server.
+static size_t segment_budget(void) {
+	long mb = CtdlGetConfigLong("c_ft_segment_mb");
+	return( (mb > 0) ? ((size_t)mb * 1024 * 1024) : (32 * 1024 * 1024) );
+}
+
+
+// Add or remove a message under each of a list of words in a segment
+static void segment_insert(struct ft_segment *seg, ft_token *tokens, int num_tokens, long msgnum, int op) {
+	struct ft_pending *p;
+	int i;
+
+	for (i=0; i<num_tokens; ++i) {
+		p = find_pending(seg, tokens[i], 1);
+		if (op == 1) {
+			list_remove(p->removed, &p->num_removed, msgnum);
+			list_insert(seg, &p->added, &p->num_added, &p->alloc_added, msgnum);
+		}
+		else {
+			// It might be on disk or in the segment being merged, so remember the removal either way
+			list_remove(p->added, &p->num_added, msgnum);
+			list_insert(seg, &p->removed, &p->num_removed, &p->alloc_removed, msgnum);
+		}
+	}
+}
+
+
+// The current segment has outgrown its budget.  Ask the indexer to write it out.
+static void merge_wanted(int full) {
+	if ((full) && (!__atomic_exchange_n(&ft_merge_wanted, 1, __ATOMIC_SEQ_CST))) {
+		syslog(LOG_DEBUG, "fulltext: index segment is full");
+	}
+}
+
+
+// Nonzero if the current segment is full and waiting to be written out
+int ft_segment_merge_wanted(void) {
+	return(__atomic_load_n(&ft_merge_wanted, __ATOMIC_SEQ_CST));
+}
+
+
+// Record that a message contains (op == 1) or no longer contains (op == 0) each of these words
+void ft_segment_update(ft_token *tokens, int num_tokens, long msgnum, int op) {
+	int full;
+
+	pthread_mutex_lock(&ft_segment_lock);
+	if (ft_active == NULL) {
+		ft_active = ft_segment_new();
+	}
+	segment_insert(ft_active, tokens, num_tokens, msgnum, op);
+	full = (ft_active->bytes > segment_budget());
+	pthread_mutex_unlock(&ft_segment_lock);
+
+	merge_wanted(full);
+}
+
+
+// A private segment lets an indexing thread collect postings without taking any locks.
+// It only collects additions, and nothing sees them until it is handed to ft_segment_absorb().
+void ft_segment_add(struct ft_segment *seg, ft_token *tokens, int num_tokens, long msgnum) {
+	segment_insert(seg, tokens, num_tokens, msgnum, 1);
+}
+
+
+// Fold a private segment into the current one, and free it
+void ft_segment_absorb(struct ft_segment *seg) {
+	struct ft_pending *p, *a;
+	long *merged;
+	int num_merged;
+	int full;
+	int i;
+
+	pthread_mutex_lock(&ft_segment_lock);
+	if (ft_active == NULL) {
+		ft_active = ft_segment_new();
+	}
+	for (i=0; i<FT_SEGMENT_BUCKETS; ++i) {
+		for (p = seg->buckets[i]; p != NULL; p = p->next) {
+			if (p->num_added == 0) {
+				continue;
+			}
+			a = find_pending(ft_active, p->word, 1);
+			if (a->num_removed > 0) {
+				a->num_removed = ft_msgs_subtract(a->removed, a->num_removed, p->added, p->num_added);
+			}
+			if (a->num_added == 0) {			// nothing there yet, so just take it over
+				if (a->added != NULL) free(a->added);
+				ft_active->bytes += (p->alloc_added - a->alloc_added) * sizeof(long);
+				a->added = p->added;
+				a->num_added = p->num_added;
+				a->alloc_added = p->alloc_added;
+				p->added = NULL;
+			}
+			else {
+				merged = ft_msgs_union(a->added, a->num_added, p->added, p->num_added, &num_merged);
+				free(a->added);
+				ft_active->bytes += (num_merged - a->alloc_added) * sizeof(long);
+				a->added = merged;
+				a->num_added = num_merged;
+				a->alloc_added = num_merged;
+			}
+		}
+	}
+	full = (ft_active->bytes > segment_budget());
+	pthread_mutex_unlock(&ft_segment_lock);
+
+	ft_segment_free(seg);
+	merge_wanted(full);
+}
+
+
+// Add words to the dictionary.  They must be sorted, so words sharing a record are next to each other.
+// We only add words which had no posting list, so we don't look for them in the record first; a word
+// can only be listed twice if its posting list emptied out and it came back, which does no harm.
+static void add_to_dictionary(ft_token *words, int num_words) {
+	char key[WB_MIN + 1];
+	int keylen;
+	struct cdbdata *cdb_dict;
+	StrBuf *dict;
+	int i;
+
+	dict = NewStrBuf();
+	i = 0;
+	while (i < num_words) {
+		keylen = ft_dict_key(key, words[i]);
+		FlushStrBuf(dict);
+		cdb_dict = cdb_fetch(CDB_FULLTEXT, key, keylen);
+		if (cdb_dict != NULL) {
+			StrBufAppendBufPlain(dict, cdb_dict->ptr, cdb_dict->len, 0);
+			cdb_free(cdb_dict);
+		}
+
+		// every word in this run of the list shares the record
+		for (; (i < num_words) && (!strncmp(words[i], &key[1], WB_MIN)); ++i) {
+			if (StrLength(dict) > 0) {
+				StrBufAppendBufPlain(dict, HKEY(" "), 0);
+			}
+			StrBufAppendBufPlain(dict, words[i], -1, 0);
+		}
+		cdb_store(CDB_FULLTEXT, key, keylen, (void *)ChrPtr(dict), StrLength(dict));
+	}
+	FreeStrBuf(&dict);
+}
+
+
+// Write one word's pending changes into its posting list.  Returns nonzero if the word is new to the index.
+static int merge_pending(struct ft_pending *p) {
+	struct cdbdata *cdb_bucket;
+	char *postings = NULL;
+	size_t len = 0;
+	long *msgs;
+	int num_msgs;
+	int is_new;
+
+	cdb_bucket = cdb_fetch(CDB_FULLTEXT, p->word, strlen(p->word));
+	is_new = (cdb_bucket == NULL);
+
+	if (p->num_added > 0) {
+		if (cdb_bucket != NULL) {
+			postings = ft_postings_append(cdb_bucket->ptr, cdb_bucket->len, p->added, p->num_added, &len);
+		}
+		else {
+			postings = ft_postings_encode(p->added, p->num_added, &len);
+		}
+	}
+	else if (cdb_bucket != NULL) {
+		postings = malloc(cdb_bucket->len);
+		memcpy(postings, cdb_bucket->ptr, cdb_bucket->len);
+		len = cdb_bucket->len;
+	}
+	if (cdb_bucket != NULL) {
+		cdb_free(cdb_bucket);
+	}
+
+	if ((p->num_removed > 0) && (postings != NULL)) {
+		msgs = ft_postings_decode(postings, len, &num_msgs);
+		free(postings);
+		postings = NULL;
+		num_msgs = ft_msgs_subtract(msgs, num_msgs, p->removed, p->num_removed);
+		if (num_msgs > 0) {
+			postings = ft_postings_encode(msgs, num_msgs, &len);
+		}
+		if (msgs != NULL) free(msgs);
+	}
+
+	if (postings != NULL) {
+		cdb_store(CDB_FULLTEXT, p->word, strlen(p->word), postings, len);
+		free(postings);
+		return(is_new);
+	}
+	if (!is_new) {
+		cdb_delete(CDB_FULLTEXT, p->word, strlen(p->word));
+	}
+	return(0);
+}
+
+
+// Write the current segment out to disk
+void ft_segment_merge(void) {
+	struct ft_segment *seg;
+	struct ft_pending *p;
+	ft_token *new_words = NULL;
+	int num_new_words = 0;
+	int alloc_new_words = 0;
+	time_t last_update = 0;
+	long num_done = 0;
+	int i;
+
+	pthread_mutex_lock(&ft_merge_lock);
+
+	pthread_mutex_lock(&ft_segment_lock);
+	seg = ft_active;
+	if ((seg == NULL) || (seg->num_words == 0)) {
+		pthread_mutex_unlock(&ft_segment_lock);
+		pthread_mutex_unlock(&ft_merge_lock);
+		return;
+	}
+	ft_active = ft_segment_new();
+	ft_merging = seg;
+	__atomic_store_n(&ft_merge_wanted, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&ft_segment_lock);
+
+	syslog(LOG_INFO, "fulltext: merging %ld words (%ld KB) into the index", seg->num_words, (long)(seg->bytes / 1024));
+	for (i=0; i<FT_SEGMENT_BUCKETS; ++i) {
+		for (p = seg->buckets[i]; p != NULL; p = p->next) {
+			if (merge_pending(p)) {
+				if (num_new_words >= alloc_new_words) {
+					alloc_new_words = (alloc_new_words > 0) ? (alloc_new_words * 2) : 1024;
+					new_words = realloc(new_words, sizeof(ft_token) * alloc_new_words);
+				}
+				memcpy(new_words[num_new_words++], p->word, sizeof(ft_token));
+			}
+			++num_done;
+		}
+		if ((time(NULL) - last_update) >= 10) {
+			syslog(LOG_INFO, "fulltext: merged %ld of %ld words", num_done, seg->num_words);
+			last_update = time(NULL);
+		}
+	}
+
+	if (num_new_words > 0) {
+		syslog(LOG_INFO, "fulltext: adding %d new words to the dictionary", num_new_words);
+		qsort(new_words, num_new_words, sizeof(ft_token), tokcmp);
+		add_to_dictionary(new_words, num_new_words);
+		free(new_words);
+	}
+
+	pthread_mutex_lock(&ft_segment_lock);
+	ft_merging = NULL;
+	pthread_mutex_unlock(&ft_segment_lock);
+	ft_segment_free(seg);
+
+	pthread_mutex_unlock(&ft_merge_lock);
+	syslog(LOG_INFO, "fulltext: merge complete");
+}
+
+
+// Throw away everything pending (used when the whole index is being rebuilt)
+void ft_segment_discard(void) {
+	pthread_mutex_lock(&ft_merge_lock);
+	pthread_mutex_lock(&ft_segment_lock);
+	if (ft_active != NULL) {
+		ft_segment_free(ft_active);
+		ft_active = NULL;
+	}
+	pthread_mutex_unlock(&ft_segment_lock);
+	pthread_mutex_unlock(&ft_merge_lock);
+}
+
+
+// Copy a word's pending changes out of a segment.  Caller must hold ft_segment_lock.
+static void copy_pending(struct ft_segment *seg, const char *word, long **added, int *num_added, long **removed, int *num_removed) {
+	struct ft_pending *p;
+
+	*added = NULL;
+	*removed = NULL;
+	*num_added = 0;
+	*num_removed = 0;
+	p = find_pending(seg, word, 0);
+	if (p == NULL) {
+		return;
+	}
+	if (p->num_added > 0) {
+		*added = malloc(sizeof(long) * p->num_added);
+		memcpy(*added, p->added, sizeof(long) * p->num_added);
+		*num_added = p->num_added;
+	}
+	if (p->num_removed > 0) {
+		*removed = malloc(sizeof(long) * p->num_removed);
+		memcpy(*removed, p->removed, sizeof(long) * p->num_removed);
+		*num_removed = p->num_removed;
+	}
+}
+
+
+// Apply a word's pending changes to its posting list from disk (which may be NULL).  Returns 0 if there
+// aren't any, in which case the caller can go on using the compressed list.  Otherwise *msgs gets the
+// word's current message list, which the caller must free().
+int ft_segment_overlay(const char *word, struct cdbdata *postings, long **msgs, int *num_msgs) {
+	long *added[2], *removed[2];
+	int num_added[2], num_removed[2];
+	long *merged;
+	int num_merged;
+	int i;
+
+	pthread_mutex_lock(&ft_segment_lock);
+	copy_pending(ft_merging, word, &added[0], &num_added[0], &removed[0], &num_removed[0]);
+	copy_pending(ft_active, word, &added[1], &num_added[1], &removed[1], &num_removed[1]);
+	pthread_mutex_unlock(&ft_segment_lock);
+
+	if ((num_added[0] + num_removed[0] + num_added[1] + num_removed[1]) == 0) {
+		return(0);
+	}
+
+	*msgs = NULL;
+	*num_msgs = 0;
+	if (postings != NULL) {
+		*msgs = ft_postings_decode(postings->ptr, postings->len, num_msgs);
+	}
+
+	// older segment first
+	for (i=0; i<2; ++i) {
+		if (num_added[i] > 0) {
+			merged = ft_msgs_union(*msgs, *num_msgs, added[i], num_added[i], &num_merged);
+			if (*msgs != NULL) free(*msgs);
+			*msgs = merged;
+			*num_msgs = num_merged;
+		}
+		if (num_removed[i] > 0) {
+			*num_msgs = ft_msgs_subtract(*msgs, *num_msgs, removed[i], num_removed[i]);
+		}
+		if (added[i] != NULL) free(added[i]);
+		if (removed[i] != NULL) free(removed[i]);
+	}
+	return(1);
+}
@@ -0,0 +1,27 @@
+// In-memory segment of pending full text index changes
+//
+// Copyright (c) 2005-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef FT_SEGMENT_H
+#define FT_SEGMENT_H
+
+// Dictionary records are filed under this character plus the first WB_MIN characters of a word
+#define FT_DICT_PREFIX	'*'
+
+struct ft_segment;
+
+int ft_dict_key(char *key, const char *word);
+struct ft_segment *ft_segment_new(void);
+void ft_segment_free(struct ft_segment *seg);
+void ft_segment_add(struct ft_segment *seg, ft_token *tokens, int num_tokens, long msgnum);
+void ft_segment_absorb(struct ft_segment *seg);
+void ft_segment_update(ft_token *tokens, int num_tokens, long msgnum, int op);
+void ft_segment_merge(void);
+int ft_segment_merge_wanted(void);
+void ft_segment_discard(void);
+int ft_segment_overlay(const char *word, struct cdbdata *postings, long **msgs, int *num_msgs);
+
+#endif // FT_SEGMENT_H
@@ -37,7 +37,6 @@
 #include "../../msgbase.h"
 #include "../../control.h"
 #include "ft_wordbreaker.h"
-#include "crc16.h"
 #include "../../ctdl_module.h"
 
 /*
@@ -114,23 +113,20 @@ static char *noise_words[] = {
 /*
  * Compare function
  */
-int intcmp(const void *rec1, const void *rec2) {
-	int i1, i2;
-
-	i1 = *(const int *)rec1;
-	i2 = *(const int *)rec2;
-
-	if (i1 > i2) return(1);
-	if (i1 < i2) return(-1);
-	return(0);
+static int tokcmp(const void *rec1, const void *rec2) {
+	return(strcmp((const char *)rec1, (const char *)rec2));
 }
 
 
-void wordbreaker(const char *text, int *num_tokens, int **tokens) {
+/*
+ * Break text into the words we index: lowercased, WB_MIN to WB_MAX characters,
+ * noise words removed.  The list comes back sorted with duplicates removed.
+ */
+void wordbreaker(const char *text, int *num_tokens, ft_token **tokens) {
 
 	int wb_num_tokens = 0;
 	int wb_num_alloc = 0;
-	int *wb_tokens = NULL;
+	ft_token *wb_tokens = NULL;
 
 	const char *ptr;
 	const char *word_start;
@@ -139,7 +135,6 @@ void wordbreaker(const char *text, int *num_tokens, int **tokens) {
 	int word_len;
 	char word[256];
 	int i;
-	int word_crc;
 	
 	if (text == NULL) {		/* no NULL text please */
 		*num_tokens = 0;
@@ -157,14 +152,14 @@ void wordbreaker(const char *text, int *num_tokens, int **tokens) {
 	word_start = NULL;
 	while (*ptr) {
 		ch = *ptr;
-		if (isalnum(ch)) {
+		if (isalnum((unsigned char)ch)) {
 			if (!word_start) {
 				word_start = ptr;
 			}
 		}
 		++ptr;
 		ch = *ptr;
-		if ( (!isalnum(ch)) && (word_start) ) {
+		if ( (!isalnum((unsigned char)ch)) && (word_start) ) {
 			word_end = ptr;
 
 			/* extract the word */
@@ -183,7 +178,7 @@ void wordbreaker(const char *text, int *num_tokens, int **tokens) {
 			/* are we ok with the length? */
 			if ( (word_len >= WB_MIN) && (word_len <= WB_MAX) ) {
 				for (i=0; i<word_len; ++i) {
-					word[i] = tolower(word[i]);
+					word[i] = tolower((unsigned char)word[i]);
 				}
 				/* disqualify noise words */
 				for (i=0; i<NUM_NOISE; ++i) {
@@ -196,29 +191,29 @@ void wordbreaker(const char *text, int *num_tokens, int **tokens) {
 				if (word_len == 0)
 					continue;
 
-				word_crc = (int) CalcCRC16Bytes(word_len, word);
-
 				++wb_num_tokens;
 				if (wb_num_tokens > wb_num_alloc) {
 					wb_num_alloc += 512;
-					wb_tokens = realloc(wb_tokens, (sizeof(int) * wb_num_alloc));
+					wb_tokens = realloc(wb_tokens, (sizeof(ft_token) * wb_num_alloc));
 				}
-				wb_tokens[wb_num_tokens - 1] = word_crc;
+				memcpy(wb_tokens[wb_num_tokens - 1], word, word_len + 1);
 			}
 		}
 	}
 
 	/* sort and purge dups */
 	if (wb_num_tokens > 1) {
-		qsort(wb_tokens, wb_num_tokens, sizeof(int), intcmp);
-		for (i=0; i<(wb_num_tokens-1); ++i) {
-			if (wb_tokens[i] == wb_tokens[i+1]) {
-				memmove(&wb_tokens[i], &wb_tokens[i+1],
-					((wb_num_tokens - i - 1)*sizeof(int)));
-				--wb_num_tokens;
-				--i;
+		int n = 1;
+		qsort(wb_tokens, wb_num_tokens, sizeof(ft_token), tokcmp);
+		for (i=1; i<wb_num_tokens; ++i) {
+			if (strcmp(wb_tokens[i], wb_tokens[n-1])) {
+				if (i != n) {
+					memcpy(wb_tokens[n], wb_tokens[i], sizeof(ft_token));
+				}
+				++n;
 			}
 		}
+		wb_num_tokens = n;
 	}
 
 	*num_tokens = wb_num_tokens;
@@ -15,7 +15,7 @@
  * later on, or even if we update this one, we can use a different ID so the
  * system knows it needs to throw away the existing index and rebuild it.
  */
-#define	FT_WORDBREAKER_ID	0x0021
+#define	FT_WORDBREAKER_ID	0x0022
 
 /*
  * Minimum and maximum length of words to index
@@ -23,4 +23,9 @@
 #define WB_MIN			4	// nothing with 3 or less chars
 #define WB_MAX			40
 
-void wordbreaker(const char *text, int *num_tokens, int **tokens);
+/*
+ * A word as it is stored in the index
+ */
+typedef char ft_token[WB_MAX+1];
+
+void wordbreaker(const char *text, int *num_tokens, ft_token **tokens);
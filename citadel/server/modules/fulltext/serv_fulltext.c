@@ -18,6 +18,8 @@
 #include <sys/wait.h>
 #include <string.h>
 #include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <libcitadel.h>
 #include "../../citadel_defs.h"
 #include "../../server.h"
@@ -27,8 +29,11 @@
 #include "../../database.h"
 #include "../../msgbase.h"
 #include "../../control.h"
+#include "../../room_ops.h"
 #include "serv_fulltext.h"
 #include "ft_wordbreaker.h"
+#include "ft_postings.h"
+#include "ft_segment.h"
 #include "../../threads.h"
 #include "../../context.h"
 #include "../../ctdl_module.h"
@@ -38,8 +43,21 @@ long *ft_newmsgs = NULL;
 int ft_num_msgs = 0;
 int ft_num_alloc = 0;
 
-int ftc_num_msgs[65536];
-long *ftc_msgs[65536];
+// The index is keyed by word.  Each record holds a compressed list of the messages containing that
+// word (see ft_postings.c).  There is also a dictionary of every indexed word, filed under its first
+// WB_MIN characters with FT_DICT_PREFIX in front, which is how we find the words for a prefix search.
+// Changes to the index collect in memory and are merged into it in batches (see ft_segment.c).
+
+// Messages saved since the last housekeeping pass, waiting to be indexed
+long *ft_saved_msgs = NULL;
+int ft_num_saved = 0;
+int ft_alloc_saved = 0;
+pthread_mutex_t ft_saved_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Messages which were indexed as soon as they were saved, so the batch indexer can skip them
+long *ft_early_msgs = NULL;
+int ft_num_early = 0;
+int ft_alloc_early = 0;
 
 
 // Compare function
@@ -55,115 +73,67 @@ int longcmp(const void *rec1, const void *rec2) {
 }
 
 
-// Flush our index cache out to disk.
-void ft_flush_cache(void) {
-	int i;
-	time_t last_update = 0;
+static int tokcmp(const void *rec1, const void *rec2) {
+	return(strcmp((const char *)rec1, (const char *)rec2));
+}
 
-	for (i=0; i<65536; ++i) {
-		if ((time(NULL) - last_update) >= 10) {
-			syslog(LOG_INFO, "fulltext: flushing index cache to disk (%d%% complete)", (i * 100 / 65536));
-			last_update = time(NULL);
-		}
-		if (ftc_msgs[i] != NULL) {
-			cdb_store(CDB_FULLTEXT, &i, sizeof(int), ftc_msgs[i], (ftc_num_msgs[i] * sizeof(long)));
-			ftc_num_msgs[i] = 0;
-			free(ftc_msgs[i]);
-			ftc_msgs[i] = NULL;
-		}
-	}
-	syslog(LOG_INFO, "fulltext: flushed index cache to disk (100%% complete)");
+
+// Render a message as plain text, the way we index it, so we don't end up indexing a bunch of
+// encoded base64, etc.  Frees the message.  The caller must free() the text.
+char *ft_message_text(struct CtdlMessage *msg) {
+	StrBuf *saved_redirect_buffer;
+	StrBuf *msgtext;
+
+	saved_redirect_buffer = CC->redirect_buffer;
+	CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
+	CtdlOutputPreLoadedMsg(msg, MT_CITADEL, HEADERS_ALL, 0, 1, 0);
+	CM_Free(msg);
+	msgtext = CC->redirect_buffer;
+	CC->redirect_buffer = saved_redirect_buffer;
+	return(SmashStrBuf(&msgtext));
 }
 
 
-// Index or de-index a message.  (op == 1 to index, 0 to de-index)
-void ft_index_message(long msgnum, int op) {
+// Break a message into the words we index it under.  Returns the number of words; the caller must free() them.
+static int ft_message_tokens(long msgnum, ft_token **tokens) {
 	int num_tokens = 0;
-	int *tokens = NULL;
-	int i, j;
-	struct cdbdata *cdb_bucket;
-	StrBuf *msgtext;
 	char *txt;
-	int tok;
 	struct CtdlMessage *msg = NULL;
 
+	*tokens = NULL;
 	msg = CtdlFetchMessage(msgnum, 1);
 	if (msg == NULL) {
-		syslog(LOG_ERR, "fulltext: ft_index_message() could not load msg %ld", msgnum);
-		return;
+		syslog(LOG_ERR, "fulltext: could not load msg %ld", msgnum);
+		return(0);
 	}
 
 	if (!CM_IsEmpty(msg, eSuppressIdx)) {
-		syslog(LOG_DEBUG, "fulltext: ft_index_message() excluded msg %ld", msgnum);
+		syslog(LOG_DEBUG, "fulltext: excluded msg %ld", msgnum);
 		CM_Free(msg);
-		return;
+		return(0);
 	}
 
-	syslog(LOG_DEBUG, "fulltext: ft_index_message() %s msg %ld", (op ? "adding" : "removing") , msgnum);
-
-	// Output the message as text before indexing it, so we don't end up
-	// indexing a bunch of encoded base64, etc.
-	CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
-	CtdlOutputPreLoadedMsg(msg, MT_CITADEL, HEADERS_ALL, 0, 1, 0);
-	CM_Free(msg);
-	msgtext = CC->redirect_buffer;
-	CC->redirect_buffer = NULL;
-	if (msgtext != NULL) {
-		syslog(LOG_DEBUG, "fulltext: wordbreaking message %ld (%d bytes)", msgnum, StrLength(msgtext));
+	txt = ft_message_text(msg);
+	if (txt != NULL) {
+		syslog(LOG_DEBUG, "fulltext: wordbreaking message %ld (%d bytes)", msgnum, (int)strlen(txt));
 	}
-	txt = SmashStrBuf(&msgtext);
-	wordbreaker(txt, &num_tokens, &tokens);
+	wordbreaker(txt, &num_tokens, tokens);
 	free(txt);
+	return(num_tokens);
+}
+
+
+// Index or de-index a message.  (op == 1 to index, 0 to de-index)
+void ft_index_message(long msgnum, int op) {
+	int num_tokens = 0;
+	ft_token *tokens = NULL;
+
+	syslog(LOG_DEBUG, "fulltext: ft_index_message() %s msg %ld", (op ? "adding" : "removing") , msgnum);
+	num_tokens = ft_message_tokens(msgnum, &tokens);
 
 	syslog(LOG_DEBUG, "fulltext: indexing message %ld [%d tokens]", msgnum, num_tokens);
 	if (num_tokens > 0) {
-		for (i=0; i<num_tokens; ++i) {
-
-			// Add the message to the relevant token bucket
-
-			// search for tokens[i]
-			tok = tokens[i];
-
-			if ( (tok >= 0) && (tok <= 65535) ) {
-				// fetch the bucket, Liza
-				if (ftc_msgs[tok] == NULL) {
-					cdb_bucket = cdb_fetch(CDB_FULLTEXT, &tok, sizeof(int));
-					if (cdb_bucket != NULL) {
-						ftc_num_msgs[tok] = cdb_bucket->len / sizeof(long);
-						ftc_msgs[tok] = (long *)cdb_bucket->ptr;
-						cdb_bucket->ptr = NULL;
-						cdb_free(cdb_bucket);
-					}
-					else {
-						ftc_num_msgs[tok] = 0;
-						ftc_msgs[tok] = malloc(sizeof(long));
-					}
-				}
-	
-	
-				if (op == 1) {	// add to index
-					++ftc_num_msgs[tok];
-					ftc_msgs[tok] = realloc(ftc_msgs[tok], ftc_num_msgs[tok]*sizeof(long));
-					ftc_msgs[tok][ftc_num_msgs[tok] - 1] = msgnum;
-				}
-	
-				if (op == 0) {	// remove from index
-					if (ftc_num_msgs[tok] >= 1) {
-						for (j=0; j<ftc_num_msgs[tok]; ++j) {
-							if (ftc_msgs[tok][j] == msgnum) {
-								memmove(&ftc_msgs[tok][j], &ftc_msgs[tok][j+1], ((ftc_num_msgs[tok] - j - 1)*sizeof(long)));
-								--ftc_num_msgs[tok];
-								--j;
-							}
-						}
-					}
-				}
-			}
-			else {
-				syslog(LOG_ALERT, "fulltext: invalid token %d !!", tok);
-			}
-		}
-
+		ft_segment_update(tokens, num_tokens, msgnum, op);
 		free(tokens);
 	}
 }
@@ -194,16 +164,240 @@ void ft_index_room(struct ctdlroom *qrbuf, void *data) {
 }
 
 
+// Remember that a message has been indexed ahead of the batch indexer
+static void ft_add_early(long msgnum) {
+	if (ft_num_early >= ft_alloc_early) {
+		ft_alloc_early = (ft_alloc_early > 0) ? (ft_alloc_early * 2) : 256;
+		ft_early_msgs = realloc(ft_early_msgs, (ft_alloc_early * sizeof(long)));
+	}
+	ft_early_msgs[ft_num_early++] = msgnum;
+}
+
+
+// Forget about the early messages the batch indexer has caught up with.  Leaves the list sorted.
+static void ft_prune_early(long indexed_through) {
+	int i, n = 0;
+
+	qsort(ft_early_msgs, ft_num_early, sizeof(long), longcmp);
+	for (i=0; i<ft_num_early; ++i) {
+		if (ft_early_msgs[i] > indexed_through) {
+			ft_early_msgs[n++] = ft_early_msgs[i];
+		}
+	}
+	ft_num_early = n;
+}
+
+
+// Building the index for a large message base (when full text indexing is first turned on, or when
+// the wordbreaker changes) is done by several threads at once.  Fetching, rendering, and breaking up
+// the messages is most of the work and doesn't need any locks, so each thread does that for whichever
+// message is next on the list and collects the postings in a segment of its own.  The list is handed
+// out in chunks; at the end of each chunk the threads fold their segments into the shared one, and
+// every so often the coordinator writes that out and records how far it got in MMfulltext, so a
+// restart picks up from there.
+struct ft_parallel_run {
+	long *msgs;			// what to index, sorted
+	int num_msgs;
+	long newhighest;		// MMfulltext once they're all done
+	int next;			// next one to hand out
+	int chunk_end;			// hand out messages up to (not including) this one
+	int chunk_id;			// bumped each time a new chunk starts
+	int num_workers;		// worker threads still running
+	int num_finished;		// workers done with the current chunk
+	int stop;
+};
+
+struct ft_parallel_run ft_run;
+int ft_parallel_running = 0;
+pthread_mutex_t ft_run_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ft_run_cond = PTHREAD_COND_INITIALIZER;
+
+
+// Write out the current segment if it has filled up.  Whoever filled it only asked for this, so it's done
+// here, on the indexer's time.  This is an EVT_HOUSE hook, and the batch indexer calls it as it goes.
+void ft_merge_if_full(void) {
+	if (ft_segment_merge_wanted()) {
+		ft_segment_merge();
+	}
+}
+
+
+// Save our place, after writing out everything indexed so far
+static void ft_checkpoint(long indexed_through) {
+	ft_segment_merge();
+	begin_critical_section(S_CONTROL);
+	CtdlSetConfigLong("MMfulltext", indexed_through);
+	CtdlSetConfigInt("MM_fulltext_wordbreaker", FT_WORDBREAKER_ID);
+	end_critical_section(S_CONTROL);
+}
+
+
+// One of the indexing threads
+void *ft_parallel_worker(void *arg) {
+	struct CitContext ctx;
+	struct ft_segment *seg;
+	ft_token *tokens;
+	int num_tokens;
+	int chunk_id = 0;
+	int i;
+
+	CtdlFillSystemContext(&ctx, "fulltext");
+	become_session(&ctx);
+
+	pthread_mutex_lock(&ft_run_lock);
+	while (1) {
+		while ((!ft_run.stop) && (ft_run.chunk_id == chunk_id)) {
+			pthread_cond_wait(&ft_run_cond, &ft_run_lock);
+		}
+		if (ft_run.stop) {
+			break;
+		}
+		chunk_id = ft_run.chunk_id;
+
+		seg = ft_segment_new();
+		while ((ft_run.next < ft_run.chunk_end) && (!server_shutting_down)) {
+			i = ft_run.next++;
+			pthread_mutex_unlock(&ft_run_lock);
+
+			num_tokens = ft_message_tokens(ft_run.msgs[i], &tokens);
+			if (num_tokens > 0) {
+				ft_segment_add(seg, tokens, num_tokens, ft_run.msgs[i]);
+				free(tokens);
+			}
+
+			pthread_mutex_lock(&ft_run_lock);
+		}
+		pthread_mutex_unlock(&ft_run_lock);
+
+		ft_segment_absorb(seg);
+
+		pthread_mutex_lock(&ft_run_lock);
+		++ft_run.num_finished;
+		pthread_cond_broadcast(&ft_run_cond);
+	}
+	--ft_run.num_workers;
+	pthread_cond_broadcast(&ft_run_cond);
+	pthread_mutex_unlock(&ft_run_lock);
+
+	become_session(NULL);
+	return(NULL);
+}
+
+
+// Hands out the work to the indexing threads, and reports on their progress
+void *ft_parallel_coordinator(void *arg) {
+	int num_threads;
+	int i;
+	time_t started, last_checkpoint, last_progress = 0;
+	long done;
+
+	num_threads = CtdlGetConfigInt("c_ft_threads");
+	syslog(LOG_INFO, "fulltext: indexing %d messages with %d threads", ft_run.num_msgs, num_threads);
+	started = time(NULL);
+	last_checkpoint = started;
+
+	pthread_mutex_lock(&ft_run_lock);
+	for (i=0; i<num_threads; ++i) {
+		if (CtdlThreadCreate(ft_parallel_worker) == 0) {
+			++ft_run.num_workers;
+		}
+	}
+
+	while ((ft_run.num_workers > 0) && (ft_run.next < ft_run.num_msgs) && (!server_shutting_down)) {
+
+		// Start a chunk and wait for the threads to finish it
+		ft_run.chunk_end = ft_run.next + FT_PARALLEL_CHUNK;
+		if (ft_run.chunk_end > ft_run.num_msgs) {
+			ft_run.chunk_end = ft_run.num_msgs;
+		}
+		ft_run.num_finished = 0;
+		++ft_run.chunk_id;
+		pthread_cond_broadcast(&ft_run_cond);
+		while (ft_run.num_finished < ft_run.num_workers) {
+			pthread_cond_wait(&ft_run_cond, &ft_run_lock);
+		}
+		if ((server_shutting_down) || (ft_run.next < ft_run.chunk_end)) {
+			break;					// the chunk didn't get finished
+		}
+		pthread_mutex_unlock(&ft_run_lock);
+
+		done = ft_run.chunk_end;
+		if ((time(NULL) - last_progress) >= 10) {
+			syslog(LOG_INFO, "fulltext: indexed %ld of %d messages (%ld%%), %ld per second",
+				done, ft_run.num_msgs, ((done * 100) / ft_run.num_msgs),
+				(done / ((time(NULL) > started) ? (time(NULL) - started) : 1))
+			);
+			last_progress = time(NULL);
+		}
+		if (done >= ft_run.num_msgs) {
+			ft_checkpoint(ft_run.newhighest);
+		}
+		else if ((time(NULL) - last_checkpoint) >= FT_CHECKPOINT_TIME) {
+			ft_checkpoint(ft_run.msgs[done - 1]);
+			last_checkpoint = time(NULL);
+		}
+		else {
+			ft_merge_if_full();			// the threads are waiting for the next chunk anyway
+		}
+
+		pthread_mutex_lock(&ft_run_lock);
+	}
+
+	// Send the threads home and wait for them to leave
+	ft_run.stop = 1;
+	pthread_cond_broadcast(&ft_run_cond);
+	while (ft_run.num_workers > 0) {
+		pthread_cond_wait(&ft_run_cond, &ft_run_lock);
+	}
+	syslog(LOG_INFO, "fulltext: indexing threads finished (%d of %d messages)", ft_run.next, ft_run.num_msgs);
+	free(ft_run.msgs);
+	memset(&ft_run, 0, sizeof(struct ft_parallel_run));
+	ft_parallel_running = 0;
+	pthread_cond_broadcast(&ft_run_cond);
+	pthread_mutex_unlock(&ft_run_lock);
+	return(NULL);
+}
+
+
+// Start indexing the messages in ft_newmsgs on several threads.  Returns nonzero if they're off and running.
+static int ft_start_parallel(void) {
+	pthread_mutex_lock(&ft_run_lock);
+	memset(&ft_run, 0, sizeof(struct ft_parallel_run));
+	ft_run.msgs = ft_newmsgs;
+	ft_run.num_msgs = ft_num_msgs;
+	ft_run.newhighest = ft_newhighest;
+	ft_parallel_running = 1;
+	pthread_mutex_unlock(&ft_run_lock);
+
+	if (CtdlThreadCreate(ft_parallel_coordinator) != 0) {
+		pthread_mutex_lock(&ft_run_lock);
+		memset(&ft_run, 0, sizeof(struct ft_parallel_run));
+		ft_parallel_running = 0;
+		pthread_mutex_unlock(&ft_run_lock);
+		return(0);
+	}
+
+	// The message list belongs to the coordinator now
+	ft_newmsgs = NULL;
+	ft_num_msgs = 0;
+	ft_num_alloc = 0;
+	return(1);
+}
+
+
 // Begin the fulltext indexing process.
 void do_fulltext_indexing(void) {
-	int i;
+	int i, n;
 	static time_t last_progress = 0L;
 	static int is_running = 0;
+	time_t started;
 	if (is_running) return;         // Concurrency check - only one can run 
+	if (ft_parallel_running) return;	// the indexing threads are still at it
 	is_running = 1;
 
 	// Don't do this if the site doesn't have it enabled.
 	if (!CtdlGetConfigInt("c_enable_fulltext")) {
+		is_running = 0;
 		return;
 	}
 
@@ -214,29 +408,43 @@ void do_fulltext_indexing(void) {
 			CtdlGetConfigInt("MM_fulltext_wordbreaker"), FT_WORDBREAKER_ID
 		);
 		syslog(LOG_INFO, "fulltext: (re)initializing index");
+		ft_segment_discard();
+		ft_num_early = 0;
 		cdb_trunc(CDB_FULLTEXT);
 		CtdlSetConfigLong("MMfulltext", 0);
 	}
 	end_critical_section(S_CONTROL);
 
-	// Silently return if our fulltext index is up to date with new messages.
+	// If our fulltext index is up to date with new messages, just write out anything waiting in memory.
 	if ((CtdlGetConfigLong("MMfulltext") >= CtdlGetConfigLong("MMhighest"))) {
-		return;		// nothing to do!
+		ft_segment_merge();
+		is_running = 0;
+		return;
 	}
 
 	// Now go through each room and find messages to index.
+	started = time(NULL);
 	ft_newhighest = CtdlGetConfigLong("MMhighest");
 	CtdlForEachRoom(ft_index_room, NULL);	// load all msg pointers
 
 	if (ft_num_msgs > 0) {
 		qsort(ft_newmsgs, ft_num_msgs, sizeof(long), longcmp);
-		for (i=0; i<(ft_num_msgs-1); ++i) { // purge dups
-			if (ft_newmsgs[i] == ft_newmsgs[i+1]) {
-				memmove(&ft_newmsgs[i], &ft_newmsgs[i+1], ((ft_num_msgs - i - 1)*sizeof(long)));
-				--ft_num_msgs;
-				--i;
+		for (i=1, n=1; i<ft_num_msgs; ++i) { // purge dups
+			if (ft_newmsgs[i] != ft_newmsgs[n-1]) {
+				ft_newmsgs[n++] = ft_newmsgs[i];
 			}
 		}
+		ft_num_msgs = n;
+
+		// Skip the ones which were indexed when they were saved
+		ft_prune_early(CtdlGetConfigLong("MMfulltext"));
+		ft_num_msgs = ft_msgs_subtract(ft_newmsgs, ft_num_msgs, ft_early_msgs, ft_num_early);
+
+		// If there's a lot to do, do it on several threads (in the background, so housekeeping can carry on)
+		if ((ft_num_msgs >= FT_PARALLEL_MIN) && (CtdlGetConfigInt("c_ft_threads") > 1) && (ft_start_parallel())) {
+			is_running = 0;
+			return;
+		}
 
 		// Here it is ... do each message!
 		for (i=0; i<ft_num_msgs; ++i) {
@@ -246,6 +454,7 @@ void do_fulltext_indexing(void) {
 				last_progress = time(NULL);
 			}
 			ft_index_message(ft_newmsgs[i], 1);
+			ft_merge_if_full();
 
 			// Check to see if we need to quit early
 			if (server_shutting_down) {
@@ -254,9 +463,9 @@ void do_fulltext_indexing(void) {
 				break;
 			}
 
-			// Check to see if we have to maybe flush to disk
-			if (i >= FT_MAX_CACHE) {
-				syslog(LOG_DEBUG, "fulltext: time to flush.");
+			// Don't hold up the rest of the housekeeping for too long; we'll pick up here next time.
+			if ((time(NULL) - started) >= FT_MAX_RUN_TIME) {
+				syslog(LOG_DEBUG, "fulltext: indexed %d messages, continuing later", i + 1);
 				ft_newhighest = ft_newmsgs[i];
 				break;
 			}
@@ -275,11 +484,8 @@ void do_fulltext_indexing(void) {
 	}
 	
 	// Save our place so we don't have to do this again
-	ft_flush_cache();
-	begin_critical_section(S_CONTROL);
-	CtdlSetConfigLong("MMfulltext", ft_newhighest);
-	CtdlSetConfigInt("MM_fulltext_wordbreaker", FT_WORDBREAKER_ID);
-	end_critical_section(S_CONTROL);
+	ft_checkpoint(ft_newhighest);
+	ft_prune_early(ft_newhighest);
 
 	syslog(LOG_DEBUG, "fulltext: indexing finished");
 	is_running = 0;
@@ -287,72 +493,388 @@ void do_fulltext_indexing(void) {
 }
 
 
+// Called after a message is saved.  Queue it up so it can be searched for within seconds,
+// instead of waiting for the next batch.
+int ft_aftersave(struct CtdlMessage *msg, struct recptypes *recps) {
+	long msgnum;
+
+	if ((!CtdlGetConfigInt("c_enable_fulltext")) || (CM_IsEmpty(msg, eVltMsgNum))) {
+		return(0);
+	}
+	msgnum = atol(msg->cm_fields[eVltMsgNum]);
+	if (msgnum <= 0) {
+		return(0);
+	}
+
+	pthread_mutex_lock(&ft_saved_lock);
+	if (ft_num_saved >= ft_alloc_saved) {
+		ft_alloc_saved = (ft_alloc_saved > 0) ? (ft_alloc_saved * 2) : 64;
+		ft_saved_msgs = realloc(ft_saved_msgs, (ft_alloc_saved * sizeof(long)));
+	}
+	ft_saved_msgs[ft_num_saved++] = msgnum;
+	pthread_mutex_unlock(&ft_saved_lock);
+	return(0);
+}
+
+
+// Index the messages saved since the last time we looked (called from housekeeping)
+void ft_index_saved_messages(void) {
+	long *msgs;
+	int num_msgs;
+	int i;
+
+	if (ft_num_saved == 0) {			// unlocked peek; we'll be back in a second anyway
+		return;
+	}
+
+	pthread_mutex_lock(&ft_saved_lock);
+	msgs = ft_saved_msgs;
+	num_msgs = ft_num_saved;
+	ft_saved_msgs = NULL;
+	ft_num_saved = 0;
+	ft_alloc_saved = 0;
+	pthread_mutex_unlock(&ft_saved_lock);
+
+	// If the index is about to be rebuilt, the batch indexer will get these.
+	if (	(CtdlGetConfigInt("c_enable_fulltext"))
+		&& (CtdlGetConfigInt("MM_fulltext_wordbreaker") == FT_WORDBREAKER_ID)
+	) {
+		for (i=0; (i<num_msgs) && (!server_shutting_down); ++i) {
+			if (msgs[i] > CtdlGetConfigLong("MMfulltext")) {
+				ft_index_message(msgs[i], 1);
+				ft_add_early(msgs[i]);
+			}
+		}
+	}
+	free(msgs);
+}
+
+
+// Write out whatever is still in memory before the databases are closed
+void ft_shutdown(void) {
+	pthread_mutex_lock(&ft_run_lock);
+	while (ft_parallel_running) {			// the indexing threads stop when they see we're shutting down
+		pthread_cond_wait(&ft_run_cond, &ft_run_lock);
+	}
+	pthread_mutex_unlock(&ft_run_lock);
+	ft_segment_merge();
+}
+
+
+// One thing all the results of a search must contain: a word, or any of the words beginning with a prefix
+struct ft_term {
+	long count;			// how many messages have it (used to look at the rarest first)
+	struct cdbdata *postings;	// compressed posting list from disk, or...
+	long *msgs;			// ...an uncompressed one
+	int num_msgs;
+};
+
+
+// Reduce text to its words, lowercased and separated by single spaces, so phrases can be found with strstr()
+char *ft_normalize(const char *text) {
+	char *out;
+	const char *p;
+	int n = 0;
+
+	out = malloc(strlen(text) + 1);
+	for (p = text; *p; ++p) {
+		if (isalnum((unsigned char)*p)) {
+			out[n++] = tolower((unsigned char)*p);
+		}
+		else if ((n > 0) && (out[n-1] != ' ')) {
+			out[n++] = ' ';
+		}
+	}
+	if ((n > 0) && (out[n-1] == ' ')) {
+		--n;
+	}
+	out[n] = 0;
+	return(out);
+}
+
+
+// Get a word's posting list.  If the indexer has changes to it which haven't been written out yet,
+// it is decoded and they are applied.  Returns 0 if no message contains the word.
+int ft_get_term(const char *word, struct ft_term *t) {
+	long last;
+
+	memset(t, 0, sizeof(struct ft_term));
+
+	t->postings = cdb_fetch(CDB_FULLTEXT, word, strlen(word));
+	if (ft_segment_overlay(word, t->postings, &t->msgs, &t->num_msgs)) {
+		if (t->postings != NULL) {
+			cdb_free(t->postings);
+			t->postings = NULL;
+		}
+		t->count = t->num_msgs;
+	}
+	else if (t->postings != NULL) {
+		if (ft_postings_header(t->postings->ptr, t->postings->len, &t->count, &last) < 0) {
+			t->count = 0;
+		}
+	}
+	return(t->count > 0);
+}
+
+
+// Get the messages containing any word that begins with "prefix" (which must be at least WB_MIN characters).
+// Returns 0 if there aren't any.
+int ft_get_prefix_term(const char *prefix, struct ft_term *t) {
+	char key[WB_MIN + 1];
+	int keylen;
+	struct cdbdata *cdb_dict;
+	StrBuf *dict;
+	StrBuf *word;
+	const char *pos = NULL;
+	struct ft_term wt;
+	int alloc = 0;
+	int i, n;
+
+	memset(t, 0, sizeof(struct ft_term));
+	if (strlen(prefix) < WB_MIN) {
+		return(0);
+	}
+	keylen = ft_dict_key(key, prefix);
+	cdb_dict = cdb_fetch(CDB_FULLTEXT, key, keylen);
+	if (cdb_dict == NULL) {
+		return(0);
+	}
+	dict = NewStrBufPlain(cdb_dict->ptr, cdb_dict->len);
+	cdb_free(cdb_dict);
+
+	word = NewStrBuf();
+	while (StrBufExtract_NextToken(word, dict, &pos, ' ') >= 0) {
+		if (strncmp(ChrPtr(word), prefix, strlen(prefix))) {
+			continue;
+		}
+		if (ft_get_term(ChrPtr(word), &wt)) {
+			if (wt.postings != NULL) {
+				wt.msgs = ft_postings_decode(wt.postings->ptr, wt.postings->len, &wt.num_msgs);
+			}
+
+			// add them to what we have so far
+			if (t->num_msgs + wt.num_msgs > alloc) {
+				alloc = (t->num_msgs + wt.num_msgs) * 2;
+				t->msgs = realloc(t->msgs, sizeof(long) * alloc);
+			}
+			memcpy(&t->msgs[t->num_msgs], wt.msgs, sizeof(long) * wt.num_msgs);
+			t->num_msgs += wt.num_msgs;
+		}
+		if (wt.postings != NULL) cdb_free(wt.postings);	// there may be one even if no message has the word
+		if (wt.msgs != NULL) free(wt.msgs);
+	}
+	FreeStrBuf(&word);
+	FreeStrBuf(&dict);
+
+	// sort the union and take out the duplicates
+	if (t->num_msgs > 1) {
+		qsort(t->msgs, t->num_msgs, sizeof(long), longcmp);
+		for (i=1, n=1; i<t->num_msgs; ++i) {
+			if (t->msgs[i] != t->msgs[n-1]) {
+				t->msgs[n++] = t->msgs[i];
+			}
+		}
+		t->num_msgs = n;
+	}
+
+	t->count = t->num_msgs;
+	return(t->count > 0);
+}
+
+
+static int termcmp(const void *rec1, const void *rec2) {
+	const struct ft_term *t1 = rec1;
+	const struct ft_term *t2 = rec2;
+
+	if (t1->count > t2->count) return(1);
+	if (t1->count < t2->count) return(-1);
+	return(0);
+}
+
+
+// Returns nonzero if a message contains a phrase (already run through ft_normalize())
+int ft_msg_contains_phrase(long msgnum, const char *phrase) {
+	struct CtdlMessage *msg;
+	char *txt;
+	char *normalized;
+	int found;
+
+	msg = CtdlFetchMessage(msgnum, 1);
+	if (msg == NULL) {
+		return(0);
+	}
+	txt = ft_message_text(msg);
+	if (txt == NULL) {
+		return(0);
+	}
+	normalized = ft_normalize(txt);
+	free(txt);
+	found = (strstr(normalized, phrase) != NULL);
+	free(normalized);
+	return(found);
+}
+
+
 // API call to perform searches.
-// (This one does the "all of these words" search.)
+// This does an "all of these words" search.  A word ending in "*" matches any word beginning with what
+// comes before it, and words in double quotes have to appear together as a phrase.
 // Caller is responsible for freeing the message list.
 void ft_search(int *fts_num_msgs, long **fts_msgs, const char *search_string) {
+	int num_words = 0;
+	int alloc_words = 0;
+	ft_token *words = NULL;
 	int num_tokens = 0;
-	int *tokens = NULL;
-	int i, j;
-	struct cdbdata *cdb_bucket;
-	int num_all_msgs = 0;
-	long *all_msgs = NULL;
+	ft_token *tokens = NULL;
+	int num_prefixes = 0;
+	ft_token *prefixes = NULL;
+	int num_phrases = 0;
+	char **phrases = NULL;
+	int num_terms = 0;
+	struct ft_term *terms = NULL;
 	int num_ret_msgs = 0;
-	int num_ret_alloc = 0;
 	long *ret_msgs = NULL;
-	int tok;
+	char chunk[SIZ];
+	const char *p;
+	const char *chunk_end;
+	int len;
+	int i, j;
+	int nothing = 0;
+
+	// Break the search string into words, prefixes, and phrases
+	p = search_string;
+	while (*p) {
+		while ((*p) && (isspace((unsigned char)*p))) ++p;
+		if (*p == 0) break;
+
+		if (*p == '"') {
+			++p;
+			chunk_end = strchr(p, '"');
+			if (chunk_end == NULL) chunk_end = p + strlen(p);
+		}
+		else {
+			for (chunk_end = p; (*chunk_end) && (!isspace((unsigned char)*chunk_end)); ++chunk_end) ;
+		}
+		len = chunk_end - p;
+		if (len >= sizeof chunk) len = sizeof chunk - 1;
+		memcpy(chunk, p, len);
+		chunk[len] = 0;
+		p = (*chunk_end == '"') ? chunk_end + 1 : chunk_end;
+
+		// A prefix search?  Anything shorter than a whole word (a bare "*", say) would match most of the
+		// index, so that isn't allowed, and nothing is found.
+		if ((len > 0) && (chunk[len-1] == '*')) {
+			if (len <= WB_MIN) {
+				syslog(LOG_DEBUG, "fulltext: prefix \"%s\" is too short", chunk);
+				nothing = 1;
+				break;
+			}
+			chunk[--len] = 0;
+			for (i=0; (i<len) && (isalnum((unsigned char)chunk[i])); ++i) {
+				chunk[i] = tolower((unsigned char)chunk[i]);
+			}
+			if ((i == len) && (len <= WB_MAX)) {
+				prefixes = realloc(prefixes, sizeof(ft_token) * (num_prefixes + 1));
+				memcpy(prefixes[num_prefixes++], chunk, len + 1);
+				continue;
+			}
+		}
 
-	wordbreaker(search_string, &num_tokens, &tokens);
-	if (num_tokens > 0) {
-		for (i=0; i<num_tokens; ++i) {
-
-			// search for tokens[i]
-			tok = tokens[i];
-
-			// fetch the bucket, Liza
-			if (ftc_msgs[tok] == NULL) {
-				cdb_bucket = cdb_fetch(CDB_FULLTEXT, &tok, sizeof(int));
-				if (cdb_bucket != NULL) {
-					ftc_num_msgs[tok] = cdb_bucket->len / sizeof(long);
-					ftc_msgs[tok] = (long *)cdb_bucket->ptr;
-					cdb_bucket->ptr = NULL;
-					cdb_free(cdb_bucket);
-				}
-				else {
-					ftc_num_msgs[tok] = 0;
-					ftc_msgs[tok] = malloc(sizeof(long));
-				}
+		// The words in it must all be present.  If it's a phrase, they must be together, too.
+		wordbreaker(chunk, &num_tokens, &tokens);
+		if (num_tokens > 0) {
+			if (num_words + num_tokens > alloc_words) {
+				alloc_words = num_words + num_tokens + 16;
+				words = realloc(words, sizeof(ft_token) * alloc_words);
 			}
+			memcpy(&words[num_words], tokens, sizeof(ft_token) * num_tokens);
+			num_words += num_tokens;
+			free(tokens);
 
-			num_all_msgs += ftc_num_msgs[tok];
-			if (num_all_msgs > 0) {
-				all_msgs = realloc(all_msgs, num_all_msgs*sizeof(long) );
-				memcpy(&all_msgs[num_all_msgs-ftc_num_msgs[tok]], ftc_msgs[tok], ftc_num_msgs[tok]*sizeof(long) );
+			if (strchr(chunk, ' ') != NULL) {
+				phrases = realloc(phrases, sizeof(char *) * (num_phrases + 1));
+				phrases[num_phrases++] = ft_normalize(chunk);
 			}
+		}
+	}
 
+	if (num_words > 1) {
+		qsort(words, num_words, sizeof(ft_token), tokcmp);
+		for (i=1, j=1; i<num_words; ++i) {
+			if (strcmp(words[i], words[j-1])) {
+				memcpy(words[j++], words[i], sizeof(ft_token));
+			}
 		}
-		free(tokens);
-		if (all_msgs != NULL) {
-			qsort(all_msgs, num_all_msgs, sizeof(long), longcmp);
-
-			// At this point, if a message appears num_tokens times in the
-			// list, then it contains all of the search tokens.
-			if (num_all_msgs >= num_tokens)
-				for (j=0; j<(num_all_msgs-num_tokens+1); ++j) {
-					if (all_msgs[j] == all_msgs[j+num_tokens-1]) {
-						++num_ret_msgs;
-						if (num_ret_msgs > num_ret_alloc) {
-							num_ret_alloc += 64;
-							ret_msgs = realloc(ret_msgs, (num_ret_alloc*sizeof(long)) );
-						}
-						ret_msgs[num_ret_msgs - 1] = all_msgs[j];
-						
-					}
+		num_words = j;
+	}
+
+	// Look up everything.  If any of it isn't in the index, there are no results.
+	if (num_words + num_prefixes > 0) {
+		terms = malloc(sizeof(struct ft_term) * (num_words + num_prefixes));
+	}
+	for (i=0; (i<num_words) && (!nothing); ++i) {
+		if (!ft_get_term(words[i], &terms[num_terms++])) {
+			nothing = 1;
+		}
+	}
+	for (i=0; (i<num_prefixes) && (!nothing); ++i) {
+		if (!ft_get_prefix_term(prefixes[i], &terms[num_terms++])) {
+			nothing = 1;
+		}
+	}
+
+	// Intersect the lists, starting with the shortest, so each step has as little to look at as possible
+	if ((num_terms > 0) && (!nothing)) {
+		qsort(terms, num_terms, sizeof(struct ft_term), termcmp);
+		if (terms[0].postings != NULL) {
+			ret_msgs = ft_postings_decode(terms[0].postings->ptr, terms[0].postings->len, &num_ret_msgs);
+		}
+		else {
+			ret_msgs = terms[0].msgs;
+			num_ret_msgs = terms[0].num_msgs;
+			terms[0].msgs = NULL;
+		}
+		for (i=1; (i<num_terms) && (num_ret_msgs > 0); ++i) {
+			if (terms[i].postings != NULL) {
+				num_ret_msgs = ft_postings_intersect(terms[i].postings->ptr, terms[i].postings->len, ret_msgs, num_ret_msgs);
+			}
+			else {
+				num_ret_msgs = msglist_intersect(ret_msgs, ret_msgs, num_ret_msgs, terms[i].msgs, terms[i].num_msgs);
+			}
+		}
+	}
+
+	// Phrases have to be checked against the messages themselves
+	if (num_phrases > 0) {
+		for (i=0, j=0; i<num_ret_msgs; ++i) {
+			int k;
+			for (k=0; k<num_phrases; ++k) {
+				if (!ft_msg_contains_phrase(ret_msgs[i], phrases[k])) {
+					break;
 				}
-			free(all_msgs);
+			}
+			if (k == num_phrases) {
+				ret_msgs[j++] = ret_msgs[i];
+			}
 		}
+		num_ret_msgs = j;
 	}
 
+	for (i=0; i<num_terms; ++i) {
+		if (terms[i].postings != NULL) cdb_free(terms[i].postings);
+		if (terms[i].msgs != NULL) free(terms[i].msgs);
+	}
+	for (i=0; i<num_phrases; ++i) {
+		free(phrases[i]);
+	}
+	if (terms != NULL) free(terms);
+	if (phrases != NULL) free(phrases);
+	if (prefixes != NULL) free(prefixes);
+	if (words != NULL) free(words);
+
+	if ((num_ret_msgs == 0) && (ret_msgs != NULL)) {
+		free(ret_msgs);
+		ret_msgs = NULL;
+	}
 	*fts_num_msgs = num_ret_msgs;
 	*fts_msgs = ret_msgs;
 }
@@ -387,13 +909,6 @@ void cmd_srch(char *argbuf) {
 }
 
 
-// Zero out our index cache.
-void initialize_ft_cache(void) {
-	memset(ftc_num_msgs, 0, (65536 * sizeof(int)));
-	memset(ftc_msgs, 0, (65536 * sizeof(long *)));
-}
-
-
 void ft_delete_remove(char *room, long msgnum) {
 	if (room) return;
 	
@@ -407,11 +922,14 @@ void ft_delete_remove(char *room, long msgnum) {
 // Initialization function, called from modules_init.c
 char *ctdl_module_init_fulltext(void) {
 	if (!threading) {
-		initialize_ft_cache();
 		CtdlRegisterProtoHook(cmd_srch, "SRCH", "Full text search");
 		CtdlRegisterDeleteHook(ft_delete_remove);
 		CtdlRegisterSearchFuncHook(ft_search, "fulltext");
+		CtdlRegisterMessageHook(ft_aftersave, EVT_AFTERSAVE);
+		CtdlRegisterSessionHook(ft_index_saved_messages, EVT_HOUSE, PRIO_HOUSE + 20);
+		CtdlRegisterSessionHook(ft_merge_if_full, EVT_HOUSE, PRIO_HOUSE + 21);
 		CtdlRegisterSessionHook(do_fulltext_indexing, EVT_TIMER, PRIO_CLEANUP + 300);
+		CtdlRegisterSessionHook(ft_shutdown, EVT_SHUTDOWN, PRIO_SHUTDOWN + 60);
 	}
 	// return our module name for the log
 	return "fulltext";
@@ -0,0 +1,504 @@
+// IMAP CONDSTORE and QRESYNC (RFC 7162)
+//
+// A client which remembers the highest modification sequence it saw in a folder can come back and ask for
+// only the flags which changed since then (FETCH ... (CHANGEDSINCE n)), and with QRESYNC, which messages went
+// away (VANISHED), without having to fetch the flags of the whole folder again.  The numbers themselves are
+// kept by the core (see modseq.c); this is just the protocol.
+//
+// Only \Seen and \Answered are kept from one session to the next, so those are the only flags which get a
+// modification sequence.  \Deleted doesn't outlive the command that sets it, because we always expunge.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "../../sysdep.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <limits.h>
+#include <libcitadel.h>
+#include "../../citadel_defs.h"
+#include "../../server.h"
+#include "../../citserver.h"
+#include "../../support.h"
+#include "../../config.h"
+#include "../../context.h"
+#include "../../modseq.h"
+#include "serv_imap.h"
+#include "imap_tools.h"
+#include "imap_fetch.h"
+#include "imap_condstore.h"
+#include "../../ctdl_module.h"
+
+struct uid_range {
+	long lo;
+	long hi;
+};
+
+
+// Implements the ENABLE command (RFC 5161).  The only things we know how to enable are CONDSTORE and QRESYNC.
+void imap_enable(int num_parms, ConstStr *Params) {
+	citimap *Imap = IMAP;
+	StrBuf *enabled = NewStrBuf();
+	int i;
+
+	for (i = 2; i < num_parms; ++i) {
+		if ((!strcasecmp(Params[i].Key, "CONDSTORE")) && (!Imap->condstore)) {
+			Imap->condstore = 1;
+			StrBufAppendBufPlain(enabled, HKEY(" CONDSTORE"), 0);
+		}
+		else if ((!strcasecmp(Params[i].Key, "QRESYNC")) && (!Imap->qresync)) {
+			Imap->qresync = 1;
+			Imap->condstore = 1;		// QRESYNC implies CONDSTORE
+			StrBufAppendBufPlain(enabled, HKEY(" QRESYNC"), 0);
+		}
+	}
+
+	IAPrintf("* ENABLED%s\r\n", ChrPtr(enabled));
+	FreeStrBuf(&enabled);
+	IReply("OK ENABLE completed");
+}
+
+
+// The modification sequence of the message at index i (not sequence number) in the selected folder.  The
+// room's log of arrivals and the log of this user's flag changes are loaded the first time they're needed
+// during a command, and kept until imap_forget_modseqs() is called at the end of it.
+long imap_msg_modseq(int i) {
+	citimap *Imap = IMAP;
+
+	if (Imap->flaglog == NULL) {
+		Imap->flaglog = CtdlGetModseqLog(CC->room.QRnumber, CC->user.usernum);
+		Imap->arrivals = CtdlGetModseqLog(CC->room.QRnumber, MODSEQ_ARRIVALS);
+	}
+	return(CtdlMsgModseq(Imap->flaglog, Imap->arrivals, Imap->msgids[i]));
+}
+
+
+void imap_forget_modseqs(void) {
+	CtdlFreeModseqLog(&IMAP->flaglog);
+	CtdlFreeModseqLog(&IMAP->arrivals);
+}
+
+
+// The MODSEQ fetch item.  Asking for it turns CONDSTORE on.
+void imap_fetch_modseq(int i) {
+	IMAP->condstore = 1;
+	IAPrintf("MODSEQ (%ld)", imap_msg_modseq(i));
+}
+
+
+// Tell the client that the flags of the message at index i have changed (or, if flags_too is 0, just its
+// modification sequence, which a client using CONDSTORE wants to know even after a STORE .SILENT)
+void imap_flags_changed(int i, int flags_too) {
+	citimap *Imap = IMAP;
+
+	IAPrintf("* %d FETCH (", i + 1);
+	if (flags_too) {
+		imap_fetch_flags(i);
+	}
+	if (Imap->condstore) {
+		IAPrintf("%sMODSEQ (%ld)", (flags_too ? " " : ""), imap_msg_modseq(i));
+	}
+	IAPuts(")\r\n");
+}
+
+
+static void append_uid_range(StrBuf *out, long lo, long hi) {
+	if (StrLength(out) > 0) {
+		StrBufAppendBufPlain(out, HKEY(","), 0);
+	}
+	if (lo == hi) {
+		StrBufAppendPrintf(out, "%ld", lo);
+	}
+	else {
+		StrBufAppendPrintf(out, "%ld:%ld", lo, hi);
+	}
+}
+
+
+// Write a sorted array of UIDs as an IMAP sequence set, with runs of consecutive ones as ranges
+void imap_append_uidset(StrBuf *out, long *uids, int num_uids) {
+	int i, j;
+
+	for (i = 0; i < num_uids; i = j + 1) {
+		for (j = i; (j + 1 < num_uids) && (uids[j + 1] == uids[j] + 1); ++j) ;
+		append_uid_range(out, uids[i], uids[j]);
+	}
+}
+
+
+// Break out an IMAP sequence set of UIDs.  A "*" means maxuid.  The caller must free() the ranges.
+static int parse_uidset(const char *uidset, long maxuid, struct uid_range **ranges) {
+	char setstr[SIZ], lostr[SIZ], histr[SIZ];
+	int num_sets;
+	long swap;
+	int s;
+
+	num_sets = num_tokens(uidset, ',');
+	*ranges = malloc((num_sets + 1) * sizeof(struct uid_range));
+	for (s = 0; s < num_sets; ++s) {
+		extract_token(setstr, uidset, s, ',', sizeof setstr);
+		extract_token(lostr, setstr, 0, ':', sizeof lostr);
+		if (num_tokens(setstr, ':') >= 2) {
+			extract_token(histr, setstr, 1, ':', sizeof histr);
+		}
+		else {
+			safestrncpy(histr, lostr, sizeof histr);
+		}
+		(*ranges)[s].lo = (!strcmp(lostr, "*")) ? maxuid : atol(lostr);
+		(*ranges)[s].hi = (!strcmp(histr, "*")) ? maxuid : atol(histr);
+		if ((*ranges)[s].lo > (*ranges)[s].hi) {
+			swap = (*ranges)[s].lo;
+			(*ranges)[s].lo = (*ranges)[s].hi;
+			(*ranges)[s].hi = swap;
+		}
+	}
+	return(num_sets);
+}
+
+
+static int uid_in_ranges(long uid, struct uid_range *ranges, int num_ranges) {
+	int s;
+
+	for (s = 0; s < num_ranges; ++s) {
+		if ((uid >= ranges[s].lo) && (uid <= ranges[s].hi)) {
+			return(1);
+		}
+	}
+	return(0);
+}
+
+
+// Index of the first message in the selected folder whose UID is at least uid
+static int first_msg_from(long uid) {
+	citimap *Imap = IMAP;
+	int lo = 0;
+	int hi = Imap->num_msgs;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (Imap->msgids[mid] < uid) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return(lo);
+}
+
+
+// Put the words of a parenthesized list, which imap_parameterize() has spread over the tokens first..last,
+// back together with the parentheses taken out
+static StrBuf *modifier_words(int first, int last) {
+	citimap_command *Cmd = &IMAP->Cmd;
+	StrBuf *words = NewStrBuf();
+	const char *pch;
+	int i;
+
+	for (i = first; i <= last; ++i) {
+		StrBufAppendBufPlain(words, Cmd->Params[i].Key, Cmd->Params[i].len, 0);
+		StrBufAppendBufPlain(words, HKEY(" "), 0);
+	}
+	for (pch = ChrPtr(words); *pch != '\0'; ++pch) {
+		if ((*pch == '(') || (*pch == ')')) {
+			StrBufPeek(words, pch, 0, ' ');
+		}
+	}
+	return(words);
+}
+
+
+// Index of the token in which the parenthesized list starting at token first is closed
+static int end_of_list(int first) {
+	citimap_command *Cmd = &IMAP->Cmd;
+	int nest = 0;
+	int i;
+	long j;
+
+	for (i = first; i < Cmd->num_parms; ++i) {
+		for (j = 0; j < Cmd->Params[i].len; ++j) {
+			if ((Cmd->Params[i].Key[j] == '(') || (Cmd->Params[i].Key[j] == '[')) {
+				++nest;
+			}
+			else if ((Cmd->Params[i].Key[j] == ')') || (Cmd->Params[i].Key[j] == ']')) {
+				--nest;
+			}
+		}
+		if (nest <= 0) {
+			return(i);
+		}
+	}
+	return(Cmd->num_parms - 1);
+}
+
+
+// FETCH and UID FETCH may have a list of modifiers after the data items (RFC 4466), and the data items may
+// themselves be a parenthesized list, starting at token first.  We know CHANGEDSINCE and VANISHED.  The
+// modifiers are taken off the end of the command so the data items can be parsed the usual way.
+// Returns 0 if all is well, or -1 if there's a modifier we don't understand.
+int imap_fetch_modifiers(int first, long *changedsince, int *vanished) {
+	citimap_command *Cmd = &IMAP->Cmd;
+	StrBuf *words;
+	char *word;
+	char *saveptr = NULL;
+	int last_item;
+	int retval = 0;
+
+	*changedsince = 0;
+	*vanished = 0;
+
+	last_item = end_of_list(first);
+	if (last_item + 1 >= Cmd->num_parms) {
+		return(0);					// no modifiers
+	}
+
+	words = modifier_words(last_item + 1, Cmd->num_parms - 1);
+	Cmd->num_parms = last_item + 1;
+
+	word = strtok_r((char *)ChrPtr(words), " ", &saveptr);
+	while ((word != NULL) && (retval == 0)) {
+		if (!strcasecmp(word, "CHANGEDSINCE")) {
+			word = strtok_r(NULL, " ", &saveptr);
+			*changedsince = (word != NULL) ? atol(word) : 0;
+			if (*changedsince < 1) {
+				retval = -1;
+			}
+		}
+		else if (!strcasecmp(word, "VANISHED")) {
+			*vanished = 1;
+		}
+		else {
+			retval = -1;
+		}
+		word = strtok_r(NULL, " ", &saveptr);
+	}
+
+	FreeStrBuf(&words);
+	if (*changedsince > 0) {
+		IMAP->condstore = 1;
+	}
+	return(retval);
+}
+
+
+// CHANGEDSINCE implies the MODSEQ data item
+void imap_fetch_add_modseq(citimap_command *Cmd) {
+	int i;
+
+	for (i = 0; i < Cmd->num_parms; ++i) {
+		if (!strcasecmp(Cmd->Params[i].Key, "MODSEQ")) {
+			return;
+		}
+	}
+	if (Cmd->num_parms + 1 >= Cmd->avail_parms) {
+		CmdAdjust(Cmd, Cmd->avail_parms + 1, 1);
+	}
+	Cmd->Params[Cmd->num_parms++] = (ConstStr){HKEY("MODSEQ")};
+}
+
+
+// Leave out of a fetch the messages which haven't changed since the supplied modification sequence
+void imap_changedsince(long changedsince) {
+	citimap *Imap = IMAP;
+	int i;
+
+	for (i = 0; i < Imap->num_msgs; ++i) {
+		if ((Imap->flags[i] & IMAP_SELECTED) && (imap_msg_modseq(i) <= changedsince)) {
+			Imap->flags[i] &= ~IMAP_SELECTED;
+		}
+	}
+}
+
+
+// Tell the client which of the UIDs in a set have gone away since the supplied modification sequence.  If the
+// room's log doesn't go back that far, we have to say that every UID in the set which isn't here any more has
+// gone away, which is what the client would otherwise have had to work out for itself.
+void imap_vanished_earlier(const char *uidset, long since) {
+	citimap *Imap = IMAP;
+	struct uid_range *ranges = NULL;
+	int num_ranges;
+	long *uids = NULL;
+	int num_uids;
+	int num_gone = 0;
+	StrBuf *out;
+	long lo;
+	int i, s;
+
+	out = NewStrBuf();
+	num_ranges = parse_uidset(uidset, CtdlGetConfigLong("MMhighest"), &ranges);
+	num_uids = CtdlModseqVanished(CC->room.QRnumber, since, &uids);
+
+	if (num_uids >= 0) {
+		// A message which was deleted may have been put back since (it's the same message number)
+		for (i = 0; i < num_uids; ++i) {
+			if (uid_in_ranges(uids[i], ranges, num_ranges)) {
+				s = first_msg_from(uids[i]);
+				if ((s >= Imap->num_msgs) || (Imap->msgids[s] != uids[i])) {
+					uids[num_gone++] = uids[i];
+				}
+			}
+		}
+		imap_append_uidset(out, uids, num_gone);
+	}
+	else {
+		for (s = 0; s < num_ranges; ++s) {
+			lo = ranges[s].lo;
+			for (i = first_msg_from(lo); (i < Imap->num_msgs) && (Imap->msgids[i] <= ranges[s].hi); ++i) {
+				if (Imap->msgids[i] > lo) {
+					append_uid_range(out, lo, Imap->msgids[i] - 1);
+				}
+				lo = Imap->msgids[i] + 1;
+			}
+			if (lo <= ranges[s].hi) {
+				append_uid_range(out, lo, ranges[s].hi);
+			}
+		}
+	}
+
+	if (StrLength(out) > 0) {
+		IAPrintf("* VANISHED (EARLIER) %s\r\n", ChrPtr(out));
+	}
+	FreeStrBuf(&out);
+	if (uids != NULL) {
+		free(uids);
+	}
+	free(ranges);
+}
+
+
+// STORE and UID STORE may have a list of modifiers (RFC 4466) before the flags, at token *first.  We know
+// UNCHANGEDSINCE.  On return, *first is the token after them.  *unchangedsince is left at -1 if it wasn't
+// there.  Returns 0 if all is well, or -1 if there's a modifier we don't understand.
+int imap_store_modifiers(int *first, long *unchangedsince) {
+	citimap_command *Cmd = &IMAP->Cmd;
+	StrBuf *words;
+	char *word;
+	char *saveptr = NULL;
+	int last;
+	int retval = 0;
+
+	*unchangedsince = (-1L);
+	if ((*first >= Cmd->num_parms) || (Cmd->Params[*first].Key[0] != '(')) {
+		return(0);
+	}
+
+	last = end_of_list(*first);
+	words = modifier_words(*first, last);
+	*first = last + 1;
+
+	word = strtok_r((char *)ChrPtr(words), " ", &saveptr);
+	while ((word != NULL) && (retval == 0)) {
+		if (!strcasecmp(word, "UNCHANGEDSINCE")) {
+			word = strtok_r(NULL, " ", &saveptr);
+			if ((word == NULL) || (!isdigit(word[0]))) {
+				retval = -1;
+			}
+			else {
+				*unchangedsince = atol(word);
+				IMAP->condstore = 1;
+			}
+		}
+		else {
+			retval = -1;
+		}
+		word = strtok_r(NULL, " ", &saveptr);
+	}
+
+	FreeStrBuf(&words);
+	return(retval);
+}
+
+
+// Leave out of a STORE the messages which have changed since the supplied modification sequence, and list them
+// (by UID or by sequence number, according to the command) for the MODIFIED response code
+void imap_unchangedsince(long unchangedsince, int is_uid, StrBuf *modified) {
+	citimap *Imap = IMAP;
+	long n;
+	int i;
+
+	for (i = 0; i < Imap->num_msgs; ++i) {
+		if ((Imap->flags[i] & IMAP_SELECTED) && (imap_msg_modseq(i) > unchangedsince)) {
+			Imap->flags[i] &= ~IMAP_SELECTED;
+			n = (is_uid ? Imap->msgids[i] : (i + 1));
+			append_uid_range(modified, n, n);
+		}
+	}
+}
+
+
+// SELECT and EXAMINE may have a list of parameters after the mailbox name: (CONDSTORE), or
+// (QRESYNC (uidvalidity modseq [known-uids [seq-match-data]])).  For QRESYNC, *resync_modseq is set to the
+// modification sequence the client last saw, or left at 0 if what the client knows is no good to us, and
+// *known_uids to the UIDs it knows about, if it said.  Returns 0 if all is well, or -1 if the parameters
+// make no sense.
+int imap_select_modifiers(long *resync_modseq, StrBuf **known_uids) {
+	citimap *Imap = IMAP;
+	StrBuf *words;
+	char *word;
+	char *saveptr = NULL;
+	long uidvalidity;
+	int retval = 0;
+
+	*resync_modseq = 0;
+	*known_uids = NULL;
+	if (Imap->Cmd.num_parms <= 3) {
+		return(0);
+	}
+
+	words = modifier_words(3, Imap->Cmd.num_parms - 1);
+	word = strtok_r((char *)ChrPtr(words), " ", &saveptr);
+	if ((word != NULL) && (!strcasecmp(word, "CONDSTORE"))) {
+		Imap->condstore = 1;
+	}
+	else if ((word != NULL) && (!strcasecmp(word, "QRESYNC")) && (Imap->qresync)) {
+		word = strtok_r(NULL, " ", &saveptr);
+		uidvalidity = (word != NULL) ? atol(word) : 0;
+		word = strtok_r(NULL, " ", &saveptr);
+		*resync_modseq = (word != NULL) ? atol(word) : 0;
+		if ((uidvalidity < 1) || (*resync_modseq < 1)) {
+			retval = -1;
+		}
+		if (uidvalidity != GLOBAL_UIDVALIDITY_VALUE) {
+			*resync_modseq = 0;		// it'll have to start over
+		}
+
+		// The known UIDs are optional.  The sequence match data after them is only there to help a
+		// server which doesn't remember what it expunged, so we don't need it.
+		word = strtok_r(NULL, " ", &saveptr);
+		if ((word != NULL) && (imap_is_message_set(word))) {
+			*known_uids = NewStrBufPlain(word, -1);
+		}
+	}
+	else {
+		retval = -1;
+	}
+
+	FreeStrBuf(&words);
+	return(retval);
+}
+
+
+// Bring a reconnecting QRESYNC client up to date: which messages it knew about have gone away, and the flags
+// of every message which changed (or arrived) since it last looked
+void imap_select_resync(long modseq, const char *known_uids) {
+	citimap *Imap = IMAP;
+	long msg_modseq;
+	int i;
+
+	imap_vanished_earlier(((known_uids != NULL) ? known_uids : "1:*"), modseq);
+
+	for (i = 0; i < Imap->num_msgs; ++i) {
+		msg_modseq = imap_msg_modseq(i);
+		if (msg_modseq > modseq) {
+			IAPrintf("* %d FETCH (UID %ld ", i + 1, Imap->msgids[i]);
+			imap_fetch_flags(i);
+			IAPrintf(" MODSEQ (%ld))\r\n", msg_modseq);
+		}
+	}
+}
@@ -0,0 +1,21 @@
+// IMAP CONDSTORE and QRESYNC (RFC 7162)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+void imap_enable(int num_parms, ConstStr *Params);
+long imap_msg_modseq(int i);
+void imap_forget_modseqs(void);
+void imap_fetch_modseq(int i);
+void imap_flags_changed(int i, int flags_too);
+void imap_append_uidset(StrBuf *out, long *uids, int num_uids);
+int imap_fetch_modifiers(int first, long *changedsince, int *vanished);
+void imap_fetch_add_modseq(citimap_command *Cmd);
+void imap_changedsince(long changedsince);
+void imap_vanished_earlier(const char *uidset, long since);
+int imap_store_modifiers(int *first, long *unchangedsince);
+void imap_unchangedsince(long unchangedsince, int is_uid, StrBuf *modified);
+int imap_select_modifiers(long *resync_modseq, StrBuf **known_uids);
+void imap_select_resync(long modseq, const char *known_uids);
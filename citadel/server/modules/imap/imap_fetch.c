@@ -44,7 +44,9 @@
 #include "serv_imap.h"
 #include "imap_tools.h"
 #include "imap_fetch.h"
+#include "imap_condstore.h"
 #include "../../genstamp.h"
+#include "../../overview.h"
 #include "../../ctdl_module.h"
 
 
@@ -90,15 +92,19 @@ void imap_fetch_flags(int seq)
 }
 
 
-void imap_fetch_internaldate(struct CtdlMessage *msg) {
+/*
+ * The date comes from the message's overview record, so this doesn't have to load the message.
+ */
+void imap_fetch_internaldate(long msgnum) {
 	char datebuf[64];
-	time_t msgdate;
-
-	if (!msg) return;
-	if (!CM_IsEmpty(msg, eTimestamp)) {
-		msgdate = atol(msg->cm_fields[eTimestamp]);
-	}
-	else {
+	time_t msgdate = 0;
+	struct msg_overview *ov;
+
+	ov = GetOverview(msgnum);
+	if (ov == NULL) return;
+	msgdate = ov->date;
+	free(ov);
+	if (msgdate == 0) {
 		msgdate = time(NULL);
 	}
 
@@ -1018,6 +1024,9 @@ void imap_do_fetch_msg(int seq, citimap_command *Cmd) {
 		else if (!strcasecmp(Cmd->Params[i].Key, "FLAGS")) {
 			imap_fetch_flags(seq-1);
 		}
+		else if (!strcasecmp(Cmd->Params[i].Key, "MODSEQ")) {
+			imap_fetch_modseq(seq-1);
+		}
 
 		/* Potentially fetchable from cache, if the client requests
 		 * stuff from the same message several times in a row.
@@ -1065,11 +1074,7 @@ void imap_do_fetch_msg(int seq, citimap_command *Cmd) {
 			imap_fetch_envelope(msg);
 		}
 		else if (!strcasecmp(Cmd->Params[i].Key, "INTERNALDATE")) {
-			if (msg == NULL) {
-				msg = CtdlFetchMessage(Imap->msgids[seq-1], 0);
-				body_loaded = 0;
-			}
-			imap_fetch_internaldate(msg);
+			imap_fetch_internaldate(Imap->msgids[seq-1]);
 		}
 
 		if (i != Cmd->num_parms-1) IAPuts(" ");
@@ -1380,12 +1385,20 @@ void imap_pick_range(const char *supplied_range, int is_uid) {
 void imap_fetch(int num_parms, ConstStr *Params) {
 	citimap_command Cmd;
 	int num_items;
+	long changedsince;
+	int vanished;
 	
 	if (num_parms < 4) {
 		IReply("BAD invalid parameters");
 		return;
 	}
 
+	/* VANISHED only makes sense with UIDs */
+	if ((imap_fetch_modifiers(3, &changedsince, &vanished) != 0) || (vanished)) {
+		IReply("BAD invalid FETCH modifiers");
+		return;
+	}
+
 	imap_pick_range(Params[2].Key, 0);
 
 	memset(&Cmd, 0, sizeof(citimap_command));
@@ -1400,6 +1413,11 @@ void imap_fetch(int num_parms, ConstStr *Params) {
 		return;
 	}
 
+	if (changedsince > 0) {
+		imap_changedsince(changedsince);
+		imap_fetch_add_modseq(&Cmd);
+	}
+
 	imap_do_fetch(&Cmd);
 	IReply("OK FETCH completed");
 	FreeStrBuf(&Cmd.CmdBuf);
@@ -1414,12 +1432,22 @@ void imap_uidfetch(int num_parms, ConstStr *Params) {
 	int num_items;
 	int i;
 	int have_uid_item = 0;
+	long changedsince;
+	int vanished;
 
 	if (num_parms < 5) {
 		IReply("BAD invalid parameters");
 		return;
 	}
 
+	/* VANISHED needs QRESYNC to have been enabled, and CHANGEDSINCE to say since when */
+	if (	(imap_fetch_modifiers(4, &changedsince, &vanished) != 0)
+		|| ((vanished) && ((!IMAP->qresync) || (changedsince < 1)))
+	) {
+		IReply("BAD invalid UID FETCH modifiers");
+		return;
+	}
+
 	imap_pick_range(Params[3].Key, 1);
 
 	memset(&Cmd, 0, sizeof(citimap_command));
@@ -1454,6 +1482,14 @@ void imap_uidfetch(int num_parms, ConstStr *Params) {
 		Cmd.Params[0] = (ConstStr){HKEY("UID")};
 	}
 
+	if (changedsince > 0) {
+		if (vanished) {
+			imap_vanished_earlier(Params[3].Key, changedsince);
+		}
+		imap_changedsince(changedsince);
+		imap_fetch_add_modseq(&Cmd);
+	}
+
 	imap_do_fetch(&Cmd);
 	IReply("OK UID FETCH completed");
 	FreeStrBuf(&Cmd.CmdBuf);
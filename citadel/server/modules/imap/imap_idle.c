@@ -0,0 +1,241 @@
+// IMAP IDLE (RFC 2177)
+//
+// A client which has said IDLE is parked like any other session waiting for input, so it doesn't hold a worker
+// thread.  We keep a table of the idling sessions by the room each one has selected.  Whenever a message is
+// saved into a room or deleted from one, the room and delete hooks mark the sessions idling on that room as
+// having asynchronous output waiting; the next free worker then runs imap_idle_async() for each of them, which
+// rescans the folder and sends only what changed.  Nobody polls.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "../../sysdep.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <libcitadel.h>
+#include "../../citadel_defs.h"
+#include "../../server.h"
+#include "../../citserver.h"
+#include "../../support.h"
+#include "../../context.h"
+#include "serv_imap.h"
+#include "imap_tools.h"
+#include "imap_fetch.h"
+#include "imap_idle.h"
+#include "imap_condstore.h"
+#include "../../ctdl_module.h"
+
+#define IDLE_BUCKETS 256
+
+struct imap_idler {
+	struct imap_idler *next;
+	struct imap_idler *prev;
+	struct CitContext *who;
+	long usernum;
+	char roomname[ROOMNAMELEN];		// empty if no folder is selected (then there's nothing to push)
+	int bucket;
+	time_t since;
+	StrBuf *tag;				// the tag of the IDLE command, to answer DONE with
+};
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct imap_idler *idlers[IDLE_BUCKETS];
+
+
+static int idle_bucket(const char *roomname) {
+	char lcname[ROOMNAMELEN];
+	int i;
+
+	for (i = 0; (roomname[i] != 0) && (i < sizeof lcname - 1); ++i) {
+		lcname[i] = tolower(roomname[i]);
+	}
+	lcname[i] = 0;
+	return(abs(HashLittle(lcname, i)) % IDLE_BUCKETS);
+}
+
+
+// Wake up the sessions idling on a room.  If usernum is not -1, only that user's sessions are interested (the
+// change was to their seen/answered flags, which nobody else shares).
+void imap_idle_notify(const char *roomname, long usernum) {
+	struct imap_idler *i;
+	int bucket;
+
+	if (IsEmptyStr(roomname)) {
+		return;
+	}
+	bucket = idle_bucket(roomname);
+
+	pthread_mutex_lock(&idle_lock);
+	for (i = idlers[bucket]; i != NULL; i = i->next) {
+		if ( (!strcasecmp(i->roomname, roomname))
+			&& ((usernum == -1) || (usernum == i->usernum))
+		) {
+			set_async_waiting(i->who);
+		}
+	}
+	pthread_mutex_unlock(&idle_lock);
+}
+
+
+// Implements the IDLE command
+void imap_idle(int num_parms, ConstStr *Params) {
+	citimap *Imap = IMAP;
+	struct imap_idler *i;
+
+	if (Imap->idler != NULL) {			// can't happen; the next line would have ended it
+		IReply("BAD already idling");
+		return;
+	}
+
+	i = (struct imap_idler *) malloc(sizeof(struct imap_idler));
+	memset(i, 0, sizeof(struct imap_idler));
+	i->who = CC;
+	i->usernum = CC->user.usernum;
+	if (Imap->selected) {
+		safestrncpy(i->roomname, CC->room.QRname, sizeof i->roomname);
+	}
+	i->bucket = idle_bucket(i->roomname);
+	i->since = time(NULL);
+	i->tag = NewStrBufPlain(CKEY(Params[0]));
+	Imap->idler = i;
+
+	// Let asynchronous output through before anyone can ask for it, so nothing is missed in between
+	CC->is_async = 1;
+
+	pthread_mutex_lock(&idle_lock);
+	i->next = idlers[i->bucket];
+	if (i->next != NULL) {
+		i->next->prev = i;
+	}
+	idlers[i->bucket] = i;
+	pthread_mutex_unlock(&idle_lock);
+
+	// Anything which had already changed was sent by the rescan before this command ran
+	IAPuts("+ idling\r\n");
+}
+
+
+// Stop idling (after DONE, or because the session is going away)
+void imap_idle_end(void) {
+	citimap *Imap = IMAP;
+	struct imap_idler *i = Imap->idler;
+
+	if (i == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&idle_lock);
+	if (i->prev != NULL) {
+		i->prev->next = i->next;
+	}
+	else {
+		idlers[i->bucket] = i->next;
+	}
+	if (i->next != NULL) {
+		i->next->prev = i->prev;
+	}
+	pthread_mutex_unlock(&idle_lock);
+
+	CC->is_async = 0;
+	__atomic_store_n(&CC->async_waiting, 0, __ATOMIC_SEQ_CST);
+	FreeStrBuf(&i->tag);
+	free(i);
+	Imap->idler = NULL;
+}
+
+
+// The client sent a line while we were idling.  It ought to be DONE; either way, the IDLE is over.
+void imap_idle_done(StrBuf *line) {
+	citimap *Imap = IMAP;
+
+	if (!strcasecmp(ChrPtr(line), "DONE")) {
+		IAPrintf("%s OK IDLE terminated\r\n", ChrPtr(Imap->idler->tag));
+	}
+	else {
+		IAPrintf("%s BAD expected DONE\r\n", ChrPtr(Imap->idler->tag));
+	}
+	imap_idle_end();
+}
+
+
+// Called by a worker thread for an idling session which has been woken up: send whatever changed.
+void imap_idle_async(void) {
+	citimap *Imap = IMAP;
+	unsigned int *old_flags = NULL;
+	int i;
+
+	if ((Imap == NULL) || (Imap->idler == NULL) || (!Imap->selected)) {
+		return;
+	}
+
+	// New and expunged messages (EXISTS, RECENT and EXPUNGE).  The room's modification time only has a resolution
+	// of a second, so don't let the rescan skip itself on the strength of that; we know something happened.
+	Imap->last_mtime = 0;
+	imap_rescan_msgids();
+
+	// The rescan only looks for flags on new messages.  Another session of the same user may have changed
+	// some on the old ones, so take a fresh look and report the ones which are different.
+	if (Imap->num_msgs > 0) {
+		old_flags = malloc(sizeof(unsigned int) * Imap->num_msgs);
+		memcpy(old_flags, Imap->flags, sizeof(unsigned int) * Imap->num_msgs);
+		imap_set_seen_flags(0);
+		for (i = 0; i < Imap->num_msgs; ++i) {
+			if ((old_flags[i] & IMAP_MASK_SETABLE) != (Imap->flags[i] & IMAP_MASK_SETABLE)) {
+				imap_flags_changed(i, 1);
+			}
+		}
+		free(old_flags);
+	}
+
+	imap_forget_modseqs();
+	IUnbuffer();
+}
+
+
+// A message was saved into a room
+static int imap_idle_roomhook(struct ctdlroom *qrbuf) {
+	imap_idle_notify(qrbuf->QRname, -1);
+	return(0);
+}
+
+
+// A message was deleted from a room (or from the message base, when room is NULL, which is no news to anybody)
+static void imap_idle_deletehook(char *room, long msgnum) {
+	if (room != NULL) {
+		imap_idle_notify(room, -1);
+	}
+}
+
+
+// Idle sessions would otherwise be logged out after c_sleeping seconds, which may well be less than the 29
+// minutes RFC 2177 says a client may idle for before it has to say something.  So we keep them alive until
+// they've been idle for IMAP_IDLE_TIMEOUT, after which the usual timeout applies.
+static void imap_idle_keepalive(void) {
+	struct imap_idler *i;
+	time_t now = time(NULL);
+	int b;
+
+	pthread_mutex_lock(&idle_lock);
+	for (b = 0; b < IDLE_BUCKETS; ++b) {
+		for (i = idlers[b]; i != NULL; i = i->next) {
+			if ((now - i->since) < IMAP_IDLE_TIMEOUT) {
+				i->who->lastcmd = now;
+			}
+		}
+	}
+	pthread_mutex_unlock(&idle_lock);
+}
+
+
+void imap_idle_init(void) {
+	CtdlRegisterRoomHook(imap_idle_roomhook);
+	CtdlRegisterDeleteHook(imap_idle_deletehook);
+	CtdlRegisterSessionHook(imap_idle_keepalive, EVT_TIMER, PRIO_CLEANUP + 410);
+}
@@ -0,0 +1,13 @@
+// IMAP IDLE (RFC 2177)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+void imap_idle(int num_parms, ConstStr *Params);
+void imap_idle_done(StrBuf *line);
+void imap_idle_end(void);
+void imap_idle_async(void);
+void imap_idle_notify(const char *roomname, long usernum);
+void imap_idle_init(void);
@@ -70,6 +70,8 @@ void imap_setmetadata(int num_parms, ConstStr *Params) {
 	char set_value[32];
 	int set_view = VIEW_BBS;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	if (num_parms != 6) {
 		IReply("BAD usage error");
@@ -140,9 +142,11 @@ void imap_setmetadata(int num_parms, ConstStr *Params) {
 	/*
 	 * Always set the per-user view to the requested one.
 	 */
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &CC->room);
 	vbuf.v_view = set_view;
-	CtdlSetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &CC->room);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 
 	/* If this is a "value.priv" set operation, we're done. */
 
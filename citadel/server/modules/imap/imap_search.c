@@ -39,6 +39,7 @@
 #include "../../user_ops.h"
 #include "../../database.h"
 #include "../../msgbase.h"
+#include "../../room_ops.h"
 #include "../../internet_addressing.h"
 #include "serv_imap.h"
 #include "imap_tools.h"
@@ -527,7 +528,6 @@ void imap_do_search(int num_items, ConstStr *itemlist, int is_uid) {
 	int i, j, k;
 	int fts_num_msgs = 0;
 	long *fts_msgs = NULL;
-	int is_in_list = 0;
 	int num_results = 0;
 
 	/* Strip parentheses.  We realize that this method will not work
@@ -551,16 +551,14 @@ void imap_do_search(int num_items, ConstStr *itemlist, int is_uid) {
 		if (!strcasecmp(itemlist[i].Key, "BODY")) {
 			CtdlModuleDoSearch(&fts_num_msgs, &fts_msgs, itemlist[i+1].Key, "fulltext");
 			if (fts_num_msgs > 0) {
+				/* Both lists are ascending, so walk them together */
+				k = 0;
 				for (j=0; j < Imap->num_msgs; ++j) {
-					if (Imap->flags[j] & IMAP_SELECTED) {
-						is_in_list = 0;
-						for (k=0; k<fts_num_msgs; ++k) {
-							if (Imap->msgids[j] == fts_msgs[k]) {
-								++is_in_list;
-							}
-						}
+					if ((j > 0) && (Imap->msgids[j] < Imap->msgids[j-1])) {
+						k = 0;		/* shouldn't happen, but don't miss anything if it does */
 					}
-					if (!is_in_list) {
+					k = msglist_gallop(fts_msgs, fts_num_msgs, k, Imap->msgids[j]);
+					if ((k >= fts_num_msgs) || (fts_msgs[k] != Imap->msgids[j])) {
 						Imap->flags[j] = Imap->flags[j] & ~IMAP_SELECTED;
 					}
 				}
@@ -36,6 +36,8 @@
 #include "imap_tools.h"
 #include "imap_fetch.h"
 #include "imap_store.h"
+#include "imap_idle.h"
+#include "imap_condstore.h"
 #include "../../genstamp.h"
 
 
@@ -127,13 +129,6 @@ void imap_do_store(citimap_command *Cmd) {
 
 				ss_msglist[num_ss++] = Imap->msgids[i];
 				imap_do_store_msg(i, oper, bits_to_twiddle);
-
-				if (!silent) {
-					IAPrintf("* %d FETCH (", i+1);
-					imap_fetch_flags(i);
-					IAPuts(")\r\n");
-				}
-
 			}
 		}
 	}
@@ -157,6 +152,19 @@ void imap_do_store(citimap_command *Cmd) {
 			);
 		}
 
+		// Let this user's other sessions which are idling in this folder know
+		imap_idle_notify(CC->room.QRname, CC->user.usernum);
+	}
+
+	// Tell the client what the flags are now.  This comes after the database has been updated so that a
+	// CONDSTORE client is told the new modification sequences, which it wants to know even after .SILENT
+	imap_forget_modseqs();
+	if ((!silent) || (Imap->condstore)) {
+		for (i = 0; i < Imap->num_msgs; ++i) {
+			if (Imap->flags[i] & IMAP_SELECTED) {
+				imap_flags_changed(i, !silent);
+			}
+		}
 	}
 
 	free(ss_msglist);
@@ -169,12 +177,20 @@ void imap_do_store(citimap_command *Cmd) {
 void imap_store(int num_parms, ConstStr *Params) {
 	citimap_command Cmd;
 	int num_items;
+	int first_item = 3;
+	long unchangedsince;
+	StrBuf *modified;
 
 	if (num_parms < 3) {
 		IReply("BAD invalid parameters");
 		return;
 	}
 
+	if (imap_store_modifiers(&first_item, &unchangedsince) != 0) {
+		IReply("BAD invalid STORE modifiers");
+		return;
+	}
+
 	if (imap_is_message_set(Params[2].Key)) {
 		imap_pick_range(Params[2].Key, 0);
 	}
@@ -183,34 +199,55 @@ void imap_store(int num_parms, ConstStr *Params) {
 		return;
 	}
 
+	// With UNCHANGEDSINCE, leave alone anything that's been changed since the client last looked
+	modified = NewStrBuf();
+	if (unchangedsince >= 0) {
+		imap_unchangedsince(unchangedsince, 0, modified);
+	}
+
 	memset(&Cmd, 0, sizeof(citimap_command));
 	Cmd.CmdBuf = NewStrBufPlain(NULL, StrLength(IMAP->Cmd.CmdBuf));
-	MakeStringOf(Cmd.CmdBuf, 3);
+	MakeStringOf(Cmd.CmdBuf, first_item);
 
 	num_items = imap_extract_data_items(&Cmd);
 	if (num_items < 1) {
 		IReply("BAD invalid data item list");
 		FreeStrBuf(&Cmd.CmdBuf);
 		free(Cmd.Params);
+		FreeStrBuf(&modified);
 		return;
 	}
 
 	imap_do_store(&Cmd);
-	IReply("OK STORE completed");
+	if (StrLength(modified) > 0) {
+		IReplyPrintf("OK [MODIFIED %s] Conditional STORE failed", ChrPtr(modified));
+	}
+	else {
+		IReply("OK STORE completed");
+	}
 	FreeStrBuf(&Cmd.CmdBuf);
 	free(Cmd.Params);
+	FreeStrBuf(&modified);
 }
 
 // This function is called by the main command loop.
 void imap_uidstore(int num_parms, ConstStr *Params) {
 	citimap_command Cmd;
 	int num_items;
+	int first_item = 4;
+	long unchangedsince;
+	StrBuf *modified;
 
 	if (num_parms < 4) {
 		IReply("BAD invalid parameters");
 		return;
 	}
 
+	if (imap_store_modifiers(&first_item, &unchangedsince) != 0) {
+		IReply("BAD invalid UID STORE modifiers");
+		return;
+	}
+
 	if (imap_is_message_set(Params[3].Key)) {
 		imap_pick_range(Params[3].Key, 1);
 	}
@@ -219,20 +256,33 @@ void imap_uidstore(int num_parms, ConstStr *Params) {
 		return;
 	}
 
+	// With UNCHANGEDSINCE, leave alone anything that's been changed since the client last looked
+	modified = NewStrBuf();
+	if (unchangedsince >= 0) {
+		imap_unchangedsince(unchangedsince, 1, modified);
+	}
+
 	memset(&Cmd, 0, sizeof(citimap_command));
 	Cmd.CmdBuf = NewStrBufPlain(NULL, StrLength(IMAP->Cmd.CmdBuf));
-	MakeStringOf(Cmd.CmdBuf, 4);
+	MakeStringOf(Cmd.CmdBuf, first_item);
 
 	num_items = imap_extract_data_items(&Cmd);
 	if (num_items < 1) {
 		IReply("BAD invalid data item list");
 		FreeStrBuf(&Cmd.CmdBuf);
 		free(Cmd.Params);
+		FreeStrBuf(&modified);
 		return;
 	}
 
 	imap_do_store(&Cmd);
-	IReply("OK UID STORE completed");
+	if (StrLength(modified) > 0) {
+		IReplyPrintf("OK [MODIFIED %s] Conditional STORE failed", ChrPtr(modified));
+	}
+	else {
+		IReply("OK UID STORE completed");
+	}
 	FreeStrBuf(&Cmd.CmdBuf);
 	free(Cmd.Params);
+	FreeStrBuf(&modified);
 }
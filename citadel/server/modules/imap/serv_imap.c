@@ -27,8 +27,10 @@
 #include "../../config.h"
 #include "../../user_ops.h"
 #include "../../database.h"
+#include "../../msglist_cache.h"
 #include "../../msgbase.h"
 #include "../../internet_addressing.h"
+#include "../../modseq.h"
 #include "serv_imap.h"
 #include "imap_tools.h"
 #include "imap_list.h"
@@ -38,6 +40,8 @@
 #include "imap_acl.h"
 #include "imap_metadata.h"
 #include "imap_misc.h"
+#include "imap_idle.h"
+#include "imap_condstore.h"
 
 #include "../../ctdl_module.h"
 HashList *ImapCmds = NULL;
@@ -148,10 +152,8 @@ void imap_free_transmitted_message(void) {
 
 
 /*
- * Set the \Seen, \Recent. and \Answered flags, based on the sequence
- * sets stored in the visit record for this user/room.  Note that we have
- * to parse each sequence set manually here, because calling the utility
- * function is_msg_in_sequence_set() over and over again is too expensive.
+ * Set the \Seen, \Recent. and \Answered flags, based on the sets stored
+ * in the visit record for this user/room.
  *
  * first_msg should be set to 0 to rescan the flags for every message in the
  * room, or some other value if we're only interested in an incremental
@@ -160,75 +162,31 @@ void imap_free_transmitted_message(void) {
 void imap_set_seen_flags(int first_msg) {
 	citimap *Imap = IMAP;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 	int i;
-	int num_sets;
-	int s;
-	char setstr[64], lostr[64], histr[64];
-	long lo, hi;
 
 	if (Imap->num_msgs < 0) return;
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
-
-	for (i = first_msg; i < Imap->num_msgs; ++i) {
-		Imap->flags[i] = Imap->flags[i] & ~IMAP_SEEN;
-		Imap->flags[i] |= IMAP_RECENT;
-		Imap->flags[i] = Imap->flags[i] & ~IMAP_ANSWERED;
-	}
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &CC->room);
 
 	/*
-	 * Do the "\Seen" flag.
-	 * (Any message not "\Seen" is considered "\Recent".)
+	 * Any message not "\Seen" is considered "\Recent".
 	 */
-	num_sets = num_tokens(vbuf.v_seen, ',');
-	for (s=0; s<num_sets; ++s) {
-		extract_token(setstr, vbuf.v_seen, s, ',', sizeof setstr);
-
-		extract_token(lostr, setstr, 0, ':', sizeof lostr);
-		if (num_tokens(setstr, ':') >= 2) {
-			extract_token(histr, setstr, 1, ':', sizeof histr);
-			if (!strcmp(histr, "*")) {
-				snprintf(histr, sizeof histr, "%ld", LONG_MAX);
-			}
-		} 
-		else {
-			strcpy(histr, lostr);
-		}
-		lo = atol(lostr);
-		hi = atol(histr);
-
-		for (i = first_msg; i < Imap->num_msgs; ++i) {
-			if ((Imap->msgids[i] >= lo) && (Imap->msgids[i] <= hi)){
-				Imap->flags[i] |= IMAP_SEEN;
-				Imap->flags[i] = Imap->flags[i] & ~IMAP_RECENT;
-			}
+	for (i = first_msg; i < Imap->num_msgs; ++i) {
+		Imap->flags[i] = Imap->flags[i] & ~IMAP_SEEN & ~IMAP_RECENT & ~IMAP_ANSWERED;
+		if (seen_set_contains(seen, Imap->msgids[i])) {
+			Imap->flags[i] |= IMAP_SEEN;
 		}
-	}
-
-	/* Do the ANSWERED flag */
-	num_sets = num_tokens(vbuf.v_answered, ',');
-	for (s=0; s<num_sets; ++s) {
-		extract_token(setstr, vbuf.v_answered, s, ',', sizeof setstr);
-
-		extract_token(lostr, setstr, 0, ':', sizeof lostr);
-		if (num_tokens(setstr, ':') >= 2) {
-			extract_token(histr, setstr, 1, ':', sizeof histr);
-			if (!strcmp(histr, "*")) {
-				snprintf(histr, sizeof histr, "%ld", LONG_MAX);
-			}
-		} 
 		else {
-			strcpy(histr, lostr);
+			Imap->flags[i] |= IMAP_RECENT;
 		}
-		lo = atol(lostr);
-		hi = atol(histr);
-
-		for (i = first_msg; i < Imap->num_msgs; ++i) {
-			if ((Imap->msgids[i] >= lo) && (Imap->msgids[i] <= hi)){
-				Imap->flags[i] |= IMAP_ANSWERED;
-			}
+		if (seen_set_contains(answered, Imap->msgids[i])) {
+			Imap->flags[i] |= IMAP_ANSWERED;
 		}
 	}
 
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 }
 
 
@@ -258,7 +216,6 @@ void imap_add_single_msgid(long msgnum, void *userdata) {
  */
 void imap_load_msgids(void) {
 	struct CitContext *CCC = CC;
-	struct cdbdata *cdbfr;
 	citimap *Imap = CCCIMAP;
 
 	if (Imap->selected == 0) {
@@ -268,16 +225,9 @@ void imap_load_msgids(void) {
 
 	imap_free_msgids();	/* If there was already a map, free it */
 
-	/* Load the message list */
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &CC->room.QRnumber, sizeof(long));
-	if (cdbfr != NULL) {
-		Imap->msgids = (long*)cdbfr->ptr;
-		Imap->num_msgs = cdbfr->len / sizeof(long);
-		Imap->num_alloc = cdbfr->len / sizeof(long);
-		cdbfr->ptr = NULL;
-		cdbfr->len = 0;
-		cdb_free(cdbfr);
-	}
+	/* Load the message list (our own copy, since we edit it as messages come and go) */
+	Imap->msgids = CtdlCopyMsgList(CC->room.QRnumber, &Imap->num_msgs);
+	Imap->num_alloc = Imap->num_msgs;
 
 	if (Imap->num_msgs) {
 		Imap->flags = malloc(Imap->num_alloc * sizeof(unsigned int));
@@ -296,12 +246,14 @@ void imap_rescan_msgids(void) {
 	citimap *Imap = CCCIMAP;
 	int original_num_msgs = 0;
 	long original_highest = 0L;
-	int i, j, jstart;
-	int message_still_exists;
-	struct cdbdata *cdbfr;
+	int i, j, k;
+	struct msglist *ml;
 	long *msglist = NULL;
 	int num_msgs = 0;
 	int num_recent = 0;
+	long *vanished = NULL;
+	int num_vanished = 0;
+	StrBuf *uidset;
 
 	if (Imap->selected == 0) {
 		syslog(LOG_ERR, "imap_load_msgids() can't run; no room selected");
@@ -320,46 +272,49 @@ void imap_rescan_msgids(void) {
 	/* Load the *current* message list from disk, so we can compare it
 	 * to what we have in memory.
 	 */
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &CC->room.QRnumber, sizeof(long));
-	if (cdbfr != NULL) {
-		msglist = (long*)cdbfr->ptr;
-		cdbfr->ptr = NULL;
-		num_msgs = cdbfr->len / sizeof(long);
-		cdbfr->len = 0;
-		cdb_free(cdbfr);
+	ml = CtdlGetMsgList(CC->room.QRnumber);
+	if (ml != NULL) {
+		msglist = ml->msgs;
+		num_msgs = ml->num_msgs;
 	}
 	else {
 		num_msgs = 0;
 	}
 
-	/*
-	 * Check to see if any of the messages we know about have been expunged
-	 */
+	// Check to see if any of the messages we know about have been expunged.  Both lists are sorted, so this
+	// is a single merge pass, which closes up the gaps in our arrays as it goes.  Each message which is gone
+	// is reported with the sequence number it has by then, i.e. after the ones before it were taken out.
+	// A client which has enabled QRESYNC gets a single VANISHED response with their UIDs instead.
 	if (Imap->num_msgs > 0) {
-		jstart = 0;
-		for (i = 0; i < Imap->num_msgs; ++i) {
-
-			message_still_exists = 0;
-			if (num_msgs > 0) {
-				for (j = jstart; j < num_msgs; ++j) {
-					if (msglist[j] == Imap->msgids[i]) {
-						message_still_exists = 1;
-						jstart = j;
-						break;
-					}
-				}
+		if (Imap->qresync) {
+			vanished = malloc(Imap->num_msgs * sizeof(long));
+		}
+		for (i = 0, j = 0, k = 0; i < Imap->num_msgs; ++i) {
+			while ((j < num_msgs) && (msglist[j] < Imap->msgids[i])) {
+				++j;
 			}
-
-			if (message_still_exists == 0) {
-				IAPrintf("* %d EXPUNGE\r\n", i + 1);
-
-				// When a message is expunged, we have to slide all the existing messages up in the message array.
-				--Imap->num_msgs;
-				memmove(&Imap->msgids[i], &Imap->msgids[i + 1], (sizeof(long) * (Imap->num_msgs - i)));
-				memmove(&Imap->flags[i], &Imap->flags[i + 1], (sizeof(unsigned int) * (Imap->num_msgs - i)));
-				--i;
+			if ((j < num_msgs) && (msglist[j] == Imap->msgids[i])) {
+				Imap->msgids[k] = Imap->msgids[i];
+				Imap->flags[k] = Imap->flags[i];
+				++k;
+			}
+			else if (vanished != NULL) {
+				vanished[num_vanished++] = Imap->msgids[i];
 			}
+			else {
+				IAPrintf("* %d EXPUNGE\r\n", k + 1);
+			}
+		}
+		Imap->num_msgs = k;
 
+		if (num_vanished > 0) {
+			uidset = NewStrBuf();
+			imap_append_uidset(uidset, vanished, num_vanished);
+			IAPrintf("* VANISHED %s\r\n", ChrPtr(uidset));
+			FreeStrBuf(&uidset);
+		}
+		if (vanished != NULL) {
+			free(vanished);
 		}
 	}
 
@@ -389,7 +344,7 @@ void imap_rescan_msgids(void) {
 	 */
 	if (Imap->num_msgs > original_num_msgs) {
 
-		for (j = 0; j < num_msgs; ++j) {
+		for (j = 0; j < Imap->num_msgs; ++j) {
 			if (Imap->flags[j] & IMAP_RECENT) {
 				++num_recent;
 			}
@@ -399,9 +354,7 @@ void imap_rescan_msgids(void) {
 		IAPrintf("* %d RECENT\r\n", num_recent);
 	}
 
-	if (msglist != NULL) {
-		free(msglist);
-	}
+	CtdlPutMsgList(&ml);
 	Imap->last_mtime = CC->room.QRmtime;
 }
 
@@ -418,6 +371,10 @@ void imap_cleanup_function(void) {
 	if (CC->h_command_function != imap_command_loop)
 		return;
 
+	/* Stop listening for changes, if the session was in IDLE */
+	imap_idle_end();
+	imap_forget_modseqs();
+
 	/* If there is a mailbox selected, auto-expunge it. */
 	if (Imap->selected) {
 		imap_do_expunge();
@@ -451,7 +408,7 @@ void imap_cleanup_function(void) {
  * Does the actual work of the CAPABILITY command (because we need to output this stuff in other places as well)
  */
 void imap_output_capability_string(void) {
-	IAPuts("CAPABILITY IMAP4REV1 NAMESPACE ID AUTH=PLAIN AUTH=LOGIN UIDPLUS");
+	IAPuts("CAPABILITY IMAP4REV1 NAMESPACE ID AUTH=PLAIN AUTH=LOGIN UIDPLUS IDLE ENABLE CONDSTORE QRESYNC");
 
 #ifdef HAVE_OPENSSL
 	if (!CC->redirect_ssl) IAPuts(" STARTTLS");
@@ -778,6 +735,8 @@ void imap_select(int num_parms, ConstStr *Params) {
 	struct ctdlroom QRscratch;
 	int msgs, new;
 	int i;
+	long resync_modseq = 0;
+	StrBuf *known_uids = NULL;
 
 	/* Convert the supplied folder name to a roomname */
 	i = imap_roomname(towhere, sizeof towhere, Params[2].Key);
@@ -787,6 +746,13 @@ void imap_select(int num_parms, ConstStr *Params) {
 		return;
 	}
 
+	/* (CONDSTORE) or (QRESYNC ...) */
+	if (imap_select_modifiers(&resync_modseq, &known_uids) != 0) {
+		IReply("BAD invalid SELECT parameters");
+		FreeStrBuf(&known_uids);
+		return;
+	}
+
 	/* First try a regular match */
 	c = CtdlGetRoom(&QRscratch, towhere);
 
@@ -813,11 +779,15 @@ void imap_select(int num_parms, ConstStr *Params) {
 	/* Fail here if no such room */
 	if (!ok) {
 		IReply("NO ... no such room, or access denied");
+		FreeStrBuf(&known_uids);
 		return;
 	}
 
 	/* If we already had some other folder selected, auto-expunge it */
 	imap_do_expunge();
+	if ((Imap->qresync) && (Imap->selected)) {
+		IAPuts("* OK [CLOSED] Previous mailbox closed\r\n");
+	}
 
 	/*
 	 * CtdlUserGoto() formally takes us to the desired room, happily returning
@@ -854,6 +824,14 @@ void imap_select(int num_parms, ConstStr *Params) {
 	 */
 	IAPuts("* FLAGS (\\Deleted \\Seen \\Answered)\r\n");
 	IAPuts("* OK [PERMANENTFLAGS (\\Deleted \\Seen \\Answered)] permanent flags\r\n");
+	IAPrintf("* OK [HIGHESTMODSEQ %ld] Highest modification sequence\r\n", CtdlHighestModseq(CC->room.QRnumber, CC->user.usernum));
+
+	/* A QRESYNC client which has been here before only needs to hear about what changed */
+	if (resync_modseq > 0) {
+		imap_select_resync(resync_modseq, ((known_uids != NULL) ? ChrPtr(known_uids) : NULL));
+	}
+	FreeStrBuf(&known_uids);
+
 	IReplyPrintf("OK [%s] %s completed", (Imap->readonly ? "READ-ONLY" : "READ-WRITE"), Params[1].Key);
 }
 
@@ -1135,6 +1113,7 @@ void imap_status(int num_parms, ConstStr *Params) {
 	IAPrintf(" (MESSAGES %d ", msgs);
 	IAPrintf("RECENT %d ", new);	/* Initially, new==recent */
 	IAPrintf("UIDNEXT %ld ", CtdlGetConfigLong("MMhighest") + 1);
+	IAPrintf("HIGHESTMODSEQ %ld ", CtdlHighestModseq(CC->room.QRnumber, CC->user.usernum));
 	IAPrintf("UNSEEN %d)\r\n", new);
 	
 	/*
@@ -1453,6 +1432,13 @@ void imap_command_loop(void) {
 	}
 	StrBufTrim(Imap->Cmd.CmdBuf);
 
+	/* If the client is in IDLE, this line ends it */
+	if (Imap->idler != NULL) {
+		imap_idle_done(Imap->Cmd.CmdBuf);
+		IUnbuffer();
+		return;
+	}
+
 	/* If we're in the middle of a multi-line command, handle that */
 	switch (Imap->authstate){
 	case imap_as_expecting_username:
@@ -1528,6 +1514,7 @@ BAIL:
 	IUnbuffer();
 
 	imap_free_transmitted_message();
+	imap_forget_modseqs();
 
 	gettimeofday(&tv2, NULL);
 	total_time = (tv2.tv_usec + (tv2.tv_sec * 1000000)) - (tv1.tv_usec + (tv1.tv_sec * 1000000));
@@ -1594,6 +1581,8 @@ char *ctdl_module_init_imap(void) {
 	RegisterImapCMD("LISTRIGHTS", "", imap_listrights, I_FLAG_LOGGED_IN);
 	RegisterImapCMD("MYRIGHTS", "", imap_myrights, I_FLAG_LOGGED_IN);
 	RegisterImapCMD("GETMETADATA", "", imap_getmetadata, I_FLAG_LOGGED_IN);
+	RegisterImapCMD("IDLE", "", imap_idle, I_FLAG_LOGGED_IN);
+	RegisterImapCMD("ENABLE", "", imap_enable, I_FLAG_LOGGED_IN);
 	RegisterImapCMD("SETMETADATA", "", imap_setmetadata, I_FLAG_LOGGED_IN);
 
 	/* The commands below require the SELECT state on a mailbox */
@@ -1610,11 +1599,12 @@ char *ctdl_module_init_imap(void) {
 	RegisterImapCMD("CLOSE", "", imap_close, I_FLAG_LOGGED_IN | I_FLAG_SELECT);
 
 	if (!threading) {
-		CtdlRegisterServiceHook(CtdlGetConfigInt("c_imap_port"), NULL, imap_greeting, imap_command_loop, NULL, CitadelServiceIMAP);
+		CtdlRegisterServiceHook(CtdlGetConfigInt("c_imap_port"), NULL, imap_greeting, imap_command_loop, imap_idle_async, CitadelServiceIMAP);
 #ifdef HAVE_OPENSSL
-		CtdlRegisterServiceHook(CtdlGetConfigInt("c_imaps_port"), NULL, imaps_greeting, imap_command_loop, NULL, CitadelServiceIMAPS);
+		CtdlRegisterServiceHook(CtdlGetConfigInt("c_imaps_port"), NULL, imaps_greeting, imap_command_loop, imap_idle_async, CitadelServiceIMAPS);
 #endif
 		CtdlRegisterSessionHook(imap_cleanup_function, EVT_STOP, PRIO_STOP + 30);
+		imap_idle_init();
 	}
 	
 	// return our module name for the log
@@ -8,6 +8,7 @@ int imap_grabroom(char *returned_roomname, const char *foldername, int zapped_ok
 void imap_free_transmitted_message(void);
 int imap_do_expunge(void);
 void imap_rescan_msgids(void);
+void imap_set_seen_flags(int first_msg);
 
 /*
  * FDELIM defines which character we want to use as a folder delimiter
@@ -61,6 +62,13 @@ typedef struct __citimap {
 	char cached_bodypart[SIZ];
 	long cached_bodymsgnum;
 	char cached_body_withbody;	/* 1 = body cached; 0 = only headers cached */
+
+	struct imap_idler *idler;	/* set while the client is in IDLE */
+
+	int condstore;			/* client has enabled CONDSTORE (RFC 7162) */
+	int qresync;			/* client has enabled QRESYNC, so expunges are reported as VANISHED */
+	struct modseq_log *flaglog;	/* this user's flag changes in the selected room, during a command */
+	struct modseq_log *arrivals;	/* late arrivals in the selected room, during a command */
 } citimap;
 
 /*
@@ -252,15 +252,16 @@ int is_sequence_set(char *s) {
 // Traverse the visits file...
 void migr_export_visits(void) {
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 	struct cdbdata *cdbv;
+	StrBuf *setstr = NewStrBuf();
 
 	cdb_rewind(CDB_VISIT);
 
 	while (cdbv = cdb_next_item(CDB_VISIT), cdbv != NULL) {
 		memset(&vbuf, 0, sizeof(struct visit));
-		memcpy(&vbuf, cdbv->ptr,
-		       ((cdbv->len > sizeof(struct visit)) ?
-			sizeof(struct visit) : cdbv->len));
+		CtdlDecodeVisit(cdbv, &vbuf, &seen, &answered);
 		cdb_free(cdbv);
 
 		client_write(HKEY("<visit>\n"));
@@ -269,24 +270,31 @@ void migr_export_visits(void) {
 		cprintf("<v_usernum>%ld</v_usernum>\n", vbuf.v_usernum);
 
 		client_write(HKEY("<v_seen>"));
-		if ( (!IsEmptyStr(vbuf.v_seen)) && (is_sequence_set(vbuf.v_seen)) ) {
-			xml_strout(vbuf.v_seen);
+		if (seen->num_ranges > 0) {
+			FlushStrBuf(setstr);
+			seen_set_to_string(setstr, seen);
+			xml_strout((char *)ChrPtr(setstr));
 		}
 		else {
 			cprintf("%ld", vbuf.v_lastseen);
 		}
 		client_write(HKEY("</v_seen>"));
 
-		if ( (!IsEmptyStr(vbuf.v_answered)) && (is_sequence_set(vbuf.v_answered)) ) {
+		if (answered->num_ranges > 0) {
+			FlushStrBuf(setstr);
+			seen_set_to_string(setstr, answered);
 			client_write(HKEY("<v_answered>"));
-			xml_strout(vbuf.v_answered);
+			xml_strout((char *)ChrPtr(setstr));
 			client_write(HKEY("</v_answered>\n"));
 		}
+		seen_set_free(&seen);
+		seen_set_free(&answered);
 
 		cprintf("<v_flags>%u</v_flags>\n", vbuf.v_flags);
 		cprintf("<v_view>%d</v_view>\n", vbuf.v_view);
 		client_write(HKEY("</visit>\n"));
 	}
+	FreeStrBuf(&setstr);
 }
 
 
@@ -475,6 +483,8 @@ char FRname[ROOMNAMELEN];
 struct floor flbuf;
 int floornum = 0;
 struct visit vbuf;
+struct seen_set *vseen = NULL;
+struct seen_set *vanswered = NULL;
 struct MetaData smi;
 long import_msgnum = 0;
 
@@ -518,7 +528,11 @@ void migr_xml_start(void *data, const char *el, const char **attr) {
 	else if (!strcasecmp(el, "room"))		memset(&qrbuf, 0, sizeof(struct ctdlroom));
 	else if (!strcasecmp(el, "room_messages"))	memset(FRname, 0, sizeof FRname);
 	else if (!strcasecmp(el, "floor"))		memset(&flbuf, 0, sizeof(struct floor));
-	else if (!strcasecmp(el, "visit"))		memset(&vbuf, 0, sizeof(struct visit));
+	else if (!strcasecmp(el, "visit")) {
+		memset(&vbuf, 0, sizeof(struct visit));
+		seen_set_free(&vseen);
+		seen_set_free(&vanswered);
+	}
 
 	else if (!strcasecmp(el, "message")) {
 		memset(&smi, 0, sizeof (struct MetaData));
@@ -610,11 +624,18 @@ int migr_visitrecord(void *data, const char *el) {
 		for (i=0; i < max; ++i) 
 			if (!isdigit(ChrPtr(migr_chardata)[i]))
 				is_textual_seen = 1;
-		if (is_textual_seen)
-			safestrncpy(vbuf.v_seen, ChrPtr(migr_chardata), sizeof vbuf.v_seen);
+		if ( (is_textual_seen) && (is_sequence_set((char *)ChrPtr(migr_chardata))) ) {
+			seen_set_free(&vseen);
+			vseen = seen_set_from_string(ChrPtr(migr_chardata));
+		}
 	}
 
-	else if (!strcasecmp(el, "v_answered"))			safestrncpy(vbuf.v_answered, ChrPtr(migr_chardata), sizeof vbuf.v_answered);
+	else if (!strcasecmp(el, "v_answered")) {
+		if (is_sequence_set((char *)ChrPtr(migr_chardata))) {
+			seen_set_free(&vanswered);
+			vanswered = seen_set_from_string(ChrPtr(migr_chardata));
+		}
+	}
 	else if (!strcasecmp(el, "v_flags"))			vbuf.v_flags = atoi(ChrPtr(migr_chardata));
 	else if (!strcasecmp(el, "v_view"))			vbuf.v_view = atoi(ChrPtr(migr_chardata));
 	else return 0;
@@ -736,7 +757,9 @@ void migr_xml_end(void *data, const char *el) {
 		; // Nothing to do anymore
 	}
 	else if (!strcasecmp(el, "visit")) {
-		put_visit(&vbuf);
+		put_visit(&vbuf, vseen, vanswered);
+		seen_set_free(&vseen);
+		seen_set_free(&vanswered);
 		syslog(LOG_INFO, "migrate: imported visit: %ld/%ld/%ld", vbuf.v_roomnum, vbuf.v_roomgen, vbuf.v_usernum);
 	}
 
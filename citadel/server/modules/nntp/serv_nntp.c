@@ -42,8 +42,10 @@
 #include "../../room_ops.h"
 #include "../../database.h"
 #include "../../msgbase.h"
+#include "../../msglist_cache.h"
 #include "../../internet_addressing.h"
 #include "../../genstamp.h"
+#include "../../overview.h"
 #include "../../domain.h"
 #include "../../clientsocket.h"
 #include "../../locate_host.h"
@@ -317,19 +319,8 @@ void nntp_authinfo(const char *cmd) {
 //
 struct nntp_msglist nntp_fetch_msglist(struct ctdlroom *qrbuf) {
 	struct nntp_msglist nm;
-	struct cdbdata *cdbfr;
-
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &qrbuf->QRnumber, sizeof(long));
-	if (cdbfr != NULL) {
-		nm.msgnums = (long*)cdbfr->ptr;
-		cdbfr->ptr = NULL;
-		nm.num_msgs = cdbfr->len / sizeof(long);
-		cdbfr->len = 0;
-		cdb_free(cdbfr);
-	} else {
-		nm.num_msgs = 0;
-		nm.msgnums = NULL;
-	}
+
+	nm.msgnums = CtdlCopyMsgList(qrbuf->QRnumber, &nm.num_msgs);
 	return(nm);
 }
 
@@ -936,21 +927,33 @@ void nntp_last_next(const char *cmd) {
 }
 
 
-//
-// back end for the XOVER command , called for each message number
-//
-void nntp_xover_backend(long msgnum, void *userdata) {
+// Append one field of an overview line.  Fields are separated by tabs, so any tabs or line breaks in the
+// content itself become spaces.
+static void nntp_xover_field(StrBuf *line, const char *content) {
+	const char *ptr;
 
-	struct listgroup_range *lr = (struct listgroup_range *)userdata;
+	StrBufAppendBufPlain(line, HKEY("\t"), 0);
+	for (ptr = content; *ptr != 0; ++ptr) {
+		if ((*ptr == '\t') || (*ptr == '\r') || (*ptr == '\n')) {
+			StrBufAppendBufPlain(line, HKEY(" "), 0);
+		}
+		else {
+			StrBufAppendBufPlain(line, ptr, 1, 0);
+		}
+	}
+}
 
-	// check range if supplied
-	if (msgnum < lr->lo) return;
-	if ((lr->hi != 0) && (msgnum > lr->hi)) return;
 
-	struct CtdlMessage *msg = CtdlFetchMessage(msgnum, 0);
-	if (msg == NULL) {
-		return;
-	}
+//
+// back end for the XOVER command, called with the overview of each message in the range
+//
+void nntp_xover_backend(struct msg_overview *ov, void *userdata) {
+	StrBuf *line = (StrBuf *)userdata;
+	char buf[SIZ];
+	char *ref;
+	char *bar;
+	int len;
+	int first;
 
 	// Teh RFC says we need:
 	// -------------------------
@@ -962,22 +965,33 @@ void nntp_xover_backend(long msgnum, void *userdata) {
 	// :bytes metadata item
 	// :lines metadata item
 
-	time_t msgtime = atol(msg->cm_fields[eTimestamp]);
-	char strtimebuf[26];
-	ctime_r(&msgtime, strtimebuf);
-
-	// here we go -- print the line o'data
-	cprintf("%ld\t%s\t%s <%s>\t%s\t%s\t%s\t100\t10\r\n",
-		msgnum,
-		msg->cm_fields[eMsgSubject],
-		msg->cm_fields[eAuthor],
-		msg->cm_fields[erFc822Addr],
-		strtimebuf,
-		msg->cm_fields[emessageId],
-		msg->cm_fields[eWeferences]
-	);
+	FlushStrBuf(line);
+	StrBufPrintf(line, "%ld", ov->msgnum);
+	nntp_xover_field(line, ov->subject);
+
+	snprintf(buf, sizeof buf, "%s <%s>", ov->author, ov->rfc822addr);
+	nntp_xover_field(line, buf);
+
+	datestring(buf, sizeof buf, ov->date, DATESTRING_RFC822);
+	nntp_xover_field(line, buf);
+
+	snprintf(buf, sizeof buf, "<%s>", ov->msgid);
+	nntp_xover_field(line, (IsEmptyStr(ov->msgid) ? "" : buf));
+
+	// References are stored without the angle brackets and separated by vertical bars
+	StrBufAppendBufPlain(line, HKEY("\t"), 0);
+	first = 1;
+	for (ref = ov->references; !IsEmptyStr(ref); ref = (bar ? bar + 1 : NULL)) {
+		bar = strchr(ref, '|');
+		len = (bar ? bar - ref : strlen(ref));
+		if (len > 0) {
+			StrBufAppendPrintf(line, "%s<%.*s>", (first ? "" : " "), len, ref);
+			first = 0;
+		}
+	}
 
-	CM_Free(msg);
+	StrBufAppendPrintf(line, "\t%ld\t%ld\r\n", ov->bytes, ov->lines);
+	cputbuf(line);
 }
 
 
@@ -1015,9 +1029,11 @@ void nntp_xover(const char *cmd) {
 		}
 	}
 
+	StrBuf *line = NewStrBuf();
 	cprintf("224 Overview information follows\r\n");
-	CtdlForEachMessage(MSGS_ALL, 0L, NULL, NULL, NULL, nntp_xover_backend, &lr);
+	CtdlForEachOverview(lr.lo, lr.hi, nntp_xover_backend, line);
 	cprintf(".\r\n");
+	FreeStrBuf(&line);
 }
 
 
@@ -145,6 +145,7 @@ void pop3_add_message(long msgnum, void *userdata) {
 // of messages in the inbox, or -1 for error)
 int pop3_grab_mailbox(void) {
         struct visit vbuf;
+	struct seen_set *seen = NULL;
 	int i;
 
 	if (CtdlGetRoom(&CC->room, MAILROOM) != 0) return(-1);
@@ -153,13 +154,14 @@ int pop3_grab_mailbox(void) {
 	CtdlForEachMessage(MSGS_ALL, 0L, NULL, NULL, NULL, pop3_add_message, NULL);
 
 	/* Figure out which are old and which are new */
-        CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
+        CtdlGetRelationshipSets(&vbuf, &seen, NULL, &CC->user, &CC->room);
 	POP3->lastseen = (-1);
 	if (POP3->num_msgs) for (i=0; i<POP3->num_msgs; ++i) {
-		if (is_msg_in_sequence_set(vbuf.v_seen, (POP3->msgs[POP3->num_msgs-1].msgnum) )) {
+		if (seen_set_contains(seen, (POP3->msgs[POP3->num_msgs-1].msgnum) )) {
 			POP3->lastseen = i;
 		}
 	}
+	seen_set_free(&seen);
 
 	return(POP3->num_msgs);
 }
@@ -361,6 +363,8 @@ void pop3_dele(char *argbuf) {
 void pop3_update(void) {
 	int i;
         struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	long *deletemsgs = NULL;
 	int num_deletemsgs = 0;
@@ -382,9 +386,12 @@ void pop3_update(void) {
 	// Set last read pointer
 	if (POP3->num_msgs > 0) {
 		CtdlLockGetCurrentUser();
-		CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
-		snprintf(vbuf.v_seen, sizeof vbuf.v_seen, "*:%ld", POP3->msgs[POP3->num_msgs-1].msgnum);
-		CtdlSetRelationship(&vbuf, &CC->user, &CC->room);
+		CtdlGetRelationshipSets(&vbuf, NULL, &answered, &CC->user, &CC->room);
+		seen = seen_set_new();
+		seen_set_add(seen, 0, POP3->msgs[POP3->num_msgs-1].msgnum);
+		CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &CC->room);
+		seen_set_free(&seen);
+		seen_set_free(&answered);
 		CtdlPutCurrentUserLock();
 	}
 
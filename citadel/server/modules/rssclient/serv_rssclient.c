@@ -19,6 +19,7 @@
 #include <expat.h>
 #include <curl/curl.h>
 #include <libcitadel.h>
+#include "../../sysconfig.h"
 #include "../../citadel_defs.h"
 #include "../../server.h"
 #include "../../citserver.h"
@@ -36,6 +37,18 @@
 struct rssfeed {
 	char url[SIZ];			// string containing the URL of an RSS or Atom feed
 	char room[ROOMNAMELEN];		// the name of the room which is pulling this feed
+	int config_interval;		// poll interval set in the room's config (seconds), or 0 if none was set
+	int interval;			// how often we poll it (seconds)
+	time_t next_poll;		// when we poll it next
+	int failures;			// polls in a row which have failed
+	char etag[256];			// validators from the last time it was downloaded, for a conditional GET
+	char last_modified[128];
+	CURL *curl;			// the poll in progress, if there is one
+	StrBuf *downloaded;
+	struct curl_slist *headers;
+	char new_etag[256];
+	char new_last_modified[128];
+	struct rssfeed *next;
 };
 
 struct rssparser {
@@ -46,9 +59,11 @@ struct rssparser {
 	char *link;
 	char *description;
 	char *item_id;
+	int ttl;
 };
 
-time_t last_run = 0L;
+struct rssfeed *feeds = NULL;		// every feed configured in any room, and when each one is due
+time_t last_scan = 0L;
 
 
 // This handler is called whenever an XML tag opens.
@@ -219,6 +234,10 @@ void rss_end_element(void *data, const char *el) {
 		}
 	}
 
+	else if (!strcasecmp(el, "ttl")) {			// how many minutes the feed may be cached (rss)
+		r->ttl = atoi(ChrPtr(r->CData));
+	}
+
 	else if (!strcasecmp(el, "link")) {			// link to story (rss)
 		if (r->link != NULL) {
 			free(r->link);
@@ -272,61 +291,299 @@ void rss_handle_data(void *data, const char *content, int length) {
 // Feed has been downloaded, now parse it.
 // `Feed` is the actual RSS downloaded from the site.
 // `url` is a string containing the feed URL
-void rss_parse_feed(StrBuf *Feed, char *url, char *room) {
+// Returns the number of minutes the feed says it may be cached for, or 0 if it doesn't say.
+int rss_parse_feed(StrBuf *Feed, char *url, char *room) {
 	struct rssparser r;
 
 	memset(&r, 0, sizeof r);
-	strcpy(r.url, url);
-	strcpy(r.room, room);
+	safestrncpy(r.url, url, sizeof r.url);
+	safestrncpy(r.room, room, sizeof r.room);
 	XML_Parser p = XML_ParserCreate("UTF-8");
 	XML_SetElementHandler(p, rss_start_element, rss_end_element);
 	XML_SetCharacterDataHandler(p, rss_handle_data);
 	XML_SetUserData(p, (void *)&r);
 	XML_Parse(p, ChrPtr(Feed), StrLength(Feed), XML_TRUE);
 	XML_ParserFree(p);
+	return(r.ttl);
+}
+
+
+// libcurl hands us the response headers one at a time.  We keep the validators so we can ask for the feed
+// conditionally next time.  (If there were redirects, we only want the headers from the last response.)
+size_t rss_header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+	struct rssfeed *f = (struct rssfeed *) userdata;
+	size_t len = size * nitems;
+	char hdr[512];
+
+	safestrncpy(hdr, buffer, ((len < sizeof hdr) ? (len + 1) : sizeof hdr));
+	if (!strncasecmp(hdr, HKEY("HTTP/"))) {
+		f->new_etag[0] = 0;
+		f->new_last_modified[0] = 0;
+	}
+	else if (!strncasecmp(hdr, HKEY("ETag:"))) {
+		safestrncpy(f->new_etag, &hdr[5], sizeof f->new_etag);
+		string_trim(f->new_etag);
+	}
+	else if (!strncasecmp(hdr, HKEY("Last-Modified:"))) {
+		safestrncpy(f->new_last_modified, &hdr[14], sizeof f->new_last_modified);
+		string_trim(f->new_last_modified);
+	}
+	return(len);
+}
+
+
+// A feed's schedule and validators are kept in the config database, so a restart doesn't forget them and
+// download every feed in full (or hammer one which has been failing).  URLs can be longer than a database
+// key may be, so the key is a hash of the URL and room, and the value repeats them in case two ever collide:
+//	next_poll <tab> failures <tab> interval <tab> etag <tab> last_modified <tab> room <tab> url
+void rss_state_key(struct rssfeed *f, char *key, size_t keylen) {
+	char buf[SIZ + ROOMNAMELEN + 2];
+
+	snprintf(buf, sizeof buf, "%s|%s", f->url, f->room);
+	snprintf(key, keylen, "rssclient_%08x", (unsigned int) HashLittle(buf, strlen(buf)));
+}
+
+
+void rss_save_state(struct rssfeed *f) {
+	char key[64];
+	char *value;
+	size_t len;
+
+	rss_state_key(f, key, sizeof key);
+	len = strlen(f->etag) + strlen(f->last_modified) + strlen(f->room) + strlen(f->url) + 128;
+	value = malloc(len);
+	snprintf(value, len, "%ld\t%d\t%d\t%s\t%s\t%s\t%s",
+		(long) f->next_poll, f->failures, f->interval, f->etag, f->last_modified, f->room, f->url
+	);
+	CtdlSetConfigStr(key, value);
+	free(value);
 }
 
 
-// pull one RSS feed and save it to a room
-void rss_pull_one_feed(char *url, char *room) {
-	CURL *curl;
-	CURLcode res;
-	StrBuf *Downloaded = NULL;
+void rss_load_state(struct rssfeed *f) {
+	char key[64];
+	char room[ROOMNAMELEN];
+	char *value;
+	char *url;
+	int i;
 
-	curl = curl_easy_init();
-	if (!curl) {
+	rss_state_key(f, key, sizeof key);
+	value = CtdlGetConfigStr(key);
+	if ((value == NULL) || (num_tokens(value, '\t') < 7)) {
+		return;
+	}
+	extract_token(room, value, 5, '\t', sizeof room);
+	for (i = 0, url = value; (url != NULL) && (i < 6); ++i) {	// the URL is everything after the sixth tab
+		url = strchr(url, '\t');
+		if (url != NULL) ++url;
+	}
+	if ((url == NULL) || (strcmp(url, f->url)) || (strcasecmp(room, f->room))) {
 		return;
 	}
 
-	Downloaded = NewStrBuf();
+	f->next_poll = extract_long(value, 0);
+	f->failures = extract_int(value, 1);
+	if (extract_int(value, 2) > 0) {
+		f->interval = extract_int(value, 2);
+	}
+	extract_token(f->etag, value, 3, '\t', sizeof f->etag);
+	extract_token(f->last_modified, value, 4, '\t', sizeof f->last_modified);
+}
+
+
+void rss_forget_state(struct rssfeed *f) {
+	char key[64];
+
+	rss_state_key(f, key, sizeof key);
+	CtdlDelConfig(key);
+}
+
+
+// Set up the download of one feed
+CURL *rss_poll_start(struct rssfeed *f) {
+	char hdr[512];
+
+	f->curl = curl_easy_init();
+	if (!f->curl) {
+		return(NULL);
+	}
+
+	f->downloaded = NewStrBuf();
+	f->new_etag[0] = 0;
+	f->new_last_modified[0] = 0;
+	if (!IsEmptyStr(f->etag)) {
+		snprintf(hdr, sizeof hdr, "If-None-Match: %s", f->etag);
+		f->headers = curl_slist_append(f->headers, hdr);
+	}
+	if (!IsEmptyStr(f->last_modified)) {
+		snprintf(hdr, sizeof hdr, "If-Modified-Since: %s", f->last_modified);
+		f->headers = curl_slist_append(f->headers, hdr);
+	}
+
+	syslog(LOG_DEBUG, "rssclient: fetching %s%s", f->url, (f->headers ? " (conditional)" : ""));
+	curl_easy_setopt(f->curl, CURLOPT_URL, f->url);
+	curl_easy_setopt(f->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(f->curl, CURLOPT_SSL_VERIFYHOST, 0L);
+	curl_easy_setopt(f->curl, CURLOPT_FOLLOWLOCATION, 1L);			// Follow redirects
+	curl_easy_setopt(f->curl, CURLOPT_WRITEFUNCTION, CurlFillStrBuf_callback);	// What to do with downloaded data
+	curl_easy_setopt(f->curl, CURLOPT_WRITEDATA, f->downloaded);		// Give it our StrBuf to work with
+	curl_easy_setopt(f->curl, CURLOPT_HEADERFUNCTION, rss_header_callback);
+	curl_easy_setopt(f->curl, CURLOPT_HEADERDATA, (void *) f);
+	if (f->headers) {
+		curl_easy_setopt(f->curl, CURLOPT_HTTPHEADER, f->headers);
+	}
+	curl_easy_setopt(f->curl, CURLOPT_TIMEOUT, 20L);				// Time out after 20 seconds
+	curl_easy_setopt(f->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(f->curl, CURLOPT_PRIVATE, (void *) f);
+	return(f->curl);
+}
+
+
+void rss_poll_cleanup(struct rssfeed *f) {
+	if (f->curl) {
+		curl_easy_cleanup(f->curl);
+		f->curl = NULL;
+	}
+	if (f->headers) {
+		curl_slist_free_all(f->headers);
+		f->headers = NULL;
+	}
+	FreeStrBuf(&f->downloaded);
+}
+
+
+// A feed has finished downloading.  Save any new items and work out when to poll it next.
+void rss_poll_done(struct rssfeed *f, CURLcode res) {
+	long response_code = 0;
+	int ttl = 0;
 
-	syslog(LOG_DEBUG, "rssclient: fetching %s", url);
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);			// Follow redirects
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlFillStrBuf_callback);	// What to do with downloaded data
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, Downloaded);			// Give it our StrBuf to work with
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);				// Time out after 20 seconds
-	res = curl_easy_perform(curl);						// Perform the request
+	curl_easy_getinfo(f->curl, CURLINFO_RESPONSE_CODE, &response_code);
 	if (res != CURLE_OK) {
-		syslog(LOG_WARNING, "rssclient: failed to load feed: %s", curl_easy_strerror(res));
+		syslog(LOG_WARNING, "rssclient: failed to load feed %s: %s", f->url, curl_easy_strerror(res));
+		++f->failures;
+	}
+	else if (response_code == 304) {
+		syslog(LOG_DEBUG, "rssclient: %s has not changed", f->url);
+		f->failures = 0;
+	}
+	else if (response_code >= 400) {
+		syslog(LOG_WARNING, "rssclient: failed to load feed %s: HTTP %ld", f->url, response_code);
+		++f->failures;
+	}
+	else {
+		f->failures = 0;
+		safestrncpy(f->etag, f->new_etag, sizeof f->etag);
+		safestrncpy(f->last_modified, f->new_last_modified, sizeof f->last_modified);
+		ttl = rss_parse_feed(f->downloaded, f->url, f->room);
 	}
-	curl_easy_cleanup(curl);
 
-	rss_parse_feed(Downloaded, url, room);
-	FreeStrBuf(&Downloaded);						// free the downloaded feed data
+	// The room's config decides how often we poll, if it says; otherwise the feed can ask us to slow down.
+	if (f->config_interval > 0) {
+		f->interval = f->config_interval;
+	}
+	else if (ttl > 0) {
+		f->interval = ttl * 60;
+		if (f->interval < RSSCLIENT_POLL_INTERVAL) {
+			f->interval = RSSCLIENT_POLL_INTERVAL;
+		}
+		if (f->interval > RSSCLIENT_MAX_INTERVAL) {
+			f->interval = RSSCLIENT_MAX_INTERVAL;
+		}
+	}
+
+	// A feed which keeps failing is tried less and less often
+	long wait = f->interval;
+	int doublings = f->failures;
+	while ((doublings-- > 0) && (wait < RSSCLIENT_MAX_INTERVAL)) {
+		wait *= 2;
+	}
+	if ((f->failures > 0) && (wait > RSSCLIENT_MAX_INTERVAL)) {
+		wait = RSSCLIENT_MAX_INTERVAL;
+	}
+	f->next_poll = time(NULL) + wait;
+	rss_save_state(f);
+
+	rss_poll_cleanup(f);
+}
+
+
+// Download every feed which is due, several at a time
+void rss_poll_feeds(void) {
+	CURLM *multi;
+	CURLMsg *m;
+	struct rssfeed *f = feeds;
+	int num_active = 0;
+	int num_polled = 0;
+	int still_running = 0;
+	int msgs_left = 0;
+	time_t now = time(NULL);
+
+	multi = curl_multi_init();
+	if (!multi) {
+		return;
+	}
+
+	while (((f != NULL) || (num_active > 0)) && (!server_shutting_down)) {
+
+		// Start as many downloads as we're allowed to
+		while ((f != NULL) && (num_active < RSSCLIENT_MAX_CONNECTIONS)) {
+			if ((f->next_poll <= now) && (rss_poll_start(f) != NULL)) {
+				curl_multi_add_handle(multi, f->curl);
+				++num_active;
+				++num_polled;
+			}
+			f = f->next;
+		}
+
+		curl_multi_perform(multi, &still_running);
+
+		// Collect the ones which have finished
+		while (m = curl_multi_info_read(multi, &msgs_left), m != NULL) {
+			if (m->msg != CURLMSG_DONE) {
+				continue;
+			}
+			CURL *curl = m->easy_handle;
+			CURLcode res = m->data.result;
+			char *priv = NULL;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+			curl_multi_remove_handle(multi, curl);
+			rss_poll_done((struct rssfeed *) priv, res);
+			--num_active;
+		}
+
+		if (num_active > 0) {
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+	}
+
+	// If we're shutting down, anything still going is abandoned
+	for (f = feeds; f != NULL; f = f->next) {
+		if (f->curl) {
+			curl_multi_remove_handle(multi, f->curl);
+			rss_poll_cleanup(f);
+		}
+	}
+	curl_multi_cleanup(multi);
+
+	if (num_polled > 0) {
+		syslog(LOG_DEBUG, "rssclient: polled %d feed%s", num_polled, ((num_polled == 1) ? "" : "s"));
+	}
 }
 
 
-// Scan a room's netconfig looking for RSS feed parsing requests
+// Scan a room's netconfig looking for RSS feed parsing requests.  A feed we already knew about keeps its
+// schedule and validators; it is moved from the old list to the new one.  A feed we didn't know about picks up
+// whatever was saved the last time it was polled.
 void rssclient_scan_room(struct ctdlroom *qrbuf, void *data) {
 	char *serialized_config = NULL;
 	int num_configs = 0;
 	char cfgline[SIZ];
-	struct rssfeed one_feed;
+	char url[SIZ];
+	struct rssfeed **old_feeds = (struct rssfeed **)data;
+	struct rssfeed **pf;
+	struct rssfeed *f;
+	int interval;
 	int i = 0;
-	Array *feeds = (Array *)data;
 
 	if (server_shutting_down) return;
 
@@ -339,14 +596,35 @@ void rssclient_scan_room(struct ctdlroom *qrbuf, void *data) {
 	for (i=0; i<num_configs; ++i) {
 		extract_token(cfgline, serialized_config, i, '\n', sizeof cfgline);
 		if (!strncasecmp(cfgline, HKEY("rssclient|"))) {
-			strcpy(cfgline, &cfgline[10]);
-			char *vbar = strchr(cfgline, '|');
-			if (vbar != NULL) {
-				*vbar = 0;
+			extract_token(url, cfgline, 1, '|', sizeof url);
+			interval = extract_int(cfgline, 2) * 60;	// optional poll interval, in minutes
+			if ((interval > 0) && (interval < 60)) {
+				interval = 60;
+			}
+
+			for (pf = old_feeds; *pf != NULL; pf = &(*pf)->next) {
+				if ((!strcmp((*pf)->url, url)) && (!strcasecmp((*pf)->room, qrbuf->QRname))) {
+					break;
+				}
+			}
+			if (*pf != NULL) {
+				f = *pf;
+				*pf = f->next;
 			}
-			safestrncpy(one_feed.url, cfgline, SIZ);
-			safestrncpy(one_feed.room, qrbuf->QRname, ROOMNAMELEN);
-			array_append(feeds, &one_feed);
+			else {
+				f = malloc(sizeof(struct rssfeed));
+				memset(f, 0, sizeof(struct rssfeed));
+				safestrncpy(f->url, url, sizeof f->url);
+				safestrncpy(f->room, qrbuf->QRname, sizeof f->room);
+				f->interval = RSSCLIENT_POLL_INTERVAL;
+				rss_load_state(f);
+			}
+			if (interval != f->config_interval) {
+				f->config_interval = interval;
+				f->interval = ((interval > 0) ? interval : RSSCLIENT_POLL_INTERVAL);
+			}
+			f->next = feeds;
+			feeds = f;
 		}
 	}
 
@@ -354,37 +632,30 @@ void rssclient_scan_room(struct ctdlroom *qrbuf, void *data) {
 }
 
 
-// Scan for rooms that have RSS client requests configured
+// Look for feeds which are due to be polled, and poll them.  The list of feeds is rebuilt from the rooms'
+// configurations every RSSCLIENT_POLL_INTERVAL seconds.
 void rssclient_scan(void) {
 	time_t now = time(NULL);
-
-	// Run no more than once every 15 minutes.
-	if ((now - last_run) < 900) {
-		syslog(LOG_DEBUG,
-			"rssclient: polling interval not yet reached; last run was %ldm%lds ago",
-			((now - last_run) / 60),
-			((now - last_run) % 60)
-		);
-		return;
-	}
-
-	syslog(LOG_DEBUG, "rssclient: started");
-	Array *feeds = array_new(sizeof(struct rssfeed));
-	if (feeds == NULL) {
-		syslog(LOG_DEBUG, "rssclient: cannot allocate memory for feed list");
-		return;
-	}
-	CtdlForEachRoom(rssclient_scan_room, feeds);
-
-	for (int i=0; i<array_len(feeds); ++i) {
-		struct rssfeed *r = (struct rssfeed *) array_get_element_at(feeds, i);
-		rss_pull_one_feed(r->url, r->room);
+	struct rssfeed *old_feeds;
+	struct rssfeed *f;
+
+	if ((now - last_scan) >= RSSCLIENT_POLL_INTERVAL) {
+		syslog(LOG_DEBUG, "rssclient: scanning rooms for feeds");
+		old_feeds = feeds;
+		feeds = NULL;
+		CtdlForEachRoom(rssclient_scan_room, &old_feeds);
+		while (old_feeds != NULL) {			// these are no longer configured anywhere
+			f = old_feeds;
+			old_feeds = f->next;
+			if (!server_shutting_down) {		// (if we are, the scan stopped early)
+				rss_forget_state(f);
+			}
+			free(f);
+		}
+		last_scan = now;
 	}
 
-	array_free(feeds);
-	syslog(LOG_DEBUG, "rssclient: ended");
-	last_run = time(NULL);
-	return;
+	rss_poll_feeds();
 }
 
 
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <libcitadel.h>
 #include <curl/curl.h>
 #include "../../sysconfig.h"
@@ -31,6 +32,7 @@
 #include "../../internet_addressing.h"
 #include "../../citadel_dirs.h"
 #include "../smtp/smtp_util.h"
+#include "../smtp/smtp_queue.h"
 
 long last_queue_job_submitted = 0;
 long last_queue_job_processed = 0;
@@ -41,6 +43,77 @@ struct smtpmsgsrc {		// Data passed in and out of libcurl for message upload
 	int bytes_sent;
 };
 
+// libcurl can be told to carry on with a transaction when some of its recipients are refused.  Without
+// that, one bad address would sink everyone else's delivery, so we only batch recipients when we have it.
+#if LIBCURL_VERSION_NUM >= 0x080200
+#define SMTP_RCPT_ALLOWFAILS	CURLOPT_MAIL_RCPT_ALLOWFAILS
+#elif LIBCURL_VERSION_NUM >= 0x074500
+#define SMTP_RCPT_ALLOWFAILS	CURLOPT_MAIL_RCPT_ALLLOWFAILS
+#endif
+
+struct smtp_recp {		// One recipient of a queue entry, and how delivery to it went
+	char *addr;
+	int result;		// three-digit SMTP status
+	char *response;		// what the remote server said (or NULL)
+};
+
+struct smtp_session;
+
+struct smtp_domain {		// A destination domain, its MX list, and how many sessions are open to it
+	char node[1024];
+	char mxes[SIZ];
+	int num_mx;
+	int active;
+	int held;			// nonzero if we're not trying this domain right now
+	unsigned int mx_down;		// MXes which could not be reached during this run (the first 32 of them)
+	int tried;			// sessions which tried to connect during this run
+	int reached;			// sessions which got an answer from an MX during this run
+	int delivered;			// and what became of the recipients
+	int deferred;
+	int failed;
+	int num_held;
+	struct smtp_session *filling;	// the session we're adding its recipients to
+	struct smtp_domain *next;
+};
+
+// What we remember about a destination domain from one queue run to the next: how delivery to it has been
+// going, and whether we're holding off on it because none of its MXes could be reached the last few times we tried.
+struct smtp_domain_state {
+	long sessions;
+	long delivered;
+	long deferred;
+	long failed;
+	long unreachable;
+	long held;
+	int consecutive;		// delivery attempts in a row in which no MX could be reached
+	time_t hold_until;		// don't try the domain again before this time
+	time_t last_attempt;
+};
+
+static HashList *domain_states = NULL;
+static pthread_mutex_t domain_states_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// libcurl's cache of host name lookups, shared by every session so that it lasts from one queue run to the next
+static CURLSH *smtp_share = NULL;
+static pthread_mutex_t smtp_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct smtp_session {		// One SMTP transaction: one message, one MX, one or more recipients
+	struct smtp_domain *dom;
+	int mx;			// which of the domain's MXes to try
+	int *recps;		// indexes into the array of recipients
+	int num_recps;
+	int rcpt_sent;		// how many RCPT TO commands have gone out
+	int awaiting_rcpt;	// which of them we're waiting for a reply to, or -1
+	int *rcpt_code;		// the reply to each one
+	char **rcpt_text;
+	struct smtpmsgsrc src;
+	StrBuf *own_message;	// a copy of the message with headers just for this recipient (or NULL)
+	struct curl_slist *rcpt_list;
+	CURL *curl;
+	char response[SIZ];	// the last reply line received
+	struct smtp_session *next;
+};
+
 // Initialize the SMTP outbound queue
 void smtp_init_spoolout(void) {
 	struct ctdlroom qrbuf;
@@ -141,26 +214,6 @@ static size_t upload_source(void *ptr, size_t size, size_t nmemb, void *userp) {
 }
 
 
-// The libcurl API doesn't provide a way to capture the actual SMTP result message returned
-// by the remote server.  This is an ugly way to extract it, by capturing debug data from
-// the library and filtering on the lines we want.
-int ctdl_libcurl_smtp_debug_callback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr) {
-	if (type != CURLINFO_HEADER_IN)
-		return 0;
-	if (!userptr)
-		return 0;
-	char *debugbuf = (char *) userptr;
-
-	int len = strlen(debugbuf);
-	if (len + size > SIZ)
-		return 0;
-
-	memcpy(&debugbuf[len], data, size);
-	debugbuf[len + size] = 0;
-	return 0;
-}
-
-
 // Go through the debug output of an SMTP transaction, and boil it down to just the final success or error response message.
 void trim_response(long response_code, char *response) {
 	if ((response_code < 100) || (response_code > 999) || (IsEmptyStr(response))) {
@@ -196,122 +249,534 @@ void trim_response(long response_code, char *response) {
 }
 
 
-// Attempt a delivery to one recipient.
-// Returns a three-digit SMTP status code.
-int smtp_attempt_delivery(long msgid, char *recp, char *envelope_from, char *source_room, char *response) {
-	struct smtpmsgsrc s;
-	char *fromaddr = NULL;
+// The libcurl API doesn't provide a way to capture the actual SMTP result messages returned
+// by the remote server.  This is an ugly way to extract them, by capturing debug data from
+// the library and filtering on the lines we want.  We keep the last reply line, and we match
+// up the reply to each RCPT TO command with its recipient.
+static int ctdl_libcurl_smtp_debug_callback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr) {
+	struct smtp_session *sess = (struct smtp_session *) userptr;
+
+	if (!sess) {
+		return 0;
+	}
+
+	if (type == CURLINFO_HEADER_OUT) {
+		if ((size >= 8) && (!strncasecmp(data, "RCPT TO:", 8)) && (sess->rcpt_sent < sess->num_recps)) {
+			sess->awaiting_rcpt = sess->rcpt_sent++;
+		}
+		return 0;
+	}
+	if (type != CURLINFO_HEADER_IN) {
+		return 0;
+	}
+
+	if (size >= sizeof sess->response) {
+		size = sizeof sess->response - 1;
+	}
+	memcpy(sess->response, data, size);
+	sess->response[size] = 0;
+
+	// The last line of a reply is three digits followed by anything but a hyphen
+	if (	(sess->awaiting_rcpt >= 0)
+		&& (size >= 3)
+		&& (isdigit(data[0])) && (isdigit(data[1])) && (isdigit(data[2]))
+		&& ((size == 3) || (data[3] != '-'))
+	) {
+		int code = atoi(sess->response);
+		sess->rcpt_code[sess->awaiting_rcpt] = code;
+		if ((code / 100) != 2) {
+			char *text = strdup(sess->response);
+			if (text) {
+				trim_response(code, text);
+				sess->rcpt_text[sess->awaiting_rcpt] = text;
+			}
+		}
+		sess->awaiting_rcpt = -1;
+	}
+	return 0;
+}
+
+
+static void smtp_share_lockfunc(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+	pthread_mutex_lock(&smtp_share_lock);
+}
+
+
+static void smtp_share_unlockfunc(CURL *handle, curl_lock_data data, void *userptr) {
+	pthread_mutex_unlock(&smtp_share_lock);
+}
+
+
+// Is a domain being held because its MXes haven't been answering?
+static int smtp_domain_is_held(char *node) {
+	struct smtp_domain_state *st = NULL;
+	int held = 0;
+
+	pthread_mutex_lock(&domain_states_lock);
+	if ((domain_states != NULL) && (GetHash(domain_states, node, strlen(node), (void *)&st)) && (st != NULL)) {
+		held = (st->hold_until > time(NULL));
+	}
+	pthread_mutex_unlock(&domain_states_lock);
+	return(held);
+}
+
+
+// At the end of a delivery attempt, add what happened to each domain to what we remember about it.  A domain
+// whose MXes couldn't be reached SMTP_HOLD_THRESHOLD attempts in a row is held for SMTP_HOLD_MIN seconds, doubling
+// each further time it happens, up to SMTP_HOLD_MAX.
+static void smtp_record_domain(struct smtp_domain *dom) {
+	struct smtp_domain_state *st = NULL;
+	time_t now = time(NULL);
+	long hold;
+
+	pthread_mutex_lock(&domain_states_lock);
+	if (domain_states == NULL) {
+		domain_states = NewHash(1, NULL);
+	}
+	if ((!GetHash(domain_states, dom->node, strlen(dom->node), (void *)&st)) || (st == NULL)) {
+		if (GetCount(domain_states) >= SMTP_DOMAIN_STATES) {	// keep this from growing without bound
+			DeleteHashContent(&domain_states);
+			domain_states = NewHash(1, NULL);
+		}
+		st = malloc(sizeof(struct smtp_domain_state));
+		if (st == NULL) {
+			pthread_mutex_unlock(&domain_states_lock);
+			return;
+		}
+		memset(st, 0, sizeof(struct smtp_domain_state));
+		Put(domain_states, dom->node, strlen(dom->node), st, NULL);
+	}
+
+	st->sessions += dom->tried;
+	st->delivered += dom->delivered;
+	st->deferred += dom->deferred;
+	st->failed += dom->failed;
+	st->held += dom->num_held;
+	if (dom->tried > 0) {
+		st->last_attempt = now;
+		if (dom->reached > 0) {
+			st->consecutive = 0;
+			st->hold_until = 0;
+		}
+		else {
+			++st->unreachable;
+			if (++st->consecutive >= SMTP_HOLD_THRESHOLD) {
+				int doublings = st->consecutive - SMTP_HOLD_THRESHOLD;
+				hold = SMTP_HOLD_MIN;
+				while ((doublings-- > 0) && (hold < SMTP_HOLD_MAX)) {
+					hold *= 2;
+				}
+				if (hold > SMTP_HOLD_MAX) {
+					hold = SMTP_HOLD_MAX;
+				}
+				st->hold_until = now + hold;
+				syslog(LOG_INFO, "smtpclient: no MX for <%s> could be reached %d times in a row; holding it for %ld seconds",
+					dom->node, st->consecutive, hold
+				);
+			}
+		}
+	}
+	pthread_mutex_unlock(&domain_states_lock);
+}
+
+
+// Find (or add) a recipient's domain, looking up its MX list the first time we see it
+static struct smtp_domain *smtp_find_domain(struct smtp_domain **domains, char *node) {
+	struct smtp_domain *dom;
+
+	for (dom = *domains; dom != NULL; dom = dom->next) {
+		if (!strcasecmp(dom->node, node)) {
+			return(dom);
+		}
+	}
+
+	dom = malloc(sizeof(struct smtp_domain));
+	memset(dom, 0, sizeof(struct smtp_domain));
+	safestrncpy(dom->node, node, sizeof dom->node);
+	dom->held = smtp_domain_is_held(dom->node);
+	if (!dom->held) {
+		dom->num_mx = getmx(dom->mxes, dom->node);
+	}
+	dom->next = *domains;
+	*domains = dom;
+	return(dom);
+}
+
+
+// Set up a libcurl handle for an SMTP session
+static CURL *smtp_session_start(struct smtp_session *sess, struct smtp_recp *recps, StrBuf *message, char *mail_from, char *source_room) {
 	CURL *curl;
-	CURLcode res = CURLE_OK;
-	struct curl_slist *recipients = NULL;
-	long response_code = 421;
-	int num_mx = 0;
-	char mxes[SIZ];
-	char user[1024];
-	char node[1024];
-	char name[1024];
 	char try_this_mx[256];
 	char smtp_url[512];
 	int i;
 
-	syslog(LOG_DEBUG, "smtpclient: smtp_attempt_delivery(%ld, %s)", msgid, recp);
-
-	process_rfc822_addr(recp, user, node, name);	// split recipient address into username, hostname, displayname
-	num_mx = getmx(mxes, node);
-	if (num_mx < 1) {
-		return (421);
+	curl = curl_easy_init();
+	if (!curl) {
+		return(NULL);
 	}
 
-	CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
 	if (!IsEmptyStr(source_room)) {
-		// If we have a source room, it's probably a mailing list message; generate an unsubscribe header
+		// If we have a source room, it's probably a mailing list message; generate an unsubscribe header.
+		// (This is why mailing list messages go to one recipient per session.)
 		char esc_room[ROOMNAMELEN*2];
 		char esc_email[1024];
 		urlesc(esc_room, sizeof esc_room, source_room);
-		urlesc(esc_email, sizeof esc_email, recp);
-		cprintf("List-Unsubscribe: <http://%s/listsub?cmd=unsubscribe&room=%s&email=%s>\r\n",
+		urlesc(esc_email, sizeof esc_email, recps[sess->recps[0]].addr);
+		sess->own_message = NewStrBufPlain(NULL, StrLength(message) + 256);
+		StrBufPrintf(sess->own_message,
+			"List-Unsubscribe: <http://%s/listsub?cmd=unsubscribe&room=%s&email=%s>\r\n",
 			CtdlGetConfigStr("c_fqdn"),
 			esc_room,
 			esc_email
 		);
+		StrBufAppendBuf(sess->own_message, message, 0);
+		sess->src.TheMessage = sess->own_message;
+	}
+	else {
+		sess->src.TheMessage = message;
+	}
+	sess->src.bytes_total = StrLength(sess->src.TheMessage);
+	sess->src.bytes_sent = 0;
+
+	sess->rcpt_sent = 0;
+	sess->awaiting_rcpt = -1;
+	sess->response[0] = 0;
+	for (i = 0; i < sess->num_recps; ++i) {
+		sess->rcpt_list = curl_slist_append(sess->rcpt_list, recps[sess->recps[i]].addr);
+		sess->rcpt_code[i] = 0;
+		sess->rcpt_text[i] = NULL;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_MAIL_FROM, mail_from);
+	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, sess->rcpt_list);
+#ifdef SMTP_RCPT_ALLOWFAILS
+	curl_easy_setopt(curl, SMTP_RCPT_ALLOWFAILS, 1L);			// deliver to whoever is accepted
+#endif
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_source);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &sess->src);
+	curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);				// tell libcurl we are uploading
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L + (2L * sess->num_recps));	// Time out after 20 seconds, plus a bit per recipient
+	if (CtdlGetConfigInt("c_smtpclient_disable_starttls") == 0) {
+		curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);	// Attempt STARTTLS if offered
+	}
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+	curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, ctdl_libcurl_smtp_debug_callback);
+	curl_easy_setopt(curl, CURLOPT_DEBUGDATA, (void *) sess);
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *) sess);
+	if (smtp_share) {
+		curl_easy_setopt(curl, CURLOPT_SHARE, smtp_share);
+		curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, (long) SMTP_DNS_CACHE_TIMEOUT);
+	}
+
+	// Construct an SMTP URL in the form of:
+	//      smtp[s]://target_host/source_host
+	// This looks weird but libcurl uses that last part to set our name for EHLO or HELO.
+	// We check for "smtp://" and "smtps://" because the admin may have put those prefixes in a smart-host entry.
+	// If there is no prefix we add "smtp://"
+	extract_token(try_this_mx, sess->dom->mxes, sess->mx, '|', (sizeof try_this_mx - 7));
+	snprintf(smtp_url, sizeof smtp_url,
+		"%s%s/%s",
+		(((!strncasecmp(try_this_mx, HKEY("smtp://")))
+		|| (!strncasecmp(try_this_mx, HKEY("smtps://")))) ? "" : "smtp://"),
+		try_this_mx, CtdlGetConfigStr("c_fqdn")
+	);
+	curl_easy_setopt(curl, CURLOPT_URL, smtp_url);
+	syslog(LOG_DEBUG, "smtpclient: trying MX %d of %d <%s> for %d recipient%s",
+		sess->mx + 1, sess->dom->num_mx, smtp_url, sess->num_recps, ((sess->num_recps == 1) ? "" : "s")
+	);
+
+	sess->curl = curl;
+	return(curl);
+}
+
+
+// An SMTP session is over.  Record each recipient's result.  Returns nonzero if there are recipients left
+// over who got a transient failure and whose domain has another MX, in which case the session has been
+// set up to try them there.
+static int smtp_session_done(struct smtp_session *sess, CURLcode res, struct smtp_recp *recps) {
+	long response_code = 0;
+	int remaining = 0;
+	int i, result;
+	char *text;
+
+	curl_easy_getinfo(sess->curl, CURLINFO_RESPONSE_CODE, &response_code);
+	syslog(LOG_DEBUG,
+	       "smtpclient: libcurl returned %d (%s) , SMTP response %ld",
+	       res, curl_easy_strerror(res), response_code
+	);
+	++sess->dom->tried;
+	if ((res != CURLE_OK) && (response_code == 0)) {	// check for errors
+		response_code = 421;				// non-protocol errors are transient
+		if (sess->mx < 32) {
+			sess->dom->mx_down |= (1U << sess->mx);	// don't bother with this MX again during this run
+		}
 	}
+	else {
+		++sess->dom->reached;
+	}
+	trim_response(response_code, sess->response);		// trim the reply down to just the actual message
+
+	// A recipient who was refused gets the reply to their RCPT TO; everyone else gets the final reply
+	for (i = 0; i < sess->num_recps; ++i) {
+		struct smtp_recp *r = &recps[sess->recps[i]];
+		if ((sess->rcpt_code[i] != 0) && ((sess->rcpt_code[i] / 100) != 2)) {
+			result = sess->rcpt_code[i];
+			text = (sess->rcpt_text[i] ? sess->rcpt_text[i] : "");
+		}
+		else {
+			result = (int) response_code;
+			text = sess->response;
+		}
+		r->result = result;
+		if (r->response) {
+			free(r->response);
+		}
+		r->response = strdup(text);
+		if (sess->rcpt_text[i]) {
+			free(sess->rcpt_text[i]);
+			sess->rcpt_text[i] = NULL;
+		}
+
+		if (((result / 100) == 4) && (sess->mx + 1 < sess->dom->num_mx)) {
+			sess->recps[remaining] = sess->recps[i];
+			sess->rcpt_code[remaining] = 0;
+			++remaining;
+		}
+		else if ((result / 100) == 2) {
+			++sess->dom->delivered;
+		}
+		else if ((result / 100) == 5) {
+			++sess->dom->failed;
+		}
+		else {
+			++sess->dom->deferred;
+		}
+	}
+
+	curl_slist_free_all(sess->rcpt_list);
+	sess->rcpt_list = NULL;
+	curl_easy_cleanup(sess->curl);
+	sess->curl = NULL;
+	FreeStrBuf(&sess->own_message);
+
+	sess->num_recps = remaining;
+	if (remaining > 0) {
+		++sess->mx;
+		return(1);
+	}
+	return(0);
+}
+
+
+// None of a session's MXes could be reached, so its recipients get a transient failure without another try
+static void smtp_session_unreachable(struct smtp_session *sess, struct smtp_recp *recps) {
+	int i;
+
+	for (i = 0; i < sess->num_recps; ++i) {
+		struct smtp_recp *r = &recps[sess->recps[i]];
+		r->result = 421;
+		if (r->response == NULL) {
+			r->response = strdup("No mail server for this domain could be reached");
+		}
+		++sess->dom->deferred;
+	}
+}
+
+
+static void smtp_session_free(struct smtp_session *sess) {
+	int i;
+
+	if (sess->rcpt_text) {
+		for (i = 0; i < sess->num_recps; ++i) {
+			if (sess->rcpt_text[i]) {
+				free(sess->rcpt_text[i]);
+			}
+		}
+	}
+	if (sess->rcpt_list) {
+		curl_slist_free_all(sess->rcpt_list);
+	}
+	if (sess->curl) {
+		curl_easy_cleanup(sess->curl);
+	}
+	FreeStrBuf(&sess->own_message);
+	free(sess->recps);
+	free(sess->rcpt_code);
+	free(sess->rcpt_text);
+	free(sess);
+}
+
+
+// Attempt delivery of one message to a list of recipients.
+//
+// The message is rendered once.  Recipients are grouped by domain into sessions of up to SMTP_MAX_RCPTS
+// each, and the sessions are run side by side on libcurl's multi interface, which hands a session a
+// connection left open by an earlier one to the same MX when there is one.  No more than
+// SMTP_MAX_CONNECTIONS sessions run at once, and no more than SMTP_MAX_DOMAIN_CONNECTIONS to any one domain.
+// A recipient we couldn't find anything out about is left with a 421, so it will be tried again later.
+void smtp_attempt_delivery(long msgid, struct smtp_recp *recps, int num_recps, char *envelope_from, char *source_room) {
+	char *fromaddr = NULL;
+	StrBuf *message;
+	struct smtp_domain *domains = NULL;
+	struct smtp_domain *dom;
+	struct smtp_session *pending = NULL;
+	struct smtp_session **pending_tail = &pending;
+	struct smtp_session **pp;
+	struct smtp_session *sess;
+	struct smtp_session *active[SMTP_MAX_CONNECTIONS];
+	CURLM *multi;
+	CURLMsg *m;
+	int num_active = 0;
+	int still_running = 0;
+	int msgs_left = 0;
+	int batch_size = 1;
+	char user[1024];
+	char node[1024];
+	char name[1024];
+	char *mail_from;
+	int i;
+
+	syslog(LOG_DEBUG, "smtpclient: smtp_attempt_delivery(%ld, %d recipients)", msgid, num_recps);
+	for (i = 0; i < num_recps; ++i) {
+		recps[i].result = 421;
+		recps[i].response = NULL;
+	}
+	memset(active, 0, sizeof active);
+
+	CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
 	CtdlOutputMsg(msgid, MT_RFC822, HEADERS_ALL, 0, 1, NULL, 0, NULL, &fromaddr, NULL);
-	s.TheMessage = CC->redirect_buffer;
-	s.bytes_total = StrLength(CC->redirect_buffer);
-	s.bytes_sent = 0;
+	message = CC->redirect_buffer;
 	CC->redirect_buffer = NULL;
-	response_code = 421;
-					// keep trying MXes until one works or we run out
-	for (i = 0; ((i < num_mx) && ((response_code / 100) == 4)); ++i) {
-		response_code = 421;	// default 421 makes non-protocol errors transient
-		s.bytes_sent = 0;	// rewind our buffer in case we try multiple MXes
-
-		curl = curl_easy_init();
-		if (curl) {
-			response[0] = 0;
-
-			if (!IsEmptyStr(envelope_from)) {
-				curl_easy_setopt(curl, CURLOPT_MAIL_FROM, envelope_from);
+	mail_from = (!IsEmptyStr(envelope_from) ? envelope_from : fromaddr);
+
+#ifdef SMTP_RCPT_ALLOWFAILS
+	if (IsEmptyStr(source_room)) {
+		batch_size = SMTP_MAX_RCPTS;
+	}
+#endif
+
+	// Sort the recipients into sessions, by domain
+	for (i = 0; i < num_recps; ++i) {
+		process_rfc822_addr(recps[i].addr, user, node, name);	// split recipient address into username, hostname, displayname
+		dom = smtp_find_domain(&domains, node);
+		if (dom->held) {
+			recps[i].response = strdup("Delivery to this domain is on hold because its mail servers have not been answering");
+			++dom->num_held;
+			continue;
+		}
+		if (dom->num_mx < 1) {
+			continue;
+		}
+
+		sess = dom->filling;
+		if ((sess == NULL) || (sess->num_recps >= batch_size)) {
+			sess = malloc(sizeof(struct smtp_session));
+			memset(sess, 0, sizeof(struct smtp_session));
+			sess->dom = dom;
+			sess->recps = malloc(sizeof(int) * batch_size);
+			sess->rcpt_code = malloc(sizeof(int) * batch_size);
+			sess->rcpt_text = calloc(batch_size, sizeof(char *));
+			*pending_tail = sess;
+			pending_tail = &sess->next;
+			dom->filling = sess;
+		}
+		sess->recps[sess->num_recps++] = i;
+	}
+
+	multi = curl_multi_init();
+	if (multi) {
+		curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long) SMTP_MAX_CONNECTIONS);
+	}
+	while ((multi) && ((pending != NULL) || (num_active > 0)) && (!server_shutting_down)) {
+
+		// Start as many sessions as the limits allow
+		pp = &pending;
+		while ((*pp != NULL) && (num_active < SMTP_MAX_CONNECTIONS)) {
+			sess = *pp;
+			if (sess->dom->active >= SMTP_MAX_DOMAIN_CONNECTIONS) {
+				pp = &sess->next;
+				continue;
 			}
-			else {
-				curl_easy_setopt(curl, CURLOPT_MAIL_FROM, fromaddr);
+			*pp = sess->next;
+			sess->next = NULL;
+			while ((sess->mx < sess->dom->num_mx) && (sess->mx < 32) && (sess->dom->mx_down & (1U << sess->mx))) {
+				++sess->mx;				// skip MXes which have already failed to answer
 			}
-
-			recipients = curl_slist_append(recipients, recp);
-			curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
-			curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_source);
-			curl_easy_setopt(curl, CURLOPT_READDATA, &s);
-			curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);				// tell libcurl we are uploading
-			curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);				// Time out after 20 seconds
-			if (CtdlGetConfigInt("c_smtpclient_disable_starttls") == 0) {
-				curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);	// Attempt STARTTLS if offered
+			if (sess->mx >= sess->dom->num_mx) {
+				smtp_session_unreachable(sess, recps);
+				smtp_session_free(sess);
+				continue;
 			}
-			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-			curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, ctdl_libcurl_smtp_debug_callback);
-			curl_easy_setopt(curl, CURLOPT_DEBUGDATA, (void *) response);
-			curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-
-			// Construct an SMTP URL in the form of:
-			//      smtp[s]://target_host/source_host
-			// This looks weird but libcurl uses that last part to set our name for EHLO or HELO.
-			// We check for "smtp://" and "smtps://" because the admin may have put those prefixes in a smart-host entry.
-			// If there is no prefix we add "smtp://"
-			extract_token(try_this_mx, mxes, i, '|', (sizeof try_this_mx - 7));
-			snprintf(smtp_url, sizeof smtp_url,
-				"%s%s/%s",
-				(((!strncasecmp(try_this_mx, HKEY("smtp://")))
-				|| (!strncasecmp(try_this_mx, HKEY("smtps://")))) ? "" : "smtp://"),
-				try_this_mx, CtdlGetConfigStr("c_fqdn")
-			);
-			curl_easy_setopt(curl, CURLOPT_URL, smtp_url);
-			syslog(LOG_DEBUG, "smtpclient: trying MX %d of %d <%s>", i+1, num_mx, smtp_url);	// send the message
-			res = curl_easy_perform(curl);
-			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-			syslog(LOG_DEBUG,
-			       "smtpclient: libcurl returned %d (%s) , SMTP response %ld",
-			       res, curl_easy_strerror(res), response_code
-			);
+			if (smtp_session_start(sess, recps, message, mail_from, source_room) == NULL) {
+				smtp_session_free(sess);
+				continue;
+			}
+			curl_multi_add_handle(multi, sess->curl);
+			for (i = 0; active[i] != NULL; ++i) ;
+			active[i] = sess;
+			++sess->dom->active;
+			++num_active;
+		}
+
+		curl_multi_perform(multi, &still_running);
 
-			if ((res != CURLE_OK) && (response_code == 0)) {	// check for errors
-				response_code = 421;
+		// Collect the ones which have finished
+		while (m = curl_multi_info_read(multi, &msgs_left), m != NULL) {
+			if (m->msg != CURLMSG_DONE) {
+				continue;
+			}
+			CURL *curl = m->easy_handle;
+			CURLcode res = m->data.result;
+			char *priv = NULL;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+			sess = (struct smtp_session *) priv;
+			curl_multi_remove_handle(multi, curl);
+			for (i = 0; active[i] != sess; ++i) ;
+			active[i] = NULL;
+			--sess->dom->active;
+			--num_active;
+			if (smtp_session_done(sess, res, recps)) {
+				for (pp = &pending; *pp != NULL; pp = &(*pp)->next) ;
+				*pp = sess;				// try the next MX
+			}
+			else {
+				smtp_session_free(sess);
 			}
+		}
 
-			curl_slist_free_all(recipients);
-			recipients = NULL;					// this gets reused; avoid double-free
-			curl_easy_cleanup(curl);
-			curl = NULL;						// this gets reused; avoid double-free
+		if (num_active > 0) {
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+	}
 
-			// Trim the error message buffer down to just the actual message
-			trim_response(response_code, response);
+	// If we're shutting down, anything still going is abandoned (and will be retried next time)
+	while (pending != NULL) {
+		sess = pending;
+		pending = sess->next;
+		smtp_session_free(sess);
+	}
+	for (i = 0; i < SMTP_MAX_CONNECTIONS; ++i) {
+		if (active[i] != NULL) {
+			curl_multi_remove_handle(multi, active[i]->curl);
+			smtp_session_free(active[i]);
 		}
 	}
+	if (multi) {
+		curl_multi_cleanup(multi);
+	}
 
-	FreeStrBuf(&s.TheMessage);
+	while (domains != NULL) {
+		dom = domains;
+		domains = dom->next;
+		smtp_record_domain(dom);
+		free(dom);
+	}
+	FreeStrBuf(&message);
 	if (fromaddr) {
 		free(fromaddr);
 	}
-	return ((int) response_code);
 }
 
 
@@ -325,7 +790,6 @@ void smtp_process_one_msg(long qmsgnum) {
 	int num_delayed = 0;
 	long deletes[2];
 	int delete_this_queue = 0;
-	char server_response[SIZ];
 
 	msg = CtdlFetchMessage(qmsgnum, 1);
 	if (msg == NULL) {
@@ -337,58 +801,51 @@ void smtp_process_one_msg(long qmsgnum) {
 	msg->cm_fields[eMesageText] = NULL;
 	CM_Free(msg);
 
-	// if the queue job message has any CRLF's convert them to LF's
-	char *crlf = NULL;
-	while (crlf = strstr(instr, "\r\n"), crlf != NULL) {
-		strcpy(crlf, crlf + 1);
-	}
-
-	// Strip out the headers and we are now left with just the instructions.
-	char *soi = strstr(instr, "\n\n");
-	if (soi) {
-		strcpy(instr, soi + 2);
-	}
-
 	long msgid = 0;
 	time_t submitted = time(NULL);
 	time_t attempted = 0;
+	int attempts = 0;
 	char *bounceto = NULL;
 	char *envelope_from = NULL;
 	char *source_room = NULL;
+	struct smtp_recp *recps = NULL;
+	int num_recps = 0;
+	int alloc_recps = 0;
 
+	// Read the instructions.  (The headers come first, but nothing in them looks like an instruction.)
 	char cfgline[SIZ];
-	for (i = 0; i < num_tokens(instr, '\n'); ++i) {
-		extract_token(cfgline, instr, i, '\n', sizeof cfgline);
+	char *pos = instr;
+	while (smtp_queue_next_line(&pos, cfgline, sizeof cfgline)) {
 		if (!strncasecmp(cfgline, HKEY("msgid|")))
 			msgid = atol(&cfgline[6]);
 		if (!strncasecmp(cfgline, HKEY("submitted|")))
 			submitted = atol(&cfgline[10]);
 		if (!strncasecmp(cfgline, HKEY("attempted|")))
 			attempted = atol(&cfgline[10]);
+		if (!strncasecmp(cfgline, HKEY("attempts|")))
+			attempts = atoi(&cfgline[9]);
 		if (!strncasecmp(cfgline, HKEY("bounceto|")))
 			bounceto = strdup(&cfgline[9]);
 		if (!strncasecmp(cfgline, HKEY("envelope_from|")))
 			envelope_from = strdup(&cfgline[14]);
 		if (!strncasecmp(cfgline, HKEY("source_room|")))
 			source_room = strdup(&cfgline[12]);
-	}
-
-	int should_try_now = 0;
-	if (attempted < submitted) {			// If no attempts have been made yet, try now
-		should_try_now = 1;
-	}
-	else if ((attempted - submitted) <= 14400) {
-		if ((time(NULL) - attempted) > 1800) {	// First four hours, retry every 30 minutes
-			should_try_now = 1;
-		}
-	}
-	else {
-		if ((time(NULL) - attempted) > 14400) {	// After that, retry once every 4 hours
-			should_try_now = 1;
+		if (!strncasecmp(cfgline, HKEY("remote|"))) {		// recipients still to be tried
+			char recp[SIZ];
+			int previous_result = extract_int(cfgline, 2);
+			if ((previous_result == 0) || (previous_result == 4)) {
+				extract_token(recp, cfgline, 1, '|', sizeof recp);
+				if (num_recps >= alloc_recps) {
+					alloc_recps = (alloc_recps > 0) ? (alloc_recps * 2) : 16;
+					recps = realloc(recps, sizeof(struct smtp_recp) * alloc_recps);
+				}
+				memset(&recps[num_recps], 0, sizeof(struct smtp_recp));
+				recps[num_recps++].addr = strdup(recp);
+			}
 		}
 	}
 
-	if (should_try_now) {
+	if (time(NULL) >= smtp_queue_next_attempt(submitted, attempted)) {
 		syslog(LOG_DEBUG, "smtpclient: attempting delivery of message <%ld> now", qmsgnum);
 		if (source_room) {
 			syslog(LOG_DEBUG, "smtpclient: this message originated in <%s>", source_room);
@@ -397,35 +854,37 @@ void smtp_process_one_msg(long qmsgnum) {
 		StrBufAppendPrintf(NewInstr, "Content-type: " SPOOLMIME "\n\n");
 		StrBufAppendPrintf(NewInstr, "msgid|%ld\n", msgid);
 		StrBufAppendPrintf(NewInstr, "submitted|%ld\n", submitted);
+		StrBufAppendPrintf(NewInstr, "attempts|%d\n", attempts + 1);
 		if (bounceto) {
 			StrBufAppendPrintf(NewInstr, "bounceto|%s\n", bounceto);
 		}
 		if (envelope_from) {
 			StrBufAppendPrintf(NewInstr, "envelope_from|%s\n", envelope_from);
 		}
-		for (i = 0; i < num_tokens(instr, '\n'); ++i) {
-			extract_token(cfgline, instr, i, '\n', sizeof cfgline);
-			if (!strncasecmp(cfgline, HKEY("remote|"))) {
-				char recp[SIZ];
-				int previous_result = extract_int(cfgline, 2);
-				if ((previous_result == 0) || (previous_result == 4)) {
-					int new_result = 421;
-					extract_token(recp, cfgline, 1, '|', sizeof recp);
-					new_result = smtp_attempt_delivery(msgid, recp, envelope_from, source_room, server_response);
-					syslog(LOG_DEBUG, "smtpclient: recp: <%s> , result: %d (%s)", recp, new_result, server_response);
-					if ((new_result / 100) == 2) {
-						++num_success;
-					}
-					else {
-						if ((new_result / 100) == 5) {
-							++num_fail;
-						}
-						else {
-							++num_delayed;
-						}
-						StrBufAppendPrintf(NewInstr, "remote|%s|%ld|%ld (%s)\n", recp, (new_result / 100), new_result, server_response);
-					}
+
+		// Try all of the recipients at once
+		smtp_attempt_delivery(msgid, recps, num_recps, envelope_from, source_room);
+
+		for (i = 0; i < num_recps; ++i) {
+			int new_result = recps[i].result;
+			char *server_response = (recps[i].response ? recps[i].response : "");
+			syslog(LOG_DEBUG, "smtpclient: recp: <%s> , result: %d (%s)", recps[i].addr, new_result, server_response);
+			if ((new_result / 100) == 2) {
+				++num_success;
+			}
+			else {
+				if ((new_result / 100) == 5) {
+					++num_fail;
+				}
+				else {
+					++num_delayed;
 				}
+				StrBufAppendPrintf(NewInstr, "remote|%s|%d|%d (%s)\n", recps[i].addr, (new_result / 100), new_result, server_response);
+			}
+			free(recps[i].addr);
+			recps[i].addr = NULL;
+			if (recps[i].response) {
+				free(recps[i].response);
 			}
 		}
 
@@ -476,6 +935,7 @@ void smtp_process_one_msg(long qmsgnum) {
 	}
 	else {
 		syslog(LOG_DEBUG, "smtpclient: %ld retry time not reached", qmsgnum);
+		smtp_queue_add(qmsgnum);		// it came off the index, so put it back
 	}
 
 	if (bounceto != NULL) {
@@ -487,27 +947,30 @@ void smtp_process_one_msg(long qmsgnum) {
 	if (source_room != NULL) {
 		free(source_room);
 	}
+	for (i = 0; i < num_recps; ++i) {
+		if (recps[i].addr != NULL) {
+			free(recps[i].addr);
+		}
+	}
+	if (recps != NULL) {
+		free(recps);
+	}
 	free(instr);
 }
 
 
-// Callback for smtp_do_queue()
-void smtp_add_msg(long msgnum, void *userdata) {
-	Array *smtp_queue = (Array *) userdata;
-	array_append(smtp_queue, &msgnum);
-}
-
-
 enum {
-	FULL_QUEUE_RUN,		// try to process the entire queue, including messages that have already been attempted
-	QUICK_QUEUE_RUN		// only process jobs in the queue that have not been tried yet
+	FULL_QUEUE_RUN,		// a run from the timer, every minute
+	QUICK_QUEUE_RUN		// a run because something new was submitted or something fell due
 };
 
 
-// Run through the queue sending out messages.
+// Run through the queue sending out messages.  The queue index knows which entries are due, so all we have to do
+// is tell it about any new entries and then take the due ones off it in order.
 void smtp_do_queue(int type_of_queue_run) {
 	static int doing_smtpclient = 0;
-	int i = 0;
+	struct smtp_queue_entry e;
+	int num_processed = 0;
 
 	// This is a concurrency check to make sure only one smtpclient run is done at a time.
 	begin_critical_section(S_SMTPQUEUE);
@@ -529,39 +992,20 @@ void smtp_do_queue(int type_of_queue_run) {
 		return;
 	}
 
-	// This array will hold the list of queue job messages
-	Array *smtp_queue = array_new(sizeof(long));
-	if (smtp_queue == NULL) {
-		syslog(LOG_WARNING, "smtpclient: cannot allocate queue array");
-		doing_smtpclient = 0;
-		return;
-	}
-
-	// Put the queue in memory so we can close the db cursor
-	CtdlForEachMessage(
-		(type_of_queue_run == QUICK_QUEUE_RUN ? MSGS_GT : MSGS_ALL),			// quick = new jobs; full = all jobs
-		(type_of_queue_run == QUICK_QUEUE_RUN ? last_queue_job_processed : 0),		// quick = new jobs; full = all jobs
-		NULL,
-		SPOOLMIME,		// Searching for Content-type of SPOOLIME will give us only queue instruction messages
-		NULL,
-		smtp_add_msg,		// That's our callback function to add a job to the queue
-		(void *)smtp_queue
-	);
+	// Anything submitted from here on will be seen by the next run
+	last_queue_job_processed = last_queue_job_submitted;
+	smtp_queue_ingest(CC->room.QRnumber);
 
-	// We are ready to run through the queue now.
-	syslog(LOG_DEBUG, "smtpclient: %d messages to be processed", array_len(smtp_queue));
-	for (i = 0; i < array_len(smtp_queue); ++i) {
-		long m;
-		memcpy(&m, array_get_element_at(smtp_queue, i), sizeof(long));
-		smtp_process_one_msg(m);
+	while ((!server_shutting_down) && (smtp_queue_pop_due(time(NULL), &e))) {
+		syslog(LOG_DEBUG, "smtpclient: queue entry %ld is due (attempt %d, <%s>)", e.qmsgnum, e.attempts + 1, e.domain);
+		smtp_process_one_msg(e.qmsgnum);
+		++num_processed;
 	}
 
-	array_free(smtp_queue);
-	last_queue_job_processed = last_queue_job_submitted;
 	doing_smtpclient = 0;
-	syslog(LOG_DEBUG, "smtpclient: end %s queue run , last_queue_job_processed=%ld , last_queue_job_submitted=%ld",
+	syslog(LOG_DEBUG, "smtpclient: end %s queue run , %d processed , %d waiting",
 		(type_of_queue_run == QUICK_QUEUE_RUN ? "quick" : "full"),
-		last_queue_job_processed, last_queue_job_submitted
+		num_processed, smtp_queue_length()
 	);
 }
 
@@ -572,15 +1016,55 @@ void smtp_do_queue_full(void) {
 
 
 void smtp_do_queue_quick(void) {
-	if (last_queue_job_submitted > last_queue_job_processed) {
+	if ((last_queue_job_submitted > last_queue_job_processed) || (smtp_queue_is_due(time(NULL)))) {
 		smtp_do_queue(QUICK_QUEUE_RUN);
 	}
 }
 
 
+// Report on outbound SMTP: the queue, the MX cache, and how delivery to each domain has been going
+void cmd_smts(char *argbuf) {
+	struct mx_cache_stats mxs;
+	struct smtp_domain_state *st;
+	HashPos *it;
+	long len;
+	const char *key;
+	void *v;
+
+	if (CtdlAccessCheck(ac_aide)) return;
+
+	cprintf("%d Outbound SMTP status\n", LISTING_FOLLOWS);
+	cprintf("queue|%d\n", smtp_queue_length());
+	getmx_cache_stats(&mxs);
+	cprintf("mxcache|%d|%ld|%ld|%ld\n", mxs.entries, mxs.hits, mxs.negative_hits, mxs.misses);
+
+	pthread_mutex_lock(&domain_states_lock);
+	if (domain_states != NULL) {
+		it = GetNewHashPos(domain_states, 0);
+		while (GetNextHashPos(domain_states, it, &len, &key, &v)) {
+			st = (struct smtp_domain_state *) v;
+			cprintf("domain|%s|%ld|%ld|%ld|%ld|%ld|%ld|%d|%ld|%ld\n",
+				key, st->sessions, st->delivered, st->deferred, st->failed, st->unreachable, st->held,
+				st->consecutive, (long)st->hold_until, (long)st->last_attempt
+			);
+		}
+		DeleteHashPos(&it);
+	}
+	pthread_mutex_unlock(&domain_states_lock);
+	cprintf("000\n");
+}
+
+
 // Initialization function, called from modules_init.c
 char *ctdl_module_init_smtpclient(void) {
 	if (!threading) {
+		smtp_share = curl_share_init();
+		if (smtp_share) {
+			curl_share_setopt(smtp_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+			curl_share_setopt(smtp_share, CURLSHOPT_LOCKFUNC, smtp_share_lockfunc);
+			curl_share_setopt(smtp_share, CURLSHOPT_UNLOCKFUNC, smtp_share_unlockfunc);
+		}
+		CtdlRegisterProtoHook(cmd_smts, "SMTS", "Get outbound SMTP status");
 		CtdlRegisterMessageHook(smtp_aftersave, EVT_AFTERSAVE);
 		CtdlRegisterSessionHook(smtp_do_queue_quick, EVT_HOUSE, PRIO_AGGR + 51);
 		CtdlRegisterSessionHook(smtp_do_queue_full, EVT_TIMER, PRIO_AGGR + 51);
@@ -0,0 +1,240 @@
+// Index of the outbound SMTP queue
+//
+// The queue itself is still the instruction messages in SMTP_SPOOLOUT_ROOM; that is what survives a
+// restart.  Reading every one of those on every queue run (to find out whether it was due) got slow when
+// the queue was long, so here we keep an index of them in memory: a heap ordered by the time each entry is
+// next due to be tried.  Instructions are read once, when they first appear in the room, and after that a
+// queue run only looks at the ones which are due.  The first run after startup reads them all to build it.
+//
+// Copyright (c) 1997-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "../../sysdep.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <libcitadel.h>
+#include "../../citadel_defs.h"
+#include "../../server.h"
+#include "../../citserver.h"
+#include "../../msgbase.h"
+#include "../../room_ops.h"
+#include "../../msglist_cache.h"
+#include "smtp_queue.h"
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct smtp_queue_entry *heap = NULL;
+static int heap_len = 0;
+static int heap_alloc = 0;
+static long queue_highwater = 0;		// everything in the room up to here has been indexed
+
+
+// Copy the next line of a queue instruction into buf and step past it.  Returns 0 when there are no more lines.
+// (Walking the lines this way is linear; extract_token() on line i has to count its way there every time.)
+int smtp_queue_next_line(char **pos, char *buf, size_t bufsize) {
+	char *start = *pos;
+	size_t len;
+
+	if ((start == NULL) || (*start == 0)) {
+		return(0);
+	}
+	len = strcspn(start, "\n");
+	*pos = start + len + ((start[len] == '\n') ? 1 : 0);
+	if ((len > 0) && (start[len - 1] == '\r')) {
+		--len;
+	}
+	if (len >= bufsize) {
+		len = bufsize - 1;
+	}
+	memcpy(buf, start, len);
+	buf[len] = 0;
+	return(1);
+}
+
+
+// When should a queue entry be tried next?
+time_t smtp_queue_next_attempt(time_t submitted, time_t attempted) {
+	if (attempted < submitted) {			// If no attempts have been made yet, try now
+		return(0);
+	}
+	if ((attempted - submitted) <= 14400) {		// First four hours, retry every 30 minutes
+		return(attempted + 1800);
+	}
+	return(attempted + 14400);			// After that, retry once every 4 hours
+}
+
+
+static int entry_before(struct smtp_queue_entry *a, struct smtp_queue_entry *b) {
+	if (a->next_attempt != b->next_attempt) {
+		return(a->next_attempt < b->next_attempt);
+	}
+	return(a->qmsgnum < b->qmsgnum);
+}
+
+
+static void swap_entries(int i, int j) {
+	struct smtp_queue_entry t;
+
+	memcpy(&t, &heap[i], sizeof t);
+	memcpy(&heap[i], &heap[j], sizeof t);
+	memcpy(&heap[j], &t, sizeof t);
+}
+
+
+// Put an entry into the heap.  Caller must hold queue_lock.
+static void heap_push(struct smtp_queue_entry *e) {
+	int i, parent;
+
+	if (heap_len >= heap_alloc) {
+		heap_alloc = (heap_alloc > 0) ? (heap_alloc * 2) : 256;
+		heap = realloc(heap, sizeof(struct smtp_queue_entry) * heap_alloc);
+	}
+	memcpy(&heap[heap_len], e, sizeof(struct smtp_queue_entry));
+	for (i = heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!entry_before(&heap[i], &heap[parent])) {
+			break;
+		}
+		swap_entries(i, parent);
+	}
+}
+
+
+// Take the first entry off the heap.  Caller must hold queue_lock, and the heap must not be empty.
+static void heap_pop(struct smtp_queue_entry *e) {
+	int i, child;
+
+	memcpy(e, &heap[0], sizeof(struct smtp_queue_entry));
+	if (--heap_len > 0) {
+		memcpy(&heap[0], &heap[heap_len], sizeof(struct smtp_queue_entry));
+	}
+	for (i = 0; (child = (i * 2) + 1) < heap_len; i = child) {
+		if ((child + 1 < heap_len) && (entry_before(&heap[child + 1], &heap[child]))) {
+			++child;
+		}
+		if (!entry_before(&heap[child], &heap[i])) {
+			break;
+		}
+		swap_entries(i, child);
+	}
+}
+
+
+// Read one queue instruction message and index it
+void smtp_queue_add(long qmsgnum) {
+	struct CtdlMessage *msg;
+	struct smtp_queue_entry e;
+	time_t submitted = time(NULL);
+	time_t attempted = 0;
+	char line[SIZ];
+	char *pos;
+	char *bar;
+	char *at;
+
+	msg = CtdlFetchMessage(qmsgnum, 1);
+	if (msg == NULL) {
+		return;
+	}
+
+	memset(&e, 0, sizeof e);
+	e.qmsgnum = qmsgnum;
+	pos = msg->cm_fields[eMesageText];
+	while (smtp_queue_next_line(&pos, line, sizeof line)) {
+		if (!strncasecmp(line, HKEY("submitted|"))) {
+			submitted = atol(&line[10]);
+		}
+		else if (!strncasecmp(line, HKEY("attempted|"))) {
+			attempted = atol(&line[10]);
+		}
+		else if (!strncasecmp(line, HKEY("attempts|"))) {
+			e.attempts = atoi(&line[9]);
+		}
+		else if ((!strncasecmp(line, HKEY("remote|"))) && (IsEmptyStr(e.domain))) {
+			bar = strchr(&line[7], '|');			// remote|address|result|...
+			if (bar != NULL) {
+				*bar = 0;
+				if ((atoi(bar + 1) == 0) || (atoi(bar + 1) == 4)) {
+					at = strrchr(&line[7], '@');
+					safestrncpy(e.domain, (at ? at + 1 : &line[7]), sizeof e.domain);
+				}
+			}
+		}
+	}
+	CM_Free(msg);
+
+	e.next_attempt = smtp_queue_next_attempt(submitted, attempted);
+	pthread_mutex_lock(&queue_lock);
+	heap_push(&e);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+
+// Index any queue instructions which have appeared in the queue room since the last time we looked.
+// Message numbers only go up, so that's everything after the last one we saw.
+void smtp_queue_ingest(long qrnumber) {
+	struct msglist *ml;
+	struct MetaData smi;
+	int num_indexed = 0;
+	int i;
+
+	ml = CtdlGetMsgList(qrnumber);
+	if (ml == NULL) {
+		return;
+	}
+
+	for (i = msglist_gallop(ml->msgs, ml->num_msgs, 0, queue_highwater + 1); i < ml->num_msgs; ++i) {
+		GetMetaData(&smi, ml->msgs[i]);
+		if (!strcasecmp(smi.meta_content_type, SPOOLMIME)) {	// the room also holds the messages themselves
+			smtp_queue_add(ml->msgs[i]);
+			++num_indexed;
+		}
+	}
+	if ((ml->num_msgs > 0) && (ml->msgs[ml->num_msgs - 1] > queue_highwater)) {
+		queue_highwater = ml->msgs[ml->num_msgs - 1];
+	}
+	CtdlPutMsgList(&ml);
+
+	if (num_indexed > 0) {
+		syslog(LOG_DEBUG, "smtpclient: indexed %d new queue entries, %d in the queue", num_indexed, smtp_queue_length());
+	}
+}
+
+
+// Take the next entry which is due off the index.  Returns 0 if there isn't one.
+int smtp_queue_pop_due(time_t now, struct smtp_queue_entry *e) {
+	int found = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	if ((heap_len > 0) && (heap[0].next_attempt <= now)) {
+		heap_pop(e);
+		found = 1;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return(found);
+}
+
+
+// Is anything due?
+int smtp_queue_is_due(time_t now) {
+	int due;
+
+	pthread_mutex_lock(&queue_lock);
+	due = ((heap_len > 0) && (heap[0].next_attempt <= now));
+	pthread_mutex_unlock(&queue_lock);
+	return(due);
+}
+
+
+int smtp_queue_length(void) {
+	int len;
+
+	pthread_mutex_lock(&queue_lock);
+	len = heap_len;
+	pthread_mutex_unlock(&queue_lock);
+	return(len);
+}
@@ -0,0 +1,26 @@
+// Index of the outbound SMTP queue
+//
+// Copyright (c) 1997-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef SMTP_QUEUE_H
+#define SMTP_QUEUE_H
+
+struct smtp_queue_entry {
+	long qmsgnum;			// the queue instruction message
+	time_t next_attempt;		// when it is next due to be tried
+	int attempts;			// how many times it has been tried so far
+	char domain[128];		// where the first recipient still waiting is
+};
+
+void smtp_queue_ingest(long qrnumber);
+void smtp_queue_add(long qmsgnum);
+int smtp_queue_pop_due(time_t now, struct smtp_queue_entry *e);
+int smtp_queue_is_due(time_t now);
+int smtp_queue_length(void);
+time_t smtp_queue_next_attempt(time_t submitted, time_t attempted);
+int smtp_queue_next_line(char **pos, char *buf, size_t bufsize);
+
+#endif // SMTP_QUEUE_H
@@ -1,6 +1,6 @@
 // This module allows Citadel to use an external SpamAssassin service to filter incoming messages arriving via SMTP.
 //
-// Copyright (c) 1998-2022 by the citadel.org team
+// Copyright (c) 1998-2023 by the citadel.org team
 //
 // This program is open source software.  Use, duplication, or disclosure
 // is subject to the terms of the GNU General Public License, version 3.
@@ -35,76 +35,37 @@
 #include "../../domain.h"
 #include "../../clientsocket.h"
 #include "../../ctdl_module.h"
+#include "../../scanclient.h"
 
 
-// Connect to the SpamAssassin server and scan a message.
-int spam_assassin(struct CtdlMessage *msg, struct recptypes *recp) {
-	int sock = (-1);
-	char sahosts[SIZ];
-	int num_sahosts;
-	char buf[SIZ];
-	int is_spam = 0;
-	int sa;
-	StrBuf *msgtext;
-
-	// For users who have authenticated to this server we never want to
-	// apply spam filtering, because presumably they're trustworthy.
-	if (CC->logged_in) return(0);
-
-	// See if we have any SpamAssassin hosts configured
-	num_sahosts = get_hosts(sahosts, "spamassassin");
-	if (num_sahosts < 1) return(0);
-
-	// Try them one by one until we get a working one
-        for (sa=0; sa<num_sahosts; ++sa) {
-                extract_token(buf, sahosts, sa, '|', sizeof buf);
-                syslog(LOG_INFO, "Connecting to SpamAssassin at <%s>\n", buf);
-                sock = sock_connect(buf, SPAMASSASSIN_PORT);
-                if (sock >= 0) syslog(LOG_DEBUG, "Connected!\n");
-        }
-
-	// If the service isn't running, just pass the mail through.  Potentially throwing away mails isn't good.
-	if (sock < 0) {
-		return(0);
-	}
+// Ask spamd to check a message.  It closes the connection when it has answered, so there's nothing to pool.
+void spamd_request(StrBuf *out, StrBuf *msgtext) {
+	StrBufAppendPrintf(out, "CHECK SPAMC/1.2\r\nContent-length: %d\r\n\r\n", StrLength(msgtext));
+	StrBufAppendBuf(out, msgtext, 0);
+}
 
-	CC->SBuf.Buf = NewStrBuf();
-	CC->sMigrateBuf = NewStrBuf();
-	CC->SBuf.ReadWritePointer = NULL;
 
-	// Command
-	syslog(LOG_DEBUG, "Transmitting command\n");
-	sprintf(buf, "CHECK SPAMC/1.2\r\n\r\n");
-	sock_write(&sock, buf, strlen(buf));
+int spamd_reply_complete(StrBuf *in, int eof) {
+	return(eof);
+}
 
-	// Message
-	CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
-	CtdlOutputPreLoadedMsg(msg, MT_RFC822, HEADERS_ALL, 0, 1, 0);
-	msgtext = CC->redirect_buffer;
-	CC->redirect_buffer = NULL;
 
-	sock_write(&sock, SKEY(msgtext));
-	FreeStrBuf(&msgtext);
+// The reply looks like:
+//	SPAMD/1.1 0 EX_OK
+//	Spam: True ; 15 / 5
+int spamd_verdict(StrBuf *in, struct CtdlMessage *msg) {
+	char buf[SIZ];
+	int is_spam = 0;
 
-	// Close one end of the socket connection; this tells SpamAssassin that we're done.
-	if (sock != -1)
-		sock_shutdown(sock, SHUT_WR);
-	
-	// Response
-	syslog(LOG_DEBUG, "Awaiting response\n");
-        if (sock_getln(&sock, buf, sizeof buf) < 0) {
-                goto bail;
-        }
-        syslog(LOG_DEBUG, "<%s\n", buf);
+	extract_token(buf, ChrPtr(in), 0, '\n', sizeof buf);
+	syslog(LOG_DEBUG, "spam: <%s", buf);
 	if (strncasecmp(buf, "SPAMD", 5)) {
-		goto bail;
+		return(-1);
 	}
-        if (sock_getln(&sock, buf, sizeof buf) < 0) {
-                goto bail;
-        }
-        syslog(LOG_DEBUG, "<%s\n", buf);
-        syslog(LOG_DEBUG, "c_spam_flag_only setting %d\n", CtdlGetConfigInt("c_spam_flag_only"));
-        if (CtdlGetConfigInt("c_spam_flag_only")) {
+	extract_token(buf, ChrPtr(in), 1, '\n', sizeof buf);
+	string_trim(buf);
+	syslog(LOG_DEBUG, "spam: <%s", buf);
+	if (CtdlGetConfigInt("c_spam_flag_only")) {
 		int headerlen;
 		char *cur;
 		char sastatus[10];
@@ -112,11 +73,9 @@ int spam_assassin(struct CtdlMessage *msg, struct recptypes *recp) {
 		char saoutof[10];
 		int numscore;
 
-                syslog(LOG_DEBUG, "flag spam code used");
-
-                extract_token(sastatus, buf, 1, ' ', sizeof sastatus);
-                extract_token(sascore, buf, 3, ' ', sizeof sascore);
-                extract_token(saoutof, buf, 5, ' ', sizeof saoutof);
+		extract_token(sastatus, buf, 1, ' ', sizeof sastatus);
+		extract_token(sascore, buf, 3, ' ', sizeof sascore);
+		extract_token(saoutof, buf, 5, ' ', sizeof saoutof);
 
 		memcpy(buf, HKEY("X-Spam-Level: "));
 		cur = buf + 14;
@@ -130,10 +89,8 @@ int spam_assassin(struct CtdlMessage *msg, struct recptypes *recp) {
 				     sastatus, sascore, saoutof);
 
 		CM_PrependToField(msg, eMesageText, buf, headerlen);
-
 	}
 	else {
-                syslog(LOG_DEBUG, "reject spam code used");
 		if (!strncasecmp(buf, "Spam: True", 10)) {
 			is_spam = 1;
 		}
@@ -143,17 +100,27 @@ int spam_assassin(struct CtdlMessage *msg, struct recptypes *recp) {
 		}
 	}
 
-bail:	close(sock);
-	FreeStrBuf(&CC->SBuf.Buf);
-	FreeStrBuf(&CC->sMigrateBuf);
 	return(is_spam);
 }
 
 
+static struct scanner spamd = {
+	.name = "SpamAssassin",
+	.hosttype = "spamassassin",
+	.port = SPAMASSASSIN_PORT,
+	.trust_logged_in = 1,		// users who have authenticated to this server are presumably trustworthy
+	.keepalive = 0,
+	.hello = NULL,
+	.request = spamd_request,
+	.reply_complete = spamd_reply_complete,
+	.verdict = spamd_verdict
+};
+
+
 // Initialization function, called from modules_init.c
 char *ctdl_module_init_spam(void) {
 	if (!threading) {
-		CtdlRegisterMessageHook(spam_assassin, EVT_SMTPSCAN);
+		CtdlRegisterScanner(&spamd);
 	}
 	
 	// return our module name for the log
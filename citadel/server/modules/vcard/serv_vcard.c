@@ -924,6 +924,8 @@ void check_get_greeting(void) {
 void vcard_CtdlCreateRoom(void) {
 	struct ctdlroom qr;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	// Create the calendar room if it doesn't already exist
 	CtdlCreateRoom(USERCONTACTSROOM, 4, "", 0, 1, 0, VIEW_ADDRESSBOOK);
@@ -938,9 +940,11 @@ void vcard_CtdlCreateRoom(void) {
 	CtdlPutRoomLock(&qr);
 
 	// Set the view to a calendar view
-	CtdlGetRelationship(&vbuf, &CC->user, &qr);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &qr);
 	vbuf.v_view = 2;			// 2 = address book view
-	CtdlSetRelationship(&vbuf, &CC->user, &qr);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &qr);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 
 	return;
 }
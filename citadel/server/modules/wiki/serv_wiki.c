@@ -627,11 +627,7 @@ void wiki_rev(char *pagename, char *rev, char *operation)
 			 * but only if the client fetches the message we just generated immediately
 			 * without first trying to perform other fetch operations.
 			 */
-			if (CC->cached_msglist != NULL) {
-				free(CC->cached_msglist);
-				CC->cached_msglist = NULL;
-				CC->cached_num_msgs = 0;
-			}
+			CtdlForgetCachedMsgList(CC);
 			CC->cached_msglist = malloc(sizeof(long));
 			if (CC->cached_msglist != NULL) {
 				CC->cached_num_msgs = 1;
@@ -23,7 +23,11 @@
 #include "internet_addressing.h"
 #include "euidindex.h"
 #include "msgbase.h"
+#include "msglist_cache.h"
+#include "msglist_store.h"
 #include "journaling.h"
+#include "overview.h"
+#include "modseq.h"
 
 struct addresses_to_be_filed *atbf = NULL;
 
@@ -384,47 +388,57 @@ int CtdlMsgCmp(struct CtdlMessage *msg, struct CtdlMessage *template) {
 }
 
 
-// Retrieve the "seen" message list for the current room.
-void CtdlGetSeen(char *buf, int which_set) {
+// Retrieve the "seen" message list for the current room, as a sequence set string.
+void CtdlGetSeen(StrBuf *Target, int which_set) {
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	// Learn about the user and room in question
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &CC->room);
 
 	if (which_set == ctdlsetseen_seen) {
-		safestrncpy(buf, vbuf.v_seen, SIZ);
+		seen_set_to_string(Target, seen);
 	}
 	if (which_set == ctdlsetseen_answered) {
-		safestrncpy(buf, vbuf.v_answered, SIZ);
+		seen_set_to_string(Target, answered);
 	}
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 }
 
 
-// Manipulate the "seen msgs" string (or other message set strings)
+// Manipulate the "seen msgs" set (or other message sets)
 void CtdlSetSeen(long *target_msgnums, int num_target_msgnums,
 		int target_setting, int which_set,
 		struct ctdluser *which_user, struct ctdlroom *which_room) {
-	struct cdbdata *cdbfr;
+	struct msglist *ml;
 	int i, k;
 	int is_seen = 0;
 	int was_seen = 0;
 	long lo = (-1L);
-	long hi = (-1L);
 	struct visit vbuf;
-	long *msglist;
+	const long *msglist;
 	int num_msgs = 0;
-	StrBuf *vset;
-	StrBuf *setstr;
-	StrBuf *lostr;
-	StrBuf *histr;
-	const char *pvset;
+	struct seen_set *oldset = NULL;
+	struct seen_set *newset = NULL;
+	struct seen_set *otherset = NULL;
+	long *targets;
 	char *is_set;	// actually an array of booleans
+	long *changed;
+	int num_changed = 0;
+	long modseq = 0L;
 
 	// Don't bother doing *anything* if we were passed a list of zero messages
 	if (num_target_msgnums < 1) {
 		return;
 	}
 
+	// We only know about these two
+	if ((which_set != ctdlsetseen_seen) && (which_set != ctdlsetseen_answered)) {
+		return;
+	}
+
 	// If no room was specified, we go with the current room.
 	if (!which_room) {
 		which_room = &CC->room;
@@ -441,180 +455,107 @@ void CtdlSetSeen(long *target_msgnums, int num_target_msgnums,
 		   which_set,
 		   which_room->QRname);
 
-	// Learn about the user and room in question
-	CtdlGetRelationship(&vbuf, which_user, which_room);
-
 	// Load the message list
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &which_room->QRnumber, sizeof(long));
-	if (cdbfr != NULL) {
-		msglist = (long *) cdbfr->ptr;
-		cdbfr->ptr = NULL;	// CtdlSetSeen() now owns this memory
-		num_msgs = cdbfr->len / sizeof(long);
-		cdb_free(cdbfr);
+	ml = CtdlGetMsgList(which_room->QRnumber);
+	if (ml != NULL) {
+		msglist = ml->msgs;
+		num_msgs = ml->num_msgs;
 	}
 	else {
 		return;	// No messages at all?  No further action.
 	}
 
-	is_set = malloc(num_msgs * sizeof(char));
-	memset(is_set, 0, (num_msgs * sizeof(char)) );
-
-	// Decide which message set we're manipulating
-	switch(which_set) {
-	case ctdlsetseen_seen:
-		vset = NewStrBufPlain(vbuf.v_seen, -1);
-		break;
-	case ctdlsetseen_answered:
-		vset = NewStrBufPlain(vbuf.v_answered, -1);
-		break;
-	default:
-		vset = NewStrBuf();
-	}
-
-
-#if 0	// This is a special diagnostic section.  Do not allow it to run during normal operation.
-	syslog(LOG_DEBUG, "There are %d messages in the room.\n", num_msgs);
-	for (i=0; i<num_msgs; ++i) {
-		if ((i > 0) && (msglist[i] <= msglist[i-1])) abort();
+	// Learn about the user and room in question.  The set we aren't changing is written back as it was.
+	if (which_set == ctdlsetseen_seen) {
+		CtdlGetRelationshipSets(&vbuf, &oldset, &otherset, which_user, which_room);
 	}
-	syslog(LOG_DEBUG, "We are twiddling %d of them.\n", num_target_msgnums);
-	for (k=0; k<num_target_msgnums; ++k) {
-		if ((k > 0) && (target_msgnums[k] <= target_msgnums[k-1])) abort();
+	else {
+		CtdlGetRelationshipSets(&vbuf, &otherset, &oldset, which_user, which_room);
 	}
-#endif
-
-	// Translate the existing sequence set into an array of booleans
-	setstr = NewStrBuf();
-	lostr = NewStrBuf();
-	histr = NewStrBuf();
-	pvset = NULL;
-	while (StrBufExtract_NextToken(setstr, vset, &pvset, ',') >= 0) {
 
-		StrBufExtract_token(lostr, setstr, 0, ':');
-		if (StrBufNum_tokens(setstr, ':') >= 2) {
-			StrBufExtract_token(histr, setstr, 1, ':');
-		}
-		else {
-			FlushStrBuf(histr);
-			StrBufAppendBuf(histr, lostr, 0);
-		}
-		lo = StrTol(lostr);
-		if (!strcmp(ChrPtr(histr), "*")) {
-			hi = LONG_MAX;
+	// Find out which messages in the room are currently in the set
+	is_set = malloc(num_msgs * sizeof(char));
+	seen_set_lookup_sorted(oldset, msglist, num_msgs, is_set);
+	seen_set_free(&oldset);
+
+	// Apply the changes.  Both lists are sorted, so this is a single merge pass.  Note which messages
+	// actually changed, for the modification sequences IMAP clients can ask about.
+	targets = malloc(num_target_msgnums * sizeof(long));
+	memcpy(targets, target_msgnums, num_target_msgnums * sizeof(long));
+	num_target_msgnums = sort_msglist(targets, num_target_msgnums);
+	changed = malloc(num_target_msgnums * sizeof(long));
+	for (i=0, k=0; (i<num_msgs) && (k<num_target_msgnums); ) {
+		if (msglist[i] < targets[k]) {
+			++i;
+		}
+		else if (msglist[i] > targets[k]) {
+			++k;
 		}
 		else {
-			hi = StrTol(histr);
-		}
-
-		for (i = 0; i < num_msgs; ++i) {
-			if ((msglist[i] >= lo) && (msglist[i] <= hi)) {
-				is_set[i] = 1;
+			if ((is_set[i] != 0) != (target_setting != 0)) {
+				changed[num_changed++] = msglist[i];
 			}
+			is_set[i] = target_setting;
+			++i;
+			++k;
 		}
 	}
-	FreeStrBuf(&setstr);
-	FreeStrBuf(&lostr);
-	FreeStrBuf(&histr);
+	free(targets);
 
-	// Now translate the array of booleans back into a sequence set
-	FlushStrBuf(vset);
+	// Now translate the array of booleans back into a set of ranges.  Messages which are no longer in
+	// the room fall out of it, which keeps the set no bigger than it needs to be.
+	newset = seen_set_new();
 	was_seen = 0;
-	lo = (-1);
-	hi = (-1);
-
 	for (i=0; i<num_msgs; ++i) {
 		is_seen = is_set[i];
-
-		// Apply changes
-		for (k=0; k<num_target_msgnums; ++k) {
-			if (msglist[i] == target_msgnums[k]) {
-				is_seen = target_setting;
-			}
-		}
-
 		if ((was_seen == 0) && (is_seen == 1)) {
 			lo = msglist[i];
 		}
 		else if ((was_seen == 1) && (is_seen == 0)) {
-			hi = msglist[i-1];
-
-			if (StrLength(vset) > 0) {
-				StrBufAppendBufPlain(vset, HKEY(","), 0);
-			}
-			if (lo == hi) {
-				StrBufAppendPrintf(vset, "%ld", hi);
-			}
-			else {
-				StrBufAppendPrintf(vset, "%ld:%ld", lo, hi);
-			}
+			seen_set_add(newset, lo, msglist[i-1]);
 		}
-
-		if ((is_seen) && (i == num_msgs - 1)) {
-			if (StrLength(vset) > 0) {
-				StrBufAppendBufPlain(vset, HKEY(","), 0);
-			}
-			if ((i==0) || (was_seen == 0)) {
-				StrBufAppendPrintf(vset, "%ld", msglist[i]);
-			}
-			else {
-				StrBufAppendPrintf(vset, "%ld:%ld", lo, msglist[i]);
-			}
-		}
-
 		was_seen = is_seen;
 	}
-
-	// We will have to stuff this string back into a 4096 byte buffer, so if it's
-	// larger than that now, truncate it by removing tokens from the beginning.
-	// The limit of 100 iterations is there to prevent an infinite loop in case
-	// something unexpected happens.
-	int number_of_truncations = 0;
-	while ( (StrLength(vset) > SIZ) && (number_of_truncations < 100) ) {
-		StrBufRemove_token(vset, 0, ',');
-		++number_of_truncations;
+	if (was_seen) {
+		seen_set_add(newset, lo, msglist[num_msgs-1]);
 	}
 
-	// If we're truncating the sequence set of messages marked with the 'seen' flag,
-	// we want the earliest messages (the truncated ones) to be marked, not unmarked.
-	// Otherwise messages at the beginning will suddenly appear to be 'unseen'.
-	if ( (which_set == ctdlsetseen_seen) && (number_of_truncations > 0) ) {
-		StrBuf *first_tok;
-		first_tok = NewStrBuf();
-		StrBufExtract_token(first_tok, vset, 0, ',');
-		StrBufRemove_token(vset, 0, ',');
+	free(is_set);
+	CtdlPutMsgList(&ml);
 
-		if (StrBufNum_tokens(first_tok, ':') > 1) {
-			StrBufRemove_token(first_tok, 0, ':');
-		}
-		
-		StrBuf *new_set;
-		new_set = NewStrBuf();
-		StrBufAppendBufPlain(new_set, HKEY("1:"), 0);
-		StrBufAppendBuf(new_set, first_tok, 0);
-		StrBufAppendBufPlain(new_set, HKEY(":"), 0);
-		StrBufAppendBuf(new_set, vset, 0);
-
-		FreeStrBuf(&vset);
-		FreeStrBuf(&first_tok);
-		vset = new_set;
-	}
-
-	// Decide which message set we're manipulating.  Zero the buffers so they compress well.
-	switch (which_set) {
-		case ctdlsetseen_seen:
-			memset(vbuf.v_seen, 0, sizeof vbuf.v_seen);
-			safestrncpy(vbuf.v_seen, ChrPtr(vset), sizeof vbuf.v_seen);
-			break;
-		case ctdlsetseen_answered:
-			memset(vbuf.v_answered, 0, sizeof vbuf.v_seen);
-			safestrncpy(vbuf.v_answered, ChrPtr(vset), sizeof vbuf.v_answered);
-			break;
+	// The visit record and the log of flag changes are written together, so nobody sees one without the
+	// other.  The number of the change has to be taken before the transaction begins.
+	if (num_changed > 0) {
+		modseq = CtdlModseqBegin();
 	}
+	cdb_begin_transaction();
+	if (which_set == ctdlsetseen_seen) {
+		CtdlSetRelationshipSets(&vbuf, newset, otherset, which_user, which_room);
+	}
+	else {
+		CtdlSetRelationshipSets(&vbuf, otherset, newset, which_user, which_room);
+	}
+	CtdlModseqFlagsChanged(which_room->QRnumber, which_user->usernum, changed, num_changed, modseq);
+	cdb_end_transaction();
+	if (num_changed > 0) {
+		CtdlModseqEnd();
+	}
+	seen_set_free(&newset);
+	seen_set_free(&otherset);
+	free(changed);
+}
 
-	free(is_set);
-	free(msglist);
-	CtdlSetRelationship(&vbuf, which_user, which_room);
-	FreeStrBuf(&vset);
+
+// Let go of the message list saved by the previous CtdlForEachMessage() in this session
+void CtdlForgetCachedMsgList(CitContext *ccptr) {
+	if (ccptr->cached_msglist_ref != NULL) {
+		CtdlPutMsgList(&ccptr->cached_msglist_ref);
+	}
+	else if (ccptr->cached_msglist != NULL) {
+		free(ccptr->cached_msglist);
+	}
+	ccptr->cached_msglist = NULL;
+	ccptr->cached_num_msgs = 0;
 }
 
 
@@ -626,9 +567,10 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
                         ForEachMsgCallback CallBack,
 			void *userdata)
 {
-	int a, i, j;
+	int a, i;
 	struct visit vbuf;
-	struct cdbdata *cdbfr;
+	struct seen_set *seen = NULL;
+	struct msglist *ml = NULL;
 	long *msglist = NULL;
 	int num_msgs = 0;
 	int num_processed = 0;
@@ -656,29 +598,32 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 	}
 	CtdlGetUser(&CC->user, CC->curr_user);
 
-	if (server_shutting_down) {
-		if (need_to_free_re) regfree(&re);
-		return -1;
-	}
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
-
 	if (server_shutting_down) {
 		if (need_to_free_re) regfree(&re);
 		return -1;
 	}
 
 	// Load the message list
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &CC->room.QRnumber, sizeof(long));
-	if (cdbfr == NULL) {
+	ml = CtdlGetMsgList(CC->room.QRnumber);
+	if (ml == NULL) {
 		if (need_to_free_re) regfree(&re);
 		return 0;	// No messages at all?  No further action.
 	}
+	num_msgs = ml->num_msgs;
 
-	msglist = (long *) cdbfr->ptr;
-	num_msgs = cdbfr->len / sizeof(long);
-
-	cdbfr->ptr = NULL;	// clear this so that cdb_free() doesn't free it
-	cdb_free(cdbfr);	// we own this memory now
+	// The list is shared with other sessions and must not be modified.  Filtering by content type,
+	// template, or search string edits it in place, so only those need a private copy.
+	if (	((content_type != NULL) && (!IsEmptyStr(content_type)))
+		|| (compare != NULL)
+		|| ((mode == MSGS_SEARCH) && (search_string))
+	) {
+		msglist = malloc(sizeof(long) * (num_msgs + 1));
+		memcpy(msglist, ml->msgs, sizeof(long) * num_msgs);
+		CtdlPutMsgList(&ml);
+	}
+	else {
+		msglist = ml->msgs;
+	}
 
 	/*
 	 * Now begin the traversal.
@@ -713,7 +658,9 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 		}
 	}
 
-	num_msgs = sort_msglist(msglist, num_msgs);
+	if (ml == NULL) {			// (a shared list is always sorted already)
+		num_msgs = sort_msglist(msglist, num_msgs);
+	}
 
 	/* If a template was supplied, filter out the messages which
 	 * don't match.  (This could induce some delays!)
@@ -746,7 +693,8 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 	 * output list is guaranteed to be shorter than or equal to the
 	 * input list, we overwrite the bottom of the input list.  This
 	 * eliminates the need to memmove big chunks of the list over and
-	 * over again.
+	 * over again.  (The template filter above may have zeroed some
+	 * entries, so squeeze those out first to keep the list ascending.)
 	 */
 	if ( (num_msgs > 0) && (mode == MSGS_SEARCH) && (search_string) ) {
 
@@ -763,12 +711,11 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 			orig_num_msgs = num_msgs;
 			num_msgs = 0;
 			for (i=0; i<orig_num_msgs; ++i) {
-				for (j=0; j<num_search_msgs; ++j) {
-					if (msglist[i] == search_msgs[j]) {
-						msglist[num_msgs++] = msglist[i];
-					}
+				if (msglist[i] > 0L) {
+					msglist[num_msgs++] = msglist[i];
 				}
 			}
+			num_msgs = msglist_intersect(msglist, msglist, num_msgs, search_msgs, num_search_msgs);
 		}
 		else {
 			num_msgs = 0;	/* No messages qualify */
@@ -782,6 +729,13 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 		mode = MSGS_ALL;
 	}
 
+	/*
+	 * Every mode except MSGS_ALL looks at which messages have been seen.
+	 */
+	if ((num_msgs > 0) && (mode != MSGS_ALL)) {
+		CtdlGetRelationshipSets(&vbuf, &seen, NULL, &CC->user, &CC->room);
+	}
+
 	/*
 	 * Now iterate through the message list, according to the
 	 * criteria supplied by the caller.
@@ -790,7 +744,13 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 		for (a = 0; a < num_msgs; ++a) {
 			if (server_shutting_down) {
 				if (need_to_free_re) regfree(&re);
-				free(msglist);
+				seen_set_free(&seen);
+				if (ml != NULL) {
+					CtdlPutMsgList(&ml);
+				}
+				else {
+					free(msglist);
+				}
 				return num_processed;
 			}
 			thismsg = msglist[a];
@@ -798,7 +758,7 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 				is_seen = 0;
 			}
 			else {
-				is_seen = is_msg_in_sequence_set(vbuf.v_seen, thismsg);
+				is_seen = seen_set_contains(seen, thismsg);
 				if (is_seen) lastold = thismsg;
 			}
 			if (
@@ -828,16 +788,19 @@ int CtdlForEachMessage(int mode, long ref, char *search_string,
 			}
 		}
 	if (need_to_free_re) regfree(&re);
+	seen_set_free(&seen);
 
 	/*
 	 * We cache the most recent msglist in order to do security checks later
 	 */
 	if (CC->client_socket > 0) {
-		if (CC->cached_msglist != NULL) {
-			free(CC->cached_msglist);
-		}
+		CtdlForgetCachedMsgList(CC);
 		CC->cached_msglist = msglist;
 		CC->cached_num_msgs = num_msgs;
+		CC->cached_msglist_ref = ml;		// if it's the shared list, hang on to our reference
+	}
+	else if (ml != NULL) {
+		CtdlPutMsgList(&ml);
 	}
 	else {
 		free(msglist);
@@ -1132,7 +1095,7 @@ struct CtdlMessage *CtdlFetchMessage(long msgnum, int with_body) {
 	struct CtdlMessage *ret = NULL;
 
 	syslog(LOG_DEBUG, "msgbase: CtdlFetchMessage(%ld, %d)", msgnum, with_body);
-	dmsgtext = cdb_fetch(CDB_MSGMAIN, &msgnum, sizeof(long));
+	dmsgtext = cdb_fetch_borrowed(CDB_MSGMAIN, &msgnum, sizeof(long));	// the fields are copied out of it
 	if (dmsgtext == NULL) {
 		syslog(LOG_ERR, "msgbase: message #%ld was not found", msgnum);
 		return NULL;
@@ -1145,8 +1108,6 @@ struct CtdlMessage *CtdlFetchMessage(long msgnum, int with_body) {
 
 	ret = CtdlDeserializeMessage(msgnum, with_body, dmsgtext->ptr, dmsgtext->len);
 
-	cdb_free(dmsgtext);
-
 	if (ret == NULL) {
 		return NULL;
 	}
@@ -2223,11 +2184,8 @@ DONE:	/* now we're done */
 int CtdlSaveMsgPointersInRoom(char *roomname, long newmsgidlist[], int num_newmsgs,
 			int do_repl_check, struct CtdlMessage *supplied_msg, int suppress_refcount_adj
 ) {
-	int i, j, unique;
+	int i;
 	char hold_rm[ROOMNAMELEN];
-	struct cdbdata *cdbfr;
-	int num_msgs;
-	long *msglist;
 	long highest_msg = 0L;
 
 	long msgid = 0;
@@ -2257,68 +2215,26 @@ int CtdlSaveMsgPointersInRoom(char *roomname, long newmsgidlist[], int num_newms
 	}
 
 
-	msgs_to_be_merged = malloc(sizeof(long) * num_newmsgs);
-	num_msgs_to_be_merged = 0;
-
-
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &CC->room.QRnumber, sizeof(long));
-	if (cdbfr == NULL) {
-		msglist = NULL;
-		num_msgs = 0;
-	} else {
-		msglist = (long *) cdbfr->ptr;
-		cdbfr->ptr = NULL;	/* CtdlSaveMsgPointerInRoom() now owns this memory */
-		num_msgs = cdbfr->len / sizeof(long);
-		cdb_free(cdbfr);
-	}
-
-
-	/* Create a list of msgid's which were supplied by the caller, but do
-	 * not already exist in the target room.  It is absolutely taboo to
-	 * have more than one reference to the same message in a room.
+	/* Add the messages to the room.  It is absolutely taboo to have more than one
+	 * reference to the same message in a room, so any which are already there are
+	 * left out; what remains in msgs_to_be_merged afterwards is what was added.
 	 */
-	for (i=0; i<num_newmsgs; ++i) {
-		unique = 1;
-		if (num_msgs > 0) for (j=0; j<num_msgs; ++j) {
-			if (msglist[j] == newmsgidlist[i]) {
-				unique = 0;
-			}
-		}
-		if (unique) {
-			msgs_to_be_merged[num_msgs_to_be_merged++] = newmsgidlist[i];
-		}
-	}
+	msgs_to_be_merged = malloc(sizeof(long) * num_newmsgs);
+	memcpy(msgs_to_be_merged, newmsgidlist, sizeof(long) * num_newmsgs);
+	num_msgs_to_be_merged = msglist_add(CC->room.QRnumber, msgs_to_be_merged, num_newmsgs);
 
 	syslog(LOG_DEBUG, "msgbase: %d unique messages to be merged", num_msgs_to_be_merged);
 
-	/*
-	 * Now merge the new messages
-	 */
-	msglist = realloc(msglist, (sizeof(long) * (num_msgs + num_msgs_to_be_merged)) );
-	if (msglist == NULL) {
-		syslog(LOG_ALERT, "msgbase: ERROR; can't realloc message list!");
-		free(msgs_to_be_merged);
-		return (ERROR + INTERNAL_ERROR);
-	}
-	memcpy(&msglist[num_msgs], msgs_to_be_merged, (sizeof(long) * num_msgs_to_be_merged) );
-	num_msgs += num_msgs_to_be_merged;
-
-	/* Sort the message list, so all the msgid's are in order */
-	num_msgs = sort_msglist(msglist, num_msgs);
-
 	/* Determine the highest message number */
-	highest_msg = msglist[num_msgs - 1];
-
-	/* Write it back to disk. */
-	cdb_store(CDB_MSGLISTS, &CC->room.QRnumber, (int)sizeof(long),
-		  msglist, (int)(num_msgs * sizeof(long)));
-
-	/* Free up the memory we used. */
-	free(msglist);
+	highest_msg = CC->room.QRhighest;
+	if ((num_msgs_to_be_merged > 0) && (msgs_to_be_merged[num_msgs_to_be_merged - 1] > highest_msg)) {
+		highest_msg = msgs_to_be_merged[num_msgs_to_be_merged - 1];
+	}
 
 	/* Update the highest-message pointer and unlock the room. */
 	CC->room.QRhighest = highest_msg;
 	CtdlPutRoomLock(&CC->room);
+	CtdlModseqArrived(CC->room.QRnumber, msgs_to_be_merged, num_msgs_to_be_merged);
 
 	/* Perform replication checks if necessary */
 	if ( (DoesThisRoomNeedEuidIndexing(&CC->room)) && (do_repl_check) ) {
@@ -2390,6 +2306,69 @@ int CtdlSaveMsgPointerInRoom(char *roomname, long msgid,
 }
 
 
+/*
+ * Save one message in a whole list of rooms -- usually the mailboxes of a message's local recipients.
+ * Doing that one room at a time costs a room lock, a message list update, a room record write
+ * and a reference count update for every room, each in a transaction of its own.  Here the rooms are
+ * done in batches of DELIVERY_BATCH_ROOMS, each under one room lock and in one transaction, and the
+ * reference count is bumped once at the end.  No replication checks are done.
+ *
+ * Returns the number of rooms the message was saved in.
+ */
+int CtdlSaveMsgPointerInRooms(char **roomnames, int num_rooms, long msgid) {
+	struct ctdlroom *batch;
+	int num_batch;
+	int num_saved = 0;
+	long newmsg;
+	int first, i;
+
+	syslog(LOG_DEBUG, "msgbase: CtdlSaveMsgPointerInRooms(msg=%ld, num_rooms=%d)", msgid, num_rooms);
+	if ((roomnames == NULL) || (num_rooms < 1) || (msgid <= 0L)) {
+		return(0);
+	}
+
+	batch = malloc(sizeof(struct ctdlroom) * ((num_rooms < DELIVERY_BATCH_ROOMS) ? num_rooms : DELIVERY_BATCH_ROOMS));
+	for (first = 0; first < num_rooms; first += DELIVERY_BATCH_ROOMS) {
+		num_batch = 0;
+
+		begin_critical_section(S_ROOMS);
+		cdb_begin_transaction();
+		for (i = first; (i < num_rooms) && (i < first + DELIVERY_BATCH_ROOMS); ++i) {
+			if (CtdlGetRoom(&batch[num_batch], roomnames[i]) != 0) {
+				syslog(LOG_ERR, "msgbase: no such room <%s>", roomnames[i]);
+				continue;
+			}
+
+			/* It is absolutely taboo to have more than one reference to the same message in a room */
+			newmsg = msgid;
+			if (msglist_add(batch[num_batch].QRnumber, &newmsg, 1) == 0) {
+				continue;
+			}
+			if (msgid > batch[num_batch].QRhighest) {
+				batch[num_batch].QRhighest = msgid;
+			}
+			CtdlPutRoom(&batch[num_batch]);
+			++num_batch;
+		}
+		cdb_end_transaction();
+		end_critical_section(S_ROOMS);
+
+		for (i = 0; i < num_batch; ++i) {
+			CtdlModseqArrived(batch[i].QRnumber, &msgid, 1);
+			PerformRoomHooks(&batch[i]);
+		}
+		num_saved += num_batch;
+	}
+	free(batch);
+
+	if (num_saved > 0) {
+		AdjRefCount(msgid, num_saved);
+	}
+	syslog(LOG_DEBUG, "msgbase: message %ld saved in %d of %d rooms", msgid, num_saved, num_rooms);
+	return(num_saved);
+}
+
+
 /*
  * Message base operation to save a new message to the message store
  * (returns new message number)
@@ -2757,6 +2736,7 @@ long CtdlSubmitMsg(struct CtdlMessage *msg,	/* message to save */
 	CC->redirect_buffer = NULL;
 
 	PutMetaData(&smi);
+	PutOverview(newmsgid, msg, content_type, saved_rfc822_version);
 
 	/* Now figure out where to store the pointers */
 	syslog(LOG_DEBUG, "msgbase: storing pointers");
@@ -2799,28 +2779,50 @@ long CtdlSubmitMsg(struct CtdlMessage *msg,	/* message to save */
 		
 	CM_SetFieldLONG(msg, eVltMsgNum, newmsgid);
 
-	// If this is private, local mail, make a copy in the recipient's mailbox and bump the reference count.
+	// If this is private, local mail, make a copy in each recipient's mailbox and bump the reference count.
+	// All the mailboxes are looked up first, so the message can be saved in all of them at once.
 	if ((recps != NULL) && (recps->num_local > 0)) {
 		char *pch;
 		int ntokens;
+		char **mailboxes;
+		char **mailbox_owners;
+		long *mailbox_usernums;
+		int num_mailboxes = 0;
 
 		pch = recps->recp_local;
 		recps->recp_local = recipient;
 		ntokens = num_tokens(pch, '|');
+		mailboxes = malloc(sizeof(char *) * ntokens);
+		mailbox_owners = malloc(sizeof(char *) * ntokens);
+		mailbox_usernums = malloc(sizeof(long) * ntokens);
 		for (i=0; i<ntokens; ++i) {
 			extract_token(recipient, pch, i, '|', sizeof recipient);
 			syslog(LOG_DEBUG, "msgbase: delivering private local mail to <%s>", recipient);
 			if (CtdlGetUser(&userbuf, recipient) == 0) {
 				CtdlMailboxName(actual_rm, sizeof actual_rm, &userbuf, MAILROOM);
-				CtdlSaveMsgPointerInRoom(actual_rm, newmsgid, 0, msg);
-				CtdlBumpNewMailCounter(userbuf.usernum);	// if this user is logged in, tell them they have new mail.
-				PerformMessageHooks(msg, recps, EVT_AFTERUSRMBOXSAVE);
+				mailboxes[num_mailboxes] = strdup(actual_rm);
+				mailbox_owners[num_mailboxes] = strdup(recipient);
+				mailbox_usernums[num_mailboxes] = userbuf.usernum;
+				++num_mailboxes;
 			}
 			else {
 				syslog(LOG_DEBUG, "msgbase: no user <%s>", recipient);
 				CtdlSaveMsgPointerInRoom(CtdlGetConfigStr("c_aideroom"), newmsgid, 0, msg);
 			}
 		}
+
+		CtdlSaveMsgPointerInRooms(mailboxes, num_mailboxes, newmsgid);
+
+		for (i=0; i<num_mailboxes; ++i) {
+			safestrncpy(recipient, mailbox_owners[i], sizeof recipient);
+			CtdlBumpNewMailCounter(mailbox_usernums[i]);	// if this user is logged in, tell them they have new mail.
+			PerformMessageHooks(msg, recps, EVT_AFTERUSRMBOXSAVE);
+			free(mailboxes[i]);
+			free(mailbox_owners[i]);
+		}
+		free(mailboxes);
+		free(mailbox_owners);
+		free(mailbox_usernums);
 		recps->recp_local = pch;
 	}
 
@@ -3226,7 +3228,6 @@ int CtdlDeleteMessages(const char *room_name,	// which room
 		       char *content_type	// or "" for any.  regular expressions expected.
 ) {
 	struct ctdlroom qrbuf;
-	struct cdbdata *cdbfr;
 	long *msglist = NULL;
 	long *dellist = NULL;
 	int num_msgs = 0;
@@ -3250,14 +3251,9 @@ int CtdlDeleteMessages(const char *room_name,	// which room
 		if (need_to_free_re) regfree(&re);
 		return(0);	/* room not found */
 	}
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &qrbuf.QRnumber, sizeof(long));
-
-	if (cdbfr != NULL) {
-		dellist = malloc(cdbfr->len);
-		msglist = (long *) cdbfr->ptr;
-		cdbfr->ptr = NULL;	/* CtdlDeleteMessages() now owns this memory */
-		num_msgs = cdbfr->len / sizeof(long);
-		cdb_free(cdbfr);
+	msglist = CtdlCopyMsgList(qrbuf.QRnumber, &num_msgs);	/* our own copy, to be edited */
+	if (msglist != NULL) {
+		dellist = malloc(sizeof(long) * (num_msgs + 1));
 	}
 	if (num_msgs > 0) {
 		int have_contenttype = (content_type != NULL) && !IsEmptyStr(content_type);
@@ -3326,14 +3322,21 @@ int CtdlDeleteMessages(const char *room_name,	// which room
 			FreeStrBuf(&dbg);
 		}
 */
-		num_msgs = sort_msglist(msglist, num_msgs);
-		cdb_store(CDB_MSGLISTS, &qrbuf.QRnumber, (int)sizeof(long),
-			  msglist, (int)(num_msgs * sizeof(long)));
-
-		if (num_msgs > 0)
-			qrbuf.QRhighest = msglist[num_msgs - 1];
-		else
+		/* Only the deletions are written (unless that leaves nothing at all) */
+		while ((num_msgs > 0) && (msglist[num_msgs - 1] == 0L)) {
+			--num_msgs;
+		}
+		for (i = 0; (i < num_msgs) && (msglist[i] == 0L); ++i) ;
+		if (i >= num_msgs) {
+			msglist_destroy(qrbuf.QRnumber);
 			qrbuf.QRhighest = 0;
+		}
+		else {
+			if (num_deleted > 0) {
+				msglist_remove(qrbuf.QRnumber, dellist, num_deleted);
+			}
+			qrbuf.QRhighest = msglist[num_msgs - 1];
+		}
 	}
 	CtdlPutRoomLock(&qrbuf);
 
@@ -3346,6 +3349,7 @@ int CtdlDeleteMessages(const char *room_name,	// which room
 	 * section.
 	 */
 	if (num_deleted) {
+		CtdlModseqExpunged(qrbuf.QRnumber, dellist, num_deleted);
 		for (i=0; i<num_deleted; ++i) {
 			PerformDeleteHooks(qrbuf.QRname, dellist[i]);
 		}
@@ -3375,7 +3379,7 @@ void GetMetaData(struct MetaData *smibuf, long msgnum)
 	/* Use the negative of the message number for its supp record index */
 	TheIndex = (0L - msgnum);
 
-	cdbsmi = cdb_fetch(CDB_MSGMAIN, &TheIndex, sizeof(long));
+	cdbsmi = cdb_fetch_borrowed(CDB_MSGMAIN, &TheIndex, sizeof(long));
 	if (cdbsmi == NULL) {
 		return;			/* record not found; leave it alone */
 	}
@@ -3383,7 +3387,6 @@ void GetMetaData(struct MetaData *smibuf, long msgnum)
 	       ((cdbsmi->len > sizeof(struct MetaData)) ?
 		sizeof(struct MetaData) : cdbsmi->len)
 	);
-	cdb_free(cdbsmi);
 	return;
 }
 
@@ -3406,15 +3409,83 @@ void PutMetaData(struct MetaData *smibuf)
 
 
 /*
- * Convenience function to process a big block of AdjRefCount() operations
+ * Remove a message, its metadata and its overview from the message base.  Caller runs the delete hooks first.
+ */
+static void DeleteMessageRecords(long msgnum)
+{
+	long delnum;
+
+	/* Remove from message base */
+	delnum = msgnum;
+	cdb_delete(CDB_MSGMAIN, &delnum, (int)sizeof(long));
+	cdb_delete(CDB_BIGMSGS, &delnum, (int)sizeof(long));
+
+	/* Remove metadata and overview records */
+	delnum = (0L - msgnum);
+	cdb_delete(CDB_MSGMAIN, &delnum, (int)sizeof(long));
+	DeleteOverview(msgnum);
+}
+
+
+/*
+ * Process a big block of AdjRefCount() operations.  Rather than one database transaction per message
+ * (and then several more for each one which gets deleted), the reference counts are adjusted
+ * REFCOUNT_BATCH_SIZE at a time in a single transaction, and the messages whose count reaches zero
+ * are deleted the same way once their delete hooks have run.
  */
 void AdjRefCountList(long *msgnum, long nmsg, int incr)
 {
-	long i;
+	struct MetaData smi;
+	long *dellist;
+	long num_deleted = 0;
+	long first, i;
+
+	if (nmsg == 1) {
+		AdjRefCount(msgnum[0], incr);
+		return;
+	}
+	if (nmsg < 1) {
+		return;
+	}
+
+	dellist = malloc(sizeof(long) * nmsg);
+	if (dellist == NULL) {
+		for (i = 0; i < nmsg; i++) {
+			AdjRefCount(msgnum[i], incr);
+		}
+		return;
+	}
 
-	for (i = 0; i < nmsg; i++) {
-		AdjRefCount(msgnum[i], incr);
+	for (first = 0; first < nmsg; first += REFCOUNT_BATCH_SIZE) {
+		begin_critical_section(S_SUPPMSGMAIN);
+		cdb_begin_transaction();
+		for (i = first; (i < nmsg) && (i < first + REFCOUNT_BATCH_SIZE); ++i) {
+			GetMetaData(&smi, msgnum[i]);
+			smi.meta_refcount += incr;
+			PutMetaData(&smi);
+			if (smi.meta_refcount == 0) {
+				dellist[num_deleted++] = msgnum[i];
+			}
+		}
+		cdb_end_transaction();
+		end_critical_section(S_SUPPMSGMAIN);
+	}
+	syslog(LOG_DEBUG, "msgbase: AdjRefCountList() %ld msgs ref count delta %+d, %ld to be deleted", nmsg, incr, num_deleted);
+
+	/* Call delete hooks with NULL room to show they have gone altogether */
+	for (i = 0; i < num_deleted; i++) {
+		PerformDeleteHooks(NULL, dellist[i]);
+	}
+
+	for (first = 0; first < num_deleted; first += REFCOUNT_BATCH_SIZE) {
+		cdb_begin_transaction();
+		for (i = first; (i < num_deleted) && (i < first + REFCOUNT_BATCH_SIZE); ++i) {
+			DeleteMessageRecords(dellist[i]);
+		}
+		cdb_end_transaction();
 	}
+
+	free(dellist);
 }
 
 
@@ -3424,7 +3495,6 @@ void AdjRefCountList(long *msgnum, long nmsg, int incr)
 void AdjRefCount(long msgnum, int incr)
 {
 	struct MetaData smi;
-	long delnum;
 
 	/* This is a *tight* critical section; please keep it that way, as
 	 * it may get called while nested in other critical sections.  
@@ -3445,14 +3515,7 @@ void AdjRefCount(long msgnum, int incr)
 		/* Call delete hooks with NULL room to show it has gone altogether */
 		PerformDeleteHooks(NULL, msgnum);
 
-		/* Remove from message base */
-		delnum = msgnum;
-		cdb_delete(CDB_MSGMAIN, &delnum, (int)sizeof(long));
-		cdb_delete(CDB_BIGMSGS, &delnum, (int)sizeof(long));
-
-		/* Remove metadata record */
-		delnum = (0L - msgnum);
-		cdb_delete(CDB_MSGMAIN, &delnum, (int)sizeof(long));
+		DeleteMessageRecords(msgnum);
 	}
 }
 
@@ -3540,6 +3603,7 @@ long CtdlWriteObject(char *req_room,			/* Room to stuff it in */
 char *ctdl_module_init_msgbase(void) {
 	if (!threading) {
 		FillMsgKeyLookupTable();
+		CtdlRegisterSessionHook(msglist_compact_pending, EVT_TIMER, PRIO_CLEANUP + 15);
 	}
 
         /* return our module id for the log */
@@ -88,6 +88,8 @@ int TDAP_ProcessAdjRefCountQueue(void);
 void simple_listing(long, void *);
 int CtdlMsgCmp(struct CtdlMessage *msg, struct CtdlMessage *template);
 typedef void (*ForEachMsgCallback)(long MsgNumber, void *UserData);
+struct CitContext;
+void CtdlForgetCachedMsgList(struct CitContext *ccptr);
 int CtdlForEachMessage(int mode,
 			long ref,
 			char *searchstring,
@@ -134,6 +136,7 @@ int CtdlSaveMsgPointersInRoom(char *roomname, long newmsgidlist[], int num_newms
 			      int do_repl_check, struct CtdlMessage *supplied_msg, int suppress_refcount_adj
 );
 int CtdlSaveMsgPointerInRoom(char *roomname, long msgid, int do_repl_check, struct CtdlMessage *msg);
+int CtdlSaveMsgPointerInRooms(char **roomnames, int num_rooms, long msgid);
 long CtdlSaveThisMessage(struct CtdlMessage *msg, long msgid, int Reply);
 char *CtdlReadMessageBody(char *terminator, long tlen, size_t maxlen, StrBuf *exist, int crlf);
 StrBuf *CtdlReadMessageBodyBuf(
@@ -182,7 +185,7 @@ void CtdlSetSeen(long *target_msgnums, int num_target_msgnums,
 	struct ctdluser *which_user, struct ctdlroom *which_room
 );
 
-void CtdlGetSeen(char *buf, int which_set);
+void CtdlGetSeen(StrBuf *Target, int which_set);
 
 
 struct CtdlMessage *CtdlMakeMessage(
@@ -0,0 +1,268 @@
+// Shared cache of room message lists (CDB_MSGLISTS)
+//
+// Big rooms have message lists hundreds of thousands of entries long, and nearly every room
+// operation (reading, IMAP SELECT/NOOP, setting seen flags, saving a message) used to fetch and
+// copy the whole list from the database.  Here we keep the most recently used lists in memory,
+// reference counted, so any number of sessions can read the same copy.  Any write to CDB_MSGLISTS
+// goes through cdb_store()/cdb_delete(), which call msglist_cache_invalidate() to drop the stale
+// copy; sessions still holding it keep a consistent snapshot until they let go.  How the lists are
+// laid out on disk is msglist_store.c's business.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "sysdep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <libcitadel.h>
+#include "citserver.h"
+#include "config.h"
+#include "database.h"
+#include "room_ops.h"
+#include "threads.h"
+#include "msglist_cache.h"
+#include "msglist_store.h"
+
+#define MSGLIST_CACHE_BUCKETS	1024
+
+static pthread_mutex_t msglist_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct msglist *msglist_hash[MSGLIST_CACHE_BUCKETS];
+static struct msglist *lru_head = NULL;		// most recently used
+static struct msglist *lru_tail = NULL;		// least recently used
+static long cache_generation = 0;		// bumped on every invalidation
+static struct msglist_cache_stats stats;
+
+
+// The memory budget is read from the config every time, so it can be changed on a running server.
+static size_t msglist_cache_budget(void) {
+	long mb = CtdlGetConfigLong("c_msglist_cache_mb");
+	return( (mb > 0) ? ((size_t)mb * 1024 * 1024) : 0 );
+}
+
+
+static void free_msglist(struct msglist *ml) {
+	free(ml->msgs);
+	free(ml);
+}
+
+
+// Take an entry out of the hash table and LRU list.  Caller must hold the lock.
+static void unlink_msglist(struct msglist *ml) {
+	struct msglist **ptr;
+
+	for (ptr = &msglist_hash[ml->qrnumber % MSGLIST_CACHE_BUCKETS]; *ptr != NULL; ptr = &(*ptr)->hash_next) {
+		if (*ptr == ml) {
+			*ptr = ml->hash_next;
+			break;
+		}
+	}
+	if (ml->lru_prev) ml->lru_prev->lru_next = ml->lru_next; else lru_head = ml->lru_next;
+	if (ml->lru_next) ml->lru_next->lru_prev = ml->lru_prev; else lru_tail = ml->lru_prev;
+	ml->hash_next = ml->lru_prev = ml->lru_next = NULL;
+
+	ml->cached = 0;
+	--stats.entries;
+	stats.bytes -= ml->bytes;
+	if (--ml->refcount == 0) {
+		free_msglist(ml);
+	}
+}
+
+
+static void lru_to_front(struct msglist *ml) {
+	if (lru_head == ml) return;
+	if (ml->lru_prev) ml->lru_prev->lru_next = ml->lru_next;
+	if (ml->lru_next) ml->lru_next->lru_prev = ml->lru_prev; else lru_tail = ml->lru_prev;
+	ml->lru_prev = NULL;
+	ml->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = ml;
+	lru_head = ml;
+	if (lru_tail == NULL) lru_tail = ml;
+}
+
+
+static struct msglist *find_msglist(long qrnumber) {
+	struct msglist *ml;
+
+	for (ml = msglist_hash[qrnumber % MSGLIST_CACHE_BUCKETS]; ml != NULL; ml = ml->hash_next) {
+		if (ml->qrnumber == qrnumber) {
+			return(ml);
+		}
+	}
+	return(NULL);
+}
+
+
+// Load a message list from disk.  Lists are supposed to be stored sorted and without zeroes;
+// we make sure of that once here so readers can rely on it without sorting every time.
+static struct msglist *load_msglist(long qrnumber) {
+	struct msglist *ml;
+	long *msgs;
+	int num_msgs;
+	int i;
+
+	msgs = msglist_read(qrnumber, &num_msgs);
+	if (msgs == NULL) {
+		return(NULL);
+	}
+
+	ml = (struct msglist *) malloc(sizeof(struct msglist));
+	memset(ml, 0, sizeof(struct msglist));
+	ml->qrnumber = qrnumber;
+	ml->msgs = msgs;
+	ml->num_msgs = num_msgs;
+	ml->bytes = (num_msgs * sizeof(long)) + sizeof(struct msglist);
+	ml->refcount = 1;
+
+	for (i=0; i<ml->num_msgs; ++i) {
+		if ( (ml->msgs[i] <= 0L) || ((i > 0) && (ml->msgs[i] <= ml->msgs[i-1])) ) {
+			ml->num_msgs = sort_msglist(ml->msgs, ml->num_msgs);
+			break;
+		}
+	}
+	return(ml);
+}
+
+
+// Get the message list for a room.  Returns NULL if the room has no message list.
+// The caller must not modify the list, and must release it with CtdlPutMsgList() when finished.
+struct msglist *CtdlGetMsgList(long qrnumber) {
+	struct msglist *ml, *other;
+	long generation;
+	size_t budget;
+
+	pthread_mutex_lock(&msglist_cache_lock);
+	ml = find_msglist(qrnumber);
+	if (ml != NULL) {
+		++ml->refcount;
+		++stats.hits;
+		lru_to_front(ml);
+		pthread_mutex_unlock(&msglist_cache_lock);
+		return(ml);
+	}
+	++stats.misses;
+	generation = cache_generation;
+	pthread_mutex_unlock(&msglist_cache_lock);
+
+	ml = load_msglist(qrnumber);
+	if (ml == NULL) {
+		return(NULL);
+	}
+
+	// Don't cache anything read inside a transaction (it could still be rolled back), anything read while
+	// someone was writing to the message lists (it may already be stale), or anything over budget.
+	budget = msglist_cache_budget();
+	if ((TSD->tid != NULL) || (ml->bytes > budget)) {
+		return(ml);
+	}
+
+	pthread_mutex_lock(&msglist_cache_lock);
+	if (generation != cache_generation) {
+		pthread_mutex_unlock(&msglist_cache_lock);
+		return(ml);
+	}
+	other = find_msglist(qrnumber);
+	if (other != NULL) {			// someone else loaded it while we were reading; use theirs
+		++other->refcount;
+		lru_to_front(other);
+		pthread_mutex_unlock(&msglist_cache_lock);
+		free_msglist(ml);
+		return(other);
+	}
+
+	while ((lru_tail != NULL) && (stats.bytes + ml->bytes > budget)) {
+		++stats.evictions;
+		unlink_msglist(lru_tail);
+	}
+
+	ml->cached = 1;
+	++ml->refcount;				// one for the caller, one for the cache
+	ml->hash_next = msglist_hash[qrnumber % MSGLIST_CACHE_BUCKETS];
+	msglist_hash[qrnumber % MSGLIST_CACHE_BUCKETS] = ml;
+	ml->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = ml;
+	lru_head = ml;
+	if (lru_tail == NULL) lru_tail = ml;
+	++stats.entries;
+	stats.bytes += ml->bytes;
+	pthread_mutex_unlock(&msglist_cache_lock);
+	return(ml);
+}
+
+
+// Release a message list obtained from CtdlGetMsgList()
+void CtdlPutMsgList(struct msglist **ml) {
+	int refcount;
+
+	if ((ml == NULL) || (*ml == NULL)) return;
+
+	pthread_mutex_lock(&msglist_cache_lock);
+	refcount = --(*ml)->refcount;
+	pthread_mutex_unlock(&msglist_cache_lock);
+
+	if (refcount == 0) {
+		free_msglist(*ml);
+	}
+	*ml = NULL;
+}
+
+
+// Return a private copy of a room's message list, which the caller may modify and must free().
+// Returns NULL (and sets *num_msgs to zero) if the room has no message list.
+long *CtdlCopyMsgList(long qrnumber, int *num_msgs) {
+	struct msglist *ml;
+	long *msgs = NULL;
+
+	*num_msgs = 0;
+	ml = CtdlGetMsgList(qrnumber);
+	if (ml == NULL) {
+		return(NULL);
+	}
+	msgs = malloc(sizeof(long) * (ml->num_msgs + 1));
+	if (msgs != NULL) {
+		memcpy(msgs, ml->msgs, sizeof(long) * ml->num_msgs);
+		*num_msgs = ml->num_msgs;
+	}
+	CtdlPutMsgList(&ml);
+	return(msgs);
+}
+
+
+// Called by the database layer whenever a room's message list is written or deleted.
+void msglist_cache_invalidate(long qrnumber) {
+	struct msglist *ml;
+
+	pthread_mutex_lock(&msglist_cache_lock);
+	++cache_generation;
+	ml = find_msglist(qrnumber);
+	if (ml != NULL) {
+		++stats.invalidations;
+		unlink_msglist(ml);
+	}
+	pthread_mutex_unlock(&msglist_cache_lock);
+}
+
+
+// Drop everything (used when the whole table is truncated)
+void msglist_cache_flush(void) {
+	pthread_mutex_lock(&msglist_cache_lock);
+	++cache_generation;
+	while (lru_tail != NULL) {
+		++stats.invalidations;
+		unlink_msglist(lru_tail);
+	}
+	pthread_mutex_unlock(&msglist_cache_lock);
+}
+
+
+void msglist_cache_get_stats(struct msglist_cache_stats *s) {
+	pthread_mutex_lock(&msglist_cache_lock);
+	memcpy(s, &stats, sizeof(struct msglist_cache_stats));
+	pthread_mutex_unlock(&msglist_cache_lock);
+	s->budget = msglist_cache_budget();
+}
@@ -0,0 +1,44 @@
+// Shared cache of room message lists (CDB_MSGLISTS)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef MSGLIST_CACHE_H
+#define MSGLIST_CACHE_H
+
+// A room's message list as handed out by CtdlGetMsgList().  Many sessions may be looking at the
+// same one at once, so the array is read-only: anyone who needs to modify it must make a copy.
+struct msglist {
+	long *msgs;			// sorted, strictly ascending, no zeroes
+	int num_msgs;
+
+	// the rest is for the cache's own use
+	long qrnumber;
+	int refcount;			// protected by the cache mutex
+	int cached;			// nonzero while the cache itself holds a reference
+	size_t bytes;
+	struct msglist *hash_next;
+	struct msglist *lru_prev;
+	struct msglist *lru_next;
+};
+
+struct msglist_cache_stats {
+	long entries;
+	size_t bytes;
+	size_t budget;
+	long hits;
+	long misses;
+	long evictions;
+	long invalidations;
+};
+
+struct msglist *CtdlGetMsgList(long qrnumber);
+void CtdlPutMsgList(struct msglist **ml);
+long *CtdlCopyMsgList(long qrnumber, int *num_msgs);
+void msglist_cache_invalidate(long qrnumber);
+void msglist_cache_flush(void);
+void msglist_cache_get_stats(struct msglist_cache_stats *s);
+
+#endif // MSGLIST_CACHE_H
@@ -0,0 +1,70 @@
+// Operations on sorted message lists which don't need anything else from the server, so the utilities can
+// use (and time) them too.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "msglist_ops.h"
+
+
+// Find the first position at or after "start" in a sorted message list whose value is >= target
+// (or num if there is none).  We step forward in doubling strides and then binary search the last
+// stride, so a short skip costs a comparison or two and a long one costs only a logarithm.
+int msglist_gallop(const long *list, int num, int start, long target) {
+	int lo = start;
+	int hi;
+	int step = 1;
+
+	if ((lo >= num) || (list[lo] >= target)) {
+		return(lo);
+	}
+
+	hi = lo + 1;
+	while ((hi < num) && (list[hi] < target)) {
+		lo = hi;
+		step *= 2;
+		hi = lo + step;
+	}
+	if (hi > num) {
+		hi = num;
+	}
+
+	// Now list[lo] < target, and either hi == num or list[hi] >= target
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if (list[mid] < target) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return(hi);
+}
+
+
+// Intersect two sorted, strictly ascending message lists, galloping over runs which can't match.
+// This is linear when the lists are about the same size and close to (small * log(big)) when they aren't.
+// The result goes into dest, which may be the same array as a.  Returns the number of messages in it.
+int msglist_intersect(long *dest, const long *a, int num_a, const long *b, int num_b) {
+	int i = 0;
+	int j = 0;
+	int n = 0;
+
+	while ((i < num_a) && (j < num_b)) {
+		if (a[i] == b[j]) {
+			dest[n++] = a[i];
+			++i;
+			++j;
+		}
+		else if (a[i] < b[j]) {
+			i = msglist_gallop(a, num_a, i, b[j]);
+		}
+		else {
+			j = msglist_gallop(b, num_b, j, a[i]);
+		}
+	}
+	return(n);
+}
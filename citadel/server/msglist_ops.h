@@ -0,0 +1,14 @@
+// Operations on sorted message lists (see msglist_ops.c)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef MSGLIST_OPS_H
+#define MSGLIST_OPS_H
+
+int msglist_gallop(const long *list, int num, int start, long target);
+int msglist_intersect(long *dest, const long *a, int num_a, const long *b, int num_b);
+
+#endif // MSGLIST_OPS_H
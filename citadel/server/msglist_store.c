@@ -0,0 +1,612 @@
+// Segmented storage of room message lists (CDB_MSGLISTS)
+//
+// A room's message list used to be a single record holding every message number in the room, so
+// saving one message meant reading, sorting and rewriting the whole array (megabytes, in a big room),
+// and so did deleting one.  Now each list is stored in pieces:
+//
+//   key {qrnumber}		the head: a short directory of the room's segments
+//   key {qrnumber, id}		a segment: a sorted run of about MSGLIST_SEGMENT_SIZE message numbers
+//   key {qrnumber, 0}		tombstones: messages deleted from the room but still in the segments
+//
+// Segments cover ascending ranges which don't overlap, so any message number belongs in exactly one
+// of them, and a new message (which is nearly always the highest numbered) only touches the last one.
+// Deleting messages only adds tombstones.  Once a room has collected enough of them, its segments are
+// rewritten without them by msglist_compact_pending(), which runs from the housekeeping timer.
+//
+// A head record which doesn't begin with MSGLIST_SEGMENTED is a list in the old single-array format.
+// Those are read as they are, and converted the first time they are written.
+//
+// Anyone who writes a list must be holding S_ROOMS (usually by way of CtdlGetRoomLock()).  Every change is
+// made in a transaction, and a list is read from a single snapshot, so nobody sees one half done.  The
+// message list cache is kept up to date by cdb_store() and cdb_delete(), as it always was.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "sysdep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <libcitadel.h>
+#include "citserver.h"
+#include "database.h"
+#include "room_ops.h"
+#include "threads.h"
+#include "msglist_cache.h"
+#include "msglist_store.h"
+
+#define MSGLIST_SEGMENTED	(-0x4d4c5347L)	// first word of a segmented list's head record
+#define MSGLIST_TOMBSTONES	0L		// segment id of the tombstone record
+#define HEAD_WORDS		2		// magic and next segment id, followed by the segment directory
+
+enum {
+	HEAD_NONE,				// the room has no message list
+	HEAD_LEGACY,				// the whole list is in the head record
+	HEAD_SEGMENTED
+};
+
+struct segref {
+	long id;
+	long low;				// the lowest message number which goes in this segment
+};
+
+struct msglist_head {
+	long next_id;
+	int num_segs;
+	struct segref *segs;
+};
+
+static pthread_mutex_t compact_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static long *compact_queue = NULL;
+static int compact_queue_num = 0;
+static int compact_queue_alloc = 0;
+
+
+// Sort a list and remove zeroes and duplicates.  Returns the new count.
+static int sort_unique(long *msgs, int num_msgs) {
+	int i, n;
+
+	num_msgs = sort_msglist(msgs, num_msgs);
+	for (i = 1, n = (num_msgs > 0); i < num_msgs; ++i) {
+		if (msgs[i] != msgs[n - 1]) {
+			msgs[n++] = msgs[i];
+		}
+	}
+	return(n);
+}
+
+
+// Fetch one piece of a list as an array the caller must free.  Returns NULL if there is no such piece.
+static long *fetch_part(long qrnumber, long id, int *num_msgs) {
+	long key[2] = { qrnumber, id };
+	struct cdbdata *cdbfr;
+	long *msgs;
+
+	*num_msgs = 0;
+	cdbfr = cdb_fetch(CDB_MSGLISTS, key, sizeof key);
+	if (cdbfr == NULL) {
+		return(NULL);
+	}
+	if (cdbfr->len == 0) {
+		cdb_free(cdbfr);
+		return(malloc(sizeof(long)));
+	}
+	msgs = (long *) cdbfr->ptr;
+	*num_msgs = cdbfr->len / sizeof(long);
+	cdbfr->ptr = NULL;			// we own this memory now
+	cdb_free(cdbfr);
+	return(msgs);
+}
+
+
+// Write one piece of a list, or delete it if it's empty
+static void store_part(long qrnumber, long id, long *msgs, int num_msgs) {
+	long key[2] = { qrnumber, id };
+
+	if (num_msgs > 0) {
+		cdb_store(CDB_MSGLISTS, key, sizeof key, msgs, (int)(num_msgs * sizeof(long)));
+	}
+	else {
+		cdb_delete(CDB_MSGLISTS, key, sizeof key);
+	}
+}
+
+
+// Read a room's head record.  For an old style list, *legacy gets the whole list (which the caller must free).
+static int read_head(long qrnumber, struct msglist_head *h, long **legacy, int *num_legacy) {
+	struct cdbdata *cdbfr;
+	long *words;
+	int num_words;
+	int i;
+
+	memset(h, 0, sizeof(struct msglist_head));
+	*legacy = NULL;
+	*num_legacy = 0;
+
+	cdbfr = cdb_fetch(CDB_MSGLISTS, &qrnumber, sizeof(long));
+	if (cdbfr == NULL) {
+		return(HEAD_NONE);
+	}
+	words = (long *) cdbfr->ptr;
+	num_words = cdbfr->len / sizeof(long);
+
+	if ((num_words < HEAD_WORDS) || (words[0] != MSGLIST_SEGMENTED)) {
+		*legacy = malloc(sizeof(long) * (num_words + 1));
+		if (num_words > 0) {
+			memcpy(*legacy, words, sizeof(long) * num_words);
+		}
+		*num_legacy = num_words;
+		cdb_free(cdbfr);
+		return(HEAD_LEGACY);
+	}
+
+	h->next_id = words[1];
+	h->num_segs = (num_words - HEAD_WORDS) / 2;
+	h->segs = malloc(sizeof(struct segref) * (h->num_segs + 1));
+	for (i = 0; i < h->num_segs; ++i) {
+		h->segs[i].id = words[HEAD_WORDS + (i * 2)];
+		h->segs[i].low = words[HEAD_WORDS + (i * 2) + 1];
+	}
+	cdb_free(cdbfr);
+	return(HEAD_SEGMENTED);
+}
+
+
+static void write_head(long qrnumber, struct msglist_head *h) {
+	int num_words = HEAD_WORDS + (h->num_segs * 2);
+	long *words;
+	int i;
+
+	words = malloc(sizeof(long) * num_words);
+	words[0] = MSGLIST_SEGMENTED;
+	words[1] = h->next_id;
+	for (i = 0; i < h->num_segs; ++i) {
+		words[HEAD_WORDS + (i * 2)] = h->segs[i].id;
+		words[HEAD_WORDS + (i * 2) + 1] = h->segs[i].low;
+	}
+	cdb_store(CDB_MSGLISTS, &qrnumber, sizeof(long), words, (int)(num_words * sizeof(long)));
+	free(words);
+}
+
+
+// Write a sorted run of messages as new segments, and put them in the directory at position "at"
+static void write_segments(long qrnumber, struct msglist_head *h, int at, long *msgs, int num_msgs) {
+	int num_new = (num_msgs + MSGLIST_SEGMENT_SIZE - 1) / MSGLIST_SEGMENT_SIZE;
+	int i, n;
+
+	if (num_new == 0) {
+		return;
+	}
+	h->segs = realloc(h->segs, sizeof(struct segref) * (h->num_segs + num_new + 1));
+	memmove(&h->segs[at + num_new], &h->segs[at], sizeof(struct segref) * (h->num_segs - at));
+	h->num_segs += num_new;
+
+	for (i = 0; i < num_new; ++i) {
+		n = num_msgs - (i * MSGLIST_SEGMENT_SIZE);
+		if (n > MSGLIST_SEGMENT_SIZE) {
+			n = MSGLIST_SEGMENT_SIZE;
+		}
+		h->segs[at + i].id = h->next_id++;
+		h->segs[at + i].low = msgs[i * MSGLIST_SEGMENT_SIZE];
+		store_part(qrnumber, h->segs[at + i].id, &msgs[i * MSGLIST_SEGMENT_SIZE], n);
+	}
+}
+
+
+// Convert an old style list to segments
+static void convert_legacy(long qrnumber, struct msglist_head *h, long *msgs, int num_msgs) {
+	num_msgs = sort_unique(msgs, num_msgs);
+	syslog(LOG_DEBUG, "msglist: converting the message list of room %ld (%d messages) to segments", qrnumber, num_msgs);
+	h->next_id = MSGLIST_TOMBSTONES + 1;
+	write_segments(qrnumber, h, 0, msgs, num_msgs);
+	write_head(qrnumber, h);
+}
+
+
+// Read a head record for writing, converting an old style list if that's what we find.
+// Returns 0 if the room has no message list at all.
+static int read_head_for_update(long qrnumber, struct msglist_head *h) {
+	long *legacy;
+	int num_legacy;
+
+	switch (read_head(qrnumber, h, &legacy, &num_legacy)) {
+	case HEAD_LEGACY:
+		convert_legacy(qrnumber, h, legacy, num_legacy);
+		free(legacy);
+		return(1);
+	case HEAD_SEGMENTED:
+		return(1);
+	default:
+		return(0);
+	}
+}
+
+
+// Put all of the segments together and take out the tombstones
+static long *read_segments(long qrnumber, struct msglist_head *h, int *num_msgs) {
+	long *msgs = NULL;
+	long *part;
+	long *tomb;
+	int num_part, num_tomb;
+	int n = 0;
+	int i, j, k;
+
+	msgs = malloc(sizeof(long));
+	for (i = 0; i < h->num_segs; ++i) {
+		part = fetch_part(qrnumber, h->segs[i].id, &num_part);
+		if (part == NULL) {
+			syslog(LOG_ERR, "msglist: room %ld is missing segment %ld", qrnumber, h->segs[i].id);
+			continue;
+		}
+		msgs = realloc(msgs, sizeof(long) * (n + num_part + 1));
+		memcpy(&msgs[n], part, sizeof(long) * num_part);
+		n += num_part;
+		free(part);
+	}
+
+	tomb = fetch_part(qrnumber, MSGLIST_TOMBSTONES, &num_tomb);
+	if (tomb != NULL) {
+		for (i = 0, j = 0, k = 0; i < n; ++i) {
+			j = msglist_gallop(tomb, num_tomb, j, msgs[i]);
+			if ((j >= num_tomb) || (tomb[j] != msgs[i])) {
+				msgs[k++] = msgs[i];
+			}
+		}
+		n = k;
+		free(tomb);
+	}
+
+	*num_msgs = n;
+	return(msgs);
+}
+
+
+// Find the segment a message number belongs in: the last one whose low is at or below it, or else the first one
+static int find_segment(struct msglist_head *h, long msgnum) {
+	int lo = 0;
+	int hi = h->num_segs - 1;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo + 1) / 2);
+		if (h->segs[mid].low <= msgnum) {
+			lo = mid;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	return(lo);
+}
+
+
+// Take a message out of a sorted tombstone list if it's in there.  Returns nonzero if it was.
+static int untombstone(long *tomb, int *num_tomb, long msgnum) {
+	int i;
+
+	if (tomb == NULL) {
+		return(0);
+	}
+	i = msglist_gallop(tomb, *num_tomb, 0, msgnum);
+	if ((i >= *num_tomb) || (tomb[i] != msgnum)) {
+		return(0);
+	}
+	memmove(&tomb[i], &tomb[i + 1], sizeof(long) * (*num_tomb - i - 1));
+	--(*num_tomb);
+	return(1);
+}
+
+
+// A change to a list is several records, so it goes in a transaction.  If the caller has begun one already
+// (batch delivery does), the change goes in that one.  Returns nonzero if we began one here.
+static int begin_update(void) {
+	if (TSD->tid != NULL) {
+		return(0);
+	}
+	cdb_begin_transaction();
+	return(1);
+}
+
+
+static void end_update(int began) {
+	if (began) {
+		cdb_end_transaction();
+	}
+}
+
+
+// Ask for a room's segments to be rewritten without its tombstones the next time housekeeping runs
+static void schedule_compaction(long qrnumber) {
+	int i;
+
+	pthread_mutex_lock(&compact_queue_lock);
+	for (i = 0; i < compact_queue_num; ++i) {
+		if (compact_queue[i] == qrnumber) {
+			pthread_mutex_unlock(&compact_queue_lock);
+			return;
+		}
+	}
+	if (compact_queue_num >= compact_queue_alloc) {
+		compact_queue_alloc = (compact_queue_alloc > 0) ? (compact_queue_alloc * 2) : 64;
+		compact_queue = realloc(compact_queue, sizeof(long) * compact_queue_alloc);
+	}
+	compact_queue[compact_queue_num++] = qrnumber;
+	pthread_mutex_unlock(&compact_queue_lock);
+}
+
+
+// Return a room's whole message list (sorted), which the caller must free.  Returns NULL if the room has none.
+// Most callers want CtdlGetMsgList() or CtdlCopyMsgList() instead, which go through the cache.
+long *msglist_read(long qrnumber, int *num_msgs) {
+	struct msglist_head h;
+	long *msgs;
+
+	for (;;) {
+		cdb_begin_read();
+		switch (read_head(qrnumber, &h, &msgs, num_msgs)) {
+		case HEAD_LEGACY:
+			break;
+		case HEAD_SEGMENTED:
+			msgs = read_segments(qrnumber, &h, num_msgs);
+			free(h.segs);
+			break;
+		default:
+			msgs = NULL;
+			*num_msgs = 0;
+			break;
+		}
+		if (cdb_end_read() == 0) {
+			return(msgs);
+		}
+		if (msgs != NULL) {
+			free(msgs);
+		}
+	}
+}
+
+
+// Add messages to a room's list.  Only the segments the new messages belong in are read and written; for new
+// messages that is just the last one.  Messages which are already in the room are left out.  On return, the
+// first (return value) entries of msgs[] are the messages which were actually added, in ascending order.
+int msglist_add(long qrnumber, long *msgs, int num_msgs) {
+	struct msglist_head h;
+	int began;
+	long *tomb;
+	int num_tomb = 0;
+	int tomb_changed = 0;
+	int head_changed = 0;
+	long *seg;
+	int num_seg;
+	long *merged;
+	int num_merged;
+	int num_added = 0;
+	int i, j, first, s, a, in_seg;
+
+	num_msgs = sort_unique(msgs, num_msgs);
+	if (num_msgs == 0) {
+		return(0);
+	}
+
+	began = begin_update();
+	if (!read_head_for_update(qrnumber, &h)) {
+		h.next_id = MSGLIST_TOMBSTONES + 1;
+		head_changed = 1;
+	}
+	if (h.num_segs == 0) {
+		write_segments(qrnumber, &h, 0, msgs, num_msgs);
+		write_head(qrnumber, &h);
+		end_update(began);
+		free(h.segs);
+		return(num_msgs);
+	}
+
+	tomb = fetch_part(qrnumber, MSGLIST_TOMBSTONES, &num_tomb);
+
+	i = 0;
+	while (i < num_msgs) {
+
+		// Gather up the run of new messages which belong in the same segment
+		s = find_segment(&h, msgs[i]);
+		first = i;
+		while ((i < num_msgs) && ((s + 1 >= h.num_segs) || (msgs[i] < h.segs[s + 1].low))) {
+			++i;
+		}
+
+		seg = fetch_part(qrnumber, h.segs[s].id, &num_seg);
+		if (seg == NULL) {
+			syslog(LOG_ERR, "msglist: room %ld is missing segment %ld", qrnumber, h.segs[s].id);
+		}
+		merged = malloc(sizeof(long) * (num_seg + (i - first) + 1));
+		num_merged = 0;
+		a = 0;
+		for (j = first; j < i; ++j) {
+			while ((a < num_seg) && (seg[a] < msgs[j])) {
+				merged[num_merged++] = seg[a++];
+			}
+			in_seg = ((a < num_seg) && (seg[a] == msgs[j]));
+			if (untombstone(tomb, &num_tomb, msgs[j])) {
+				tomb_changed = 1;
+			}
+			else if (in_seg) {
+				continue;			// it's already in the room
+			}
+			if (!in_seg) {
+				merged[num_merged++] = msgs[j];
+			}
+			msgs[num_added++] = msgs[j];
+		}
+		while (a < num_seg) {
+			merged[num_merged++] = seg[a++];
+		}
+
+		if (num_merged != num_seg) {
+			if (merged[0] < h.segs[s].low) {
+				h.segs[s].low = merged[0];
+				head_changed = 1;
+			}
+			if (num_merged > MSGLIST_SEGMENT_SIZE) {
+				store_part(qrnumber, h.segs[s].id, merged, MSGLIST_SEGMENT_SIZE);
+				write_segments(qrnumber, &h, s + 1, &merged[MSGLIST_SEGMENT_SIZE], num_merged - MSGLIST_SEGMENT_SIZE);
+				head_changed = 1;
+			}
+			else {
+				store_part(qrnumber, h.segs[s].id, merged, num_merged);
+			}
+		}
+		free(merged);
+		if (seg != NULL) {
+			free(seg);
+		}
+	}
+
+	if (tomb_changed) {
+		store_part(qrnumber, MSGLIST_TOMBSTONES, tomb, num_tomb);
+	}
+	if (tomb != NULL) {
+		free(tomb);
+	}
+	if (head_changed) {
+		write_head(qrnumber, &h);
+	}
+	end_update(began);
+	free(h.segs);
+	return(num_added);
+}
+
+
+// Remove messages from a room's list.  This only records them as tombstones; the segments are cleaned up later.
+void msglist_remove(long qrnumber, long *msgs, int num_msgs) {
+	struct msglist_head h;
+	long *tomb;
+	int num_tomb = 0;
+	long *merged;
+	int num_merged = 0;
+	int i = 0;
+	int j = 0;
+	int began;
+
+	num_msgs = sort_unique(msgs, num_msgs);
+	if (num_msgs == 0) {
+		return;
+	}
+	began = begin_update();
+	if (!read_head_for_update(qrnumber, &h)) {
+		end_update(began);
+		return;
+	}
+	free(h.segs);
+
+	tomb = fetch_part(qrnumber, MSGLIST_TOMBSTONES, &num_tomb);
+	merged = malloc(sizeof(long) * (num_tomb + num_msgs));
+	while ((i < num_tomb) || (j < num_msgs)) {
+		if ((j >= num_msgs) || ((i < num_tomb) && (tomb[i] < msgs[j]))) {
+			merged[num_merged++] = tomb[i++];
+		}
+		else {
+			if ((i < num_tomb) && (tomb[i] == msgs[j])) {
+				++i;
+			}
+			merged[num_merged++] = msgs[j++];
+		}
+	}
+	store_part(qrnumber, MSGLIST_TOMBSTONES, merged, num_merged);
+	end_update(began);
+	if (num_merged >= MSGLIST_COMPACT_TOMBSTONES) {
+		schedule_compaction(qrnumber);
+	}
+
+	free(merged);
+	if (tomb != NULL) {
+		free(tomb);
+	}
+}
+
+
+// Delete a room's message list entirely
+void msglist_destroy(long qrnumber) {
+	struct msglist_head h;
+	long *legacy;
+	int num_legacy;
+	long key[2] = { qrnumber, MSGLIST_TOMBSTONES };
+	struct cdbdata *cdbfr;
+	int began;
+	int i;
+
+	began = begin_update();
+	switch (read_head(qrnumber, &h, &legacy, &num_legacy)) {
+	case HEAD_LEGACY:
+		free(legacy);
+		break;
+	case HEAD_SEGMENTED:
+		for (i = 0; i < h.num_segs; ++i) {
+			store_part(qrnumber, h.segs[i].id, NULL, 0);
+		}
+		free(h.segs);
+		cdbfr = cdb_fetch(CDB_MSGLISTS, key, sizeof key);
+		if (cdbfr != NULL) {
+			cdb_free(cdbfr);
+			store_part(qrnumber, MSGLIST_TOMBSTONES, NULL, 0);
+		}
+		break;
+	default:
+		end_update(began);
+		return;
+	}
+	cdb_delete(CDB_MSGLISTS, &qrnumber, sizeof(long));
+	end_update(began);
+}
+
+
+// Rewrite a room's segments without its tombstones, evening out their sizes while we're at it
+static void msglist_compact(long qrnumber) {
+	struct msglist_head h;
+	long *msgs;
+	int num_msgs;
+	int i;
+
+	begin_critical_section(S_ROOMS);
+	cdb_begin_transaction();
+	if (read_head_for_update(qrnumber, &h)) {
+		msgs = read_segments(qrnumber, &h, &num_msgs);
+		syslog(LOG_DEBUG, "msglist: compacting room %ld (%d segments, %d messages)", qrnumber, h.num_segs, num_msgs);
+		for (i = 0; i < h.num_segs; ++i) {
+			store_part(qrnumber, h.segs[i].id, NULL, 0);
+		}
+		store_part(qrnumber, MSGLIST_TOMBSTONES, NULL, 0);
+		h.num_segs = 0;
+		h.next_id = MSGLIST_TOMBSTONES + 1;
+		write_segments(qrnumber, &h, 0, msgs, num_msgs);
+		write_head(qrnumber, &h);
+		free(h.segs);
+		free(msgs);
+	}
+	cdb_end_transaction();
+	end_critical_section(S_ROOMS);
+}
+
+
+// Compact the rooms which have collected enough tombstones.  This is an EVT_TIMER hook.
+void msglist_compact_pending(void) {
+	long *queue;
+	int num_queue;
+	int i;
+
+	pthread_mutex_lock(&compact_queue_lock);
+	queue = compact_queue;
+	num_queue = compact_queue_num;
+	compact_queue = NULL;
+	compact_queue_num = 0;
+	compact_queue_alloc = 0;
+	pthread_mutex_unlock(&compact_queue_lock);
+
+	for (i = 0; (i < num_queue) && (!server_shutting_down); ++i) {
+		msglist_compact(queue[i]);
+	}
+	if (queue != NULL) {
+		free(queue);
+	}
+}
@@ -0,0 +1,17 @@
+// Segmented storage of room message lists (CDB_MSGLISTS)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef MSGLIST_STORE_H
+#define MSGLIST_STORE_H
+
+long *msglist_read(long qrnumber, int *num_msgs);
+int msglist_add(long qrnumber, long *msgs, int num_msgs);
+void msglist_remove(long qrnumber, long *msgs, int num_msgs);
+void msglist_destroy(long qrnumber);
+void msglist_compact_pending(void);
+
+#endif // MSGLIST_STORE_H
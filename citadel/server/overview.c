@@ -0,0 +1,255 @@
+// Per-message overview records (CDB_OVERVIEW)
+//
+// NNTP XOVER, IMAP FETCH and the expire pass only want a handful of header fields from each message, but
+// getting those used to mean loading (and decompressing) the whole message, body and all.  So when a message
+// is saved we also write a small record of just those fields, keyed by message number, and list from that.
+// Messages which were saved before there was such a thing get their record the first time somebody asks.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "sysdep.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <libcitadel.h>
+#include "citadel_defs.h"
+#include "server.h"
+#include "database.h"
+#include "context.h"
+#include "msgbase.h"
+#include "room_ops.h"
+#include "msglist_cache.h"
+#include "overview.h"
+
+// On disk, a record is this header followed by the strings, each one NUL terminated, in this order:
+// subject, author, rfc822addr, msgid, references, content_type
+struct overview_rec {
+	long ov_msgnum;
+	long ov_date;
+	long ov_saved;
+	long ov_bytes;
+	long ov_lines;
+};
+
+#define OVERVIEW_NUM_STRINGS 6
+
+
+// Count the lines in the body of an RFC822 rendition of a message (everything after the first blank line)
+static long count_body_lines(StrBuf *rfc822) {
+	const char *text = ChrPtr(rfc822);
+	const char *end = text + StrLength(rfc822);
+	const char *ptr;
+	long lines = 0;
+
+	ptr = strstr(text, "\r\n\r\n");
+	if (ptr != NULL) {
+		ptr += 4;
+	}
+	else if ((ptr = strstr(text, "\n\n")) != NULL) {
+		ptr += 2;
+	}
+	else {
+		return(0);
+	}
+
+	while ((ptr < end) && ((ptr = memchr(ptr, '\n', end - ptr)) != NULL)) {
+		++lines;
+		++ptr;
+	}
+	return(lines);
+}
+
+
+static void store_overview(struct overview_rec *rec, const char *strings[OVERVIEW_NUM_STRINGS]) {
+	size_t len[OVERVIEW_NUM_STRINGS];
+	size_t total = sizeof(struct overview_rec);
+	char *buf;
+	char *ptr;
+	int i;
+
+	for (i = 0; i < OVERVIEW_NUM_STRINGS; ++i) {
+		len[i] = strlen(strings[i]) + 1;
+		total += len[i];
+	}
+
+	buf = malloc(total);
+	if (buf == NULL) {
+		return;
+	}
+	memcpy(buf, rec, sizeof(struct overview_rec));
+	ptr = buf + sizeof(struct overview_rec);
+	for (i = 0; i < OVERVIEW_NUM_STRINGS; ++i) {
+		memcpy(ptr, strings[i], len[i]);
+		ptr += len[i];
+	}
+
+	cdb_store(CDB_OVERVIEW, &rec->ov_msgnum, (int)sizeof(long), buf, (int)total);
+	free(buf);
+}
+
+
+static void put_overview(long msgnum, struct CtdlMessage *msg, const char *content_type, StrBuf *rfc822, time_t saved) {
+	struct overview_rec rec;
+	const char *strings[OVERVIEW_NUM_STRINGS];
+
+	memset(&rec, 0, sizeof rec);
+	rec.ov_msgnum = msgnum;
+	rec.ov_date = CM_IsEmpty(msg, eTimestamp) ? 0 : atol(msg->cm_fields[eTimestamp]);
+	rec.ov_saved = saved;
+	if (rfc822 != NULL) {
+		rec.ov_bytes = StrLength(rfc822);
+		rec.ov_lines = count_body_lines(rfc822);
+	}
+
+	strings[0] = CM_IsEmpty(msg, eMsgSubject) ? "" : msg->cm_fields[eMsgSubject];
+	strings[1] = CM_IsEmpty(msg, eAuthor) ? "" : msg->cm_fields[eAuthor];
+	strings[2] = CM_IsEmpty(msg, erFc822Addr) ? "" : msg->cm_fields[erFc822Addr];
+	strings[3] = CM_IsEmpty(msg, emessageId) ? "" : msg->cm_fields[emessageId];
+	strings[4] = CM_IsEmpty(msg, eWeferences) ? "" : msg->cm_fields[eWeferences];
+	strings[5] = (content_type != NULL) ? content_type : "";
+
+	store_overview(&rec, strings);
+}
+
+
+// Write the overview record for a message being saved.  rfc822 is the message as rendered in RFC822 format
+// (CtdlSubmitMsg() has just done that anyway, to measure it) and is used to measure the message in bytes and lines.
+void PutOverview(long msgnum, struct CtdlMessage *msg, const char *content_type, StrBuf *rfc822) {
+	put_overview(msgnum, msg, content_type, rfc822, time(NULL));
+}
+
+
+// Unpack a record as stored into a single allocated block.  Returns NULL if it isn't a well formed record.
+static struct msg_overview *decode_overview(const char *data, size_t datalen) {
+	struct overview_rec rec;
+	struct msg_overview *ov;
+	char **fields[OVERVIEW_NUM_STRINGS];
+	size_t strlen_total;
+	char *ptr;
+	char *end;
+	int i;
+
+	if (datalen < sizeof(struct overview_rec)) {
+		return(NULL);
+	}
+	memcpy(&rec, data, sizeof rec);
+	strlen_total = datalen - sizeof(struct overview_rec);
+
+	ov = malloc(sizeof(struct msg_overview) + strlen_total + 1);
+	if (ov == NULL) {
+		return(NULL);
+	}
+	ov->msgnum = rec.ov_msgnum;
+	ov->date = (time_t) rec.ov_date;
+	ov->saved = (time_t) rec.ov_saved;
+	ov->bytes = rec.ov_bytes;
+	ov->lines = rec.ov_lines;
+
+	ptr = (char *)(ov + 1);
+	memcpy(ptr, data + sizeof(struct overview_rec), strlen_total);
+	ptr[strlen_total] = 0;
+	end = ptr + strlen_total;
+
+	fields[0] = &ov->subject;
+	fields[1] = &ov->author;
+	fields[2] = &ov->rfc822addr;
+	fields[3] = &ov->msgid;
+	fields[4] = &ov->references;
+	fields[5] = &ov->content_type;
+	for (i = 0; i < OVERVIEW_NUM_STRINGS; ++i) {
+		if (ptr >= end) {
+			free(ov);
+			return(NULL);
+		}
+		*fields[i] = ptr;
+		ptr += strlen(ptr) + 1;
+	}
+	return(ov);
+}
+
+
+// Make the overview record for a message which doesn't have one yet (it was saved before we kept them)
+static void build_overview(long msgnum) {
+	struct CtdlMessage *msg;
+	struct MetaData smi;
+	StrBuf *rfc822 = NULL;
+
+	msg = CtdlFetchMessage(msgnum, 1);
+	if (msg == NULL) {
+		return;
+	}
+	GetMetaData(&smi, msgnum);
+
+	// Render it the way CtdlSubmitMsg() does, unless output is already being captured for something else
+	if (CC->redirect_buffer == NULL) {
+		CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
+		CtdlOutputPreLoadedMsg(msg, MT_RFC822, HEADERS_ALL, 0, 1, QP_EADDR);
+		rfc822 = CC->redirect_buffer;
+		CC->redirect_buffer = NULL;
+	}
+	else {
+		rfc822 = NewStrBufPlain(CM_KEY(msg, eMesageText));
+	}
+
+	// We don't know when it was saved, and the date on it is whatever the sender said, so don't guess
+	put_overview(msgnum, msg, smi.meta_content_type, rfc822, 0);
+	FreeStrBuf(&rfc822);
+	CM_Free(msg);
+}
+
+
+// Fetch the overview of a message.  The caller must free() it.  Returns NULL if there is no such message.
+struct msg_overview *GetOverview(long msgnum) {
+	struct cdbdata *cdbov;
+	int attempts;
+
+	for (attempts = 0; attempts < 2; ++attempts) {
+		cdbov = cdb_fetch_borrowed(CDB_OVERVIEW, &msgnum, (int)sizeof(long));
+		if (cdbov != NULL) {
+			return(decode_overview(cdbov->ptr, cdbov->len));
+		}
+		if (attempts == 0) {
+			build_overview(msgnum);
+		}
+	}
+	return(NULL);
+}
+
+
+void DeleteOverview(long msgnum) {
+	cdb_delete(CDB_OVERVIEW, &msgnum, (int)sizeof(long));
+}
+
+
+// Run a callback on the overview of every message in the current room numbered from lo to hi (hi == 0 means
+// no upper limit).  Returns the number of messages visited.
+int CtdlForEachOverview(long lo, long hi, void (*CallBack)(struct msg_overview *ov, void *userdata), void *userdata) {
+	struct msglist *ml;
+	struct msg_overview *ov;
+	int num_visited = 0;
+	int i;
+
+	ml = CtdlGetMsgList(CC->room.QRnumber);
+	if (ml == NULL) {
+		return(0);
+	}
+
+	for (i = msglist_gallop(ml->msgs, ml->num_msgs, 0, lo); i < ml->num_msgs; ++i) {
+		if ((hi != 0) && (ml->msgs[i] > hi)) {
+			break;
+		}
+		ov = GetOverview(ml->msgs[i]);
+		if (ov != NULL) {
+			CallBack(ov, userdata);
+			free(ov);
+			++num_visited;
+		}
+	}
+
+	CtdlPutMsgList(&ml);
+	return(num_visited);
+}
@@ -0,0 +1,32 @@
+// Per-message overview records (CDB_OVERVIEW)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef OVERVIEW_H
+#define OVERVIEW_H
+
+// The header fields of a message which get listed a lot, without the rest of the message.
+// The strings are never NULL (a field the message doesn't have is an empty string).
+struct msg_overview {
+	long msgnum;
+	time_t date;
+	time_t saved;			// when it was saved here, or 0 if we don't know (it was saved before we kept these)
+	long bytes;			// length of the message when rendered as RFC822
+	long lines;			// lines in the body of the message when rendered as RFC822
+	char *subject;
+	char *author;
+	char *rfc822addr;
+	char *msgid;
+	char *references;		// delimited by vertical bars, the way the message stores them
+	char *content_type;
+};
+
+void PutOverview(long msgnum, struct CtdlMessage *msg, const char *content_type, StrBuf *rfc822);
+struct msg_overview *GetOverview(long msgnum);
+void DeleteOverview(long msgnum);
+int CtdlForEachOverview(long lo, long hi, void (*CallBack)(struct msg_overview *ov, void *userdata), void *userdata);
+
+#endif // OVERVIEW_H
@@ -11,6 +11,8 @@
 #include "citserver.h"
 #include "ctdl_module.h"
 #include "config.h"
+#include "msglist_cache.h"
+#include "msglist_store.h"
 #include "control.h"
 #include "user_ops.h"
 #include "room_ops.h"
@@ -98,6 +100,7 @@ int CtdlDoIHavePermissionToDeleteMessagesFromThisRoom(void) {
 void CtdlRoomAccess(struct ctdlroom *roombuf, struct ctdluser *userbuf, int *result, int *view) {
 	int retval = 0;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
 	int is_me = 0;
 	int is_guest = 0;
 
@@ -128,7 +131,7 @@ void CtdlRoomAccess(struct ctdlroom *roombuf, struct ctdluser *userbuf, int *res
 		memset(&vbuf, 0, sizeof vbuf);
 	}
 	else {
-		CtdlGetRelationship(&vbuf, userbuf, roombuf);
+		CtdlGetRelationshipSets(&vbuf, &seen, NULL, userbuf, roombuf);
 	}
 
 	// Force the properties of the Aide room
@@ -266,7 +269,7 @@ void CtdlRoomAccess(struct ctdlroom *roombuf, struct ctdluser *userbuf, int *res
 	}
 
 NEWMSG:	// By the way, we also check for the presence of new messages
-	if (is_msg_in_sequence_set(vbuf.v_seen, roombuf->QRhighest) == 0) {
+	if (seen_set_contains(seen, roombuf->QRhighest) == 0) {
 		retval = retval | UA_HASNEWMSGS;
 	}
 
@@ -276,6 +279,8 @@ NEWMSG:	// By the way, we also check for the presence of new messages
 	}
 
 SKIP_EVERYTHING:
+	seen_set_free(&seen);
+
 	// Now give the caller the information it wants.
 	if (result != NULL) *result = retval;
 	if (view != NULL) *view = vbuf.v_view;
@@ -324,16 +329,15 @@ int CtdlGetRoom(struct ctdlroom *qrbuf, const char *room_name) {
 	}
 
 	// First, try the public namespace
-	cdbqr = cdb_fetch(CDB_ROOMS, lowercase_name, strlen(lowercase_name));
+	cdbqr = cdb_fetch_borrowed(CDB_ROOMS, lowercase_name, strlen(lowercase_name));
 
 	// If that didn't work, try the user's personal namespace
 	if (cdbqr == NULL) {
 		snprintf(personal_lowercase_name, sizeof personal_lowercase_name, "%010ld.%s", CC->user.usernum, lowercase_name);
-		cdbqr = cdb_fetch(CDB_ROOMS, personal_lowercase_name, strlen(personal_lowercase_name));
+		cdbqr = cdb_fetch_borrowed(CDB_ROOMS, personal_lowercase_name, strlen(personal_lowercase_name));
 	}
 	if (cdbqr != NULL) {
 		memcpy(qrbuf, cdbqr->ptr, ((cdbqr->len > sizeof(struct ctdlroom)) ?  sizeof(struct ctdlroom) : cdbqr->len));
-		cdb_free(cdbqr);
 		room_sanity_check(qrbuf);
 		return (0);
 	}
@@ -446,10 +450,9 @@ void CtdlGetFloor(struct floor *flbuf, int floor_num) {
 	struct cdbdata *cdbfl;
 
 	memset(flbuf, 0, sizeof(struct floor));
-	cdbfl = cdb_fetch(CDB_FLOORTAB, &floor_num, sizeof(int));
+	cdbfl = cdb_fetch_borrowed(CDB_FLOORTAB, &floor_num, sizeof(int));
 	if (cdbfl != NULL) {
 		memcpy(flbuf, cdbfl->ptr, ((cdbfl->len > sizeof(struct floor)) ?  sizeof(struct floor) : cdbfl->len));
-		cdb_free(cdbfl);
 	}
 	else {
 		if (floor_num == 0) {
@@ -540,10 +543,9 @@ void CtdlForEachRoom(ForEachRoomCallBack callback_func, void *in_data) {
 
 	cdb_rewind(CDB_ROOMS);
 
-	while (cdbqr = cdb_next_item(CDB_ROOMS), cdbqr != NULL) {
+	while (cdbqr = cdb_next_item_borrowed(CDB_ROOMS), cdbqr != NULL) {
  		memset(&qrbuf, 0, sizeof(struct ctdlroom));
  		memcpy(&qrbuf, cdbqr->ptr, ((cdbqr->len > sizeof(struct ctdlroom)) ?  sizeof(struct ctdlroom) : cdbqr->len) );
-		cdb_free(cdbqr);
 		room_sanity_check(&qrbuf);
 		if (qrbuf.QRflags & QR_INUSE) {
 			callback_func(&qrbuf, in_data);
@@ -554,17 +556,7 @@ void CtdlForEachRoom(ForEachRoomCallBack callback_func, void *in_data) {
 
 // delete_msglist()  -  delete room message pointers
 void delete_msglist(struct ctdlroom *whichroom) {
-        struct cdbdata *cdbml;
-
-	// Make sure the msglist we're deleting actually exists, otherwise
-	// libdb will complain when we try to delete an invalid record
-        cdbml = cdb_fetch(CDB_MSGLISTS, &whichroom->QRnumber, sizeof(long));
-        if (cdbml != NULL) {
-        	cdb_free(cdbml);
-
-		// Go ahead and delete it
-		cdb_delete(CDB_MSGLISTS, &whichroom->QRnumber, sizeof(long));
-	}
+	msglist_destroy(whichroom->QRnumber);
 }
 
 
@@ -626,15 +618,11 @@ void CtdlUserGoto(char *where, int display_result, int transiently, int *retmsgs
 	int rmailflag;
 	int raideflag;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
 	char truncated_roomname[ROOMNAMELEN];
-        struct cdbdata *cdbfr;
-	long *msglist = NULL;
-	int num_msgs = 0;
+	struct msglist *ml;
+	char *is_seen;
 	unsigned int original_v_flags;
-	int num_sets;
-	int s;
-	char setstr[128], lostr[64], histr[64];
-	long lo, hi;
 	int is_trash = 0;
 
 	// If the supplied room name is NULL, the caller wants us to know that
@@ -648,7 +636,7 @@ void CtdlUserGoto(char *where, int display_result, int transiently, int *retmsgs
 	// Take care of all the formalities.
 
 	begin_critical_section(S_USERS);
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlGetRelationshipSets(&vbuf, &seen, NULL, &CC->user, &CC->room);
 	original_v_flags = vbuf.v_flags;
 
 	// Know the room ... but not if it's the page log room, or if the
@@ -666,9 +654,10 @@ void CtdlUserGoto(char *where, int display_result, int transiently, int *retmsgs
 		vbuf.v_flags = vbuf.v_flags | V_ACCESS;
 	}
 	
-	// Only rewrite the database record if we changed something
+	// Only rewrite the database record if we changed something.  That's rare, so the answered set is left
+	// for CtdlSetRelationshipSets() to find rather than decoded on every goto.
 	if (vbuf.v_flags != original_v_flags) {
-		CtdlSetRelationship(&vbuf, &CC->user, &CC->room);
+		CtdlSetRelationshipSets(&vbuf, seen, NULL, &CC->user, &CC->room);
 	}
 	end_critical_section(S_USERS);
 
@@ -678,52 +667,25 @@ void CtdlUserGoto(char *where, int display_result, int transiently, int *retmsgs
 		info = 1;
 	}
 
-        cdbfr = cdb_fetch(CDB_MSGLISTS, &CC->room.QRnumber, sizeof(long));
-        if (cdbfr != NULL) {
-        	msglist = (long *) cdbfr->ptr;
-		cdbfr->ptr = NULL;			// CtdlUserGoto() now owns this memory
-        	num_msgs = cdbfr->len / sizeof(long);
-        	cdb_free(cdbfr);
-	}
-
-	total_messages = 0;
-	for (a=0; a<num_msgs; ++a) {
-		if (msglist[a] > 0L) ++total_messages;
-	}
+	ml = CtdlGetMsgList(CC->room.QRnumber);
+	if (ml != NULL) {
+		total_messages = ml->num_msgs;
+		if (total_messages > 0) {
+			oldest_message = ml->msgs[0];
+			newest_message = ml->msgs[ml->num_msgs - 1];
 
-	if (total_messages > 0) {
-		oldest_message = msglist[0];
-		newest_message = msglist[num_msgs - 1];
-	}
-
-	num_sets = num_tokens(vbuf.v_seen, ',');
-	for (s=0; s<num_sets; ++s) {
-		extract_token(setstr, vbuf.v_seen, s, ',', sizeof setstr);
-
-		extract_token(lostr, setstr, 0, ':', sizeof lostr);
-		if (num_tokens(setstr, ':') >= 2) {
-			extract_token(histr, setstr, 1, ':', sizeof histr);
-			if (!strcmp(histr, "*")) {
-				snprintf(histr, sizeof histr, "%ld", LONG_MAX);
-			}
-		} 
-		else {
-			strcpy(histr, lostr);
-		}
-		lo = atol(lostr);
-		hi = atol(histr);
-
-		for (a=0; a<num_msgs; ++a) if (msglist[a] > 0L) {
-			if ((msglist[a] >= lo) && (msglist[a] <= hi)) {
-				++old_messages;
-				msglist[a] = 0L;
+			is_seen = malloc(ml->num_msgs);
+			seen_set_lookup_sorted(seen, ml->msgs, ml->num_msgs, is_seen);
+			for (a=0; a<ml->num_msgs; ++a) {
+				old_messages += is_seen[a];
 			}
+			free(is_seen);
 		}
+		CtdlPutMsgList(&ml);
 	}
+	seen_set_free(&seen);
 	new_messages = total_messages - old_messages;
 
-	if (msglist != NULL) free(msglist);
-
 	if (CC->room.QRflags & QR_MAILBOX)
 		rmailflag = 1;
 	else
@@ -1032,6 +994,8 @@ unsigned CtdlCreateRoom(char *new_room_name,
 	struct ctdlroom qrbuf;
 	struct floor flbuf;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	syslog(LOG_DEBUG, "room_ops: CtdlCreateRoom(name=%s, type=%d, view=%d)", new_room_name, new_room_type, new_room_view);
 
@@ -1101,10 +1065,12 @@ unsigned CtdlCreateRoom(char *new_room_name,
 	// Grant the creator access to the room unless the avoid_access
 	// parameter was specified.
 	if ( (CC->logged_in) && (avoid_access == 0) ) {
-		CtdlGetRelationship(&vbuf, &CC->user, &qrbuf);
+		CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &qrbuf);
 		vbuf.v_flags = vbuf.v_flags & ~V_FORGET & ~V_LOCKOUT;
 		vbuf.v_flags = vbuf.v_flags | V_ACCESS;
-		CtdlSetRelationship(&vbuf, &CC->user, &qrbuf);
+		CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &qrbuf);
+		seen_set_free(&seen);
+		seen_set_free(&answered);
 	}
 
 	// resume our happy day
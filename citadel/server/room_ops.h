@@ -1,3 +1,5 @@
+#include "msglist_ops.h"
+
 int is_known (struct ctdlroom *roombuf, int roomnum, struct ctdluser *userbuf);
 int has_newmsgs (struct ctdlroom *roombuf, int roomnum, struct ctdluser *userbuf);
 int is_zapped (struct ctdlroom *roombuf, int roomnum, struct ctdluser *userbuf);
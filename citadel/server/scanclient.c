@@ -0,0 +1,403 @@
+// Client side of external content scanners (SpamAssassin, clamd, ...)
+//
+// Modules which talk to a scanner register it here, and this code runs all of them for each message
+// which arrives via SMTP.  The message is rendered once, it is sent to all of the scanners at the same
+// time, and the replies are collected as they come in, so a message takes about as long as the slowest
+// scanner instead of all of them added together.  Scanners whose protocol allows it keep a few connections
+// open between messages.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include "sysdep.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <libcitadel.h>
+#include "citadel_defs.h"
+#include "server.h"
+#include "citserver.h"
+#include "support.h"
+#include "msgbase.h"
+#include "domain.h"
+#include "clientsocket.h"
+#include "ctdl_module.h"
+#include "scanclient.h"
+
+static struct scanner *scanners = NULL;		// this is only added to during startup
+
+enum {
+	SCAN_RUNNING,
+	SCAN_DONE,
+	SCAN_FAILED
+};
+
+struct scan_job {			// one message going to one scanner
+	struct scanner *s;
+	int sock;
+	int pooled;			// the connection came out of the pool (so it may have gone stale)
+	int state;
+	StrBuf *out;
+	long written;
+	StrBuf *in;
+	int eof;
+	struct timeval started;
+};
+
+
+static long msec_since(struct timeval *tv) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return(((now.tv_sec - tv->tv_sec) * 1000) + ((now.tv_usec - tv->tv_usec) / 1000));
+}
+
+
+// Connect to the first of a scanner's hosts which answers.  Host entries may be in the form host:port.
+static int scanner_connect(struct scanner *s) {
+	char hosts[SIZ];
+	char buf[SIZ];
+	char host[SIZ];
+	char port[SIZ];
+	int num_hosts;
+	int sock = (-1);
+	int i;
+
+	num_hosts = get_hosts(hosts, (char *)s->hosttype);
+	for (i = 0; ((i < num_hosts) && (sock < 0)); ++i) {
+		extract_token(buf, hosts, i, '|', sizeof buf);
+		extract_token(host, buf, 0, ':', sizeof host);
+		if (extract_token(port, buf, 1, ':', sizeof port) < 0) {
+			safestrncpy(port, s->port, sizeof port);
+		}
+		syslog(LOG_DEBUG, "scanclient: connecting to %s at <%s:%s>", s->name, host, port);
+		sock = sock_connect(host, port);
+	}
+	if (sock >= 0) {
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	}
+	return(sock);
+}
+
+
+// Get a connection to a scanner: one from the pool if there is one, otherwise a new one
+static int scanner_checkout(struct scanner *s, int *pooled) {
+	int sock = (-1);
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&s->lock);
+	while ((sock < 0) && (s->num_idle > 0)) {
+		--s->num_idle;
+		if ((now - s->idle_since[s->num_idle]) < SCANNER_POOL_IDLE) {
+			sock = s->idle[s->num_idle];
+		}
+		else {
+			close(s->idle[s->num_idle]);		// the scanner has probably hung up on it by now
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	*pooled = (sock >= 0);
+	if (sock < 0) {
+		sock = scanner_connect(s);
+	}
+	return(sock);
+}
+
+
+// Put a connection back in the pool, or close it if the pool is full
+static void scanner_checkin(struct scanner *s, int sock) {
+	pthread_mutex_lock(&s->lock);
+	if (s->num_idle < SCANNER_POOL_SIZE) {
+		s->idle[s->num_idle] = sock;
+		s->idle_since[s->num_idle] = time(NULL);
+		++s->num_idle;
+		sock = (-1);
+	}
+	pthread_mutex_unlock(&s->lock);
+	if (sock >= 0) {
+		close(sock);
+	}
+}
+
+
+// Set up a job's connection and what it is going to send
+static int scan_job_start(struct scan_job *j, StrBuf *msgtext, int fresh) {
+	if (fresh) {
+		j->sock = scanner_connect(j->s);
+		j->pooled = 0;
+	}
+	else {
+		j->sock = scanner_checkout(j->s, &j->pooled);
+	}
+	if (j->sock < 0) {
+		j->state = SCAN_FAILED;
+		return(-1);
+	}
+
+	FlushStrBuf(j->out);
+	FlushStrBuf(j->in);
+	if ((!j->pooled) && (j->s->hello != NULL)) {
+		j->s->hello(j->out);
+	}
+	j->s->request(j->out, msgtext);
+	j->written = 0;
+	j->eof = 0;
+	j->state = SCAN_RUNNING;
+	gettimeofday(&j->started, NULL);
+	return(0);
+}
+
+
+// Send all of the requests and read all of the replies, all at the same time
+static void scan_exchange(struct scan_job *jobs, int num_jobs) {
+	struct pollfd *pfd;
+	int *which;
+	int num_pfd;
+	time_t deadline = time(NULL) + SCANNER_TIMEOUT;
+	char buf[SIZ];
+	ssize_t n;
+	int i, k;
+
+	pfd = malloc(sizeof(struct pollfd) * num_jobs);
+	which = malloc(sizeof(int) * num_jobs);
+	if ((pfd == NULL) || (which == NULL)) {
+		for (i = 0; i < num_jobs; ++i) {
+			if (jobs[i].state == SCAN_RUNNING) {
+				jobs[i].state = SCAN_FAILED;
+			}
+		}
+		free(pfd);
+		free(which);
+		return;
+	}
+
+	while (!server_shutting_down) {
+		num_pfd = 0;
+		for (i = 0; i < num_jobs; ++i) {
+			if (jobs[i].state == SCAN_RUNNING) {
+				pfd[num_pfd].fd = jobs[i].sock;
+				pfd[num_pfd].events = POLLIN | ((jobs[i].written < StrLength(jobs[i].out)) ? POLLOUT : 0);
+				pfd[num_pfd].revents = 0;
+				which[num_pfd++] = i;
+			}
+		}
+		if (num_pfd == 0) {
+			break;
+		}
+		if (time(NULL) >= deadline) {
+			for (k = 0; k < num_pfd; ++k) {
+				syslog(LOG_WARNING, "scanclient: %s timed out", jobs[which[k]].s->name);
+				jobs[which[k]].state = SCAN_FAILED;
+			}
+			break;
+		}
+		if (poll(pfd, num_pfd, 1000) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (k = 0; k < num_pfd; ++k) {
+			struct scan_job *j = &jobs[which[k]];
+
+			if (pfd[k].revents & POLLOUT) {
+				n = send(j->sock, ChrPtr(j->out) + j->written, StrLength(j->out) - j->written, MSG_NOSIGNAL);
+				if (n > 0) {
+					j->written += n;
+				}
+				else if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+					j->state = SCAN_FAILED;
+					continue;
+				}
+			}
+
+			if (pfd[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+				n = read(j->sock, buf, sizeof buf);
+				if (n > 0) {
+					StrBufAppendBufPlain(j->in, buf, n, 0);
+				}
+				else if (n == 0) {
+					j->eof = 1;
+				}
+				else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+					j->state = SCAN_FAILED;
+					continue;
+				}
+				if (j->s->reply_complete(j->in, j->eof)) {
+					j->state = SCAN_DONE;
+				}
+				else if (j->eof) {
+					j->state = SCAN_FAILED;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < num_jobs; ++i) {
+		if (jobs[i].state == SCAN_RUNNING) {
+			jobs[i].state = SCAN_FAILED;
+		}
+	}
+	free(pfd);
+	free(which);
+}
+
+
+// Hand a message to every scanner we have configured, and return the number of them which rejected it.
+// A scanner which can't be reached, or doesn't answer sensibly, lets the message through; potentially
+// throwing away mail isn't good.
+int scan_message(struct CtdlMessage *msg, struct recptypes *recp) {
+	struct scanner *s;
+	struct scan_job *jobs = NULL;
+	int num_jobs = 0;
+	int num_retries = 0;
+	int num_rejects = 0;
+	StrBuf *msgtext = NULL;
+	char hosts[SIZ];
+	int i, v;
+	long msec;
+
+	for (s = scanners; s != NULL; s = s->next) {
+		++num_jobs;
+	}
+	if (num_jobs == 0) {
+		return(0);
+	}
+	jobs = malloc(sizeof(struct scan_job) * num_jobs);
+	if (jobs == NULL) {
+		return(0);
+	}
+
+	num_jobs = 0;
+	for (s = scanners; s != NULL; s = s->next) {
+		if ((s->trust_logged_in) && (CC->logged_in)) {		// presumably they're trustworthy
+			continue;
+		}
+		if (get_hosts(hosts, (char *)s->hosttype) < 1) {
+			continue;
+		}
+		if (msgtext == NULL) {					// render the message once, for all of them
+			CC->redirect_buffer = NewStrBufPlain(NULL, SIZ);
+			CtdlOutputPreLoadedMsg(msg, MT_RFC822, HEADERS_ALL, 0, 1, 0);
+			msgtext = CC->redirect_buffer;
+			CC->redirect_buffer = NULL;
+		}
+		memset(&jobs[num_jobs], 0, sizeof(struct scan_job));
+		jobs[num_jobs].s = s;
+		jobs[num_jobs].out = NewStrBufPlain(NULL, StrLength(msgtext) + SIZ);
+		jobs[num_jobs].in = NewStrBuf();
+		gettimeofday(&jobs[num_jobs].started, NULL);
+		if (scan_job_start(&jobs[num_jobs], msgtext, 0) < 0) {
+			syslog(LOG_WARNING, "scanclient: could not connect to %s", s->name);
+		}
+		++num_jobs;
+	}
+
+	scan_exchange(jobs, num_jobs);
+
+	// A connection from the pool may have been closed at the other end while it sat there.  Try those again.
+	for (i = 0; i < num_jobs; ++i) {
+		if ((jobs[i].state == SCAN_FAILED) && (jobs[i].pooled)) {
+			close(jobs[i].sock);
+			if (scan_job_start(&jobs[i], msgtext, 1) == 0) {
+				++num_retries;
+			}
+		}
+	}
+	if (num_retries > 0) {
+		scan_exchange(jobs, num_jobs);
+	}
+
+	for (i = 0; i < num_jobs; ++i) {
+		s = jobs[i].s;
+		v = -1;
+		if (jobs[i].state == SCAN_DONE) {
+			v = s->verdict(jobs[i].in, msg);
+		}
+		msec = msec_since(&jobs[i].started);
+
+		pthread_mutex_lock(&s->lock);
+		if (v < 0) {
+			++s->errors;
+		}
+		else {
+			++s->scans;
+			s->total_msec += msec;
+			s->last_msec = msec;
+			if (msec > s->max_msec) {
+				s->max_msec = msec;
+			}
+			if (v > 0) {
+				++s->rejects;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		if (v > 0) {
+			++num_rejects;
+		}
+		syslog(LOG_DEBUG, "scanclient: %s: %s in %ldms", s->name, ((v < 0) ? "failed" : (v > 0) ? "rejected" : "accepted"), msec);
+
+		if (jobs[i].sock >= 0) {
+			if ((v >= 0) && (s->keepalive) && (jobs[i].eof == 0)) {
+				scanner_checkin(s, jobs[i].sock);
+			}
+			else {
+				close(jobs[i].sock);
+			}
+		}
+		FreeStrBuf(&jobs[i].out);
+		FreeStrBuf(&jobs[i].in);
+	}
+
+	free(jobs);
+	FreeStrBuf(&msgtext);
+	return(num_rejects);
+}
+
+
+// Report on the scanners
+void cmd_scst(char *argbuf) {
+	struct scanner *s;
+
+	if (CtdlAccessCheck(ac_aide)) return;
+
+	cprintf("%d Content scanners\n", LISTING_FOLLOWS);
+	for (s = scanners; s != NULL; s = s->next) {
+		pthread_mutex_lock(&s->lock);
+		cprintf("%s|%ld|%ld|%ld|%ld|%ld|%ld|%d\n",
+			s->name, s->scans, s->rejects, s->errors,
+			((s->scans > 0) ? (s->total_msec / s->scans) : 0), s->max_msec, s->last_msec, s->num_idle
+		);
+		pthread_mutex_unlock(&s->lock);
+	}
+	cprintf("000\n");
+}
+
+
+// Modules call this (from their initialization functions) to add a scanner
+void CtdlRegisterScanner(struct scanner *s) {
+	pthread_mutex_init(&s->lock, NULL);
+	s->num_idle = 0;
+
+	if (scanners == NULL) {			// the first one to register brings the rest of us to life
+		CtdlRegisterMessageHook(scan_message, EVT_SMTPSCAN);
+		CtdlRegisterProtoHook(cmd_scst, "SCST", "Get content scanner statistics");
+	}
+	s->next = scanners;
+	scanners = s;
+	syslog(LOG_DEBUG, "scanclient: registered %s", s->name);
+}
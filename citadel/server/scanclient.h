@@ -0,0 +1,41 @@
+// Client side of external content scanners (SpamAssassin, clamd, ...)
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef SCANCLIENT_H
+#define SCANCLIENT_H
+
+#include <pthread.h>
+#include <time.h>
+
+struct scanner {
+	const char *name;					// for the log
+	const char *hosttype;					// which hosts in the Internet configuration to use
+	const char *port;					// the port to use if a host entry doesn't have one
+	int trust_logged_in;					// don't scan messages from users who have logged in
+	int keepalive;						// a connection can be used for more than one message
+	void (*hello)(StrBuf *out);				// what to send first on a new connection (or NULL)
+	void (*request)(StrBuf *out, StrBuf *msgtext);		// what to send to have a message scanned
+	int (*reply_complete)(StrBuf *in, int eof);		// have we got the whole reply yet?
+	int (*verdict)(StrBuf *in, struct CtdlMessage *msg);	// 1 to reject the message, 0 to accept, -1 if the reply was no good
+
+	// Everything below here belongs to scanclient.c
+	pthread_mutex_t lock;
+	int idle[SCANNER_POOL_SIZE];				// connections waiting to be used again
+	time_t idle_since[SCANNER_POOL_SIZE];
+	int num_idle;
+	long scans;
+	long rejects;
+	long errors;
+	long total_msec;
+	long max_msec;
+	long last_msec;
+	struct scanner *next;
+};
+
+void CtdlRegisterScanner(struct scanner *s);
+
+#endif // SCANCLIENT_H
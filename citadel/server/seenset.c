@@ -0,0 +1,224 @@
+// Seen/answered message sets
+//
+// The set of messages a user has seen (or answered) in a room used to be stored as a sequence set
+// string like "1:5,7,9:*" in a fixed 4 KB buffer in the visit record.  It was truncated when it grew
+// too long, and every membership test re-parsed the whole string.  These functions keep it as a
+// sorted array of ranges instead: membership is a binary search, lists of messages can be checked
+// in one merge pass, and there is no size limit.  The string form is still understood, both for
+// converting old visit records and for the places in the protocol where clients expect it.
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libcitadel.h>
+#include "seenset.h"
+
+
+struct seen_set *seen_set_new(void) {
+	struct seen_set *set;
+
+	set = (struct seen_set *) malloc(sizeof(struct seen_set));
+	memset(set, 0, sizeof(struct seen_set));
+	return(set);
+}
+
+
+void seen_set_free(struct seen_set **set) {
+	if ((set == NULL) || (*set == NULL)) return;
+	if ((*set)->ranges != NULL) {
+		free((*set)->ranges);
+	}
+	free(*set);
+	*set = NULL;
+}
+
+
+void seen_set_clear(struct seen_set *set) {
+	set->num_ranges = 0;
+}
+
+
+// Return the index of the first range whose upper bound is >= msgnum (or num_ranges if there is none)
+static int seen_set_search(const struct seen_set *set, long msgnum) {
+	int lo = 0;
+	int hi = set->num_ranges;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (set->ranges[mid].hi < msgnum) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return(lo);
+}
+
+
+// Add the messages lo through hi (inclusive) to the set, merging with any ranges they touch.
+// Adding in ascending order, as most callers do, is just an append.
+void seen_set_add(struct seen_set *set, long lo, long hi) {
+	int first, last;
+
+	if (lo > hi) return;
+
+	// find the first range which overlaps or is adjacent to the new one
+	first = seen_set_search(set, ((lo > LONG_MIN) ? lo - 1 : lo));
+
+	// find the last one
+	last = first;
+	while ((last < set->num_ranges) && ((hi == LONG_MAX) || (set->ranges[last].lo <= hi + 1))) {
+		++last;
+	}
+
+	if (last > first) {
+		// merge ranges first..last-1 and the new range into ranges[first]
+		if (set->ranges[first].lo < lo) lo = set->ranges[first].lo;
+		if (set->ranges[last - 1].hi > hi) hi = set->ranges[last - 1].hi;
+		set->ranges[first].lo = lo;
+		set->ranges[first].hi = hi;
+		if (last - first > 1) {
+			memmove(&set->ranges[first + 1], &set->ranges[last], sizeof(struct seen_range) * (set->num_ranges - last));
+			set->num_ranges -= (last - first - 1);
+		}
+		return;
+	}
+
+	// no overlap; insert a new range at position "first"
+	if (set->num_ranges >= set->alloc) {
+		set->alloc = (set->alloc > 0) ? (set->alloc * 2) : 16;
+		set->ranges = realloc(set->ranges, sizeof(struct seen_range) * set->alloc);
+	}
+	if (first < set->num_ranges) {
+		memmove(&set->ranges[first + 1], &set->ranges[first], sizeof(struct seen_range) * (set->num_ranges - first));
+	}
+	set->ranges[first].lo = lo;
+	set->ranges[first].hi = hi;
+	++set->num_ranges;
+}
+
+
+// Returns nonzero if msgnum is in the set
+int seen_set_contains(const struct seen_set *set, long msgnum) {
+	int i;
+
+	if ((set == NULL) || (set->num_ranges == 0)) return(0);
+	i = seen_set_search(set, msgnum);
+	return( (i < set->num_ranges) && (set->ranges[i].lo <= msgnum) );
+}
+
+
+// Check a sorted (ascending) array of message numbers against the set in a single pass.
+// result[i] is set to 1 if msgs[i] is in the set, 0 if not.
+void seen_set_lookup_sorted(const struct seen_set *set, const long *msgs, int num_msgs, char *result) {
+	int i;
+	int r = 0;
+
+	for (i=0; i<num_msgs; ++i) {
+		while ((set != NULL) && (r < set->num_ranges) && (set->ranges[r].hi < msgs[i])) {
+			++r;
+		}
+		result[i] = ((set != NULL) && (r < set->num_ranges) && (set->ranges[r].lo <= msgs[i]));
+	}
+}
+
+
+// Convert a sequence set string ("1:5,7,9:*") to a set.  This reads the format the visit
+// records used to be stored in, so it follows the old parser: "*" is 0 as a lower bound and
+// "no limit" as an upper bound.
+struct seen_set *seen_set_from_string(const char *str) {
+	struct seen_set *set;
+	const char *p = str;
+	char *end;
+	long lo, hi;
+
+	set = seen_set_new();
+	if (str == NULL) return(set);
+
+	while (*p) {
+		if (*p == '*') {
+			lo = 0;
+			++p;
+		}
+		else {
+			lo = strtol(p, &end, 10);
+			p = end;
+		}
+		hi = lo;
+		if (*p == ':') {
+			++p;
+			if (*p == '*') {
+				hi = LONG_MAX;
+				++p;
+			}
+			else {
+				hi = strtol(p, &end, 10);
+				p = end;
+			}
+		}
+		seen_set_add(set, lo, hi);
+
+		while ((*p) && (*p != ',')) ++p;	// skip anything we don't understand
+		if (*p == ',') ++p;
+	}
+	return(set);
+}
+
+
+// Append the sequence set string form of a set to a buffer
+void seen_set_to_string(StrBuf *Target, const struct seen_set *set) {
+	int i;
+
+	if (set == NULL) return;
+	for (i=0; i<set->num_ranges; ++i) {
+		if (i > 0) {
+			StrBufAppendBufPlain(Target, HKEY(","), 0);
+		}
+		if (set->ranges[i].lo <= 0) {
+			StrBufAppendBufPlain(Target, HKEY("*"), 0);
+		}
+		else {
+			StrBufAppendPrintf(Target, "%ld", set->ranges[i].lo);
+		}
+		if (set->ranges[i].hi == LONG_MAX) {
+			StrBufAppendBufPlain(Target, HKEY(":*"), 0);
+		}
+		else if ((set->ranges[i].hi != set->ranges[i].lo) || (set->ranges[i].lo <= 0)) {
+			StrBufAppendPrintf(Target, ":%ld", set->ranges[i].hi);
+		}
+	}
+}
+
+
+// Binary form, as stored in visit records: num_ranges pairs of longs
+size_t seen_set_encoded_len(const struct seen_set *set) {
+	return( (set == NULL) ? 0 : (sizeof(struct seen_range) * set->num_ranges) );
+}
+
+
+void seen_set_encode(const struct seen_set *set, char *dest) {
+	if ((set != NULL) && (set->num_ranges > 0)) {
+		memcpy(dest, set->ranges, sizeof(struct seen_range) * set->num_ranges);
+	}
+}
+
+
+struct seen_set *seen_set_decode(const char *src, int num_ranges) {
+	struct seen_set *set;
+
+	set = seen_set_new();
+	if (num_ranges > 0) {
+		set->alloc = num_ranges;
+		set->num_ranges = num_ranges;
+		set->ranges = malloc(sizeof(struct seen_range) * num_ranges);
+		memcpy(set->ranges, src, sizeof(struct seen_range) * num_ranges);
+	}
+	return(set);
+}
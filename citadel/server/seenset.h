@@ -0,0 +1,36 @@
+// Seen/answered message sets
+//
+// Copyright (c) 1987-2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#ifndef SEENSET_H
+#define SEENSET_H
+
+// A set of message numbers, kept as sorted, non-overlapping, non-adjacent ranges.
+// An open-ended range ("*" in the string form) has hi == LONG_MAX.
+struct seen_range {
+	long lo;
+	long hi;
+};
+
+struct seen_set {
+	int num_ranges;
+	int alloc;
+	struct seen_range *ranges;
+};
+
+struct seen_set *seen_set_new(void);
+void seen_set_free(struct seen_set **set);
+void seen_set_clear(struct seen_set *set);
+void seen_set_add(struct seen_set *set, long lo, long hi);
+int seen_set_contains(const struct seen_set *set, long msgnum);
+void seen_set_lookup_sorted(const struct seen_set *set, const long *msgs, int num_msgs, char *result);
+struct seen_set *seen_set_from_string(const char *str);
+void seen_set_to_string(StrBuf *Target, const struct seen_set *set);
+size_t seen_set_encoded_len(const struct seen_set *set);
+void seen_set_encode(const struct seen_set *set, char *dest);
+struct seen_set *seen_set_decode(const char *src, int num_ranges);
+
+#endif // SEENSET_H
@@ -634,6 +634,7 @@ void CtdlRegisterServiceHook(int tcp_port,
 
 	if (newfcn->msock > 0) {
 		ServiceHookTable = newfcn;
+		ctdl_watch_listener(newfcn->msock);
 		strcat(message, "registered.");
 		syslog(LOG_INFO, "%s", message);
 	}
@@ -76,12 +76,34 @@ struct cdbdata {
 // Defines the relationship of a user to a particular room
 // NOTE: if you add fields to this, you have to also write export/import code in server/modules/migrate/serv_migrate.c
 // NOTE: if you add fields to this, you have to also write conversion code in utils/ctdl3264/*
+// On disk, this is followed by a struct visit_sets and then the seen and answered sets (see seenset.c)
 struct visit {
 	long v_roomnum;		//
 	long v_roomgen;		// The first three fields , sizeof(long)*3 , are the index format.
 	long v_usernum;		//
 	long v_lastseen;
 	unsigned v_flags;
+	int v_view;
+};
+
+#define VISIT_MAGIC	0xC17AD5E7	// can't appear at this offset in a legacy record, which has text there
+
+struct visit_sets {
+	unsigned int magic;
+	unsigned int num_seen;		// number of ranges in the seen set
+	unsigned int num_answered;	// number of ranges in the answered set
+	unsigned int reserved;
+};
+
+
+// Visit records written before the seen and answered sets were stored in binary form.
+// The server converts these when it reads them.  utils/ctdl3264 still writes this format.
+struct visit_legacy {
+	long v_roomnum;
+	long v_roomgen;
+	long v_usernum;
+	long v_lastseen;
+	unsigned v_flags;
 	char v_seen[SIZ];
 	char v_answered[SIZ];
 	int v_view;
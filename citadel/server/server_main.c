@@ -86,7 +86,7 @@ int main(int argc, char **argv) {
 
 	// parse command-line arguments
 	int g;
-	while ((g=getopt(argc, argv, "cl:dh:x:t:B:Dru:s:R:")) != EOF) switch(g) {
+	while ((g=getopt(argc, argv, "cl:dh:x:t:B:Dru:s:R:b:")) != EOF) switch(g) {
 
 		// test this binary for compatibility and exit
 		case 'c':
@@ -154,6 +154,11 @@ int main(int argc, char **argv) {
 			rescue_string = strdup(optarg);
 			break;
 
+		// -b selects the storage backend for a new database ("berkeley" or "lmdb")
+		case 'b':
+			cdb_backend_name = optarg;
+			break;
+
 		// any other parameter makes it crash and burn
 		default:
 			fprintf(stderr,	"citserver: usage: "
@@ -162,7 +167,8 @@ int main(int argc, char **argv) {
 					"[-x MaxLogLevel] "
 					"[-d] [-r] "
 					"[-u user] "
-					"[-h HomeDir]\n"
+					"[-h HomeDir] "
+					"[-b StorageBackend]\n"
 			);
 			exit(1);
 	}
@@ -49,6 +49,57 @@
 #define SMTP_DELIVER_WARN	14400		// warn after four hours
 #define SMTP_DELIVER_FAIL	432000		// fail after five days
 
+/*
+ * Outbound SMTP sessions.  No more than SMTP_MAX_CONNECTIONS are open at once,
+ * and no more than SMTP_MAX_DOMAIN_CONNECTIONS of those to the same domain.
+ * One session carries a message to as many as SMTP_MAX_RCPTS recipients.
+ */
+#define SMTP_MAX_CONNECTIONS		20
+#define SMTP_MAX_DOMAIN_CONNECTIONS	4
+#define SMTP_MAX_RCPTS			100
+
+/*
+ * MX lookups are cached for as long as their TTL, but for no less than
+ * MX_CACHE_MIN_TTL and no more than MX_CACHE_MAX_TTL seconds.  A lookup which
+ * found no MX records is cached for MX_CACHE_NEGATIVE_TTL seconds.
+ */
+#define MX_CACHE_SIZE			1024
+#define MX_CACHE_MIN_TTL		60
+#define MX_CACHE_MAX_TTL		86400
+#define MX_CACHE_NEGATIVE_TTL		300
+
+/*
+ * libcurl keeps the addresses of MX hosts for SMTP_DNS_CACHE_TIMEOUT seconds.
+ * A domain none of whose MXes can be reached in SMTP_HOLD_THRESHOLD delivery
+ * attempts in a row is put on hold for SMTP_HOLD_MIN seconds, doubling each further time
+ * up to SMTP_HOLD_MAX.  Delivery statistics are kept for up to
+ * SMTP_DOMAIN_STATES domains.
+ */
+#define SMTP_DNS_CACHE_TIMEOUT		300
+#define SMTP_HOLD_THRESHOLD		3
+#define SMTP_HOLD_MIN			900
+#define SMTP_HOLD_MAX			14400
+#define SMTP_DOMAIN_STATES		4096
+
+/*
+ * RSS and Atom feeds are polled every RSSCLIENT_POLL_INTERVAL seconds unless
+ * the room's configuration or the feed itself asks for something else.  A feed
+ * which fails is polled less often, but at least every RSSCLIENT_MAX_INTERVAL
+ * seconds.  No more than RSSCLIENT_MAX_CONNECTIONS feeds are downloaded at once.
+ */
+#define RSSCLIENT_POLL_INTERVAL		900
+#define RSSCLIENT_MAX_INTERVAL		86400
+#define RSSCLIENT_MAX_CONNECTIONS	8
+
+/*
+ * Content scanners (SpamAssassin, clamd) get SCANNER_TIMEOUT seconds to answer.
+ * Up to SCANNER_POOL_SIZE idle connections to each are kept open for reuse, for
+ * no longer than SCANNER_POOL_IDLE seconds.
+ */
+#define SCANNER_TIMEOUT			60
+#define SCANNER_POOL_SIZE		4
+#define SCANNER_POOL_IDLE		20
+
 /*
  * Who bounced messages appear to be from
  */
@@ -84,7 +135,70 @@
 #define THREADSTACKSIZE		0x100000
 
 /*
- * How many messages may the full text indexer scan before flushing its
- * tables to disk?
+ * How long (in seconds) a worker thread must sit idle before it may retire,
+ * and how often (in seconds) the pool is permitted to shrink by one thread.
+ */
+#define WORKER_IDLE_RETIRE	60
+#define WORKER_RETIRE_INTERVAL	2
+
+/*
+ * How much output (in bytes) a session may buffer before it is written to the client
+ */
+#define CLIENT_SENDBUF_HIGHWATER	65536
+
+/*
+ * How many seconds may the full text indexer spend on one batch before
+ * writing out what it has and letting the rest of the housekeeping run?
+ */
+#define FT_MAX_RUN_TIME		20
+
+/*
+ * When there are at least this many messages to index (as when the index is
+ * first being built), the indexer uses c_ft_threads threads, handing out
+ * FT_PARALLEL_CHUNK messages at a time.  It saves its place every
+ * FT_CHECKPOINT_TIME seconds.
+ */
+#define FT_PARALLEL_MIN		1000
+#define FT_PARALLEL_CHUNK	1000
+#define FT_CHECKPOINT_TIME	60
+
+/*
+ * When one message is delivered to many mailboxes, it is saved in at most
+ * this many of them per database transaction.
+ */
+#define DELIVERY_BATCH_ROOMS	250
+
+/*
+ * When the reference counts of many messages are adjusted at once (for
+ * example when expiry deletes them from a room), this many are done per
+ * database transaction.
+ */
+#define REFCOUNT_BATCH_SIZE	250
+
+/*
+ * The nightly purge deletes dead visits, use table entries and EUID index
+ * entries this many per database transaction.
+ */
+#define EXPIRE_DELETE_BATCH	1000
+
+/*
+ * An IMAP client in IDLE is kept from being logged out for being idle
+ * for this many seconds.  RFC 2177 asks for at least 30 minutes.
+ */
+#define IMAP_IDLE_TIMEOUT	1800
+
+/*
+ * How many changes are remembered for IMAP CONDSTORE/QRESYNC in each room's
+ * log of deleted messages, and in each user's log of flag changes in a room.
+ * A client which last looked before the oldest of them has to resynchronize
+ * the hard way.
+ */
+#define MODSEQ_LOG_SIZE		10000
+
+/*
+ * Room message lists are stored in segments of this many messages.  Deleted
+ * messages are recorded as tombstones, and once a room has this many of them
+ * its segments are rewritten without them during housekeeping.
  */
-#define FT_MAX_CACHE		25
+#define MSGLIST_SEGMENT_SIZE		1024
+#define MSGLIST_COMPACT_TOMBSTONES	256
@@ -22,6 +22,12 @@
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
@@ -50,20 +56,92 @@ static RETSIGTYPE signal_cleanup(int signum) {
 }
 
 
+// The event dispatcher.  Listener sockets and idle client sockets are registered with a single
+// epoll instance in one-shot mode, so each readiness event is handed to exactly one worker thread
+// and the socket stays quiet until it is re-armed.  Client sockets are looked up through an
+// fd-indexed table so that a stale event can never reach a session which has already been purged.
+// The table is protected by a set of striped locks rather than by S_SESSION_TABLE, so binding a
+// worker to a session never contends with the rest of the session table.
+#define EPOLL_LISTENER		((uint64_t)1 << 63)
+#define EPOLL_WAKEUP		((uint64_t)1 << 62)
+#define MAX_WATCHED_SOCKETS	1048576
+#define WATCH_LOCK_STRIPES	64
+static int epoll_fd = (-1);
+static int wakeup_fd = (-1);
+static CitContext **watched_sessions = NULL;
+static int num_watched_slots = 0;
+static pthread_mutex_t watch_locks[WATCH_LOCK_STRIPES];
+
+
+// Sessions which need a worker without any socket activity (for example, because asynchronous
+// messages are waiting for them) are placed on the ready queue.  The queue is sharded by session
+// number to keep producers and consumers off each other's locks, and a session is on it at most
+// once: only a CON_IDLE -> CON_READY transition enqueues it, and only the worker which dequeues it
+// may move it out of CON_READY.
+#define READY_QUEUE_SHARDS	16
+static struct ready_shard {
+	pthread_mutex_t lock;
+	CitContext *head;
+	CitContext *tail;
+} ready_queue[READY_QUEUE_SHARDS];
+static int ready_queue_depth = 0;
+static unsigned int ready_queue_cursor = 0;
+
+
 // Some initialization stuff...
 void init_sysdep(void) {
 	sigset_t set;
-
-	// Avoid vulnerabilities related to FD_SETSIZE if we can.
-#ifdef FD_SETSIZE
-#ifdef RLIMIT_NOFILE
 	struct rlimit rl;
+	struct epoll_event ev;
+	int i;
+
+	// We no longer use select() on client sockets, so there is no reason to stay below FD_SETSIZE.
+	// Raise the soft descriptor limit as far as the hard limit allows.
 	getrlimit(RLIMIT_NOFILE, &rl);
-	rl.rlim_cur = FD_SETSIZE;
-	rl.rlim_max = FD_SETSIZE;
-	setrlimit(RLIMIT_NOFILE, &rl);
-#endif
-#endif
+	rl.rlim_cur = rl.rlim_max;
+	if ((rl.rlim_cur == RLIM_INFINITY) || (rl.rlim_cur > MAX_WATCHED_SOCKETS)) {
+		rl.rlim_cur = MAX_WATCHED_SOCKETS;
+	}
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	num_watched_slots = ((rl.rlim_cur > MAX_WATCHED_SOCKETS) ? MAX_WATCHED_SOCKETS : (int)rl.rlim_cur);
+	syslog(LOG_DEBUG, "sysdep: up to %d file descriptors are available", num_watched_slots);
+
+	watched_sessions = (CitContext **) calloc(num_watched_slots, sizeof(CitContext *));
+	if (watched_sessions == NULL) {
+		syslog(LOG_ERR, "sysdep: cannot allocate session table: %m");
+		exit(CTDLEXIT_THREAD);
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		syslog(LOG_ERR, "sysdep: epoll_create1() : %m");
+		exit(CTDLEXIT_THREAD);
+	}
+
+	for (i=0; i<WATCH_LOCK_STRIPES; ++i) {
+		pthread_mutex_init(&watch_locks[i], NULL);
+	}
+	for (i=0; i<READY_QUEUE_SHARDS; ++i) {
+		pthread_mutex_init(&ready_queue[i].lock, NULL);
+		ready_queue[i].head = NULL;
+		ready_queue[i].tail = NULL;
+	}
+
+	// The wakeup descriptor lets a thread which enqueues a ready session interrupt a sleeping worker.
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd < 0) {
+		syslog(LOG_ERR, "sysdep: eventfd() : %m");
+		exit(CTDLEXIT_THREAD);
+	}
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = EPOLL_WAKEUP;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) != 0) {
+		syslog(LOG_ERR, "sysdep: cannot watch wakeup descriptor: %m");
+		exit(CTDLEXIT_THREAD);
+	}
 
 	// If we've got OpenSSL, we're going to use it.
 #ifdef HAVE_OPENSSL
@@ -241,44 +319,124 @@ int ctdl_uds_server(char *sockpath, int queue_len) {
 }
 
 
-// The following functions implement output buffering on operating systems which
-// support it (such as Linux and various BSD flavors).
-#ifndef HAVE_DARWIN
-#ifdef TCP_CORK
-#	define HAVE_TCP_BUFFERING
-#else
-#	ifdef TCP_NOPUSH
-#		define HAVE_TCP_BUFFERING
-#		define TCP_CORK TCP_NOPUSH
-#	endif
-#endif // TCP_CORK
-#endif // HAVE_DARWIN
+// Output to the client is collected in a per-session send buffer (CC->SendBuf.Buf) and written to the
+// socket in as few system calls as possible.  The buffer is flushed when it grows past
+// CLIENT_SENDBUF_HIGHWATER, before we read anything from the client, when the worker thread is done with
+// the session, and whenever someone calls flush_output() or unbuffer_output().
 
-static unsigned on = 1, off = 0;
 
-void buffer_output(void) {
-#ifdef HAVE_TCP_BUFFERING
+// Write a set of buffers to the client socket (or the TLS layer), bypassing the send buffer.
+static int client_writev_direct(struct iovec *iov, int iovcnt) {
+	CitContext *Ctx = CC;
+	struct pollfd pfd;
+	ssize_t retval;
+	int i;
+
 #ifdef HAVE_OPENSSL
-	if (!CC->redirect_ssl)
-#endif
-		setsockopt(CC->client_socket, IPPROTO_TCP, TCP_CORK, &on, 4);
+	if (Ctx->redirect_ssl) {
+		for (i=0; i<iovcnt; ++i) {
+			if (iov[i].iov_len > 0) {
+				client_write_ssl(iov[i].iov_base, iov[i].iov_len);
+			}
+		}
+		return 0;
+	}
 #endif
+
+	while (iovcnt > 0) {
+		if (Ctx->client_socket == -1) return -1;
+
+		retval = writev(Ctx->client_socket, iov, iovcnt);
+		if (retval < 0) {
+			if (errno == EINTR) {
+				if (server_shutting_down) {
+					Ctx->kill_me = KILLME_SELECT_INTERRUPTED;
+					return -1;
+				}
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				// Only non-blocking sockets land here, so we don't have to ask fcntl() on every write.
+				pfd.fd = Ctx->client_socket;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				if ((poll(&pfd, 1, -1) == -1) && (errno != EINTR)) {
+					syslog(LOG_ERR, "sysdep: client_write() poll failed: %m");
+					client_close();
+					Ctx->kill_me = KILLME_SELECT_FAILED;
+					return -1;
+				}
+				continue;
+			}
+		}
+		if (retval < 1) {
+			syslog(LOG_ERR, "sysdep: client_write() failed: %m");
+			client_close();
+			Ctx->kill_me = KILLME_WRITE_FAILED;
+			return -1;
+		}
+
+		// Step past whatever was written; a short write can end in the middle of any element.
+		while ((iovcnt > 0) && (retval >= (ssize_t)iov->iov_len)) {
+			retval -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + retval;
+			iov->iov_len -= retval;
+		}
+	}
+	return 0;
 }
 
+
+// Send everything in this session's send buffer to the client.
+int client_flush(void) {
+	CitContext *Ctx = CC;
+	StrBuf *Buf;
+	struct iovec iov;
+	int rc = 0;
+
+	if (Ctx == NULL) return 0;
+
+	// The buffer is detached while we write it, so anything produced along the way (for example by endtls()
+	// when the TLS layer fails) starts a new buffer that goes out on the next pass instead of being interleaved.
+	while ((rc == 0) && ((Buf = Ctx->SendBuf.Buf) != NULL) && (StrLength(Buf) > 0)) {
+		Ctx->SendBuf.Buf = NULL;
+		iov.iov_base = (void *) ChrPtr(Buf);
+		iov.iov_len = StrLength(Buf);
+		rc = client_writev_direct(&iov, 1);
+		FlushStrBuf(Buf);
+		if (Ctx->SendBuf.Buf == NULL) {
+			Ctx->SendBuf.Buf = Buf;
+		}
+		else {
+			StrBufAppendBuf(Buf, Ctx->SendBuf.Buf, 0);
+			FreeStrBuf(&Ctx->SendBuf.Buf);
+			Ctx->SendBuf.Buf = Buf;
+		}
+	}
+	if ((rc != 0) && (Ctx->SendBuf.Buf != NULL)) {
+		FlushStrBuf(Ctx->SendBuf.Buf);		// nowhere left to send it
+	}
+	return rc;
+}
+
+
+// Output is always buffered now; this is kept so callers can still mark where bulk output begins.
+void buffer_output(void) {
+}
+
+
+// Push out anything we've buffered so far.
 void unbuffer_output(void) {
-#ifdef HAVE_TCP_BUFFERING
-#ifdef HAVE_OPENSSL
-	if (!CC->redirect_ssl)
-#endif
-		setsockopt(CC->client_socket, IPPROTO_TCP, TCP_CORK, &off, 4);
-#endif
+	client_flush();
 }
 
+
 void flush_output(void) {
-#ifdef HAVE_TCP_BUFFERING
-	setsockopt(CC->client_socket, IPPROTO_TCP, TCP_CORK, &off, 4);
-	setsockopt(CC->client_socket, IPPROTO_TCP, TCP_CORK, &on, 4);
-#endif
+	client_flush();
 }
 
 
@@ -286,6 +444,8 @@ void flush_output(void) {
 void client_close(void) {
 	if (!CC) return;
 	if (CC->client_socket <= 0) return;
+	client_flush();
+	if (CC->client_socket <= 0) return;		// the flush may have failed and closed it already
 	syslog(LOG_DEBUG, "sysdep: closing socket %d", CC->client_socket);
 	close(CC->client_socket);
 	CC->client_socket = -1 ;
@@ -294,14 +454,8 @@ void client_close(void) {
 
 // Send binary data to the client.
 int client_write(const char *buf, int nbytes) {
-	int bytes_written = 0;
-	int retval;
-#ifndef HAVE_TCP_BUFFERING
-	int old_buffer_len = 0;
-#endif
-	fd_set wset;
 	CitContext *Ctx;
-	int fdflags;
+	struct iovec iov[2];
 
 	if (nbytes < 1) return(0);
 
@@ -311,51 +465,40 @@ int client_write(const char *buf, int nbytes) {
 		return 0;
 	}
 
-#ifdef HAVE_OPENSSL
-	if (Ctx->redirect_ssl) {
-		client_write_ssl(buf, nbytes);
-		return 0;
-	}
-#endif
 	if (Ctx->client_socket == -1) return -1;
 
-	fdflags = fcntl(Ctx->client_socket, F_GETFL);
-
-	while ((bytes_written < nbytes) && (Ctx->client_socket != -1)){
-		if ((fdflags & O_NONBLOCK) == O_NONBLOCK) {
-			FD_ZERO(&wset);
-			FD_SET(Ctx->client_socket, &wset);
-			if (select(1, NULL, &wset, NULL, NULL) == -1) {
-				if (errno == EINTR) {
-					syslog(LOG_DEBUG, "sysdep: client_write(%d bytes) select() interrupted.", nbytes-bytes_written);
-					if (server_shutting_down) {
-						CC->kill_me = KILLME_SELECT_INTERRUPTED;
-						return (-1);
-					}
-					else {
-						// can't trust fd's and stuff so we need to re-create them
-						continue;
-					}
-				}
-				else {
-					syslog(LOG_ERR, "sysdep: client_write(%d bytes) select failed: %m", nbytes - bytes_written);
-					client_close();
-					Ctx->kill_me = KILLME_SELECT_FAILED;
-					return -1;
-				}
-			}
-		}
+	if (Ctx->SendBuf.Buf == NULL) {
+		Ctx->SendBuf.Buf = NewStrBufPlain(NULL, SIZ * 4);
+	}
 
-		retval = write(Ctx->client_socket, &buf[bytes_written], nbytes - bytes_written);
-		if (retval < 1) {
-			syslog(LOG_ERR, "sysdep: client_write(%d bytes) failed: %m", nbytes - bytes_written);
-			client_close();
-			Ctx->kill_me = KILLME_WRITE_FAILED;
-			return -1;
+	// Small writes are just collected.  A large one goes straight out together with whatever is already
+	// buffered ahead of it, in a single writev() and without copying it into the buffer first.
+	if (StrLength(Ctx->SendBuf.Buf) + nbytes < CLIENT_SENDBUF_HIGHWATER) {
+		StrBufAppendBufPlain(Ctx->SendBuf.Buf, buf, nbytes, 0);
+		return 0;
+	}
+
+	iov[0].iov_base = (void *) ChrPtr(Ctx->SendBuf.Buf);
+	iov[0].iov_len = StrLength(Ctx->SendBuf.Buf);
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = nbytes;
+	if (iov[0].iov_len == 0) {
+		return client_writev_direct(&iov[1], 1);
+	}
+	else {
+		StrBuf *Buf = Ctx->SendBuf.Buf;
+		int rc;
+
+		Ctx->SendBuf.Buf = NULL;		// see client_flush()
+		rc = client_writev_direct(iov, 2);
+		FlushStrBuf(Buf);
+		if (Ctx->SendBuf.Buf != NULL) {
+			StrBufAppendBuf(Buf, Ctx->SendBuf.Buf, 0);
+			FreeStrBuf(&Ctx->SendBuf.Buf);
 		}
-		bytes_written = bytes_written + retval;
+		Ctx->SendBuf.Buf = Buf;
+		return rc;
 	}
-	return 0;
 }
 
 
@@ -365,26 +508,32 @@ void cputbuf(const StrBuf *Buf) {
 
 
 // Send formatted printable data to the client.
-// Implemented in terms of client_write() so it's technically not sysdep...
+// The text is formatted directly into the send buffer, so there is no limit on the length of a line.
 void cprintf(const char *format, ...) {   
 	va_list arg_ptr;   
-	char buf[1024];
-	int rc;
+	CitContext *Ctx = CC;
+	StrBuf *Target;
    
-	va_start(arg_ptr, format);   
-	rc = vsnprintf(buf, sizeof buf, format, arg_ptr);
-	if (rc < 0) {
-		syslog(LOG_ERR,"Console output error occured. Format: %s",format);
-	} else {
-		if (rc >= sizeof buf) {
-			// Output was truncated.
-			// Chop at the end of the buffer
-			buf[sizeof buf - 2] = '\n';
-			buf[sizeof buf - 1] = 0;
+	if (Ctx->redirect_buffer != NULL) {
+		Target = Ctx->redirect_buffer;
+	}
+	else if (Ctx->client_socket == -1) {
+		return;
+	}
+	else {
+		if (Ctx->SendBuf.Buf == NULL) {
+			Ctx->SendBuf.Buf = NewStrBufPlain(NULL, SIZ * 4);
 		}
-		client_write(buf, strlen(buf)); 
+		Target = Ctx->SendBuf.Buf;
 	}
+
+	va_start(arg_ptr, format);   
+	StrBufVAppendPrintf(Target, format, arg_ptr);
 	va_end(arg_ptr);
+
+	if ((Target == Ctx->SendBuf.Buf) && (StrLength(Target) >= CLIENT_SENDBUF_HIGHWATER)) {
+		client_flush();
+	}
 }
 
 
@@ -403,6 +552,8 @@ int client_read_blob(StrBuf *Target, int bytes, int timeout) {
 	const char *Error;
 	int retval = 0;
 
+	client_flush();			// the client may be waiting for our output before it sends anything
+
 #ifdef HAVE_OPENSSL
 	if (CC->redirect_ssl) {
 		retval = client_read_sslblob(Target, bytes, timeout);
@@ -510,6 +661,7 @@ int CtdlClientGetLine(StrBuf *Target) {
 	const char *Error;
 	int rc;
 
+	client_flush();			// the client may be waiting for our output before it sends anything
 	FlushStrBuf(Target);
 #ifdef HAVE_OPENSSL
 	if (CC->redirect_ssl) {
@@ -701,270 +853,389 @@ int convert_login(char NameToConvert[]) {
 }
 
 
-void HuntBadSession(void) {
-	int highest;
-	CitContext *ptr;
-	fd_set readfds;
-	struct timeval tv;
-	struct ServiceFunctionHook *serviceptr;
+// Register a listener socket with the event dispatcher.  Called once, when the service is created.
+void ctdl_watch_listener(int msock) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = EPOLL_LISTENER | (uint32_t)msock;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, msock, &ev) != 0) {
+		syslog(LOG_ERR, "sysdep: cannot watch listener socket %d: %m", msock);
+	}
+}
+
+
+// Re-arm a listener socket after one of its connections has been accepted.
+static void rearm_listener(int msock) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = EPOLL_LISTENER | (uint32_t)msock;
+	if ((epoll_ctl(epoll_fd, EPOLL_CTL_MOD, msock, &ev) != 0) && (errno != EBADF) && (errno != ENOENT)) {
+		syslog(LOG_ERR, "sysdep: cannot re-arm listener socket %d: %m", msock);
+	}
+}
+
 
-	// Next, add all of the client sockets
-	begin_critical_section(S_SESSION_TABLE);
-	for (ptr = ContextList; ptr != NULL; ptr = ptr->next) {
-		if ((ptr->state == CON_SYS) && (ptr->client_socket == 0))
+// Put a session on the ready queue and wake up a worker to take care of it.
+// The caller must already have moved the session into the CON_READY state.
+static void enqueue_ready_session(CitContext *con) {
+	struct ready_shard *shard = &ready_queue[con->cs_pid % READY_QUEUE_SHARDS];
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&shard->lock);
+	con->next_ready = NULL;
+	if (shard->tail == NULL) {
+		shard->head = con;
+	}
+	else {
+		shard->tail->next_ready = con;
+	}
+	shard->tail = con;
+	con->ready_since = worker_clock_usec();
+	pthread_mutex_unlock(&shard->lock);
+
+	__atomic_add_fetch(&ready_queue_depth, 1, __ATOMIC_SEQ_CST);
+	if (write(wakeup_fd, &one, sizeof one) < 0) {
+		// EAGAIN only means the counter is already nonzero, so a wakeup is pending anyway.
+	}
+}
+
+
+// Take the next session off the ready queue and bind it to the calling thread.
+// Returns NULL without touching any locks if the queue is empty.
+static CitContext *dequeue_ready_session(void) {
+	CitContext *con = NULL;
+	CCState expected;
+	unsigned int start;
+	int i;
+
+	if (__atomic_load_n(&ready_queue_depth, __ATOMIC_SEQ_CST) <= 0) {
+		return(NULL);
+	}
+
+	start = __atomic_fetch_add(&ready_queue_cursor, 1, __ATOMIC_RELAXED);
+	for (i=0; ((i<READY_QUEUE_SHARDS) && (con == NULL)); ++i) {
+		struct ready_shard *shard = &ready_queue[(start + i) % READY_QUEUE_SHARDS];
+		if (shard->head == NULL) {
 			continue;
-		// Initialize the fdset.
-		FD_ZERO(&readfds);
-		highest = 0;
-		tv.tv_sec = 0;		// wake up every second if no input
-		tv.tv_usec = 0;
-
-		// Don't select on dead sessions, only truly idle ones
-		if (	(ptr->state == CON_IDLE)
-			&& (ptr->kill_me == 0)
-			&& (ptr->client_socket > 0)
-		) {
-			FD_SET(ptr->client_socket, &readfds);
-			if (ptr->client_socket > highest)
-				highest = ptr->client_socket;
-			
-			if ((select(highest + 1, &readfds, NULL, NULL, &tv) < 0) && (errno == EBADF)) {
-				// Gotcha!
-				syslog(LOG_ERR,
-				       "sysdep: killing session CC[%d] bad FD: [%d] User[%s] Host[%s:%s]",
-					ptr->cs_pid,
-					ptr->client_socket,
-					ptr->curr_user,
-					ptr->cs_host,
-					ptr->cs_addr
-				);
-				ptr->kill_me = 1;
-				ptr->client_socket = -1;
-				break;
+		}
+		pthread_mutex_lock(&shard->lock);
+		con = shard->head;
+		if (con != NULL) {
+			shard->head = con->next_ready;
+			if (shard->head == NULL) {
+				shard->tail = NULL;
 			}
+			con->next_ready = NULL;
 		}
+		pthread_mutex_unlock(&shard->lock);
 	}
-	end_critical_section(S_SESSION_TABLE);
 
-	// First, add the various master sockets to the fdset.
-	for (serviceptr = ServiceHookTable; serviceptr != NULL; serviceptr = serviceptr->next ) {
+	if (con == NULL) {
+		return(NULL);
+	}
+	__atomic_sub_fetch(&ready_queue_depth, 1, __ATOMIC_SEQ_CST);
 
-		// Initialize the fdset.
-		highest = 0;
-		tv.tv_sec = 0;		// wake up every second if no input
-		tv.tv_usec = 0;
+	expected = CON_READY;
+	if (!__atomic_compare_exchange_n(&con->state, &expected, CON_EXECUTING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		syslog(LOG_ERR, "sysdep: session %d was on the ready queue in state %d", con->cs_pid, expected);
+		return(NULL);
+	}
+	return(con);
+}
+
+
+// Return the number of sessions waiting on the ready queue.
+int ready_session_count(void) {
+	return(__atomic_load_n(&ready_queue_depth, __ATOMIC_SEQ_CST));
+}
 
-		FD_SET(serviceptr->msock, &readfds);
-		if (serviceptr->msock > highest) {
-			highest = serviceptr->msock;
+
+// Flag a session as needing attention even though nothing arrived on its socket.
+// If the session is idle it goes onto the ready queue; if a worker is already bound to it,
+// that worker will notice the flag when it releases the session.
+void mark_session_ready(CitContext *con) {
+	CCState expected = CON_IDLE;
+
+	if (__atomic_compare_exchange_n(&con->state, &expected, CON_READY, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		enqueue_ready_session(con);
+	}
+}
+
+
+// Return a session to the CON_IDLE state and (re-)arm its client socket so that the next input
+// from the client wakes up exactly one worker thread.  This is done under the socket's watch lock
+// because as soon as the session is idle, another thread is free to purge it, and the purge has
+// to go through unwatch_session() (which takes the same lock) before the context can be freed.
+static void release_session(CitContext *con) {
+	struct epoll_event ev;
+	pthread_mutex_t *lock;
+	int fd;
+
+	fd = con->client_socket;
+	if ((fd <= 0) || (fd >= num_watched_slots) || (con->kill_me)) {
+		__atomic_store_n(&con->state, CON_IDLE, __ATOMIC_SEQ_CST);
+		return;				// the purge will take it from here; don't touch it again
+	}
+
+	lock = &watch_locks[fd % WATCH_LOCK_STRIPES];
+	pthread_mutex_lock(lock);
+	watched_sessions[fd] = con;
+	con->watched_socket = fd;
+	__atomic_store_n(&con->state, CON_IDLE, __ATOMIC_SEQ_CST);
+
+	// Asynchronous messages may have arrived after the worker last looked.
+	if ((con->is_async) && (__atomic_load_n(&con->async_waiting, __ATOMIC_SEQ_CST)) && (con->h_async_function)) {
+		mark_session_ready(con);
+	}
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = ((uint64_t)con->cs_pid << 32) | (uint32_t)fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+		if ((errno != ENOENT) || (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+			syslog(LOG_ERR, "sysdep: cannot watch client socket %d: %m", fd);
+			con->kill_me = KILLME_SELECT_FAILED;
+		}
+	}
+	pthread_mutex_unlock(lock);
+}
+
+
+// Forget about a session which is being purged.  The caller must already own the session
+// (see dead_session_purge()).  Closing the socket removes it from the epoll set; this only
+// clears our own lookup table.
+void unwatch_session(CitContext *con) {
+	int fd = con->watched_socket;
+
+	if ((fd > 0) && (fd < num_watched_slots)) {
+		pthread_mutex_lock(&watch_locks[fd % WATCH_LOCK_STRIPES]);
+		if (watched_sessions[fd] == con) {
+			watched_sessions[fd] = NULL;
+		}
+		pthread_mutex_unlock(&watch_locks[fd % WATCH_LOCK_STRIPES]);
+	}
+	con->watched_socket = (-1);
+}
+
+
+// A client socket has input waiting.  Bind to its session if it is still the one we armed
+// the socket for and nobody else has claimed it in the meantime.
+static CitContext *claim_session(uint64_t event_data) {
+	CitContext *ptr;
+	CCState expected;
+	int fd = (int)(event_data & 0xffffffff);
+	int pid = (int)((event_data >> 32) & 0x7fffffff);
+
+	if ((fd <= 0) || (fd >= num_watched_slots)) {
+		return(NULL);
+	}
+
+	pthread_mutex_lock(&watch_locks[fd % WATCH_LOCK_STRIPES]);
+	ptr = watched_sessions[fd];
+	if ((ptr != NULL) && (ptr->cs_pid == pid) && (ptr->kill_me == 0)) {
+		expected = CON_IDLE;
+		if (__atomic_compare_exchange_n(&ptr->state, &expected, CON_EXECUTING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			ptr->input_waiting = 1;
+		}
+		else {
+			// Already on the ready queue (or being purged).  The socket will be
+			// re-armed when its owner releases it, and the input will still be there.
+			ptr = NULL;
 		}
-		if ((select(highest + 1, &readfds, NULL, NULL, &tv) < 0) && (errno == EBADF)) {
-			// Gotcha! server socket dead? commit suicide!
-			syslog(LOG_ERR, "sysdep: found bad FD: %d and its a server socket! Shutting Down!", serviceptr->msock);
-			server_shutting_down = 1;
+	}
+	else {
+		ptr = NULL;
+	}
+	pthread_mutex_unlock(&watch_locks[fd % WATCH_LOCK_STRIPES]);
+	return(ptr);
+}
+
+
+// A listener socket has a new connection waiting.  Accept it and return its brand new
+// session, already bound to the calling thread in the CON_STARTING state.
+static CitContext *accept_new_session(int msock) {
+	struct ServiceFunctionHook *serviceptr;
+	CitContext *con = NULL;
+	int ssock;
+	int i;
+
+	for (serviceptr = ServiceHookTable; serviceptr != NULL; serviceptr = serviceptr->next) {
+		if (serviceptr->msock == msock) {
 			break;
 		}
 	}
+	if (serviceptr == NULL) {		// listener went away
+		return(NULL);
+	}
+
+	ssock = accept(msock, NULL, 0);
+	rearm_listener(msock);			// let another thread take the next connection
+	if (ssock < 0) {
+		return(NULL);
+	}
+	syslog(LOG_DEBUG, "sysdep: new client socket %d", ssock);
+
+	// The master socket is non-blocking but the client
+	// sockets need to be blocking, otherwise certain
+	// operations barf on FreeBSD.  Not a fatal error.
+	if (fcntl(ssock, F_SETFL, 0) < 0) {
+		syslog(LOG_ERR, "sysdep: Can't set socket to blocking: %m");
+	}
+
+	// New context will be created already
+	// set up in the CON_EXECUTING state.
+	con = CreateNewContext();
+	if (con == NULL) {
+		close(ssock);
+		return(NULL);
+	}
+
+	// Assign our new socket number to it.
+	con->tcp_port = serviceptr->tcp_port;
+	con->client_socket = ssock;
+	con->h_command_function = serviceptr->h_command_function;
+	con->h_async_function = serviceptr->h_async_function;
+	con->h_greeting_function = serviceptr->h_greeting_function;
+	con->ServiceName = serviceptr->ServiceName;
+	
+	// Connections on a local client are always from the same host
+	if (serviceptr->sockpath != NULL) {
+		con->is_local_client = 1;
+	}
+
+	// Set the SO_REUSEADDR socket option
+	i = 1;
+	setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+	con->state = CON_STARTING;
+	return(con);
+}
+
+
+// Somebody put a session on the ready queue while we were asleep.  Consume the wakeup, re-arm it,
+// and take a session.  If there is still more work queued, pass the wakeup along to another worker.
+static CitContext *wakeup_received(void) {
+	struct epoll_event ev;
+	uint64_t counter;
+	CitContext *con;
+
+	if (read(wakeup_fd, &counter, sizeof counter) < 0) {
+		// EAGAIN means another thread already drained it; that's fine.
+	}
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = EPOLL_WAKEUP;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, wakeup_fd, &ev);
+
+	con = dequeue_ready_session();
+	if ((con != NULL) && (ready_session_count() > 0)) {
+		counter = 1;
+		if (write(wakeup_fd, &counter, sizeof counter) < 0) {
+			// already pending
+		}
+	}
+	return(con);
 }
 
 
 // Main server loop
-// select() can wake up on any of the following conditions:
+// epoll_wait() can wake up on any of the following conditions:
 // 1. A new client connection on a master socket
 // 2. Received data on a client socket
-// 3. A timer event
-// That's why we are blocking on select() and not accept().
+// 3. A session was put on the ready queue
+// 4. A timer event
+// Each worker asks for exactly one event at a time.  Because every socket is registered in
+// one-shot mode, the kernel's ready list acts as the queue which hands sessions to workers.
 void *worker_thread(void *blah) {
-	int highest;
-	CitContext *ptr;
 	CitContext *bind_me = NULL;
-	fd_set readfds;
+	struct epoll_event event;
+	struct worker_stats *ws;
 	int retval = 0;
-	struct timeval tv;
 	int force_purge = 0;
-	struct ServiceFunctionHook *serviceptr;
-	int ssock;                      // Descriptor for client socket
-	CitContext *con = NULL;         // Temporary context pointer
-	int i;
+	long long bound_at = 0;
+	long long waited = 0;
+	long commands = 0;
+	time_t idle_since = time(NULL);
 
-	pthread_mutex_lock(&ThreadCountMutex);
-	++num_workers;
-	pthread_mutex_unlock(&ThreadCountMutex);
+	// We were already counted in num_workers by grow_worker_pool()
+	ws = worker_register();
 
 	while (!server_shutting_down) {
 
 		// make doubly sure we're not holding any stale db handles which might cause a deadlock
 		cdb_check_handles();
-do_select:	force_purge = 0;
+		force_purge = 0;
 		bind_me = NULL;		// Which session shall we handle?
 
-		// Initialize the fdset
-		FD_ZERO(&readfds);
-		highest = 0;
-
-		// First, add the various master sockets to the fdset.
-		for (serviceptr = ServiceHookTable; serviceptr != NULL; serviceptr = serviceptr->next ) {
-			FD_SET(serviceptr->msock, &readfds);
-			if (serviceptr->msock > highest) {
-				highest = serviceptr->msock;
-			}
-		}
-
-		// Next, add all of the client sockets.
-		begin_critical_section(S_SESSION_TABLE);
-		for (ptr = ContextList; ptr != NULL; ptr = ptr->next) {
-			if ((ptr->state == CON_SYS) && (ptr->client_socket == 0))
-			    continue;
-
-			// Don't select on dead sessions, only truly idle ones
-			if (	(ptr->state == CON_IDLE)
-				&& (ptr->kill_me == 0)
-				&& (ptr->client_socket > 0)
-			) {
-				FD_SET(ptr->client_socket, &readfds);
-				if (ptr->client_socket > highest)
-					highest = ptr->client_socket;
-			}
-			if ((bind_me == NULL) && (ptr->state == CON_READY)) {
-				bind_me = ptr;
-				ptr->state = CON_EXECUTING;
-				break;
-			}
-			if ((bind_me == NULL) && (ptr->state == CON_GREETING)) {
-				bind_me = ptr;
-				ptr->state = CON_STARTING;
-				break;
-			}
-		}
-		end_critical_section(S_SESSION_TABLE);
-
-		if (bind_me) {
-			goto SKIP_SELECT;
-		}
+		// First, take a session which was marked for attention without any socket activity
+		// (for example, asynchronous messages are waiting).
+		bind_me = dequeue_ready_session();
 
-		// If we got this far, it means that there are no sessions
-		// which a previous thread marked for attention, so we go
-		// ahead and get ready to select().
-
-		if (!server_shutting_down) {
-			tv.tv_sec = 1;		// wake up every second if no input
-			tv.tv_usec = 0;
-			retval = select(highest + 1, &readfds, NULL, NULL, &tv);
-		}
-		else {
-			--num_workers;
-			return NULL;
-		}
-
-		// Now figure out who made this select() unblock.
-		// First, check for an error or exit condition.
-		if (retval < 0) {
-			if (errno == EBADF) {
-				syslog(LOG_ERR, "sysdep: select() failed: %m");
-				HuntBadSession();
-				goto do_select;
-			}
-			if (errno != EINTR) {
-				syslog(LOG_ERR, "sysdep: exiting: %m");
-				server_shutting_down = 1;
+		if ((bind_me == NULL) && (!server_shutting_down)) {
+			retval = epoll_wait(epoll_fd, &event, 1, 1000);		// wake up every second if no input
+			if (retval < 0) {
+				if (errno != EINTR) {
+					syslog(LOG_ERR, "sysdep: epoll_wait() failed, exiting: %m");
+					server_shutting_down = 1;
+				}
 				continue;
-			} else {
-				if (server_shutting_down) {
-					--num_workers;
+			}
+			else if (retval == 0) {
+				// Nothing happened for a whole second.  Maybe the pool is bigger than it needs to be.
+				dead_session_purge(0);
+				do_housekeeping();
+				if (worker_may_retire(idle_since)) {
+					worker_unregister(ws);
 					return(NULL);
 				}
-				goto do_select;
+				continue;
 			}
-		}
-		else if (retval == 0) {
-			if (server_shutting_down) {
-				--num_workers;
-				return(NULL);
+			else if (event.data.u64 & EPOLL_LISTENER) {
+				bind_me = accept_new_session((int)(event.data.u64 & 0xffffffff));
 			}
-		}
-
-		// Next, check to see if it's a new client connecting on a master socket.
-
-		else if ((retval > 0) && (!server_shutting_down)) for (serviceptr = ServiceHookTable; serviceptr != NULL; serviceptr = serviceptr->next) {
-
-			if (FD_ISSET(serviceptr->msock, &readfds)) {
-				ssock = accept(serviceptr->msock, NULL, 0);
-				if (ssock >= 0) {
-					syslog(LOG_DEBUG, "sysdep: new client socket %d", ssock);
-
-					// The master socket is non-blocking but the client
-					// sockets need to be blocking, otherwise certain
-					// operations barf on FreeBSD.  Not a fatal error.
-					if (fcntl(ssock, F_SETFL, 0) < 0) {
-						syslog(LOG_ERR, "sysdep: Can't set socket to blocking: %m");
-					}
-
-					// New context will be created already
-					// set up in the CON_EXECUTING state.
-					con = CreateNewContext();
-
-					// Assign our new socket number to it.
-					con->tcp_port = serviceptr->tcp_port;
-					con->client_socket = ssock;
-					con->h_command_function = serviceptr->h_command_function;
-					con->h_async_function = serviceptr->h_async_function;
-					con->h_greeting_function = serviceptr->h_greeting_function;
-					con->ServiceName = serviceptr->ServiceName;
-					
-					// Connections on a local client are always from the same host
-					if (serviceptr->sockpath != NULL) {
-						con->is_local_client = 1;
-					}
-	
-					// Set the SO_REUSEADDR socket option
-					i = 1;
-					setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
-					con->state = CON_GREETING;
-					retval--;
-					if (retval == 0)
-						break;
-				}
+			else if (event.data.u64 & EPOLL_WAKEUP) {
+				bind_me = wakeup_received();
+			}
+			else {
+				bind_me = claim_session(event.data.u64);
 			}
 		}
 
-		// It must be a client socket.  Find a context that has data
-		// waiting on its socket *and* is in the CON_IDLE state.  Any
-		// active sockets other than our chosen one are marked as
-		// CON_READY so the next thread that comes around can just bind
-		// to one without having to select() again.
-		begin_critical_section(S_SESSION_TABLE);
-		for (ptr = ContextList; ptr != NULL; ptr = ptr->next) {
-			int checkfd = ptr->client_socket;
-			if ((checkfd != -1) && (ptr->state == CON_IDLE) ){
-				if (FD_ISSET(checkfd, &readfds)) {
-					ptr->input_waiting = 1;
-					if (!bind_me) {
-						bind_me = ptr;	// I choose you!
-						bind_me->state = CON_EXECUTING;
-					}
-					else {
-						ptr->state = CON_READY;
-					}
-				} else if ((ptr->is_async) && (ptr->async_waiting) && (ptr->h_async_function)) {
-					if (!bind_me) {
-						bind_me = ptr;	// I choose you!
-						bind_me->state = CON_EXECUTING;
-					}
-					else {
-						ptr->state = CON_READY;
-					}
-				}
-			}
+		if (server_shutting_down) {
+			break;
 		}
-		end_critical_section(S_SESSION_TABLE);
 
-SKIP_SELECT:
 		// We're bound to a session
 		pthread_mutex_lock(&ThreadCountMutex);
 		++active_workers;
 		pthread_mutex_unlock(&ThreadCountMutex);
 
 		if (bind_me != NULL) {
+			// If that used up the last idle worker, or sessions are piling up on the ready queue,
+			// start more workers right now rather than letting new work wait behind this one.
+			grow_worker_pool(ready_session_count());
+
+			// Our counters are only changed under ThreadCountMutex, so CtdlGetWorkerStats() can copy them
+			// while we run.  The commands we run are added up when we let go of the session.
+			bound_at = worker_clock_usec();
+			waited = ((bind_me->ready_since != 0) ? (bound_at - bind_me->ready_since) : -1);
+			bind_me->ready_since = 0;
+			commands = 0;
+			pthread_mutex_lock(&ThreadCountMutex);
+			ws->busy = 1;
+			++ws->sessions_bound;
+			if (waited >= 0) {
+				++ws->queue_waits;
+				ws->queue_wait_usec += waited;
+				if (waited > ws->max_queue_wait_usec) {
+					ws->max_queue_wait_usec = waited;
+				}
+			}
+			pthread_mutex_unlock(&ThreadCountMutex);
+
 			become_session(bind_me);
 
 			if (bind_me->state == CON_STARTING) {
@@ -975,22 +1246,33 @@ SKIP_SELECT:
 			// If the client has sent a command, execute it.
 			if (CC->input_waiting) {
 				CC->h_command_function();
+				++commands;
 
-				while (HaveMoreLinesWaiting(CC))
-				       CC->h_command_function();
+				while (HaveMoreLinesWaiting(CC)) {
+					CC->h_command_function();
+					++commands;
+				}
 
 				CC->input_waiting = 0;
 			}
 
-			// If there are asynchronous messages waiting and the client supports it, do those now
-			if ((CC->is_async) && (CC->async_waiting) && (CC->h_async_function != NULL)) {
+			// If there are asynchronous messages waiting and the client supports it, do those now.  The flag
+			// is cleared first, so anything which arrives while we're at it sets it again and isn't lost.
+			if ((CC->is_async) && (CC->h_async_function != NULL) && (__atomic_exchange_n(&CC->async_waiting, 0, __ATOMIC_SEQ_CST))) {
 				CC->h_async_function();
-				CC->async_waiting = 0;
 			}
 
+			client_flush();
 			force_purge = CC->kill_me;
 			become_session(NULL);
-			bind_me->state = CON_IDLE;
+			release_session(bind_me);
+
+			pthread_mutex_lock(&ThreadCountMutex);
+			ws->commands_run += commands;
+			ws->busy_usec += (worker_clock_usec() - bound_at);
+			ws->busy = 0;
+			pthread_mutex_unlock(&ThreadCountMutex);
+			idle_since = time(NULL);
 		}
 
 		dead_session_purge(force_purge);
@@ -998,13 +1280,6 @@ SKIP_SELECT:
 
 		pthread_mutex_lock(&ThreadCountMutex);
 		--active_workers;
-		if ((active_workers + CtdlGetConfigInt("c_min_workers") < num_workers) &&
-		    (num_workers > CtdlGetConfigInt("c_min_workers")))
-		{
-			num_workers--;
-			pthread_mutex_unlock(&ThreadCountMutex);
-			return (NULL);
-		}
 		pthread_mutex_unlock(&ThreadCountMutex);
 	}
 
@@ -1012,10 +1287,10 @@ SKIP_SELECT:
 	pthread_mutex_lock(&ThreadCountMutex);
 	--num_workers;
 	pthread_mutex_unlock(&ThreadCountMutex);
+	worker_unregister(ws);
 	return(NULL);
 }
 
-
 // SyslogFacility()
 // Translate text facility name to syslog.h defined value.
 int SyslogFacility(char *name)
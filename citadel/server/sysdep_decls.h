@@ -44,6 +44,7 @@ int ctdl_uds_server(char *sockpath, int queue_len);
 void buffer_output(void);
 void unbuffer_output(void);
 void flush_output(void);
+int client_flush(void);
 int client_write (const char *buf, int nbytes);
 int client_read_to (char *buf, int bytes, int timeout);
 int client_read (char *buf, int bytes);
@@ -58,7 +59,7 @@ void kill_session (int session_to_kill);
 void start_daemon (int do_close_stdio);
 void checkcrash(void);
 int convert_login (char *NameToConvert);
-void init_master_fdset(void);
+void ctdl_watch_listener(int msock);
 void *worker_thread(void *);
 
 extern volatile int exit_signal;
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <time.h>
 #include <libcitadel.h>
 #include "modules_init.h"
 #include "serv_extensions.h"
@@ -15,14 +16,17 @@
 #include "config.h"
 #include "context.h"
 #include "threads.h"
+#include "database.h"
 
-int num_workers = 0;				// Current number of worker threads
+int num_workers = 0;				// Current number of worker threads (including ones still starting)
 int active_workers = 0;				// Number of ACTIVE worker threads
 pthread_key_t ThreadKey;
 pthread_mutex_t Critters[MAX_SEMAPHORES];	// Things needing locking
 struct thread_tsd masterTSD;
 int server_shutting_down = 0;			// set to nonzero during shutdown
 pthread_mutex_t ThreadCountMutex;
+struct worker_stats *worker_stats_list = NULL;	// Per-worker counters, protected by ThreadCountMutex
+time_t last_retirement = 0;			// When the pool last shrank
 
 void InitializeSemaphores(void) {
 	int i;
@@ -90,13 +94,14 @@ void *CTC_backend(void *supplied_start_routine) {
 	pthread_setspecific(ThreadKey, (const void *) mytsd);
 
 	start_routine(NULL);
+	cdb_free_tsd();
 	// free(mytsd);
 	return(NULL);
 }
 
  
-// Function to create a thread.
-void CtdlThreadCreate(void *(*start_routine)(void*)) {
+// Function to create a thread.  Returns 0 on success or an error number.
+int CtdlThreadCreate(void *(*start_routine)(void*)) {
 	pthread_t thread;
 	pthread_attr_t attr;
 	int ret = 0;
@@ -104,7 +109,133 @@ void CtdlThreadCreate(void *(*start_routine)(void*)) {
 	ret = pthread_attr_init(&attr);
 	ret = pthread_attr_setstacksize(&attr, THREADSTACKSIZE);
 	ret = pthread_create(&thread, &attr, CTC_backend, (void *)start_routine);
-	if (ret != 0) syslog(LOG_ERR, "pthread_create() : %m");
+	if (ret != 0) syslog(LOG_ERR, "pthread_create() : %s", strerror(ret));
+	pthread_attr_destroy(&attr);
+	return(ret);
+}
+
+
+// Monotonic clock in microseconds, used for the worker statistics.
+long long worker_clock_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( ((long long)ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000) );
+}
+
+
+// Called by a worker thread when it starts up.  The worker was already counted in num_workers
+// by whoever started it; here we only add its counters to the list the WSTA command reads.
+struct worker_stats *worker_register(void) {
+	struct worker_stats *ws;
+
+	ws = (struct worker_stats *) malloc(sizeof(struct worker_stats));
+	memset(ws, 0, sizeof(struct worker_stats));
+	ws->tid = pthread_self();
+	ws->started = time(NULL);
+
+	pthread_mutex_lock(&ThreadCountMutex);
+	ws->next = worker_stats_list;
+	worker_stats_list = ws;
+	pthread_mutex_unlock(&ThreadCountMutex);
+	return(ws);
+}
+
+
+// Called by a worker thread on its way out.  num_workers has already been decremented.
+void worker_unregister(struct worker_stats *ws) {
+	struct worker_stats **ptr;
+
+	pthread_mutex_lock(&ThreadCountMutex);
+	for (ptr = &worker_stats_list; *ptr != NULL; ptr = &((*ptr)->next)) {
+		if (*ptr == ws) {
+			*ptr = ws->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ThreadCountMutex);
+	free(ws);
+}
+
+
+// Start enough worker threads to cover "demand" sessions waiting for a worker, plus one spare thread
+// to keep watching for new connections.  Called by a worker as soon as it binds a session, so the pool
+// grows the moment it runs out of idle threads instead of waiting for the supervisor to notice.
+void grow_worker_pool(int demand) {
+	int max_workers = CtdlGetConfigInt("c_max_workers");
+	int to_start = 0;
+	int i;
+
+	if (demand < 0) {
+		demand = 0;
+	}
+
+	pthread_mutex_lock(&ThreadCountMutex);
+	while (	((num_workers + to_start - active_workers) < (demand + 1))
+		&& ((num_workers + to_start) < max_workers)
+	) {
+		++to_start;
+	}
+	num_workers += to_start;		// count them now, so concurrent callers don't overshoot
+	pthread_mutex_unlock(&ThreadCountMutex);
+
+	if (to_start > 0) {
+		syslog(LOG_DEBUG, "threads: starting %d worker thread%s (demand %d)", to_start, ((to_start == 1) ? "" : "s"), demand);
+	}
+	for (i=0; i<to_start; ++i) {
+		if (CtdlThreadCreate(worker_thread) != 0) {
+			pthread_mutex_lock(&ThreadCountMutex);
+			num_workers -= (to_start - i);
+			pthread_mutex_unlock(&ThreadCountMutex);
+			break;
+		}
+	}
+}
+
+
+// Called by an idle worker.  Returns nonzero (and removes the caller from num_workers) if it should exit.
+// The pool only shrinks after a worker has been idle for WORKER_IDLE_RETIRE seconds, never below
+// c_min_workers, never below one spare thread, and by at most one thread every WORKER_RETIRE_INTERVAL
+// seconds, so a bursty load doesn't make it oscillate.
+int worker_may_retire(time_t idle_since) {
+	int retire = 0;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&ThreadCountMutex);
+	if (	((now - idle_since) >= WORKER_IDLE_RETIRE)
+		&& ((now - last_retirement) >= WORKER_RETIRE_INTERVAL)
+		&& (num_workers > CtdlGetConfigInt("c_min_workers"))
+		&& ((num_workers - active_workers) > 1)
+	) {
+		--num_workers;
+		last_retirement = now;
+		retire = 1;
+	}
+	pthread_mutex_unlock(&ThreadCountMutex);
+	return(retire);
+}
+
+
+// Take a snapshot of the per-worker counters.  Returns the number of workers and sets *ret to an
+// array the caller must free().  The copy lets the caller take its time writing to a client
+// without holding ThreadCountMutex.
+int CtdlGetWorkerStats(struct worker_stats **ret) {
+	struct worker_stats *ws;
+	int num = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&ThreadCountMutex);
+	for (ws = worker_stats_list; ws != NULL; ws = ws->next) {
+		++num;
+	}
+	*ret = (struct worker_stats *) malloc(sizeof(struct worker_stats) * (num + 1));
+	for (ws = worker_stats_list; ws != NULL; ws = ws->next) {
+		memcpy(&(*ret)[i], ws, sizeof(struct worker_stats));
+		(*ret)[i].next = NULL;
+		++i;
+	}
+	pthread_mutex_unlock(&ThreadCountMutex);
+	return(num);
 }
 
 
@@ -120,14 +251,11 @@ void go_threading(void) {
 	// Second call to module init functions now that threading is up
 	initialize_modules(1);
 
-	// Begin with one worker thread.  We will expand the pool if necessary
-	CtdlThreadCreate(worker_thread);
-
-	// The supervisor thread monitors worker threads and spawns more of them if it finds that they are all in use.
+	// Begin with the minimum number of worker threads.  Workers start more of themselves as soon as they run out
+	// of idle threads (see grow_worker_pool()) and retire on their own after sitting idle for a while.
+	// The supervisor thread now only waits for shutdown, and puts back any workers lost below the minimum.
 	while (!server_shutting_down) {
-		if ((active_workers == num_workers) && (num_workers < CtdlGetConfigInt("c_max_workers"))) {
-			CtdlThreadCreate(worker_thread);
-		}
+		grow_worker_pool(CtdlGetConfigInt("c_min_workers") - 1 - active_workers);
 		usleep(1000000);
 	}
 
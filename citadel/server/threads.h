@@ -11,23 +11,57 @@
 #include <sys/time.h>
 #include <string.h>
 
-#include <db.h>
-
 #include "server.h"
 #include "sysdep_decls.h"
 
+/*
+ * A buffer which borrowed database reads are done into, so they don't have to malloc() anything
+ */
+struct cdb_borrowed {
+	struct cdbdata data;		/* What the caller gets */
+	char *buf;			/* What the record is read into... */
+	size_t alloc;
+	char *unzipped;			/* ...and expanded into, if it was stored compressed */
+	size_t unzipped_alloc;
+};
+
 /*
  * Things we need to keep track of per-thread instead of per-session
  */
 struct thread_tsd {
-	DB_TXN *tid;            /* Transaction handle */
-	DBC *cursors[MAXCDB];   /* Cursors, for traversals... */
+	void *tid;              /* Transaction handle (belongs to the storage backend) */
+	void *cursors[MAXCDB];  /* Cursors, for traversals... */
+	void *reader;           /* Read-only handle a backend can reuse from one fetch to the next */
+	struct cdb_borrowed fetch_buf;	/* for cdb_fetch_borrowed() */
+	struct cdb_borrowed cursor_buf;	/* for cdb_next_item_borrowed() */
+	void *snapshot;         /* Read-only transaction begun by cdb_begin_read() (belongs to the storage backend) */
+	int snapshot_lost;      /* Nonzero if the backend had to give up the snapshot before cdb_end_read() */
+	long *txn_rooms;		/* Rooms whose message lists were written in the open transaction */
+	int num_txn_rooms;
+	int alloc_txn_rooms;
 };
 
 extern pthread_key_t ThreadKey;
 extern struct thread_tsd masterTSD;
 #define TSD MyThread()
 
+/*
+ * Counters kept by each worker thread, readable by administrators (WSTA command).
+ * A worker changes its own counters only while holding ThreadCountMutex.
+ */
+struct worker_stats {
+	struct worker_stats *next;
+	pthread_t tid;			/* Thread id */
+	time_t started;			/* When this worker was started */
+	int busy;			/* Nonzero while bound to a session */
+	long sessions_bound;		/* Number of times a session was bound */
+	long commands_run;		/* Number of protocol commands executed */
+	long long busy_usec;		/* Total time spent bound to sessions */
+	long queue_waits;		/* Number of sessions taken from the ready queue */
+	long long queue_wait_usec;	/* Total time those sessions waited for a worker */
+	long long max_queue_wait_usec;	/* Longest time any of them waited */
+};
+
 extern int num_workers;
 extern int active_workers;
 extern int server_shutting_down;
@@ -38,7 +72,13 @@ void begin_critical_section (int which_one);
 void end_critical_section (int which_one);
 void go_threading(void);
 void InitializeMasterTSD(void);
-void CtdlThreadCreate(void *(*start_routine)(void*));
+int CtdlThreadCreate(void *(*start_routine)(void*));
+long long worker_clock_usec(void);
+struct worker_stats *worker_register(void);
+void worker_unregister(struct worker_stats *ws);
+void grow_worker_pool(int demand);
+int worker_may_retire(time_t idle_since);
+int CtdlGetWorkerStats(struct worker_stats **ret);
 
 
 extern pthread_mutex_t ThreadCountMutex;;
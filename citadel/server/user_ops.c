@@ -15,6 +15,7 @@
 #include "support.h"
 #include "citserver.h"
 #include "config.h"
+#include "msglist_cache.h"
 #include "citadel_ldap.h"
 #include "ctdl_module.h"
 #include "user_ops.h"
@@ -73,7 +74,7 @@ int CtdlGetUser(struct ctdluser *usbuf, char *name) {
 	if (IsEmptyStr(usernamekey)) {
 		return(1);	// empty user name
 	}
-	cdbus = cdb_fetch(CDB_USERS, usernamekey, strlen(usernamekey));
+	cdbus = cdb_fetch_borrowed(CDB_USERS, usernamekey, strlen(usernamekey));
 
 	if (cdbus == NULL) {	// user not found
 		return(1);
@@ -81,7 +82,6 @@ int CtdlGetUser(struct ctdluser *usbuf, char *name) {
 	if (usbuf != NULL) {
 		memcpy(usbuf, cdbus->ptr, ((cdbus->len > sizeof(struct ctdluser)) ?  sizeof(struct ctdluser) : cdbus->len));
 	}
-	cdb_free(cdbus);
 	return(0);
 }
 
@@ -235,54 +235,176 @@ int GenerateRelationshipIndex(char *IndexBuf, long RoomID, long RoomGen, long Us
 	return(sizeof(TheIndex));
 }
 
-// Back end for CtdlSetRelationship()
-void put_visit(struct visit *newvisit) {
-	cdb_store(CDB_VISIT, newvisit, (sizeof(long)*3), newvisit, sizeof(struct visit));
+// Decode a visit record as it is stored in the database.  Records written before the seen and answered
+// sets were stored in binary form are converted here.  Either set pointer may be NULL if the caller
+// isn't interested in that set; otherwise the caller must free the set it gets back.
+void CtdlDecodeVisit(struct cdbdata *cdbvisit, struct visit *vbuf, struct seen_set **seen, struct seen_set **answered) {
+	struct visit_sets hdr;
+	struct visit_legacy *legacy;
+	char *sets;
+
+	memset(&hdr, 0, sizeof(struct visit_sets));
+	if (cdbvisit->len >= sizeof(struct visit) + sizeof(struct visit_sets)) {
+		memcpy(&hdr, cdbvisit->ptr + sizeof(struct visit), sizeof(struct visit_sets));
+	}
+
+	if (
+		(hdr.magic == VISIT_MAGIC)
+		&& (cdbvisit->len >= sizeof(struct visit) + sizeof(struct visit_sets)
+			+ (((size_t)hdr.num_seen + (size_t)hdr.num_answered) * sizeof(struct seen_range)))
+	) {
+		memcpy(vbuf, cdbvisit->ptr, sizeof(struct visit));
+		sets = cdbvisit->ptr + sizeof(struct visit) + sizeof(struct visit_sets);
+		if (seen != NULL) {
+			*seen = seen_set_decode(sets, hdr.num_seen);
+		}
+		if (answered != NULL) {
+			*answered = seen_set_decode(sets + (hdr.num_seen * sizeof(struct seen_range)), hdr.num_answered);
+		}
+		return;
+	}
+
+	// Legacy record
+	legacy = (struct visit_legacy *) malloc(sizeof(struct visit_legacy));
+	memset(legacy, 0, sizeof(struct visit_legacy));
+	memcpy(legacy, cdbvisit->ptr, ((cdbvisit->len > sizeof(struct visit_legacy)) ? sizeof(struct visit_legacy) : cdbvisit->len));
+	legacy->v_seen[SIZ-1] = 0;
+	legacy->v_answered[SIZ-1] = 0;
+
+	vbuf->v_roomnum = legacy->v_roomnum;
+	vbuf->v_roomgen = legacy->v_roomgen;
+	vbuf->v_usernum = legacy->v_usernum;
+	vbuf->v_lastseen = legacy->v_lastseen;
+	vbuf->v_flags = legacy->v_flags;
+	vbuf->v_view = legacy->v_view;
+	if (seen != NULL) {
+		*seen = seen_set_from_string(legacy->v_seen);
+	}
+	if (answered != NULL) {
+		*answered = seen_set_from_string(legacy->v_answered);
+	}
+	free(legacy);
 }
 
 
-// Define a relationship between a user and a room
-void CtdlSetRelationship(struct visit *newvisit, struct ctdluser *rel_user, struct ctdlroom *rel_room) {
+// Back end for CtdlSetRelationship() -- writes the record along with its seen and answered sets
+// (a NULL set is stored as an empty one).  A seen set of everything up to v_lastseen, which is what
+// CtdlGetRelationshipSets() makes of an empty one, is stored empty again.
+void put_visit(struct visit *newvisit, struct seen_set *seen, struct seen_set *answered) {
+	struct visit_sets hdr;
+	size_t seen_len, answered_len, len;
+	char *rec;
+
+	if (	(seen != NULL)
+		&& (seen->num_ranges == 1)
+		&& (seen->ranges[0].lo == 0)
+		&& (seen->ranges[0].hi == newvisit->v_lastseen)
+	) {
+		seen = NULL;
+	}
+
+	seen_len = seen_set_encoded_len(seen);
+	answered_len = seen_set_encoded_len(answered);
+	len = sizeof(struct visit) + sizeof(struct visit_sets) + seen_len + answered_len;
+
+	memset(&hdr, 0, sizeof(struct visit_sets));
+	hdr.magic = VISIT_MAGIC;
+	hdr.num_seen = ((seen != NULL) ? seen->num_ranges : 0);
+	hdr.num_answered = ((answered != NULL) ? answered->num_ranges : 0);
+
+	rec = malloc(len);
+	memcpy(rec, newvisit, sizeof(struct visit));
+	memcpy(rec + sizeof(struct visit), &hdr, sizeof(struct visit_sets));
+	seen_set_encode(seen, rec + sizeof(struct visit) + sizeof(struct visit_sets));
+	seen_set_encode(answered, rec + sizeof(struct visit) + sizeof(struct visit_sets) + seen_len);
+
+	cdb_store(CDB_VISIT, newvisit, (sizeof(long)*3), rec, len);
+	free(rec);
+}
+
+
+// Define a relationship between a user and a room, and optionally replace its seen and/or answered sets.
+// A set passed as NULL is left as it is, which means reading the record again to find it; a caller which
+// read the record with CtdlGetRelationshipSets() in order to change it should pass back both sets instead.
+void CtdlSetRelationshipSets(struct visit *newvisit, struct seen_set *seen, struct seen_set *answered,
+				struct ctdluser *rel_user, struct ctdlroom *rel_room) {
+	struct cdbdata *cdbvisit;
+	struct visit oldvisit;
+	struct seen_set *oldseen = NULL;
+	struct seen_set *oldanswered = NULL;
+
 	// We don't use these in Citadel because they're implicit by the
 	// index, but they must be present if the database is exported.
 	newvisit->v_roomnum = rel_room->QRnumber;
 	newvisit->v_roomgen = rel_room->QRgen;
 	newvisit->v_usernum = rel_user->usernum;
 
+	// Keep whichever sets we weren't given
+	if ((seen == NULL) || (answered == NULL)) {
+		cdbvisit = cdb_fetch_borrowed(CDB_VISIT, newvisit, (sizeof(long)*3));
+		if (cdbvisit != NULL) {
+			CtdlDecodeVisit(cdbvisit, &oldvisit, ((seen == NULL) ? &oldseen : NULL), ((answered == NULL) ? &oldanswered : NULL));
+		}
+	}
+
 	// Store the record
-	put_visit(newvisit);
+	put_visit(newvisit, ((seen != NULL) ? seen : oldseen), ((answered != NULL) ? answered : oldanswered));
+	seen_set_free(&oldseen);
+	seen_set_free(&oldanswered);
 }
 
 
-// Locate a relationship between a user and a room
-void CtdlGetRelationship(struct visit *vbuf, struct ctdluser *rel_user, struct ctdlroom *rel_room) {
+// Define a relationship between a user and a room, keeping its seen and answered sets
+void CtdlSetRelationship(struct visit *newvisit, struct ctdluser *rel_user, struct ctdlroom *rel_room) {
+	CtdlSetRelationshipSets(newvisit, NULL, NULL, rel_user, rel_room);
+}
+
+
+// Locate a relationship between a user and a room, and optionally fetch its seen and/or answered sets
+// (pass NULL for any set you don't need; the caller must free the ones it asks for).
+void CtdlGetRelationshipSets(struct visit *vbuf, struct seen_set **seen, struct seen_set **answered,
+				struct ctdluser *rel_user, struct ctdlroom *rel_room) {
 	struct cdbdata *cdbvisit;
 
 	// Clear out the buffer
 	memset(vbuf, 0, sizeof(struct visit));
+	if (seen != NULL) *seen = NULL;
+	if (answered != NULL) *answered = NULL;
 
 	// Fill out the first three fields; they are also the index
 	vbuf->v_roomnum = rel_room->QRnumber;
 	vbuf->v_roomgen = rel_room->QRgen;
 	vbuf->v_usernum = rel_user->usernum;
 
-	cdbvisit = cdb_fetch(CDB_VISIT, vbuf, (sizeof(long)*3));
+	cdbvisit = cdb_fetch_borrowed(CDB_VISIT, vbuf, (sizeof(long)*3));
 	if (cdbvisit != NULL) {
-		memcpy(vbuf, cdbvisit->ptr, ((cdbvisit->len > sizeof(struct visit)) ?  sizeof(struct visit) : cdbvisit->len));
-		cdb_free(cdbvisit);
+		CtdlDecodeVisit(cdbvisit, vbuf, seen, answered);
 	}
 	else {
 		// If this is the first time the user has seen this room, set the view to be the default for the room.
 		vbuf->v_view = rel_room->QRdefaultview;
 	}
 
-	// Set v_seen if necessary
-	if (vbuf->v_seen[0] == 0) {
-		snprintf(vbuf->v_seen, sizeof vbuf->v_seen, "*:%ld", vbuf->v_lastseen);
+	if ((seen != NULL) && (*seen == NULL)) {
+		*seen = seen_set_new();
+	}
+	if ((answered != NULL) && (*answered == NULL)) {
+		*answered = seen_set_new();
+	}
+
+	// An empty seen set means everything up to v_lastseen
+	if ((seen != NULL) && ((*seen)->num_ranges == 0)) {
+		seen_set_add(*seen, 0, vbuf->v_lastseen);
 	}
 }
 
 
+// Locate a relationship between a user and a room
+void CtdlGetRelationship(struct visit *vbuf, struct ctdluser *rel_user, struct ctdlroom *rel_room) {
+	CtdlGetRelationshipSets(vbuf, NULL, NULL, rel_user, rel_room);
+}
+
+
 void CtdlMailboxName(char *buf, size_t n, const struct ctdluser *who, const char *prefix) {
 	snprintf(buf, n, "%010ld.%s", who->usernum, prefix);
 }
@@ -423,7 +545,7 @@ int getuserbyuid(struct ctdluser *usbuf, uid_t number) {
 	// No, we don't use CtdlForEachUser() because that requires multiple reads for each record
 	// TODO: make an index
 	cdb_rewind(CDB_USERS);
-	while (cdbus = cdb_next_item(CDB_USERS), cdbus != NULL) {
+	while (cdbus = cdb_next_item_borrowed(CDB_USERS), cdbus != NULL) {
 		usptr = (struct ctdluser *) cdbus->ptr;
 
 		if (usptr->uid == number) {
@@ -997,13 +1119,15 @@ void CtdlSetPassword(char *new_pw) {
 int CtdlInvtKick(char *iuser, int op) {
 	struct ctdluser USscratch;
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 	char bbb[SIZ];
 
 	if (CtdlGetUser(&USscratch, iuser) != 0) {
 		return(1);
 	}
 
-	CtdlGetRelationship(&vbuf, &USscratch, &CC->room);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &USscratch, &CC->room);
 	if (op == 1) {
 		vbuf.v_flags = vbuf.v_flags & ~V_FORGET & ~V_LOCKOUT;
 		vbuf.v_flags = vbuf.v_flags | V_ACCESS;
@@ -1012,7 +1136,9 @@ int CtdlInvtKick(char *iuser, int op) {
 		vbuf.v_flags = vbuf.v_flags & ~V_ACCESS;
 		vbuf.v_flags = vbuf.v_flags | V_FORGET | V_LOCKOUT;
 	}
-	CtdlSetRelationship(&vbuf, &USscratch, &CC->room);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &USscratch, &CC->room);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 
 	// post a message in Aide> saying what we just did
 	snprintf(bbb, sizeof bbb, "%s has been %s \"%s\" by %s.\n",
@@ -1030,6 +1156,8 @@ int CtdlInvtKick(char *iuser, int op) {
 // Returns 0 on success
 int CtdlForgetThisRoom(void) {
 	struct visit vbuf;
+	struct seen_set *seen = NULL;
+	struct seen_set *answered = NULL;
 
 	// On some systems, Admins are not allowed to forget rooms
 	if (is_aide() && (CtdlGetConfigInt("c_aide_zap") == 0)
@@ -1038,12 +1166,14 @@ int CtdlForgetThisRoom(void) {
 	}
 
 	CtdlGetUserLock(&CC->user, CC->curr_user);
-	CtdlGetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlGetRelationshipSets(&vbuf, &seen, &answered, &CC->user, &CC->room);
 
 	vbuf.v_flags = vbuf.v_flags | V_FORGET;
 	vbuf.v_flags = vbuf.v_flags & ~V_ACCESS;
 
-	CtdlSetRelationship(&vbuf, &CC->user, &CC->room);
+	CtdlSetRelationshipSets(&vbuf, seen, answered, &CC->user, &CC->room);
+	seen_set_free(&seen);
+	seen_set_free(&answered);
 	CtdlPutUserLock(&CC->user);
 
 	// Return to the Lobby, so we don't end up in an undefined room
@@ -1068,7 +1198,7 @@ void ForEachUser(void (*CallBack) (char *, void *out_data), void *in_data) {
 	cdb_rewind(CDB_USERS);
 
 	// Phase 1 : build an array of all our user account names
-	while (cdbus = cdb_next_item(CDB_USERS), cdbus != NULL) {
+	while (cdbus = cdb_next_item_borrowed(CDB_USERS), cdbus != NULL) {
 		usptr = (struct ctdluser *) cdbus->ptr;
 		if (strlen(usptr->fullname) > 0) {
 			array_append(all_users, usptr->fullname);
@@ -1102,7 +1232,7 @@ int InitialMailCheck() {
 	char mailboxname[ROOMNAMELEN];
 	struct ctdlroom mailbox;
 	struct visit vbuf;
-	struct cdbdata *cdbfr;
+	struct msglist *ml;
 	long *msglist = NULL;
 	int num_msgs = 0;
 
@@ -1111,13 +1241,10 @@ int InitialMailCheck() {
 		return(0);
 	CtdlGetRelationship(&vbuf, &CC->user, &mailbox);
 
-	cdbfr = cdb_fetch(CDB_MSGLISTS, &mailbox.QRnumber, sizeof(long));
-
-	if (cdbfr != NULL) {
-		msglist = malloc(cdbfr->len);
-		memcpy(msglist, cdbfr->ptr, cdbfr->len);
-		num_msgs = cdbfr->len / sizeof(long);
-		cdb_free(cdbfr);
+	ml = CtdlGetMsgList(mailbox.QRnumber);
+	if (ml != NULL) {
+		msglist = ml->msgs;
+		num_msgs = ml->num_msgs;
 	}
 	if (num_msgs > 0)
 		for (a = 0; a < num_msgs; ++a) {
@@ -1127,8 +1254,7 @@ int InitialMailCheck() {
 				}
 			}
 		}
-	if (msglist != NULL)
-		free(msglist);
+	CtdlPutMsgList(&ml);
 
 	return(num_newmsgs);
 }
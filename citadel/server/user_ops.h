@@ -15,6 +15,7 @@
 
 #include <ctype.h>
 #include <syslog.h>
+#include "seenset.h"
 
 int hash (char *str);
 int is_aide (void);
@@ -39,7 +40,8 @@ void ForEachUser(void (*CallBack) (char *, void *out_data), void *in_data);
 int NewMailCount(void);
 int InitialMailCheck(void);
 int GenerateRelationshipIndex(char *IndexBuf, long RoomID, long RoomGen, long UserID);
-void put_visit(struct visit *);
+void put_visit(struct visit *newvisit, struct seen_set *seen, struct seen_set *answered);
+void CtdlDecodeVisit(struct cdbdata *cdbvisit, struct visit *vbuf, struct seen_set **seen, struct seen_set **answered);
 int CtdlAssociateSystemUser(char *screenname, char *loginname);
 
 void CtdlSetPassword(char *new_pw);
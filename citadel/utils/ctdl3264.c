@@ -273,23 +273,28 @@ void convert_msglists(int which_cdb, DBT *in_key, DBT *in_data, DBT *out_key, DB
 
 	// records are indexed by a single "long" and contains an array of zero or more "long"s
 	// and remember ... "long" is int32_t on the source system
-	int32_t in_roomnum;
-	long out_roomnum;
-	memcpy(&in_roomnum, in_key->data, sizeof(in_roomnum));
-	out_roomnum = (long) in_roomnum;
+	// (Message lists stored in segments also have records indexed by two "long"s: room number and segment.
+	// Modification sequence logs are indexed by room number and user number, and are all "long"s too.)
+	int32_t in_keyparts[2];
+	long out_keyparts[2];
+	int num_keyparts = in_key->size / sizeof(int32_t);
 
-	if (in_key->size != 4) {
+	if ( (in_key->size != 4) && (((which_cdb != CDB_MSGLISTS) && (which_cdb != CDB_MODSEQ)) || (in_key->size != 8)) ) {
 		fprintf(stderr, "\033[31m\033[1m *** SOURCE DATABASE IS NOT 32-BIT *** ABORTING *** \033[0m\n");
 		abort();
 	}
+	memcpy(in_keyparts, in_key->data, in_key->size);
+	for (i=0; i<num_keyparts; ++i) {
+		out_keyparts[i] = (long) in_keyparts[i];
+	}
 
 	int num_msgs = in_data->size / sizeof(int32_t);
-	// printf("\033[32m\033[1m%s: key %ld (%d messages)\033[0m\n", table, out_roomnum, num_msgs);
+	// printf("\033[32m\033[1m%s: key %ld (%d messages)\033[0m\n", table, out_keyparts[0], num_msgs);
 
-	// the key is a "long"
-	out_key->size = sizeof(out_roomnum);
+	// the key is one or two "long"s
+	out_key->size = sizeof(long) * num_keyparts;
 	out_key->data = realloc(out_key->data, out_key->size);
-	memcpy(out_key->data, &out_roomnum, sizeof(out_roomnum));
+	memcpy(out_key->data, out_keyparts, out_key->size);
 
 	// the data is another array, but a wider type
 	out_data->size = sizeof(long) * num_msgs;
@@ -307,16 +312,17 @@ void convert_msglists(int which_cdb, DBT *in_key, DBT *in_data, DBT *out_key, DB
 
 
 // convert function for a visit record
+// The output is in the legacy format (seen and answered sets as strings); the server converts it when it reads it.
 void convert_visits(int which_cdb, DBT *in_key, DBT *in_data, DBT *out_key, DBT *out_data) {
 
 	// data
-	struct visit_32 *visit32 = (struct visit_32 *)in_data->data;
-	out_data->size = sizeof(struct visit);
+	struct visit_legacy_32 *visit32 = (struct visit_legacy_32 *)in_data->data;
+	out_data->size = sizeof(struct visit_legacy);
 	out_data->data = realloc(out_data->data, out_data->size);
-	struct visit *visit64 = (struct visit *)out_data->data;
+	struct visit_legacy *visit64 = (struct visit_legacy *)out_data->data;
 
 	//  the data (zero it out so it will compress well)
-	memset(visit64, 0, sizeof(struct visit));
+	memset(visit64, 0, sizeof(struct visit_legacy));
 	visit64->v_roomnum		= (long)	visit32->v_roomnum;
 	visit64->v_roomgen		= (long)	visit32->v_roomgen;
 	visit64->v_usernum		= (long)	visit32->v_usernum;
@@ -557,7 +563,9 @@ void (*convert_functions[])(int which_cdb, DBT *in_key, DBT *in_data, DBT *out_k
 	convert_euidindex,	// CDB_EUIDINDEX
 	convert_usersbynumber,	// CDB_USERSBYNUMBER
 	zero_function,		// CDB_UNUSED1 (obsolete)
-	convert_config		// CDB_CONFIG
+	convert_config,		// CDB_CONFIG
+	zero_function,		// CDB_OVERVIEW (rebuilt on demand)
+	convert_msglists	// CDB_MODSEQ
 };
 
 
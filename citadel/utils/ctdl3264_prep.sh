@@ -37,7 +37,7 @@ convert_struct() {
 	convert_struct "ExpirePolicy"
 	convert_struct "ctdlroom"
 	convert_struct "floor"
-	convert_struct "visit"
+	convert_struct "visit_legacy"
 	convert_struct "visit_index"
 	convert_struct "MetaData"
 	convert_struct "CtdlCompressHeader"
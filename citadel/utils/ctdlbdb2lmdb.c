@@ -0,0 +1,309 @@
+// Copy a Citadel database from Berkeley DB to LMDB, so the server can be switched to the LMDB backend.
+// Records are copied exactly as they are; nothing about their format depends on the storage engine.
+//
+// Copyright (c) 2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <libcitadel.h>
+#include <db.h>
+#include <lmdb.h>
+#include "../server/sysdep.h"
+#include "../server/citadel_defs.h"
+#include "../server/server.h"
+#include "../server/citadel_dirs.h"
+
+// Commit to the destination after this many records, so no one transaction gets too big
+#define ROWS_PER_TXN		10000
+
+// The smallest map we create.  It's only address space; the server enlarges it later if it needs to.
+#define MIN_MAP_SIZE		(64ULL * 1024 * 1024 * 1024)
+
+
+// Open the source environment
+DB_ENV *open_dbenv(char *dirname) {
+	DB_ENV *dbenv = NULL;
+	int ret;
+
+	printf("db: Linked libdb: %s\n", db_version(NULL, NULL, NULL));
+
+	ret = db_env_create(&dbenv, 0);
+	if (ret) {
+		printf("db: db_env_create: %s\n", db_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+
+	ret = dbenv->set_cachesize(dbenv, 0, 64 * 1024 * 1024, 0);
+	if (ret) {
+		printf("db: set_cachesize: %s\n", db_strerror(ret));
+		dbenv->close(dbenv, 0);
+		exit(CTDLEXIT_DB);
+	}
+
+	printf("db: opening Berkeley DB environment in %s\n", dirname);
+	ret = dbenv->open(dbenv, dirname, DB_CREATE | DB_INIT_MPOOL | DB_PRIVATE | DB_INIT_LOG, 0);
+	if (ret) {
+		printf("db: dbenv->open: %s\n", db_strerror(ret));
+		dbenv->close(dbenv, 0);
+		exit(CTDLEXIT_DB);
+	}
+
+	return(dbenv);
+}
+
+
+// Open the destination environment, with a map big enough for everything in the source
+MDB_env *open_mdbenv(char *dirname, char *src_dir, MDB_dbi *dbi) {
+	MDB_env *env = NULL;
+	MDB_txn *txn;
+	MDB_stat st;
+	struct stat sb;
+	char filename[PATH_MAX];
+	unsigned long long map_size = 0;
+	int ret;
+	int i;
+
+	printf("db: Linked liblmdb: %s\n", mdb_version(NULL, NULL, NULL));
+
+	for (i = 0; i < MAXCDB; ++i) {
+		snprintf(filename, sizeof filename, "%s/cdb.%02x", src_dir, i);
+		if (stat(filename, &sb) == 0) {
+			map_size += sb.st_size;
+		}
+	}
+	map_size *= 2;
+	if (map_size < MIN_MAP_SIZE) {
+		map_size = MIN_MAP_SIZE;
+	}
+
+	ret = mdb_env_create(&env);
+	if (ret) {
+		printf("db: mdb_env_create: %s\n", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	mdb_env_set_maxdbs(env, MAXCDB);
+	ret = mdb_env_set_mapsize(env, (size_t)map_size);
+	if (ret) {
+		printf("db: mdb_env_set_mapsize: %s\n", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+
+	// We sync once at the end.  If we crash before that, the copy is no good anyway.
+	printf("db: opening LMDB environment in %s (map size %llu MB)\n", dirname, map_size / 1024 / 1024);
+	ret = mdb_env_open(env, dirname, MDB_NOSYNC, 0600);
+	if (ret) {
+		printf("db: mdb_env_open: %s\n", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+
+	ret = mdb_txn_begin(env, NULL, 0, &txn);
+	if (ret) {
+		printf("db: mdb_txn_begin: %s\n", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	for (i = 0; i < MAXCDB; ++i) {
+		snprintf(filename, sizeof filename, "cdb.%02x", i);
+		ret = mdb_dbi_open(txn, filename, MDB_CREATE, &dbi[i]);
+		if (ret) {
+			printf("db: mdb_dbi_open(%s): %s\n", filename, mdb_strerror(ret));
+			exit(CTDLEXIT_DB);
+		}
+		if ((mdb_stat(txn, dbi[i], &st) == 0) && (st.ms_entries > 0)) {
+			printf("db: the destination already contains data.  It must be empty.\n");
+			exit(CTDLEXIT_DB);
+		}
+	}
+	ret = mdb_txn_commit(txn);
+	if (ret) {
+		printf("db: mdb_txn_commit: %s\n", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+
+	return(env);
+}
+
+
+// Copy every record of one table
+void copy_table(int which_cdb, DB_ENV *src_dbenv, MDB_env *dst_env, MDB_dbi dst_dbi) {
+	char dbfilename[32];
+	DB *src_dbp;
+	DBC *src_dbcp;
+	DBT in_key, in_data;
+	MDB_txn *txn;
+	MDB_val out_key, out_data;
+	int max_keysize = mdb_env_get_maxkeysize(dst_env);
+	int num_good_rows = 0;
+	int num_bad_rows = 0;
+	int in_txn = 0;
+	int ret;
+
+	snprintf(dbfilename, sizeof dbfilename, "cdb.%02x", which_cdb);
+
+	ret = db_create(&src_dbp, src_dbenv, 0);
+	if (ret) {
+		printf("db: db_create: %s\n", db_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	ret = src_dbp->open(src_dbp, NULL, dbfilename, NULL, DB_BTREE, 0, 0600);
+	if (ret == ENOENT) {
+		printf("%5d  (not present)\n", which_cdb);
+		src_dbp->close(src_dbp, 0);
+		return;
+	}
+	if (ret) {
+		printf("db: db_open(%s): %s\n", dbfilename, db_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	if ((ret = src_dbp->cursor(src_dbp, NULL, &src_dbcp, 0)) != 0) {
+		printf("db: db_cursor: %s\n", db_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+
+	memset(&in_key, 0, sizeof(DBT));
+	memset(&in_data, 0, sizeof(DBT));
+	while ((ret = src_dbcp->get(src_dbcp, &in_key, &in_data, DB_NEXT)) == 0) {
+
+		// A zero length key is impossible, and LMDB has a limit on how long they can be
+		if ((in_key.size == 0) || ((int)in_key.size > max_keysize)) {
+			++num_bad_rows;
+			continue;
+		}
+
+		if (!in_txn) {
+			ret = mdb_txn_begin(dst_env, NULL, 0, &txn);
+			if (ret) {
+				printf("db: mdb_txn_begin: %s\n", mdb_strerror(ret));
+				exit(CTDLEXIT_DB);
+			}
+			in_txn = 1;
+		}
+
+		out_key.mv_size = in_key.size;
+		out_key.mv_data = in_key.data;
+		out_data.mv_size = in_data.size;
+		out_data.mv_data = in_data.data;
+		ret = mdb_put(txn, dst_dbi, &out_key, &out_data, 0);
+		if (ret) {
+			printf("db: mdb_put(%d): %s\n", which_cdb, mdb_strerror(ret));
+			exit(CTDLEXIT_DB);
+		}
+		++num_good_rows;
+
+		if ((num_good_rows % ROWS_PER_TXN) == 0) {
+			ret = mdb_txn_commit(txn);
+			if (ret) {
+				printf("db: mdb_txn_commit: %s\n", mdb_strerror(ret));
+				exit(CTDLEXIT_DB);
+			}
+			in_txn = 0;
+			printf("\033[33m%5d\033[37m  \033[32m%9d\033[37m  \033[31m%8d\033[0m\r", which_cdb, num_good_rows, num_bad_rows);
+			fflush(stdout);
+		}
+	}
+
+	if (ret != DB_NOTFOUND) {
+		printf("db: db_get: %s\n", db_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	if (in_txn) {
+		ret = mdb_txn_commit(txn);
+		if (ret) {
+			printf("db: mdb_txn_commit: %s\n", mdb_strerror(ret));
+			exit(CTDLEXIT_DB);
+		}
+	}
+	printf("\033[33m%5d\033[37m  \033[32m%9d\033[37m  \033[31m%8d\033[0m\n", which_cdb, num_good_rows, num_bad_rows);
+
+	src_dbcp->close(src_dbcp);
+	ret = src_dbp->close(src_dbp, 0);
+	if (ret) {
+		printf("db: db_close: %s\n", db_strerror(ret));
+	}
+}
+
+
+int main(int argc, char **argv) {
+	char *src_dir = NULL;
+	char *dst_dir = NULL;
+	int confirmed = 0;
+	DB_ENV *src_dbenv;
+	MDB_env *dst_env;
+	MDB_dbi dst_dbi[MAXCDB];
+	int ret;
+
+	// Parse command line
+	int a;
+	while ((a = getopt(argc, argv, "s:d:y")) != EOF) {
+		switch (a) {
+		case 's':
+			src_dir = optarg;
+			break;
+		case 'd':
+			dst_dir = optarg;
+			break;
+		case 'y':
+			confirmed = 1;
+			break;
+		default:
+			fprintf(stderr, "%s: usage: %s -s source_dir -d dest_dir [-y]\n", argv[0], argv[0]);
+			exit(2);
+		}
+	}
+	if ((src_dir == NULL) || (dst_dir == NULL)) {
+		fprintf(stderr, "%s: usage: %s -s source_dir -d dest_dir [-y]\n", argv[0], argv[0]);
+		exit(2);
+	}
+
+	// Warn the user
+	printf("------------------------------------------------------------------------\n");
+	printf("ctdlbdb2lmdb copies a Citadel database from Berkeley DB to LMDB.  It is \n");
+	printf("intended to be run OFFLINE.  Shut down the Citadel server first, and be \n");
+	printf("sure it shut down cleanly.  The source [-s] directory is the data       \n");
+	printf("directory of your Berkeley DB system, and is not changed.  The          \n");
+	printf("destination [-d] directory should be empty and will receive the LMDB    \n");
+	printf("store.  Move it into place as the data directory when it's done; the    \n");
+	printf("server will see that it's LMDB and use the LMDB backend.                \n");
+	printf("------------------------------------------------------------------------\n");
+	printf("Source Berkeley DB directory: %s\n", src_dir);
+	printf("  Destination LMDB directory: %s\n", dst_dir);
+	printf("------------------------------------------------------------------------\n");
+
+	if (confirmed == 1) {
+		printf("You have specified the [-y] flag, so processing will continue.\n");
+	}
+	else {
+		printf("Run it again with the [-y] flag to proceed.\n");
+		exit(0);
+	}
+
+	src_dbenv = open_dbenv(src_dir);
+	dst_env = open_mdbenv(dst_dir, src_dir, dst_dbi);
+	printf("table  good rows  bad rows\n");
+	printf("-----  ---------  --------\n");
+	for (int i = 0; i < MAXCDB; ++i) {
+		copy_table(i, src_dbenv, dst_env, dst_dbi[i]);
+	}
+
+	printf("db: flushing the destination\n");
+	ret = mdb_env_sync(dst_env, 1);
+	if (ret) {
+		printf("db: mdb_env_sync: %s\n", mdb_strerror(ret));
+		exit(CTDLEXIT_DB);
+	}
+	mdb_env_close(dst_env);
+	ret = src_dbenv->close(src_dbenv, 0);
+	if (ret) {
+		printf("db: dbenv->close: %s\n", db_strerror(ret));
+	}
+
+	exit(0);
+}
@@ -0,0 +1,127 @@
+// Time the intersection of a room's message list with full text search results.
+//
+// CtdlForEachMessage() and imap_do_search() used to intersect the two lists with a loop inside a loop; they now
+// use msglist_intersect(), which walks both sorted lists together and gallops over runs which can't match.
+// This builds pairs of sorted lists of various shapes, runs both, and checks that they agree.
+//
+// Copyright (c) 2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../server/msglist_ops.h"
+
+
+static double now_sec(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return((double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0));
+}
+
+
+// Make a strictly ascending list of num message numbers, with gaps of 1 to 2*spacing-1 between them
+static long *make_list(int num, int spacing) {
+	long *list = malloc(sizeof(long) * (num > 0 ? num : 1));
+	long msgnum = 0;
+	int i;
+
+	for (i = 0; i < num; ++i) {
+		msgnum += 1 + (random() % (2 * spacing - 1));
+		list[i] = msgnum;
+	}
+	return(list);
+}
+
+
+// The way it used to be done
+static int nested_intersect(long *dest, const long *a, int num_a, const long *b, int num_b) {
+	int i, j;
+	int n = 0;
+
+	for (i = 0; i < num_a; ++i) {
+		for (j = 0; j < num_b; ++j) {
+			if (a[i] == b[j]) {
+				dest[n++] = a[i];
+			}
+		}
+	}
+	return(n);
+}
+
+
+// Intersect a room of num_room messages with num_hits search hits spread across the same range of numbers
+static void run(int num_room, int num_hits, int rounds, int slow) {
+	long *room, *hits, *dest, *check;
+	int room_spacing = 10;
+	int hits_spacing;
+	int n = 0, n_check = 0;
+	double t, t_merge, t_nested = 0.0;
+	int r;
+
+	hits_spacing = (int)(((long)num_room * room_spacing) / (num_hits > 0 ? num_hits : 1));
+	if (hits_spacing < 1) hits_spacing = 1;
+	room = make_list(num_room, room_spacing);
+	hits = make_list(num_hits, hits_spacing);
+	dest = malloc(sizeof(long) * (num_room > 0 ? num_room : 1));
+	check = malloc(sizeof(long) * (num_room > 0 ? num_room : 1));
+
+	t = now_sec();
+	for (r = 0; r < rounds; ++r) {
+		n = msglist_intersect(dest, room, num_room, hits, num_hits);
+	}
+	t_merge = (now_sec() - t) / rounds;
+
+	if (slow) {
+		t = now_sec();
+		n_check = nested_intersect(check, room, num_room, hits, num_hits);
+		t_nested = now_sec() - t;
+		if ((n != n_check) || (memcmp(dest, check, sizeof(long) * n))) {
+			fprintf(stderr, "ctdlintersectbench: the results differ (%d and %d messages)\n", n, n_check);
+			exit(1);
+		}
+	}
+
+	printf("%8d x %8d  %8d in common  merge %10.6f s", num_room, num_hits, n, t_merge);
+	if (slow) {
+		printf("  nested %10.3f s  (%.0fx)", t_nested, ((t_merge > 0.0) ? (t_nested / t_merge) : 0.0));
+	}
+	printf("\n");
+
+	free(room);
+	free(hits);
+	free(dest);
+	free(check);
+}
+
+
+int main(int argc, char **argv) {
+	int rounds = 100;
+	int slow = 1;
+	int a;
+
+	while ((a = getopt(argc, argv, "r:f")) != EOF) {
+		switch (a) {
+		case 'r': rounds = atoi(optarg); break;
+		case 'f': slow = 0; break;		// skip the nested loops, which take a while on the big lists
+		default:
+			fprintf(stderr, "usage: ctdlintersectbench [-r rounds] [-f]\n");
+			exit(1);
+		}
+	}
+	if (rounds < 1) rounds = 1;
+
+	srandom(1);
+	run(1000, 1000, rounds, slow);
+	run(10000, 10000, rounds, slow);
+	run(100000, 100000, rounds, slow);	// the lists are about the same size: a plain merge
+	run(100000, 1000, rounds, slow);	// a few hits in a big room: mostly galloping
+	run(1000, 100000, rounds, slow);	// a small room and a common word
+	run(100000, 10, rounds, slow);
+	return(0);
+}
@@ -0,0 +1,557 @@
+// Time the nightly purge of the visit and use tables, the old way and the new way.
+//
+// This builds a scratch Berkeley DB environment, fills a visit table and a use table with synthetic records
+// (some fraction of them dead: visits to rooms or users which no longer exist, use table entries older than
+// USETABLE_RETAIN), and purges them twice from identical starting points:
+//
+//   old	valid rooms and users in linked lists, searched from the top for every visit; every record read
+//		into a buffer of its own; every dead record deleted in a transaction of its own
+//   new	valid rooms and users in hash tables; records read into one reused buffer; dead records
+//		deleted EXPIRE_DELETE_BATCH per transaction
+//
+// which is what serv_expire did before and does now.  It doesn't touch a real Citadel database.
+//
+// Copyright (c) 2023 by the citadel.org team
+//
+// This program is open source software.  Use, duplication, or disclosure
+// is subject to the terms of the GNU General Public License, version 3.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <libcitadel.h>
+#include <db.h>
+#include "../server/sysdep.h"
+#include "../server/citadel_defs.h"
+#include "../server/server.h"
+
+#define VISIT_DB	"visit"
+#define USETABLE_DB	"usetable"
+
+struct bench_opts {
+	int num_rooms;
+	int num_users;
+	int num_visits;
+	int num_uses;
+	int dead_pct;			// percentage of the records which the purge should find
+};
+
+// The old purge's lists
+struct ValidRoom {
+	struct ValidRoom *next;
+	long vr_roomnum;
+	long vr_roomgen;
+};
+
+struct ValidUser {
+	struct ValidUser *next;
+	long vu_usernum;
+};
+
+struct VPurgeList {
+	struct VPurgeList *next;
+	long vp_roomnum;
+	long vp_roomgen;
+	long vp_usernum;
+};
+
+// The new purge's list of keys to delete
+struct PurgeKey {
+	int pk_keylen;
+	char *pk_key;
+};
+
+static DB_ENV *dbenv = NULL;
+
+
+static void fail(const char *what, int ret) {
+	fprintf(stderr, "ctdlpurgebench: %s: %s\n", what, db_strerror(ret));
+	exit(CTDLEXIT_DB);
+}
+
+
+static double now_sec(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return((double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0));
+}
+
+
+// Open the scratch environment the way the server opens its own, minus recovery
+static void open_env(char *dirname) {
+	int ret;
+
+	ret = db_env_create(&dbenv, 0);
+	if (ret) fail("db_env_create", ret);
+	ret = dbenv->set_cachesize(dbenv, 0, 64 * 1024 * 1024, 0);
+	if (ret) fail("set_cachesize", ret);
+	ret = dbenv->set_lk_detect(dbenv, DB_LOCK_DEFAULT);
+	if (ret) fail("set_lk_detect", ret);
+	ret = dbenv->open(dbenv, dirname, DB_CREATE | DB_INIT_MPOOL | DB_INIT_TXN | DB_INIT_LOCK | DB_INIT_LOG | DB_PRIVATE | DB_THREAD, 0);
+	if (ret) fail("dbenv->open", ret);
+	dbenv->set_flags(dbenv, DB_TXN_WRITE_NOSYNC, 1);	// the server's default durability
+}
+
+
+// (Re)create a table, empty
+static DB *open_table(const char *name) {
+	DB *db;
+	int ret;
+
+	dbenv->dbremove(dbenv, NULL, name, NULL, DB_AUTO_COMMIT);
+	ret = db_create(&db, dbenv, 0);
+	if (ret) fail("db_create", ret);
+	ret = db->open(db, NULL, name, NULL, DB_BTREE, DB_CREATE | DB_AUTO_COMMIT | DB_THREAD, 0600);
+	if (ret) fail("db->open", ret);
+	return(db);
+}
+
+
+static void put(DB *db, DB_TXN *tid, void *key, int keylen, void *data, int datalen) {
+	DBT dkey, ddata;
+	int ret;
+
+	memset(&dkey, 0, sizeof dkey);
+	memset(&ddata, 0, sizeof ddata);
+	dkey.data = key;
+	dkey.size = keylen;
+	ddata.data = data;
+	ddata.size = datalen;
+	ret = db->put(db, tid, &dkey, &ddata, 0);
+	if (ret) fail("db->put", ret);
+}
+
+
+// Delete one record the way cdb_delete() does outside a transaction, retrying if it loses a deadlock
+static void del_one(DB *db, void *key, int keylen) {
+	DB_TXN *tid;
+	DBT dkey;
+	int ret;
+
+	memset(&dkey, 0, sizeof dkey);
+	dkey.data = key;
+	dkey.size = keylen;
+	do {
+		ret = dbenv->txn_begin(dbenv, NULL, &tid, 0);
+		if (ret) fail("txn_begin", ret);
+		ret = db->del(db, tid, &dkey, 0);
+		if (ret == DB_LOCK_DEADLOCK) {
+			tid->abort(tid);
+		}
+		else if ((ret) && (ret != DB_NOTFOUND)) {
+			fail("db->del", ret);
+		}
+		else {
+			tid->commit(tid, 0);
+		}
+	} while (ret == DB_LOCK_DEADLOCK);
+}
+
+
+// Fill the tables.  The same seed gives the same tables, so both purges start from the same place.
+static void fill(DB *visits, DB *uses, struct bench_opts *o, unsigned int seed) {
+	struct visit vbuf;
+	struct visit_index vi;
+	struct UseTable ut;
+	DB_TXN *tid = NULL;
+	time_t now = time(NULL);
+	int i;
+
+	srandom(seed);
+	for (i = 0; i < o->num_visits; ++i) {
+		if ((i % 10000) == 0) {
+			if (tid != NULL) tid->commit(tid, 0);
+			dbenv->txn_begin(dbenv, NULL, &tid, 0);
+		}
+		memset(&vbuf, 0, sizeof vbuf);
+		vbuf.v_roomnum = 1 + (random() % o->num_rooms);
+		vbuf.v_roomgen = 1;
+		vbuf.v_usernum = 1 + (random() % o->num_users);
+		if ((random() % 100) < o->dead_pct) {
+			switch (random() % 3) {
+			case 0:	vbuf.v_roomnum += o->num_rooms; break;		// the room is gone
+			case 1:	vbuf.v_roomgen = 2; break;			// the room was deleted and its number reused
+			case 2:	vbuf.v_usernum += o->num_users; break;		// the user is gone
+			}
+		}
+		vbuf.v_lastseen = i;
+		vi.iRoomID = vbuf.v_roomnum;
+		vi.iRoomGen = vbuf.v_roomgen;
+		vi.iUserID = vbuf.v_usernum;
+		put(visits, tid, &vi, sizeof vi, &vbuf, sizeof vbuf);
+	}
+	for (i = 0; i < o->num_uses; ++i) {
+		if ((i % 10000) == 0) {
+			if (tid != NULL) tid->commit(tid, 0);
+			dbenv->txn_begin(dbenv, NULL, &tid, 0);
+		}
+		memset(&ut, 0, sizeof ut);
+		ut.hash = i;
+		ut.timestamp = now - (random() % USETABLE_RETAIN);
+		if ((random() % 100) < o->dead_pct) {
+			ut.timestamp -= USETABLE_RETAIN;
+		}
+		put(uses, tid, &ut.hash, sizeof(int), &ut, sizeof ut);
+	}
+	if (tid != NULL) tid->commit(tid, 0);
+}
+
+
+// Walk a table with a read-only cursor.  The old purge got a freshly malloc()ed copy of every record
+// (cdb_next_item()); the new one borrows a buffer which is reused (cdb_next_item_borrowed()).
+static void walk(DB *db, int borrowed, void (*cb)(void *data, int len, void *ctx), void *ctx) {
+	DBC *curs;
+	DBT key, data;
+	void *buf = NULL;
+	u_int32_t alloc = 0;
+	int ret;
+
+	ret = db->cursor(db, NULL, &curs, 0);
+	if (ret) fail("db->cursor", ret);
+	for (;;) {
+		memset(&key, 0, sizeof key);
+		memset(&data, 0, sizeof data);
+		if (borrowed) {
+			data.flags = DB_DBT_USERMEM;
+			data.data = buf;
+			data.ulen = alloc;
+		}
+		else {
+			data.flags = DB_DBT_MALLOC;
+		}
+		ret = curs->c_get(curs, &key, &data, DB_NEXT);
+		if ((borrowed) && (ret == DB_BUFFER_SMALL)) {
+			alloc = data.size * 2;
+			buf = realloc(buf, alloc);
+			continue;
+		}
+		if (ret == DB_NOTFOUND) {
+			break;
+		}
+		if (ret) fail("c_get", ret);
+		cb(data.data, data.size, ctx);
+		if (!borrowed) {
+			free(data.data);
+		}
+	}
+	curs->c_close(curs);
+	if (buf != NULL) free(buf);
+}
+
+
+static void read_visit(void *data, int len, struct visit *vbuf) {
+	memset(vbuf, 0, sizeof(struct visit));
+	memcpy(vbuf, data, ((len > sizeof(struct visit)) ? sizeof(struct visit) : len));
+}
+
+
+static void read_use(void *data, int len, struct UseTable *ut) {
+	memset(ut, 0, sizeof(struct UseTable));
+	memcpy(ut, data, ((len > sizeof(struct UseTable)) ? sizeof(struct UseTable) : len));
+}
+
+
+// The old purge of the visit table
+
+struct old_visit_ctx {
+	struct ValidRoom *rooms;
+	struct ValidUser *users;
+	struct VPurgeList *purge;
+};
+
+static void old_visit_cb(void *data, int len, void *ctx) {
+	struct old_visit_ctx *c = ctx;
+	struct ValidRoom *vrptr;
+	struct ValidUser *vuptr;
+	struct VPurgeList *vptr;
+	struct visit vbuf;
+	int RoomIsValid = 0;
+	int UserIsValid = 0;
+
+	read_visit(data, len, &vbuf);
+	for (vrptr = c->rooms; vrptr != NULL; vrptr = vrptr->next) {
+		if ((vrptr->vr_roomnum == vbuf.v_roomnum) && (vrptr->vr_roomgen == vbuf.v_roomgen)) {
+			RoomIsValid = 1;
+		}
+	}
+	for (vuptr = c->users; vuptr != NULL; vuptr = vuptr->next) {
+		if (vuptr->vu_usernum == vbuf.v_usernum) {
+			UserIsValid = 1;
+		}
+	}
+	if ((RoomIsValid == 0) || (UserIsValid == 0)) {
+		vptr = malloc(sizeof(struct VPurgeList));
+		vptr->next = c->purge;
+		vptr->vp_roomnum = vbuf.v_roomnum;
+		vptr->vp_roomgen = vbuf.v_roomgen;
+		vptr->vp_usernum = vbuf.v_usernum;
+		c->purge = vptr;
+	}
+}
+
+
+static int old_purge_visits(DB *visits, struct bench_opts *o) {
+	struct old_visit_ctx c;
+	struct ValidRoom *vrptr;
+	struct ValidUser *vuptr;
+	struct VPurgeList *vptr;
+	struct visit_index vi;
+	int purged = 0;
+	int i;
+
+	memset(&c, 0, sizeof c);
+	for (i = 1; i <= o->num_rooms; ++i) {
+		vrptr = malloc(sizeof(struct ValidRoom));
+		vrptr->next = c.rooms;
+		vrptr->vr_roomnum = i;
+		vrptr->vr_roomgen = 1;
+		c.rooms = vrptr;
+	}
+	for (i = 1; i <= o->num_users; ++i) {
+		vuptr = malloc(sizeof(struct ValidUser));
+		vuptr->next = c.users;
+		vuptr->vu_usernum = i;
+		c.users = vuptr;
+	}
+
+	walk(visits, 0, old_visit_cb, &c);
+
+	while (c.rooms != NULL) {
+		vrptr = c.rooms->next;
+		free(c.rooms);
+		c.rooms = vrptr;
+	}
+	while (c.users != NULL) {
+		vuptr = c.users->next;
+		free(c.users);
+		c.users = vuptr;
+	}
+	while (c.purge != NULL) {
+		vi.iRoomID = c.purge->vp_roomnum;
+		vi.iRoomGen = c.purge->vp_roomgen;
+		vi.iUserID = c.purge->vp_usernum;
+		del_one(visits, &vi, sizeof vi);
+		vptr = c.purge->next;
+		free(c.purge);
+		c.purge = vptr;
+		++purged;
+	}
+	return(purged);
+}
+
+
+// The old purge of the use table
+
+static void old_use_cb(void *data, int len, void *ctx) {
+	struct UseTable ut;
+
+	read_use(data, len, &ut);
+	if ((time(NULL) - ut.timestamp) > USETABLE_RETAIN) {
+		array_append((Array *)ctx, &ut.hash);
+	}
+}
+
+
+static int old_purge_uses(DB *uses) {
+	Array *purge_list = array_new(sizeof(int));
+	int purged;
+	int i;
+
+	walk(uses, 0, old_use_cb, purge_list);
+	purged = array_len(purge_list);
+	for (i = 0; i < purged; ++i) {
+		del_one(uses, array_get_element_at(purge_list, i), sizeof(int));
+	}
+	array_free(purge_list);
+	return(purged);
+}
+
+
+// The new purge: dead keys collected in an Array, deleted EXPIRE_DELETE_BATCH per transaction
+
+static void add_purge_key(Array *keys, const void *key, int keylen) {
+	struct PurgeKey pk;
+
+	pk.pk_keylen = keylen;
+	pk.pk_key = malloc(keylen);
+	memcpy(pk.pk_key, key, keylen);
+	array_append(keys, &pk);
+}
+
+
+static void delete_purge_keys(DB *db, Array *keys) {
+	struct PurgeKey *pk;
+	int num_keys = array_len(keys);
+	DB_TXN *tid;
+	DBT dkey;
+	int first, i;
+	int ret;
+
+	for (first = 0; first < num_keys; first += EXPIRE_DELETE_BATCH) {
+		ret = dbenv->txn_begin(dbenv, NULL, &tid, 0);
+		if (ret) fail("txn_begin", ret);
+		for (i = first; (i < num_keys) && (i < first + EXPIRE_DELETE_BATCH); ++i) {
+			pk = (struct PurgeKey *)array_get_element_at(keys, i);
+			memset(&dkey, 0, sizeof dkey);
+			dkey.data = pk->pk_key;
+			dkey.size = pk->pk_keylen;
+			ret = db->del(db, tid, &dkey, 0);
+			if ((ret) && (ret != DB_NOTFOUND)) fail("db->del", ret);
+			free(pk->pk_key);
+		}
+		ret = tid->commit(tid, 0);
+		if (ret) fail("txn_commit", ret);
+	}
+	array_free(keys);
+}
+
+
+struct new_visit_ctx {
+	HashList *rooms;
+	HashList *users;
+	Array *purge;
+};
+
+static void new_visit_cb(void *data, int len, void *ctx) {
+	struct new_visit_ctx *c = ctx;
+	struct visit vbuf;
+	struct visit_index vi;
+	void *v;
+
+	read_visit(data, len, &vbuf);
+	if (	(!GetHash(c->rooms, (const char *)&vbuf.v_roomnum, sizeof(long), &v))
+		|| (*(long *)v != vbuf.v_roomgen)
+		|| (!GetHash(c->users, (const char *)&vbuf.v_usernum, sizeof(long), &v))
+	) {
+		vi.iRoomID = vbuf.v_roomnum;
+		vi.iRoomGen = vbuf.v_roomgen;
+		vi.iUserID = vbuf.v_usernum;
+		add_purge_key(c->purge, &vi, sizeof vi);
+	}
+}
+
+
+static int new_purge_visits(DB *visits, struct bench_opts *o) {
+	struct new_visit_ctx c;
+	long *gen;
+	long i;
+	int purged;
+
+	c.rooms = NewHash(1, lFlathash);
+	c.users = NewHash(1, lFlathash);
+	c.purge = array_new(sizeof(struct PurgeKey));
+	for (i = 1; i <= o->num_rooms; ++i) {
+		gen = malloc(sizeof(long));
+		*gen = 1;
+		Put(c.rooms, (const char *)&i, sizeof(long), gen, NULL);
+	}
+	for (i = 1; i <= o->num_users; ++i) {
+		Put(c.users, (const char *)&i, sizeof(long), NULL, reference_free_handler);
+	}
+
+	walk(visits, 1, new_visit_cb, &c);
+
+	DeleteHash(&c.rooms);
+	DeleteHash(&c.users);
+	purged = array_len(c.purge);
+	delete_purge_keys(visits, c.purge);
+	return(purged);
+}
+
+
+static void new_use_cb(void *data, int len, void *ctx) {
+	struct UseTable ut;
+
+	read_use(data, len, &ut);
+	if ((time(NULL) - ut.timestamp) > USETABLE_RETAIN) {
+		add_purge_key((Array *)ctx, &ut.hash, sizeof(int));
+	}
+}
+
+
+static int new_purge_uses(DB *uses) {
+	Array *purge_list = array_new(sizeof(struct PurgeKey));
+	int purged;
+
+	walk(uses, 1, new_use_cb, purge_list);
+	purged = array_len(purge_list);
+	delete_purge_keys(uses, purge_list);
+	return(purged);
+}
+
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: ctdlpurgebench [-h scratch_dir] [-r rooms] [-u users] [-v visits] [-t use_table_entries] [-d dead_percent]\n"
+		"The scratch directory is emptied of the benchmark's own tables, but is otherwise left alone.\n"
+	);
+	exit(1);
+}
+
+
+int main(int argc, char **argv) {
+	struct bench_opts o;
+	char *dir = "/tmp";
+	DB *visits, *uses;
+	double t;
+	int purged;
+	int a;
+
+	o.num_rooms = 2000;
+	o.num_users = 5000;
+	o.num_visits = 200000;
+	o.num_uses = 200000;
+	o.dead_pct = 10;
+
+	while ((a = getopt(argc, argv, "h:r:u:v:t:d:")) != EOF) {
+		switch (a) {
+		case 'h': dir = optarg; break;
+		case 'r': o.num_rooms = atoi(optarg); break;
+		case 'u': o.num_users = atoi(optarg); break;
+		case 'v': o.num_visits = atoi(optarg); break;
+		case 't': o.num_uses = atoi(optarg); break;
+		case 'd': o.dead_pct = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if ((o.num_rooms < 1) || (o.num_users < 1) || (o.num_visits < 0) || (o.num_uses < 0) || (o.dead_pct < 0) || (o.dead_pct > 100)) {
+		usage();
+	}
+
+	printf("ctdlpurgebench: %d rooms, %d users, %d visits, %d use table entries, %d%% dead, in %s\n",
+		o.num_rooms, o.num_users, o.num_visits, o.num_uses, o.dead_pct, dir);
+	open_env(dir);
+
+	visits = open_table(VISIT_DB);
+	uses = open_table(USETABLE_DB);
+	fill(visits, uses, &o, 1);
+	t = now_sec();
+	purged = old_purge_visits(visits, &o);
+	printf("old: purged %7d visits           in %8.3f s\n", purged, now_sec() - t);
+	t = now_sec();
+	purged = old_purge_uses(uses);
+	printf("old: purged %7d use table entries in %8.3f s\n", purged, now_sec() - t);
+	visits->close(visits, 0);
+	uses->close(uses, 0);
+
+	visits = open_table(VISIT_DB);
+	uses = open_table(USETABLE_DB);
+	fill(visits, uses, &o, 1);
+	t = now_sec();
+	purged = new_purge_visits(visits, &o);
+	printf("new: purged %7d visits           in %8.3f s\n", purged, now_sec() - t);
+	t = now_sec();
+	purged = new_purge_uses(uses);
+	printf("new: purged %7d use table entries in %8.3f s\n", purged, now_sec() - t);
+	visits->close(visits, 0);
+	uses->close(uses, 0);
+
+	dbenv->dbremove(dbenv, NULL, VISIT_DB, NULL, DB_AUTO_COMMIT);
+	dbenv->dbremove(dbenv, NULL, USETABLE_DB, NULL, DB_AUTO_COMMIT);
+	dbenv->close(dbenv, 0);
+	return(0);
+}
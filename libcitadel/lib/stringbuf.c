@@ -11,7 +11,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #define SHOW_ME_VAPPEND_PRINTF
@@ -4266,11 +4266,10 @@ int StrBufTCP_read_buffered_line(StrBuf *Line,
 {
 	int len, rlen;
 	int nSuccessLess = 0;
-	fd_set rfds;
+	struct pollfd pfd;
 	char *pch = NULL;
         int fdflags;
 	int IsNonBlock;
-	struct timeval tv;
 
 	if (buf->BufUsed > 0) {
 		pch = strchr(buf->buf, '\n');
@@ -4293,19 +4292,17 @@ int StrBufTCP_read_buffered_line(StrBuf *Line,
 
 	while ((nSuccessLess < timeout) && (pch == NULL)) {
 		if (IsNonBlock){
-			tv.tv_sec = selectresolution;
-			tv.tv_usec = 0;
-			
-			FD_ZERO(&rfds);
-			FD_SET(*fd, &rfds);
-			if (select(*fd + 1, NULL, &rfds, NULL, &tv) == -1) {
+			pfd.fd = *fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, selectresolution * 1000) == -1) {
 				*Error = strerror(errno);
 				close (*fd);
 				*fd = -1;
 				return -1;
 			}
 		}
-		if (IsNonBlock && !  FD_ISSET(*fd, &rfds)) {
+		if (IsNonBlock && (pfd.revents == 0)) {
 			nSuccessLess ++;
 			continue;
 		}
@@ -4372,11 +4369,10 @@ int StrBufTCP_read_buffered_line_fast(StrBuf *Line,
 	const char *pLF;
 	int len, rlen, retlen;
 	int nSuccessLess = 0;
-	fd_set rfds;
+	struct pollfd pfd;
 	const char *pch = NULL;
         int fdflags;
 	int IsNonBlock;
-	struct timeval tv;
 	
 	retlen = 0;
 	if ((Line == NULL) ||
@@ -4464,12 +4460,10 @@ int StrBufTCP_read_buffered_line_fast(StrBuf *Line,
 	       (*fd != -1)) {
 		if (IsNonBlock)
 		{
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-		
-			FD_ZERO(&rfds);
-			FD_SET(*fd, &rfds);
-			if (select((*fd) + 1, &rfds, NULL, NULL, &tv) == -1) {
+			pfd.fd = *fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 1000) == -1) {
 				*Error = strerror(errno);
 				close (*fd);
 				*fd = -1;
@@ -4477,7 +4471,7 @@ int StrBufTCP_read_buffered_line_fast(StrBuf *Line,
 					*Error = ErrRBLF_SelectFailed;
 				return -1;
 			}
-			if (! FD_ISSET(*fd, &rfds) != 0) {
+			if (pfd.revents == 0) {
 				nSuccessLess ++;
 				continue;
 			}
@@ -4559,8 +4553,7 @@ int StrBufReadBLOB(StrBuf *Buf, int *fd, int append, long nBytes, const char **E
 	int nRead = 0;
 	char *ptr;
 	int IsNonBlock;
-	struct timeval tv;
-	fd_set rfds;
+	struct pollfd pfd;
 
 	if ((Buf == NULL) || (Buf->buf == NULL) || (*fd == -1))
 	{
@@ -4582,12 +4575,10 @@ int StrBufReadBLOB(StrBuf *Buf, int *fd, int append, long nBytes, const char **E
 	{
 		if (IsNonBlock)
 		{
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-		
-			FD_ZERO(&rfds);
-			FD_SET(*fd, &rfds);
-			if (select(*fd + 1, &rfds, NULL, NULL, &tv) == -1) {
+			pfd.fd = *fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 1000) == -1) {
 				*Error = strerror(errno);
 				close (*fd);
 				*fd = -1;
@@ -4595,7 +4586,7 @@ int StrBufReadBLOB(StrBuf *Buf, int *fd, int append, long nBytes, const char **E
 					*Error = ErrRBLF_SelectFailed;
 				return -1;
 			}
-			if (! FD_ISSET(*fd, &rfds) != 0) {
+			if (pfd.revents == 0) {
 				nSuccessLess ++;
 				continue;
 			}
@@ -4648,8 +4639,7 @@ int StrBufReadBLOBBuffered(StrBuf *Blob,
 	int nAlreadyRead = 0;
 	int IsNonBlock;
 	char *ptr;
-	fd_set rfds;
-	struct timeval tv;
+	struct pollfd pfd;
 	int nSuccessLess = 0;
 	int MaxTries;
 
@@ -4713,12 +4703,10 @@ int StrBufReadBLOBBuffered(StrBuf *Blob,
 	nRead = 0;
 	while ((nSuccessLess < MaxTries) && (nRead < nBytes) && (*fd != -1)) {
 		if (IsNonBlock) {
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-		
-			FD_ZERO(&rfds);
-			FD_SET(*fd, &rfds);
-			if (select(*fd + 1, &rfds, NULL, NULL, &tv) == -1) {
+			pfd.fd = *fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 1000) == -1) {
 				*Error = strerror(errno);
 				close (*fd);
 				*fd = -1;
@@ -4727,7 +4715,7 @@ int StrBufReadBLOBBuffered(StrBuf *Blob,
 				}
 				return -1;
 			}
-			if (! FD_ISSET(*fd, &rfds) != 0) {
+			if (pfd.revents == 0) {
 				nSuccessLess ++;
 				continue;
 			}